@@ -0,0 +1,46 @@
+#ifndef TESTC_ALLOC_H
+#define TESTC_ALLOC_H
+
+/*
+ * Linking the alloc library replaces malloc, calloc, realloc and free with versions that count
+ * allocations, which ASSERT_ALLOCS_BETWEEN checks. With checkLeaks in TestRunOptions
+ * (`--check-leaks`), every forked test also records the stack trace of each allocation that it
+ * makes, and a test which returns with allocations still live fails, printing where each of them
+ * was allocated. The replacements forward to glibc's allocator, so this only works with glibc.
+ */
+
+// The number of allocations made by every thread so far, counting a realloc as one
+long long Alloc_count();
+
+// Start recording the live allocations of the process. Called in each forked test. They're weak
+// so that the runner doesn't need this library to be linked.
+void Alloc_startTracking() __attribute__((weak));
+
+// Stop recording and print every allocation made since Alloc_startTracking that is still live to
+// fd. Returns the number of them.
+int Alloc_stopTracking(int fd) __attribute__((weak));
+
+typedef struct {
+    long long start;
+    int done;
+} AllocRegion;
+
+AllocRegion AllocRegion_begin();
+
+// Fail like an assertion if the region made fewer than min or more than max allocations
+void AllocRegion_end(AllocRegion *region, long long min, long long max, const char *file,
+                     int line);
+
+/*
+ * Asserts the number of allocations made by the block that follows. The block must not jump out
+ * of itself with break, goto or return, or nothing is checked.
+ * Usage:
+ * ASSERT_ALLOCS_BETWEEN(0, 0) {
+ *     lookup(table, key);
+ * }
+ */
+#define ASSERT_ALLOCS_BETWEEN(min, max) \
+    for (AllocRegion allocRegion = AllocRegion_begin(); !allocRegion.done; \
+         AllocRegion_end(&allocRegion, min, max, __FILE__, __LINE__))
+
+#endif
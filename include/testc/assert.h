@@ -1,8 +1,24 @@
 #ifndef TESTC_ASSERT_H
 #define TESTC_ASSERT_H
 
+#include <setjmp.h>
+#include <stdio.h>
 #include <testc/stack_trace.h>
 
+// Set while a property runs one of its cases, or while a test runs on a thread of the runner, so
+// that a failed assertion fails the case or the test instead of exiting. Each thread has its own.
+extern __thread sigjmp_buf *TestC_caseFailure;
+
+// The log of the test running on this thread of the runner, which failed assertions are printed
+// to instead of stderr. NULL in forked tests, whose stderr already is their log.
+extern __thread FILE *TestC_testOutput;
+
+#define TESTC_OUTPUT (TestC_testOutput != NULL ? TestC_testOutput : stderr)
+#define TESTC_TRACE_FD (TestC_testOutput != NULL ? fileno(TestC_testOutput) : STDOUT_FILENO)
+
+// End a failed test: jump to TestC_caseFailure if it's set, or exit
+void TestC_fail() __attribute__((noreturn));
+
 // In the macros below the following variables are used
 // exp, x, y: an expression e.g. foo()
 // val: the value of an expression (something determined as late as runtime)
@@ -19,7 +35,7 @@
         char buffer[size + 1];        \
         sprintf(buffer, #format, val);    \
         if (strcmp(#exp, buffer) != 0) { \
-            fprintf(stderr, "  " #exp " = " #format "\n", val);\
+            fprintf(TESTC_OUTPUT, "  " #exp " = " #format "\n", val);\
         }                            \
     }
 
@@ -29,12 +45,13 @@
         type xVal = x;       \
         type yVal = y;                   \
         if (!(xVal cmp yVal)) {   \
-            fprintf(stderr, "%s:%d\n", __FILE__, __LINE__);                                      \
-            fprintf(stderr, "Assertion Failed: " #x " " #cmp " " #y " where:\n"); \
+            fprintf(TESTC_OUTPUT, "%s:%d\n", __FILE__, __LINE__);                                \
+            fprintf(TESTC_OUTPUT, "Assertion Failed: " #x " " #cmp " " #y " where:\n"); \
             PRINT_ASSIGNMENT(x, xVal, format)                      \
             PRINT_ASSIGNMENT(y, yVal, format)                                                    \
-            printStackTrace(STDOUT_FILENO, 16);                                \
-            exit(EXIT_FAILURE);       \
+            fflush(TESTC_OUTPUT);                                                                \
+            printStackTrace(TESTC_TRACE_FD, 16);                                \
+            TestC_fail();       \
         } \
     }
 
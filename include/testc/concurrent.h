@@ -0,0 +1,52 @@
+#ifndef TESTC_CONCURRENT_H
+#define TESTC_CONCURRENT_H
+
+#include <testc/test_suite.h>
+
+/*
+ * A concurrent test runs its body on several threads at once, for a number of rounds. Each thread
+ * is pinned to its own CPU where there are enough of them, and all of the threads wait at a spin
+ * barrier before every round so that their bodies start together. The body gets the index of its
+ * thread. When an assertion fails on any thread, its message and that thread's stack trace are
+ * printed, the other threads stop after the round they're in, and the test fails. The time each
+ * thread spent in its bodies is printed to the test's log.
+ *
+ * Races show up faster when threads are preempted at unlucky points. When the TESTC_YIELD
+ * environment variable is set to a percentage, every CONCURRENT_YIELD in the body, and the start of
+ * every round, yields the CPU with that chance.
+ */
+
+// Run body on numThreads threads for numRounds rounds, failing like an assertion if it fails on
+// any of them
+void Concurrent_run(const char *name, void (*body)(int thread), int numThreads, int numRounds);
+
+// Yield the CPU with the chance set by TESTC_YIELD, if it's set
+void Concurrent_yield();
+
+#define CONCURRENT_YIELD() Concurrent_yield()
+
+/*
+ * Usage:
+ * TEST_CONCURRENT(pushesAndPops, 4, 10000) {
+ *     if (thread % 2 == 0) {
+ *         Queue_push(queue, thread);
+ *     } else {
+ *         CONCURRENT_YIELD();
+ *         Queue_pop(queue);
+ *     }
+ * }
+ */
+#define TEST_CONCURRENT(testName, numThreads, numRounds) \
+    void testName ## Body(int thread);\
+    void testName ## Method() {\
+        Concurrent_run(#testName, testName ## Body, numThreads, numRounds);\
+    }\
+    const TestSuite testName = {\
+        .name = #testName,\
+        .test = testName ## Method,\
+        .isLeaf = 1\
+    };            \
+    TESTC_REGISTER(testName) \
+    void testName ## Body(__attribute__((unused)) int thread)
+
+#endif
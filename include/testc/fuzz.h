@@ -0,0 +1,55 @@
+#ifndef TESTC_FUZZ_H
+#define TESTC_FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <testc/test_suite.h>
+
+/*
+ * A fuzz target is a test which takes arbitrary bytes. In a normal run, it's a single test which
+ * replays every input in its corpus, so inputs that once crashed it keep being checked. In a fuzz
+ * run (`--fuzz`), forked workers mutate the inputs of the corpus, and an input which reaches code
+ * that no input reached before is saved to the corpus and shared with the other workers. An input
+ * which crashes the target, or fails an assertion, is saved as `crash-<hash>` and ends the run.
+ *
+ * Coverage comes from SanitizerCoverage, so the code under test has to be compiled with the
+ * TESTC_FUZZ_COVERAGE CMake option (see testc_fuzz_coverage). Without it, mutations are still
+ * run, but nothing new is ever added to the corpus. The corpus of a target is in
+ * `fuzz_corpus/<name>` under the root test logs directory.
+ */
+typedef void (*fuzz_target_t)(const uint8_t *data, size_t size);
+
+// The largest input that the mutator makes. Longer corpus files are truncated when fuzzing.
+#define FUZZ_MAX_INPUT 4096
+
+// Run the target on every input in its corpus, exiting with a failure if the target fails
+void Fuzz_replay(const char *name, fuzz_target_t target);
+
+// Fuzz the target with numWorkers processes for the given number of seconds. Returns 1 if an input
+// crashed the target, 0 if none did and -1 if the workers couldn't be started.
+int Fuzz_run(const char *name, fuzz_target_t target, int numWorkers, int seconds);
+
+/*
+ * Usage:
+ * TEST_FUZZ(parseNeverCrashes, data, size) {
+ *     parse((const char *) data, size);
+ * }
+ */
+#define TEST_FUZZ(testName, data, size) \
+    void testName ## Target(const uint8_t *data, size_t size);\
+    void testName ## Replay() {\
+        Fuzz_replay(#testName, testName ## Target);\
+    }\
+    int testName ## Fuzz(int numWorkers, int seconds) {\
+        return Fuzz_run(#testName, testName ## Target, numWorkers, seconds);\
+    }\
+    const TestSuite testName = {\
+        .name = #testName,\
+        .test = testName ## Replay,\
+        .fuzz = testName ## Fuzz,\
+        .isLeaf = 1\
+    };            \
+    TESTC_REGISTER(testName) \
+    void testName ## Target(const uint8_t *data, size_t size)
+
+#endif
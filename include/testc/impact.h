@@ -0,0 +1,37 @@
+#ifndef TESTC_IMPACT_H
+#define TESTC_IMPACT_H
+
+#include <stdint.h>
+
+/*
+ * Impact analysis runs only the tests that a change can affect. Code that testc_impact_coverage
+ * compiles with -finstrument-functions (with the TESTC_IMPACT_COVERAGE CMake option on) calls into
+ * this library whenever it enters a function. Each forked run of a test starts with an empty
+ * bitmap with one bit per byte of the executable's code, and records the address of every function
+ * the first time it's entered into a file next to the test's log. When the run is over, the runner
+ * looks up the source file of each function and merges them into impact.index under the log root:
+ * a reverse index from every source file to the tests which ran code in it. changedFiles in
+ * TestRunOptions (`--changed-files`) then only selects the tests which ran code in a changed file,
+ * and the tests that the index doesn't know yet. Functions outside of the executable, such as in
+ * shared libraries, aren't recorded.
+ */
+
+// The most functions that a test records. The ones it enters after that aren't recorded.
+#define IMPACT_MAX_FUNCTIONS 65536
+
+// The functions entered by the runs of a test, which are shared between its repeats and the runner
+typedef struct {
+    uint64_t numFunctions;
+    uint64_t numDropped;
+    uint64_t reserved[6];
+    uint64_t functions[IMPACT_MAX_FUNCTIONS];
+} ImpactRecord;
+
+// Record the functions that this process enters into the record at path from now on, creating it
+// if needed. Returns -1 if it can't be mapped. These are weak so that the runner doesn't need this
+// library to be linked.
+int Impact_start(const char *path) __attribute__((weak));
+
+void Impact_stop() __attribute__((weak));
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef TESTC_MINIDUMP_H
+#define TESTC_MINIDUMP_H
+
+#include <stdint.h>
+
+/*
+ * A minidump is what's left of a test that crashed, without the size of a core dump: the registers
+ * of every thread, the bytes of their stacks around the stack pointer, and the modules that were
+ * mapped, which is enough to tell where each thread was. With minidumps in TestRunOptions
+ * (`--minidumps`), every forked test turns core dumps off, and a crash signal writes name.dmp next
+ * to the test's log from a handler on an alternate stack, out of a buffer that was allocated
+ * before the test started. The handler then lets the signal kill the test as it would have.
+ * Minidump_print (`--minidump`) reads one later, looking up the functions with addr2line, so the
+ * executable and libraries have to be where they were, unchanged, and have symbols or -g.
+ *
+ * The file is a MinidumpHeader, then numThreads MinidumpThreads, then the stack bytes that they
+ * point to, and then /proc/self/maps as it was at the crash. It's only written on Linux.
+ */
+
+#define MINIDUMP_MAGIC "TESTCMD1"
+// The most threads that a minidump holds. Threads after that are left out.
+#define MINIDUMP_MAX_THREADS 32
+// How much of each thread's stack is kept, from a little below the stack pointer upwards
+#define MINIDUMP_STACK_SIZE 32768
+// The most of /proc/self/maps that's kept
+#define MINIDUMP_MAPS_SIZE 131072
+#define MINIDUMP_MAX_REGISTERS 34
+
+typedef struct {
+    uint32_t tid;
+    // 1 for the thread that got the crash signal
+    uint32_t crashed;
+    uint64_t pc;
+    uint64_t sp;
+    uint64_t fp;
+    // The general purpose registers as the signal context has them: gregs on x86_64, and x0 to
+    // x30, sp, pc and pstate on aarch64
+    uint64_t registers[MINIDUMP_MAX_REGISTERS];
+    // The address of the first stack byte that was kept, how many were, and where they are in
+    // the file
+    uint64_t stackStart;
+    uint64_t stackSize;
+    uint64_t stackOffset;
+} MinidumpThread;
+
+typedef struct {
+    char magic[8];
+    // The machine that wrote it, such as x86_64, which says what the registers are
+    char machine[16];
+    int32_t signal;
+    int32_t code;
+    uint64_t faultAddress;
+    uint32_t pid;
+    uint32_t numThreads;
+    uint64_t mapsOffset;
+    uint64_t mapsSize;
+    uint64_t reserved[4];
+} MinidumpHeader;
+
+// Write a minidump to path, and no core dump, if this process gets a crash signal from now on.
+// The processes that it forks inherit the handler, but crash as if it wasn't there. The alternate
+// stack is only installed on the calling thread, since sigaltstack is per thread, so the other
+// threads run the handler on their own stacks and don't write a minidump if they overflow them.
+// Returns -1 if the handlers or the buffer couldn't be set up.
+int Minidump_install(const char *path);
+
+// Print the threads of the minidump at path to fd, with the function and line of every pc and of
+// every word on their stacks that points into code, which are likely return addresses. Returns -1
+// if it can't be read.
+int Minidump_print(const char *path, int fd);
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef TESTC_PROPERTY_H
+#define TESTC_PROPERTY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <testc/test_suite.h>
+
+/*
+ * A property is a test whose body runs on many generated inputs. The body draws its inputs from
+ * generators, which are functions taking the Property, so they compose by calling each other. All
+ * generators are built on Property_draw, which records every choice a case makes. When a case
+ * fails, whether by a failed assertion or a crash, the failure is shrunk in the test's process by
+ * replaying smaller and fewer choices, and the seed and the inputs of the smallest failing case
+ * are printed to the test's log.
+ *
+ * The cases of a property are split into PROPERTY_SHARDS tests, e.g. `parse[0]`, which run in
+ * parallel like any other tests. Cases are seeded from the TESTC_SEED environment variable if it
+ * is set, otherwise from the time. Shrunk failures are appended to a corpus file named after the
+ * property in the TESTC_CORPUS directory, `testc_corpus` by default, unless it has them already,
+ * and the first shard replays the corpus before generating new cases.
+ */
+typedef struct Property Property;
+
+#define PROPERTY_SHARDS 4
+
+// A choice between 0 and max inclusive. Shrinking makes choices smaller, so 0 should be the
+// simplest outcome.
+uint64_t Property_draw(Property *property, uint64_t max);
+
+// Any long long, though small magnitudes are more likely. Shrinks towards 0.
+long long Property_int(Property *property);
+
+// A long long between min and max inclusive. Shrinks towards min.
+long long Property_range(Property *property, long long min, long long max);
+
+// The length of an array whose elements the caller generates, between 0 and max inclusive
+int Property_length(Property *property, int max);
+
+// Fill the start of buffer with random bytes and return how many, at most maxLength
+size_t Property_bytes(Property *property, unsigned char *buffer, size_t maxLength);
+
+// Write a null-terminated string of printable characters which fits in size bytes and return its
+// length. Shrinks towards shorter strings of 'a'.
+size_t Property_string(Property *property, char *buffer, size_t size);
+
+// Run the cases of one shard of a property, exiting with a failure once one fails
+void Property_check(const char *name, void (*body)(Property *), int numCases, int shard);
+
+/*
+ * Usage:
+ * PROPERTY(parseNeverCrashes, 10000) {
+ *     char request[256];
+ *     Property_string(property, request, sizeof(request));
+ *     parse(request);
+ * }
+ */
+#define PROPERTY(testName, count) \
+    void testName ## Property(Property *property);\
+    void testName ## Shard(int shard) {\
+        Property_check(#testName, testName ## Property, count, shard);\
+    }\
+    const TestSuite testName = {\
+        .name = #testName,\
+        .caseTest = testName ## Shard,\
+        .numCases = PROPERTY_SHARDS,\
+        .isLeaf = 1\
+    };            \
+    TESTC_REGISTER(testName) \
+    void testName ## Property(Property *property)
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef TESTC_SNAPSHOT_H
+#define TESTC_SNAPSHOT_H
+
+#include <stddef.h>
+
+/*
+ * A snapshot assertion compares output against a file checked in under the snapshot directory,
+ * which is snapshotDir in TestRunOptions (`--snapshots`), or `snapshots` in the working directory
+ * by default. Snapshots are mapped and compared with memcmp, so even huge ones cost about one read.
+ * Only when they differ is a diff printed: a minimal line diff if both sides are text, or the
+ * differing byte ranges otherwise. With updateSnapshots (`--update-snapshots`), snapshots which
+ * are missing or different are written instead, atomically, and the assertion passes.
+ */
+
+// Fail like an assertion if size bytes at data aren't the same as the snapshot called name, which
+// is a path under the snapshot directory
+void Snapshot_assert(const char *name, const void *data, size_t size, const char *file, int line);
+
+#define ASSERT_SNAPSHOT(name, data, size) Snapshot_assert(name, data, size, __FILE__, __LINE__)
+
+typedef struct {
+    // stdout before the capture, and the file that it goes to during it
+    int stdoutFd;
+    int captureFd;
+    int done;
+} SnapshotCapture;
+
+SnapshotCapture SnapshotCapture_begin();
+
+// Put stdout back and assert that what was printed to it matches the snapshot
+void SnapshotCapture_end(SnapshotCapture *capture, const char *name, const char *file, int line);
+
+/*
+ * Asserts that what the block that follows prints to stdout matches a snapshot. The block must not
+ * jump out of itself with break, goto or return, or stdout isn't put back.
+ * Usage:
+ * ASSERT_STDOUT_SNAPSHOT("reports/summary.txt") {
+ *     printSummary(report);
+ * }
+ */
+#define ASSERT_STDOUT_SNAPSHOT(name) \
+    for (SnapshotCapture snapshotCapture = SnapshotCapture_begin(); !snapshotCapture.done; \
+         SnapshotCapture_end(&snapshotCapture, name, __FILE__, __LINE__))
+
+#endif
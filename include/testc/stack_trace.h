@@ -3,4 +3,18 @@
 
 void printStackTrace(int fd, int maxDepth);
 
-#endif
\ No newline at end of file
+/*
+ * Print the source line and function of every frame of a trace from backtrace(), e.g. one that was
+ * recorded earlier. Frames without debug information are printed as backtrace_symbols has them.
+ */
+void printTrace(int fd, void *const *trace, int depth);
+
+/*
+ * Write the name of the function that each frame is in to functions, looking the frames of each
+ * object up together rather than one by one like printTrace, and the source file that it's in to
+ * files. Either can be NULL. Names are allocated, and NULL where they aren't known, such as for
+ * files on macOS, which has no addr2line. Returns -1 if frames couldn't be looked up.
+ */
+int symbolizeFunctions(void *const *frames, int numFrames, char **functions, char **files);
+
+#endif
@@ -7,6 +7,19 @@
 #include <stdio.h>
 
 #include "testc/test_suite.h"
+#include "testc/trace_scope.h"
+
+// How the job slots of a run are placed on CPUs, see pin in TestRunOptions
+typedef enum {
+    TestPin_NONE,
+    // Each slot gets its own CPU out of the ones the runner may use
+    TestPin_CORES,
+    // Each slot gets its own CPU out of the ones the kernel isolated (isolcpus), so that tests
+    // which time themselves don't share a core with the rest of the system
+    TestPin_ISOLATED,
+    // Slots are spread across NUMA nodes, each one on the CPUs and the memory of its node
+    TestPin_NUMA
+} TestPinMode;
 
 typedef struct {
     const char *dir;
@@ -14,20 +27,193 @@ typedef struct {
     float fps;
     int noFork;
 
-    // path to a test suite
-    const char *filter;
+    // Period-separated patterns of the tests to run e.g. `all.*.parse*`. Each segment is a glob
+    // where * matches any characters and ? matches one character, and a segment of ** matches any
+    // number of segments. A pattern which matches a suite selects all of its tests. When there are
+    // no filters, every test is selected.
+    const char **filters;
+    int numFilters;
+
+    // Patterns, like the filters, of tests and suites that won't run even if a filter selects them
+    const char **excludes;
+    int numExcludes;
+
+    // Print the path of every selected test instead of running them
+    int list;
+
+    // The maximum number of tests that run at once. Zero or less means one slot per test.
+    int jobs;
+
+    // The number of times a failed test is rerun. A test that fails and then passes on a retry is
+    // reported as flaky instead of failed.
+    int retries;
+
+    // The number of times every test is run. Runs of the same test are spread across the job
+    // slots, so they may overlap.
+    int repeat;
+
+    // Stop repeating a test once it fails. Without repeat, tests are repeated until they fail.
+    int untilFail;
+
+    // Once this many tests have failed, kill the running tests and skip the rest. Zero or less
+    // means never.
+    int failFast;
+
+    // The maximum number of sibling tests that run one after the other in the same child, which
+    // saves a fork for every test but the first. The size of a batch adapts to how long tests take.
+    // If a test fails, the child exits, and the rest of its batch runs in a fresh child. Zero or
+    // less runs every test in its own child.
+    int batch;
+
+    // The number of seconds that TestC_main fuzzes each selected fuzz target for instead of running
+    // the tests. Zero or less runs the tests.
+    int fuzz;
+
+    // Fail tests that return with memory they allocated still allocated, printing where it was
+    // allocated. This needs the alloc library to be linked (see testc/alloc.h), and only applies
+    // to forked tests.
+    int checkLeaks;
+
+    // The number of threads that run the tests of SUITE_THREADSAFE suites in the runner's process,
+    // next to the forked tests. Zero or less forks every test. Once a test crashes on a thread,
+    // the runs that are left are forked.
+    int threads;
+
+    // Pin each job slot to a CPU or a NUMA node, which stops the kernel from moving tests across
+    // cores in the middle of a timing. Only supported on Linux. Tests started by fixture servers
+    // and threaded tests aren't pinned.
+    TestPinMode pin;
+
+    // An address like `unix:/tmp/testc.sock` or `host:port` that the run listens on for workers,
+    // which are processes of the same test binary started with TestC_work (`--worker`) on this or
+    // other hosts. The runner hands tests to whichever worker has a free slot and streams their
+    // results and logs back, so every host stays busy until the end. The tests of a worker that
+    // disconnects are requeued. Tests with a fixture server and threaded tests always run here.
+    const char *listen;
+
+    // With listen, only run here the tests that workers can't run
+    int remoteOnly;
+
+    // With remoteOnly, how many seconds the run waits for a worker to connect while none is and
+    // nothing runs here, before it skips the tests that are left, or 0 for 60
+    int workerTimeout;
+
+    // Where snapshot assertions find their snapshots (see testc/snapshot.h), or NULL for
+    // `snapshots` in the working directory
+    const char *snapshotDir;
+
+    // Write the snapshots which are missing or don't match instead of failing
+    int updateSnapshots;
+
+    // Write a timeline of the run to trace.json in its log directory, in the trace event format
+    // that chrome://tracing and Perfetto load. Every run of a test is a span on the track of the
+    // job slot, thread or worker slot it ran in, every suite is a span from its first test's start
+    // to its last test's end, and counters track how many tests were running and how much CPU the
+    // runner itself used.
+    int trace;
+
+    // Sample the stacks of every test that the runner forks on this machine, every millisecond of
+    // CPU time that it uses, and write them as folded stacks for flame graph tools: name.folded
+    // next to each test's log, and a suite.folded next to each suite's log directory, where every
+    // stack starts with the path of its test within the suite
+    int profile;
+
+    // Change how many forked tests run at once with the load on the machine, between minJobs and
+    // jobs. Four times a second, the runner reads how much of the time tasks stalled on CPU,
+    // memory and IO from /proc/pressure, or counts the runnable tasks in /proc/loadavg and the
+    // memory available in /proc/meminfo where that isn't there. It takes a quarter of the slots
+    // away when any of them is under pressure, and adds one back when none is and every slot is
+    // busy. Every reading goes to concurrency.txt in the run's log directory, and the range of the
+    // limit is printed at the end. Tests on threads and workers aren't counted.
+    int adaptiveJobs;
+    int minJobs;
+
+    // Turn core dumps off in every test that the runner forks on this machine, and write a
+    // minidump to name.dmp next to the log of each one that crashes instead, with the registers
+    // and stacks of its threads and the modules it had loaded (see testc/minidump.h)
+    int minidumps;
+
+    // Start the tests which failed the last time that the history has them in (see
+    // TestC_history) before the others
+    int failedFirst;
+
+    // Only select the tests which ran code in one of these source files, going by the impact index
+    // that past runs left under the log root (see testc/impact.h), and the tests that the index
+    // doesn't have yet. Each is a comma-separated list of paths, which can be relative to any
+    // directory that the indexed files are in. Every test is selected if there's no index, or if
+    // a file isn't in it, since nothing is known about what a change to it affects.
+    const char **changedFiles;
+    int numChangedFiles;
+
+    // Only for TestC_main: once the run is over, wait for the executable, or any of the watched
+    // paths, to change, and then execute it again with the same arguments and failedFirst. A
+    // watched directory sees changes to the files in it, but not in its subdirectories. Only
+    // supported on Linux.
+    int watch;
+    const char **watchPaths;
+    int numWatchPaths;
 } TestRunOptions;
 
 
 typedef enum {
     TestState_IDLE,
     TestState_RUNNING,
-    TestState_DONE
+    TestState_DONE,
+    // Some runs of the test passed and some failed
+    TestState_FLAKY,
+    // The test was cancelled before it could finish (see failFast in TestRunOptions)
+    TestState_SKIPPED
 } TestState;
 
-typedef struct TestNode {
-    int isLeaf;
-    const char *name;
+// The frequently written state of a test (a leaf of the graph). Leaves are stored densely and in
+// pre-order, so the scheduler and renderer scan them without chasing pointers.
+typedef struct {
+    TestState state;
+
+    // The signal that the test subprocess terminated with. See
+    // https://linux.die.net/man/2/wait under "status", where WIFCONTINUED is false
+    int exitSignal;
+
+    // The pid of the test subprocess (test is forked to ensure parent process doesn't crash).
+    pid_t pid;
+
+    // The CPU, or the NUMA node, that the test's last run was pinned to, or -1
+    int cpu;
+    int numaNode;
+
+    // The worker that ran the test's last run, in the order workers connected, or -1 if it ran in
+    // this process's children (see listen in TestRunOptions)
+    int worker;
+
+    // Whether the test runs on the runner's thread pool instead of in a subprocess, in which case
+    // pid stays 0 (see threads in TestRunOptions)
+    int threaded;
+
+    // The job slot, the thread of the pool, or the slot of the worker that the test's last run was
+    // in, which is the track it shows on in the trace (see trace in TestRunOptions)
+    int slot;
+
+    // The index of this leaf's node in TestGraph.nodes
+    int node;
+
+    // The fixture server that forks this test, or -1 if the runner forks it directly
+    int server;
+
+    // Bookkeeping for tests which run more than once (see retries and repeat in
+    // TestRunOptions). The test is finished once numRunsDone reaches maxRuns.
+    int numRuns;
+    int numRunsDone;
+    int numRunsPassed;
+    int maxRuns;
+    int retriesLeft;
+    long long totalRunNanos;
+    // For tests on a virtual clock, the total of their runs' durations on that clock
+    long long totalVirtualNanos;
+    // The CPU time and peak memory of the runs that the runner forked itself. Batched, served,
+    // threaded and remote runs aren't measured.
+    long long totalUserNanos;
+    long long totalSystemNanos;
+    long maxRssKb;
 
     // time that the test started/ended
     struct timespec start;
@@ -35,43 +221,79 @@ typedef struct TestNode {
 
     // an int representing which state the progress indicator is in (0-3 for a 4-state spinner)
     int progressIndicatorState;
+} TestLeaf;
 
-    struct TestNode *parent;
-
-    union {
-        // Properties only valid for leaf nodes
-        struct {
-            void (*test)();
-
-            TestState state;
+typedef struct {
+    int isLeaf;
 
-            // The signal that the test subprocess terminated with. See
-            // https://linux.die.net/man/2/wait under "status", where WIFCONTINUED is false
-            int exitSignal;
+    // The index of the parent node, or -1 for the root
+    int parent;
 
-            // File descriptors for where the test output should be written
+    // Nodes are stored in pre-order, so the subtree of the node at index i is the span [i, end).
+    // The first child of a parent is at i + 1 and each sibling starts at the previous one's end.
+    int end;
 
-            // The pid of the test subprocess (test is forked to ensure parent process doesn't
-            // crash).
-            pid_t pid;
+    int depth;
 
-            FILE *outputFile;
-        };
+    union {
+        // The index of a leaf node's state in TestGraph.leaves
+        int leaf;
 
         // ...for parent nodes
         struct {
-            int numChildren;
-            struct TestNode **children;
-
             // Total number taken from children and indirect children (not just immediate children)
             int numTests;
             int numPassed;
             int numFailed;
+            int numFlaky;
+            int numSkipped;
         };
     };
 } TestNode;
 
-TestNode *findNode(TestNode *node, const char *filter);
+// The rarely accessed data of a node, stored apart from the hot state
+typedef struct {
+    const char *name;
+
+    // Only set for leaves. The cases of a parameterized test have a caseTest instead of a test.
+    void (*test)();
+    case_test_t caseTest;
+    int caseIndex;
+    // Only set for fuzz targets, see TestC_fuzz
+    int (*fuzz)(int numWorkers, int seconds);
+    int virtualTime;
+    FILE *outputFile;
+
+    // Only set for parents, and only if their suite has one
+    const TestFixture *fixture;
+    int threadSafe;
+
+    // Only set for leaves: the scopes and counters that the test's runs recorded, in the order
+    // they ended (see trace_scope.h), and how many a full ring dropped
+    TraceEvent *traceEvents;
+    int numTraceEvents;
+    long long numTraceEventsDropped;
+} TestNodeInfo;
+
+/*
+ * The runtime state of a test suite. Everything lives in a single allocation: nodes[i] and
+ * info[i] describe the same node, and the root is at index 0.
+ */
+typedef struct {
+    int numNodes;
+    int numLeaves;
+    TestNode *nodes;
+    TestNodeInfo *info;
+    TestLeaf *leaves;
+} TestGraph;
+
+// Find the node at a period-separated path e.g. `all.http.parser`, or NULL if there isn't one
+TestNode *findNode(TestGraph *graph, const char *path);
+
+// Like findNode, but returns the state of a leaf, or NULL if the path isn't a leaf
+TestLeaf *findLeaf(TestGraph *graph, const char *path);
+
+void TestGraph_free(TestGraph *graph);
 
 /*
  * This function will run a test suite in parallel, spitting logs out to the target directory. The
@@ -81,7 +303,33 @@ TestNode *findNode(TestNode *node, const char *filter);
  * more like a log file. Instead, you should run this in an external terminal. You can reuse the
  * builds that CLion makes by finding the binary in cmake-build-debug.
  */
-int TestC_run(const TestSuite *suite, TestRunOptions options, TestNode **result);
+int TestC_run(const TestSuite *suite, TestRunOptions options, TestGraph **result);
+
+/*
+ * Fuzz every selected fuzz target (see testc/fuzz.h) in turn for options.fuzz seconds, with
+ * options.jobs worker processes, or one per CPU if it's zero or less. The corpus of each target is
+ * under the root test logs directory. Returns the number of targets that crashed, or -1 if fuzzing
+ * couldn't start.
+ */
+int TestC_fuzz(const TestSuite *suite, TestRunOptions options);
+
+/*
+ * Print the history of the selected tests to fd. Every run of TestC_run appends a record for each
+ * of its tests to history.results in the root test logs directory, keyed by the line of the test's
+ * path in history.paths, with its state, mean duration, CPU time, peak memory and the commit it was
+ * built from (TESTC_COMMIT, or git's HEAD in the working directory). For each test with history,
+ * this prints its failure rate, its p50 and p95 durations, and the run where its duration shifted
+ * the most if that made it much slower or faster. Returns 0, or -1 if the history couldn't be read.
+ */
+int TestC_history(const TestSuite *suite, TestRunOptions options, int fd);
+
+/*
+ * Connect to the run listening at address (see listen in TestRunOptions) and run the tests it
+ * sends, with options.jobs tests at once, or one per CPU if it's zero or less. Tests are found by
+ * their path, so the suite must be the one the run was started with. Returns once the run is over,
+ * 0 if it ended normally and -1 otherwise.
+ */
+int TestC_work(const TestSuite *suite, TestRunOptions options, const char *address);
 
 typedef enum {
     TestCResult_ALL_PASSED = 0,
@@ -6,6 +6,21 @@
 #include <testc/stack_trace.h>
 
 typedef void(*test_t)();
+typedef void(*case_test_t)(int index);
+
+/*
+ * Hooks which run around the tests of a suite. suiteSetup runs once before any of the suite's
+ * tests and suiteTeardown once after all of them. When tests are forked, they are forked from a
+ * server process which ran suiteSetup, so whatever it builds is shared copy-on-write instead of
+ * being rebuilt by every test. setup and teardown run in each test's process around the test,
+ * including the tests of nested suites. Any hook may be NULL.
+ */
+typedef struct TestFixture {
+    test_t suiteSetup;
+    test_t suiteTeardown;
+    test_t setup;
+    test_t teardown;
+} TestFixture;
 
 /*
  * A test suite defines a directed (hopefully acyclic) graph where nodes are suites and leaves are
@@ -19,17 +34,73 @@ typedef struct TestSuite {
     union {
         struct {
             test_t test;
+            // Parameterized tests run caseTest once for every index below numCases instead
+            case_test_t caseTest;
+            int numCases;
+            // Only set for fuzz targets (see testc/fuzz.h), whose test replays their corpus
+            int (*fuzz)(int numWorkers, int seconds);
+            // Whether the test runs on a virtual clock, see testc/virtual_time.h
+            int virtualTime;
         };
 
         struct {
             const struct TestSuite **children;
             int numChildren;
+            const TestFixture *fixture;
+            // Whether the tests below may run on threads of the runner, see SUITE_THREADSAFE
+            int threadSafe;
         };
     };
 } TestSuite;
 
 int TestSuite_numTests(const TestSuite *suite);
 
+/*
+ * A registration places a test in the suite at a period-separated path e.g. `http.parser`. When
+ * TESTC_AUTO_REGISTER is defined before including this header, every TEST puts a pointer to its
+ * registration in a dedicated linker section, so test files can be compiled separately and don't
+ * need to be listed in any SUITE. The suite path is TESTC_SUITE if it is defined before including
+ * this header, otherwise it's the name of the source file without its extension.
+ */
+typedef struct {
+    const char *suite;
+    const TestSuite *test;
+} TestRegistration;
+
+/*
+ * Builds a suite named rootName out of every registered test in one pass over the linker section.
+ * Tests registered under the same suite path share a suite node. The tree is built once and lives
+ * until the process exits, and each rootName gets its own root over it, which later calls with the
+ * same name return again. Note that the linker drops objects from static libraries unless
+ * they are referenced, so registered tests should be linked as object files (e.g. an OBJECT
+ * library in CMake).
+ */
+const TestSuite *TestSuite_registered(const char *rootName);
+
+#ifdef __APPLE__
+#define TESTC_SECTION __attribute__((used, section("__DATA,testc_tests")))
+#else
+#define TESTC_SECTION __attribute__((used, section("testc_tests")))
+#endif
+
+#ifdef TESTC_SUITE
+#define TESTC_SUITE_PATH TESTC_SUITE
+#else
+#define TESTC_SUITE_PATH __FILE__
+#endif
+
+#ifdef TESTC_AUTO_REGISTER
+#define TESTC_REGISTER(testName) \
+    static const TestRegistration testName ## Registration = {\
+        .suite = TESTC_SUITE_PATH,\
+        .test = &testName\
+    };\
+    static const TestRegistration *testName ## RegistrationPointer TESTC_SECTION = \
+        &testName ## Registration;
+#else
+#define TESTC_REGISTER(testName)
+#endif
+
 /*
  * Usage: TEST(myTestName) { assert(foo() === expectedFoo) }
  */
@@ -40,8 +111,48 @@ int TestSuite_numTests(const TestSuite *suite);
         .test = testName ## Method,\
         .isLeaf = 1\
     };            \
+    TESTC_REGISTER(testName) \
     void testName ## Method()
 
+/*
+ * Parameterized tests run the same body once per case, and every case is reported as its own test
+ * named after its index e.g. `parse[42]`. The cases are only expanded when a run builds its graph.
+ * TEST_P takes the number of cases and a generator which returns the parameter of a case from its
+ * index, and TEST_TABLE takes a static array of cases. The body gets the case as `param`.
+ * Usage:
+ * int square(int index) { return index * index; }
+ * TEST_P(isNonNegative, int, 1000, square) { ASSERT_EQ(param >= 0, 1, int, %d); }
+ * const char *requests[] = {"GET / HTTP/1.1", "POST / HTTP/1.1"};
+ * TEST_TABLE(parseRequest, const char *, requests) { ASSERT_EQ(parse(param), 0, int, %d); }
+ */
+#define TEST_P(testName, type, count, generator) \
+    void testName ## Case(type param);\
+    void testName ## Run(int index) {\
+        testName ## Case(generator(index));\
+    }\
+    const TestSuite testName = {\
+        .name = #testName,\
+        .caseTest = testName ## Run,\
+        .numCases = count,\
+        .isLeaf = 1\
+    };            \
+    TESTC_REGISTER(testName) \
+    void testName ## Case(type param)
+
+#define TEST_TABLE(testName, type, table) \
+    void testName ## Case(type param);\
+    void testName ## Run(int index) {\
+        testName ## Case(table[index]);\
+    }\
+    const TestSuite testName = {\
+        .name = #testName,\
+        .caseTest = testName ## Run,\
+        .numCases = sizeof(table) / sizeof(table[0]),\
+        .isLeaf = 1\
+    };            \
+    TESTC_REGISTER(testName) \
+    void testName ## Case(type param)
+
 /*
  * Use SUITE when you want to define a non-leaf node in a test suite graph.
  * Usage:
@@ -62,6 +173,54 @@ int TestSuite_numTests(const TestSuite *suite);
         .children = suiteName ## Children,                            \
     };
 
+/*
+ * Use these to define the hooks of a fixture, and then SUITE_F to attach the fixture to a suite.
+ * Usage:
+ * SUITE_SETUP(loadDataset) { dataset = load("big.csv"); }
+ * SETUP(resetCursor) { cursor = 0; }
+ * FIXTURE(dataset, .suiteSetup = loadDataset, .setup = resetCursor)
+ * SUITE_F(datasetTests, dataset, &a, &b)
+ */
+#define SUITE_SETUP(hookName) void hookName()
+#define SUITE_TEARDOWN(hookName) void hookName()
+#define SETUP(hookName) void hookName()
+#define TEARDOWN(hookName) void hookName()
+
+#define FIXTURE(fixtureName, ...) \
+    const TestFixture fixtureName = { __VA_ARGS__ };
+
+#define SUITE_F(suiteName, fixtureName, ...) \
+    const TestSuite * suiteName ## Children[] = { __VA_ARGS__ }; \
+    const TestSuite suiteName = { \
+        .name = #suiteName,     \
+        .isLeaf = 0,    \
+        .numChildren = sizeof(suiteName ## Children) / sizeof(TestSuite *), \
+        .children = suiteName ## Children,                            \
+        .fixture = &fixtureName, \
+    };
+
+/*
+ * Use SUITE_THREADSAFE for suites whose tests may share the runner's process. With threads in
+ * TestRunOptions (`--threads N`), their tests run on a pool of N threads instead of being forked,
+ * while every other test is still forked. A failed assertion or a crash only ends the test running
+ * on that thread, and its assertion messages go to the test's log, but it shares everything else
+ * with the other tests: globals, the heap, file descriptors, signal handlers, and stdout, where its
+ * printf output ends up. Tests with a fixture server, fuzz targets, tests on virtual time and
+ * leak-checked runs are always forked. Properties silence the whole process while they shrink, so
+ * keep them out of these suites.
+ * Usage:
+ * SUITE_THREADSAFE(parserTests, &parsesNumbers, &parsesStrings)
+ */
+#define SUITE_THREADSAFE(suiteName, ...) \
+    const TestSuite * suiteName ## Children[] = { __VA_ARGS__ }; \
+    const TestSuite suiteName = { \
+        .name = #suiteName,     \
+        .isLeaf = 0,    \
+        .numChildren = sizeof(suiteName ## Children) / sizeof(TestSuite *), \
+        .children = suiteName ## Children,                            \
+        .threadSafe = 1, \
+    };
+
 
 
 #endif
\ No newline at end of file
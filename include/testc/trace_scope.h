@@ -0,0 +1,91 @@
+#ifndef TESTC_TRACE_SCOPE_H
+#define TESTC_TRACE_SCOPE_H
+
+#include <stdint.h>
+
+/*
+ * Scopes and counters let a test show where inside it the time goes. TRACE_SCOPE times the rest of
+ * the block it's in, and TRACE_COUNTER records a value at a point in time. Recording one reads the
+ * clock and writes a fixed-size event into a ring in memory shared with the runner, without locks
+ * or system calls. After each run the runner takes the events out of the ring, keeps them with the
+ * test's node in the graph, appends a summary of them to the test's log, and puts them on the
+ * test's track in the trace (see trace in TestRunOptions). Events are only kept for runs that the
+ * runner starts on this machine, and nothing is recorded without the runner, as with `--nofork`.
+ * Tests on a virtual clock time their scopes on it.
+ */
+
+// The longest name that is kept, plus one. Longer names are cut short.
+#define TRACE_NAME_SIZE 36
+// The number of events a ring holds. When a run records more, the oldest are dropped.
+#define TRACE_RING_CAPACITY 1024
+
+typedef enum {
+    TraceEvent_SCOPE = 1,
+    TraceEvent_COUNTER
+} TraceEventType;
+
+typedef struct {
+    // The event's position in its ring plus one, which is written last, or 0 while it's written
+    uint64_t sequence;
+    // When a scope started or a counter was recorded, in nanoseconds on CLOCK_MONOTONIC
+    int64_t time;
+    // The duration of a scope in nanoseconds, or the value of a counter
+    int64_t value;
+    int32_t type;
+    char name[TRACE_NAME_SIZE];
+} TraceEvent;
+
+// The events of a test, shared between its runs and the runner. Writers claim a position by
+// incrementing next, so several threads, or repeats of the test, can record at once.
+typedef struct {
+    uint64_t next;
+    // Only used by the runner, which has taken the events before this position
+    uint64_t harvested;
+    uint64_t reserved[6];
+    TraceEvent events[TRACE_RING_CAPACITY];
+} TraceRing;
+
+// Record the events of every thread of this process into ring from now on, or stop recording if
+// it's NULL. It's weak so that the runner doesn't need this library to be linked.
+void TraceRing_enter(TraceRing *ring) __attribute__((weak));
+
+// Record the events of this thread into ring instead of the process's, as a test that runs on one
+// of the runner's threads does, or go back to the process's ring if it's NULL. Threads that such a
+// test starts record into the process's ring, which the runner doesn't have, so they aren't kept.
+void TraceRing_enterThread(TraceRing *ring) __attribute__((weak));
+
+typedef struct {
+    const char *name;
+    int64_t start;
+} TraceScope;
+
+TraceScope TraceScope_begin(const char *name);
+
+void TraceScope_end(TraceScope *scope);
+
+void Trace_counter(const char *name, int64_t value);
+
+#define TRACE_SCOPE_VARIABLE(line) traceScope ## line
+#define TRACE_SCOPE_NAME(line) TRACE_SCOPE_VARIABLE(line)
+
+/*
+ * Usage:
+ * TEST(parsesLargeDocument) {
+ *     Document *document;
+ *     {
+ *         TRACE_SCOPE("parse");
+ *         document = parse(input);
+ *     }
+ *     TRACE_COUNTER("nodes", document->numNodes);
+ *     TRACE_SCOPE("validate");
+ *     ASSERT_EQ(validate(document), 0, int, %d);
+ * }
+ * A scope that an assertion fails in, or that a crash ends, isn't recorded.
+ */
+#define TRACE_SCOPE(name) \
+    TraceScope TRACE_SCOPE_NAME(__LINE__) __attribute__((cleanup(TraceScope_end))) = \
+            TraceScope_begin(name)
+
+#define TRACE_COUNTER(name, value) Trace_counter(name, value)
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef TESTC_VIRTUAL_TIME_H
+#define TESTC_VIRTUAL_TIME_H
+
+#include <testc/test_suite.h>
+
+/*
+ * Linking the virtual_time library replaces sleep, usleep, nanosleep, clock_nanosleep,
+ * clock_gettime and time with versions that can run on a virtual clock. A test declared with
+ * TEST_VIRTUAL_TIME runs on it: its sleeps return at once and move the virtual clock forward
+ * instead, so the clocks it reads still add up, but it doesn't wait. The virtual clock keeps moving
+ * with the real one in between, and only goes forward. CPU time clocks stay real, and so do the
+ * timeouts of functions that aren't replaced, like poll or pthread_cond_timedwait. Tests on the
+ * virtual clock are reported with their virtual duration next to their real one. Only glibc is
+ * supported.
+ */
+
+// Put this process on the virtual clock. The nanoseconds that sleeps skip from then on are added
+// to *skippedNanos, which may be shared with another process. They're weak so that the runner
+// doesn't need this library to be linked.
+void VirtualTime_start(long long *skippedNanos) __attribute__((weak));
+
+// Go back to sleeping for real. Clocks keep the time that was skipped.
+void VirtualTime_stop() __attribute__((weak));
+
+/*
+ * Usage:
+ * TEST_VIRTUAL_TIME(retriesWithBackoff) {
+ *     ASSERT_EQ(connectWithRetries(5), -1, int, %d); // sleeps 1 + 2 + 4 + 8 seconds, instantly
+ * }
+ */
+#define TEST_VIRTUAL_TIME(testName) \
+    void testName ## Method();\
+    const TestSuite testName = {\
+        .name = #testName,\
+        .test = testName ## Method,\
+        .virtualTime = 1,\
+        .isLeaf = 1\
+    };            \
+    TESTC_REGISTER(testName) \
+    void testName ## Method()
+
+#endif
@@ -0,0 +1,204 @@
+#include <execinfo.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "testc/alloc.h"
+#include "testc/assert.h"
+#include "testc/stack_trace.h"
+
+// glibc's own allocator, which the replacements below forward to
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void __libc_free(void *pointer);
+
+// The size of the table of live allocations, a power of two. It's kept at most 3/4 full, and the
+// allocations past that aren't tracked.
+#define MAX_LIVE 16384
+#define TRACE_DEPTH 8
+// The most leaks that are printed with their stack trace
+#define MAX_REPORTED 16
+// Marks a slot whose allocation was freed, so that lookups keep probing past it
+#define FREED ((void *) 1)
+
+typedef struct {
+    void *pointer;
+    size_t size;
+    int depth;
+    void *trace[TRACE_DEPTH];
+} LiveAllocation;
+
+static long long numAllocations;
+static int tracking;
+// An open addressing hash table from pointers to their allocations, mapped instead of allocated
+static LiveAllocation *live;
+static int numUsedSlots;
+static int overflowed;
+static int tableLock;
+// Set while a thread is inside the tracker, so the allocations of backtrace() aren't tracked
+static __thread int inTracker;
+
+void lockTable() {
+    while (__atomic_exchange_n(&tableLock, 1, __ATOMIC_ACQUIRE)) {
+    }
+}
+
+void unlockTable() {
+    __atomic_store_n(&tableLock, 0, __ATOMIC_RELEASE);
+}
+
+size_t hashPointer(const void *pointer) {
+    return (size_t) (((uint64_t) (uintptr_t) pointer * 0x9e3779b97f4a7c15) >> 32) & (MAX_LIVE - 1);
+}
+
+// Not inlined, so that the frames it skips are always itself and the allocation function
+__attribute__((noinline)) void trackAllocation(void *pointer, size_t size) {
+    if (!__atomic_load_n(&tracking, __ATOMIC_RELAXED) || pointer == NULL || inTracker) {
+        return;
+    }
+    inTracker = 1;
+    void *trace[TRACE_DEPTH + 2];
+    int depth = backtrace(trace, TRACE_DEPTH + 2) - 2;
+    lockTable();
+    if (numUsedSlots >= MAX_LIVE / 4 * 3) {
+        overflowed = 1;
+    } else {
+        size_t slot = hashPointer(pointer);
+        while (live[slot].pointer != NULL && live[slot].pointer != FREED) {
+            slot = (slot + 1) & (MAX_LIVE - 1);
+        }
+        numUsedSlots += live[slot].pointer == NULL;
+        LiveAllocation *allocation = &live[slot];
+        allocation->pointer = pointer;
+        allocation->size = size;
+        allocation->depth = depth > 0 ? depth : 0;
+        memcpy(allocation->trace, trace + 2, allocation->depth * sizeof(void *));
+    }
+    unlockTable();
+    inTracker = 0;
+}
+
+void forgetAllocation(void *pointer) {
+    if (!__atomic_load_n(&tracking, __ATOMIC_RELAXED) || pointer == NULL) {
+        return;
+    }
+    lockTable();
+    for (size_t slot = hashPointer(pointer); live[slot].pointer != NULL;
+         slot = (slot + 1) & (MAX_LIVE - 1)) {
+        if (live[slot].pointer == pointer) {
+            live[slot].pointer = FREED;
+            break;
+        }
+    }
+    unlockTable();
+}
+
+void *malloc(size_t size) {
+    void *pointer = __libc_malloc(size);
+    __atomic_fetch_add(&numAllocations, 1, __ATOMIC_RELAXED);
+    trackAllocation(pointer, size);
+    return pointer;
+}
+
+void *calloc(size_t count, size_t size) {
+    void *pointer = __libc_calloc(count, size);
+    __atomic_fetch_add(&numAllocations, 1, __ATOMIC_RELAXED);
+    trackAllocation(pointer, count * size);
+    return pointer;
+}
+
+void *realloc(void *pointer, size_t size) {
+    forgetAllocation(pointer);
+    void *moved = __libc_realloc(pointer, size);
+    __atomic_fetch_add(&numAllocations, 1, __ATOMIC_RELAXED);
+    trackAllocation(moved, size);
+    return moved;
+}
+
+void free(void *pointer) {
+    forgetAllocation(pointer);
+    __libc_free(pointer);
+}
+
+long long Alloc_count() {
+    return __atomic_load_n(&numAllocations, __ATOMIC_RELAXED);
+}
+
+void Alloc_startTracking() {
+    if (live == NULL) {
+        live = mmap(NULL, MAX_LIVE * sizeof(LiveAllocation), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (live == MAP_FAILED) {
+            live = NULL;
+            perror("failed to map the table of live allocations");
+            return;
+        }
+    } else if (numUsedSlots > 0) {
+        memset(live, 0, MAX_LIVE * sizeof(LiveAllocation));
+    }
+    numUsedSlots = 0;
+    overflowed = 0;
+    // backtrace loads libgcc the first time it's called, which allocates for good
+    void *trace[1];
+    backtrace(trace, 1);
+    __atomic_store_n(&tracking, 1, __ATOMIC_RELEASE);
+}
+
+int Alloc_stopTracking(int fd) {
+    if (live == NULL) {
+        return 0;
+    }
+    __atomic_store_n(&tracking, 0, __ATOMIC_RELEASE);
+    // Wait for any thread that's still updating the table
+    lockTable();
+    unlockTable();
+    int numLeaks = 0;
+    size_t numBytes = 0;
+    for (size_t slot = 0; slot < MAX_LIVE; ++slot) {
+        const LiveAllocation *allocation = &live[slot];
+        if (allocation->pointer == NULL || allocation->pointer == FREED) {
+            continue;
+        }
+        if (numLeaks < MAX_REPORTED) {
+            dprintf(fd, "leaked %zu bytes at %p, allocated at:\n", allocation->size,
+                    allocation->pointer);
+            printTrace(fd, allocation->trace, allocation->depth);
+        }
+        ++numLeaks;
+        numBytes += allocation->size;
+    }
+    if (numLeaks > MAX_REPORTED) {
+        dprintf(fd, "...and %d more leaks\n", numLeaks - MAX_REPORTED);
+    }
+    if (numLeaks > 0) {
+        dprintf(fd, "%d allocations (%zu bytes) were never freed\n", numLeaks, numBytes);
+    }
+    if (overflowed) {
+        dprintf(fd, "too many allocations were live at once to track all of them\n");
+    }
+    return numLeaks;
+}
+
+AllocRegion AllocRegion_begin() {
+    return (AllocRegion) {.start = Alloc_count(), .done = 0};
+}
+
+void AllocRegion_end(AllocRegion *region, long long min, long long max, const char *file,
+                     int line) {
+    region->done = 1;
+    long long count = Alloc_count() - region->start;
+    if (count >= min && count <= max) {
+        return;
+    }
+    fprintf(TESTC_OUTPUT, "%s:%d\n", file, line);
+    fprintf(TESTC_OUTPUT, "Assertion Failed: between %lld and %lld allocations where:\n", min,
+            max);
+    fprintf(TESTC_OUTPUT, "  allocations = %lld\n", count);
+    fflush(TESTC_OUTPUT);
+    printStackTrace(TESTC_TRACE_FD, 16);
+    TestC_fail();
+}
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "testc/assert.h"
+#include "testc/concurrent.h"
+
+// How many times a thread spins at the barrier before it starts yielding between checks, so that
+// more threads than CPUs still make progress
+#define SPINS_BEFORE_YIELD 1024
+
+typedef struct {
+    void (*body)(int thread);
+    int numThreads;
+    int numRounds;
+    // Where the threads print failed assertions, which is wherever the test itself prints them
+    FILE *output;
+
+    // A barrier which opens each time the last thread arrives, moving on to the next generation
+    int numArrived;
+    int generation;
+
+    // Set by a thread whose body failed. The threads check it after every barrier, so they all
+    // stop after the same round.
+    int failed;
+} ConcurrentRun;
+
+typedef struct {
+    ConcurrentRun *run;
+    int index;
+    // The CPU that the thread is pinned to, or -1
+    int cpu;
+    pthread_t thread;
+    int numRounds;
+    long long totalNanos;
+    long long slowestNanos;
+} ConcurrentThread;
+
+// The percentage of CONCURRENT_YIELDs that yield, from TESTC_YIELD
+static int yieldPercent;
+static __thread uint64_t yieldRandom;
+
+void Concurrent_yield() {
+    if (yieldPercent <= 0) {
+        return;
+    }
+    // xorshift64
+    yieldRandom ^= yieldRandom << 13;
+    yieldRandom ^= yieldRandom >> 7;
+    yieldRandom ^= yieldRandom << 17;
+    if ((int) (yieldRandom % 100) < yieldPercent) {
+        sched_yield();
+    }
+}
+
+void waitAtBarrier(ConcurrentRun *run) {
+    int generation = __atomic_load_n(&run->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&run->numArrived, 1, __ATOMIC_ACQ_REL) == run->numThreads) {
+        __atomic_store_n(&run->numArrived, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&run->generation, generation + 1, __ATOMIC_RELEASE);
+        return;
+    }
+    for (int spins = 0; __atomic_load_n(&run->generation, __ATOMIC_ACQUIRE) == generation;
+         ++spins) {
+        if (spins >= SPINS_BEFORE_YIELD) {
+            sched_yield();
+        }
+    }
+}
+
+long long getNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL * 1000 * 1000 + now.tv_nsec;
+}
+
+void *runConcurrentThread(void *input) {
+    ConcurrentThread *self = input;
+    ConcurrentRun *run = self->run;
+#ifdef __linux__
+    if (self->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(self->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+    yieldRandom = (uint64_t) getNanos() * 0x9e3779b97f4a7c15 + (uint64_t) self->index + 1;
+    TestC_testOutput = run->output;
+    sigjmp_buf failure;
+    TestC_caseFailure = &failure;
+    // volatile since a failing round jumps back into the loop
+    for (volatile int round = 0; round < run->numRounds; ++round) {
+        waitAtBarrier(run);
+        if (__atomic_load_n(&run->failed, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        Concurrent_yield();
+        if (sigsetjmp(failure, 0) != 0) {
+            fprintf(TESTC_OUTPUT, "thread %d failed in round %d\n", self->index, round);
+            fflush(TESTC_OUTPUT);
+            __atomic_store_n(&run->failed, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        long long start = getNanos();
+        run->body(self->index);
+        long long nanos = getNanos() - start;
+        self->totalNanos += nanos;
+        if (nanos > self->slowestNanos) {
+            self->slowestNanos = nanos;
+        }
+        ++self->numRounds;
+    }
+    TestC_caseFailure = NULL;
+    return NULL;
+}
+
+// Pick a CPU for each thread out of the ones this process may run on. Threads aren't pinned if
+// there aren't enough CPUs for all of them, since they'd spin at the barrier on each other's CPU.
+void assignCpus(ConcurrentThread *threads, int numThreads) {
+    for (int i = 0; i < numThreads; ++i) {
+        threads[i].cpu = -1;
+    }
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) || CPU_COUNT(&allowed) < numThreads) {
+        return;
+    }
+    for (int cpu = 0, i = 0; cpu < CPU_SETSIZE && i < numThreads; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            threads[i++].cpu = cpu;
+        }
+    }
+#endif
+}
+
+void Concurrent_run(const char *name, void (*body)(int thread), int numThreads, int numRounds) {
+    const char *yield = getenv("TESTC_YIELD");
+    yieldPercent = yield != NULL ? atoi(yield) : 0;
+    ConcurrentRun run = {
+            .body = body,
+            .numThreads = numThreads,
+            .numRounds = numRounds,
+            .output = TestC_testOutput,
+    };
+    ConcurrentThread *threads = calloc(numThreads, sizeof(ConcurrentThread));
+    if (threads == NULL) {
+        perror("failed to allocate concurrent test threads");
+        TestC_fail();
+    }
+    assignCpus(threads, numThreads);
+    for (int i = 0; i < numThreads; ++i) {
+        threads[i].run = &run;
+        threads[i].index = i;
+        if (pthread_create(&threads[i].thread, NULL, runConcurrentThread, &threads[i])) {
+            perror("failed to create concurrent test thread");
+            // The threads already started would wait at the barrier forever
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    printf("%s: %d threads, %d rounds\n", name, numThreads, numRounds);
+    for (int i = 0; i < numThreads; ++i) {
+        const ConcurrentThread *thread = &threads[i];
+        printf("  thread %d", i);
+        if (thread->cpu >= 0) {
+            printf(" (cpu %d)", thread->cpu);
+        }
+        printf(": %d rounds, %.3fµs total, %.3fµs mean, %.3fµs slowest\n", thread->numRounds,
+               thread->totalNanos / 1e3,
+               thread->numRounds > 0 ? thread->totalNanos / 1e3 / thread->numRounds : 0.0,
+               thread->slowestNanos / 1e3);
+    }
+    fflush(stdout);
+    free(threads);
+    if (run.failed) {
+        TestC_fail();
+    }
+}
@@ -0,0 +1,564 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "testc/fuzz.h"
+
+// The number of coverage counters. Edges which hash to the same counter are indistinguishable.
+#define MAP_SIZE 65536
+// The number of inputs that workers can share before the oldest are overwritten
+#define QUEUE_SIZE 256
+#define MAX_WORKERS 64
+// The most inputs that a worker keeps in memory. Past it, new inputs replace random old ones.
+#define MAX_CORPUS 4096
+// Workers pull shared inputs and check the time once every this many runs
+#define SYNC_INTERVAL 256
+// A worker that runs this long past the end of the fuzz run is assumed to be stuck in the target
+#define HANG_SECONDS 10
+
+typedef struct {
+    size_t size;
+    uint8_t data[FUZZ_MAX_INPUT];
+} FuzzInput;
+
+typedef struct {
+    // 0 while the entry is being written, otherwise 1 + its position in the queue. Readers check
+    // that it didn't change while they copied the input.
+    uint64_t sequence;
+    int worker;
+    FuzzInput input;
+} QueueEntry;
+
+// The state that workers share, mapped before they're forked
+typedef struct {
+    // A bit per hit count bucket (see getBucket) per counter which any input has reached
+    uint8_t seen[MAP_SIZE];
+
+    uint64_t numQueued;
+    QueueEntry queue[QUEUE_SIZE];
+
+    uint64_t numRuns;
+    uint64_t numNewInputs;
+
+    // A worker that exits without setting this crashed on its current input
+    int finished[MAX_WORKERS];
+    FuzzInput current[MAX_WORKERS];
+} FuzzShared;
+
+// The state of a worker process
+typedef struct {
+    fuzz_target_t target;
+    const char *dir;
+    FuzzShared *shared;
+    int worker;
+    uint64_t random;
+
+    FuzzInput **corpus;
+    int numCorpus;
+
+    // The position in the shared queue of the next input to pull
+    uint64_t nextQueued;
+} Fuzzer;
+
+// Hit counts of the run in progress, written by the SanitizerCoverage callbacks below
+static uint8_t coverage[MAP_SIZE];
+static uintptr_t previousLocation;
+
+// Called once per instrumented module with its guards, which are set to the counter of their edge
+void __sanitizer_cov_trace_pc_guard_init(uint32_t *start, uint32_t *stop) {
+    static uint32_t numGuards = 0;
+    if (start == stop || *start != 0) {
+        return;
+    }
+    for (uint32_t *guard = start; guard < stop; ++guard) {
+        *guard = 1 + numGuards++ % (MAP_SIZE - 1);
+    }
+}
+
+void __sanitizer_cov_trace_pc_guard(uint32_t *guard) {
+    if (*guard != 0 && ++coverage[*guard] == 0) {
+        coverage[*guard] = UINT8_MAX;
+    }
+}
+
+// GCC only has -fsanitize-coverage=trace-pc, which calls this on every block without a guard, so
+// edges are made the way AFL makes them: from the hashes of the previous block and this one
+void __sanitizer_cov_trace_pc() {
+    uintptr_t location = (uintptr_t) (((uint64_t) (uintptr_t) __builtin_return_address(0)
+                                       * 0x9e3779b97f4a7c15) >> 48);
+    uint8_t *counter = &coverage[(location ^ previousLocation) % MAP_SIZE];
+    if (++*counter == 0) {
+        *counter = UINT8_MAX;
+    }
+    previousLocation = location >> 1;
+}
+
+// Bucket hit counts like AFL, so that running a loop 5 times instead of 4 isn't news, but running
+// it 8 times is
+uint8_t getBucket(uint8_t count) {
+    if (count <= 3) {
+        return count == 0 ? 0 : 1 << (count - 1);
+    }
+    if (count <= 7) {
+        return 8;
+    }
+    if (count <= 15) {
+        return 16;
+    }
+    if (count <= 31) {
+        return 32;
+    }
+    return count <= 127 ? 64 : 128;
+}
+
+// Record the coverage of the last run in the shared map and return whether any of it was new
+int hasNewCoverage(FuzzShared *shared) {
+    int isNew = 0;
+    const uint64_t *words = (const uint64_t *) coverage;
+    for (size_t i = 0; i < MAP_SIZE / sizeof(uint64_t); ++i) {
+        if (words[i] == 0) {
+            continue;
+        }
+        for (size_t j = i * sizeof(uint64_t); j < (i + 1) * sizeof(uint64_t); ++j) {
+            uint8_t bit = getBucket(coverage[j]);
+            if (bit != 0 && (shared->seen[j] & bit) == 0
+                && (__atomic_fetch_or(&shared->seen[j], bit, __ATOMIC_RELAXED) & bit) == 0) {
+                isNew = 1;
+            }
+        }
+    }
+    return isNew;
+}
+
+// See https://en.wikipedia.org/wiki/Xorshift#xorshift*
+uint64_t nextFuzzRandom(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1d;
+}
+
+const uint8_t interestingBytes[] = {0, 1, 16, 32, 64, 100, 127, 128, 255, '0', 'a', ' ', '\n'};
+#define NUM_INTERESTING_BYTES (sizeof(interestingBytes) / sizeof(*interestingBytes))
+
+// Apply a few random mutations to the input. Splicing takes a chunk of another corpus input.
+void mutate(Fuzzer *fuzzer, FuzzInput *input) {
+    int numMutations = 1 + (int) (nextFuzzRandom(&fuzzer->random) % 4);
+    for (int i = 0; i < numMutations; ++i) {
+        uint64_t random = nextFuzzRandom(&fuzzer->random);
+        int mutation = (int) (random % 7);
+        random >>= 8;
+        size_t size = input->size;
+        size_t position = size == 0 ? 0 : random % size;
+        random >>= 16;
+        switch (mutation) {
+            case 0:
+                if (size > 0) {
+                    input->data[position] ^= 1 << (random % 8);
+                }
+                break;
+            case 1:
+                if (size > 0) {
+                    input->data[position] = (uint8_t) random;
+                }
+                break;
+            case 2:
+                if (size > 0) {
+                    input->data[position] = interestingBytes[random % NUM_INTERESTING_BYTES];
+                }
+                break;
+            case 3:
+                if (size > 0) {
+                    int delta = 1 + (int) (random % 16);
+                    input->data[position] += (random >> 8) & 1 ? delta : -delta;
+                }
+                break;
+            case 4:
+                if (size < FUZZ_MAX_INPUT) {
+                    position = random % (size + 1);
+                    memmove(input->data + position + 1, input->data + position, size - position);
+                    input->data[position] = (uint8_t) (random >> 16);
+                    ++input->size;
+                }
+                break;
+            case 5:
+                if (size > 0) {
+                    size_t length = 1 + (random >> 16) % 16;
+                    if (length > size - position) {
+                        length = size - position;
+                    }
+                    memmove(input->data + position, input->data + position + length,
+                            size - position - length);
+                    input->size -= length;
+                }
+                break;
+            default: {
+                const FuzzInput *other = fuzzer->corpus[random % fuzzer->numCorpus];
+                if (other->size == 0) {
+                    break;
+                }
+                size_t cut = (random >> 16) % (size + 1);
+                size_t otherCut = (random >> 32) % other->size;
+                size_t length = other->size - otherCut;
+                if (length > FUZZ_MAX_INPUT - cut) {
+                    length = FUZZ_MAX_INPUT - cut;
+                }
+                memcpy(input->data + cut, other->data + otherCut, length);
+                input->size = cut + length;
+                break;
+            }
+        }
+    }
+}
+
+// Write the path of the target's corpus to path
+void getFuzzCorpusPath(const char *name, char path[PATH_MAX]) {
+    const char *root = getenv("TESTC_LOG_ROOT");
+    snprintf(path, PATH_MAX, "%s/fuzz_corpus/%s", root != NULL ? root : "test_logs", name);
+}
+
+// Create a directory and any of its parents that don't exist
+int makeDirectories(char *path) {
+    for (char *slash = strchr(path + 1, '/');; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        int failed = mkdir(path, 0777) < 0 && errno != EEXIST;
+        if (slash != NULL) {
+            *slash = '/';
+        }
+        if (failed) {
+            fprintf(stderr, "failed to create fuzz corpus directory %s: %s\n", path,
+                    strerror(errno));
+            return 1;
+        }
+        if (slash == NULL) {
+            return 0;
+        }
+    }
+}
+
+// Save an input to the corpus directory, named after its hash so that duplicates are only saved
+// once. The path of the file is written to path.
+void saveInput(const char *dir, const char *prefix, const FuzzInput *input, char path[PATH_MAX]) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < input->size; ++i) {
+        hash = (hash ^ input->data[i]) * 0x100000001b3;
+    }
+    snprintf(path, PATH_MAX, "%s/%s%016llx", dir, prefix, (unsigned long long) hash);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "failed to save fuzz input %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (write(fd, input->data, input->size) != (ssize_t) input->size) {
+        fprintf(stderr, "failed to write fuzz input %s: %s\n", path, strerror(errno));
+    }
+    close(fd);
+}
+
+void addToCorpus(Fuzzer *fuzzer, const FuzzInput *input) {
+    FuzzInput *copy;
+    if (fuzzer->numCorpus < MAX_CORPUS) {
+        copy = malloc(sizeof(FuzzInput));
+        if (copy == NULL) {
+            return;
+        }
+        fuzzer->corpus[fuzzer->numCorpus++] = copy;
+    } else {
+        copy = fuzzer->corpus[nextFuzzRandom(&fuzzer->random) % MAX_CORPUS];
+    }
+    copy->size = input->size;
+    memcpy(copy->data, input->data, input->size);
+}
+
+// Read the corpus from disk, skipping the inputs that crashed the target
+void loadCorpus(Fuzzer *fuzzer) {
+    DIR *directory = opendir(fuzzer->dir);
+    struct dirent *entry;
+    while (directory != NULL && (entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] == '.' || strncmp(entry->d_name, "crash-", 6) == 0
+            || strncmp(entry->d_name, "hang-", 5) == 0) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/%s", fuzzer->dir, entry->d_name);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        FuzzInput input;
+        ssize_t size = read(fd, input.data, FUZZ_MAX_INPUT);
+        close(fd);
+        if (size >= 0) {
+            input.size = (size_t) size;
+            addToCorpus(fuzzer, &input);
+        }
+    }
+    if (directory != NULL) {
+        closedir(directory);
+    }
+    if (fuzzer->numCorpus == 0) {
+        FuzzInput empty = {.size = 0};
+        addToCorpus(fuzzer, &empty);
+    }
+}
+
+// Run the target on an input and return whether it reached anything new. The input is copied to
+// shared memory first, so that the parent can save it if the target crashes.
+int runInput(Fuzzer *fuzzer, const FuzzInput *input) {
+    FuzzInput *current = &fuzzer->shared->current[fuzzer->worker];
+    current->size = input->size;
+    memcpy(current->data, input->data, input->size);
+    memset(coverage, 0, sizeof(coverage));
+    previousLocation = 0;
+    fuzzer->target(input->data, input->size);
+    return hasNewCoverage(fuzzer->shared);
+}
+
+// Publish an input to the other workers
+void shareInput(Fuzzer *fuzzer, const FuzzInput *input) {
+    FuzzShared *shared = fuzzer->shared;
+    uint64_t position = __atomic_fetch_add(&shared->numQueued, 1, __ATOMIC_RELAXED);
+    QueueEntry *entry = &shared->queue[position % QUEUE_SIZE];
+    __atomic_store_n(&entry->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    entry->worker = fuzzer->worker;
+    entry->input.size = input->size;
+    memcpy(entry->input.data, input->data, input->size);
+    __atomic_store_n(&entry->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+// Add the inputs that other workers published since the last pull to this worker's corpus
+void pullSharedInputs(Fuzzer *fuzzer) {
+    FuzzShared *shared = fuzzer->shared;
+    uint64_t numQueued = __atomic_load_n(&shared->numQueued, __ATOMIC_ACQUIRE);
+    if (numQueued - fuzzer->nextQueued > QUEUE_SIZE) {
+        fuzzer->nextQueued = numQueued - QUEUE_SIZE;
+    }
+    for (; fuzzer->nextQueued < numQueued; ++fuzzer->nextQueued) {
+        QueueEntry *entry = &shared->queue[fuzzer->nextQueued % QUEUE_SIZE];
+        uint64_t sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+        if (sequence != fuzzer->nextQueued + 1 || entry->worker == fuzzer->worker) {
+            continue;
+        }
+        FuzzInput input;
+        input.size = entry->input.size < FUZZ_MAX_INPUT ? entry->input.size : FUZZ_MAX_INPUT;
+        memcpy(input.data, entry->input.data, input.size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_RELAXED) == sequence) {
+            addToCorpus(fuzzer, &input);
+        }
+    }
+}
+
+// The loop of a forked worker, which exits once the run is over
+void runWorker(Fuzzer *fuzzer, int seconds) {
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, STDOUT_FILENO);
+    dup2(devNull, STDERR_FILENO);
+    close(devNull);
+    // The default action of SIGALRM ends the worker, which the parent reports as a hang
+    alarm(seconds + HANG_SECONDS);
+
+    fuzzer->corpus = malloc(MAX_CORPUS * sizeof(FuzzInput *));
+    if (fuzzer->corpus == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+    loadCorpus(fuzzer);
+    // Running the corpus first marks what it already covers, so only progress past it is saved
+    for (int i = 0; i < fuzzer->numCorpus; ++i) {
+        runInput(fuzzer, fuzzer->corpus[i]);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    time_t deadline = now.tv_sec + seconds;
+    FuzzInput candidate;
+    for (uint64_t numRuns = 1;; ++numRuns) {
+        const FuzzInput *parent = fuzzer->corpus[nextFuzzRandom(&fuzzer->random)
+                                                 % fuzzer->numCorpus];
+        candidate.size = parent->size;
+        memcpy(candidate.data, parent->data, parent->size);
+        mutate(fuzzer, &candidate);
+        if (runInput(fuzzer, &candidate)) {
+            char path[PATH_MAX];
+            saveInput(fuzzer->dir, "", &candidate, path);
+            addToCorpus(fuzzer, &candidate);
+            shareInput(fuzzer, &candidate);
+            __atomic_fetch_add(&fuzzer->shared->numNewInputs, 1, __ATOMIC_RELAXED);
+        }
+        if (numRuns % SYNC_INTERVAL == 0) {
+            __atomic_fetch_add(&fuzzer->shared->numRuns, SYNC_INTERVAL, __ATOMIC_RELAXED);
+            pullSharedInputs(fuzzer);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (now.tv_sec >= deadline) {
+                break;
+            }
+        }
+    }
+    fuzzer->shared->finished[fuzzer->worker] = 1;
+    _exit(EXIT_SUCCESS);
+}
+
+int Fuzz_run(const char *name, fuzz_target_t target, int numWorkers, int seconds) {
+    if (numWorkers < 1) {
+        numWorkers = 1;
+    } else if (numWorkers > MAX_WORKERS) {
+        numWorkers = MAX_WORKERS;
+    }
+    char dir[PATH_MAX];
+    getFuzzCorpusPath(name, dir);
+    if (makeDirectories(dir)) {
+        return -1;
+    }
+    FuzzShared *shared = mmap(NULL, sizeof(FuzzShared), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("failed to map fuzz worker state");
+        return -1;
+    }
+    printf("fuzzing %s with %d workers for %d seconds, corpus in %s\n", name, numWorkers,
+           seconds, dir);
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pids[MAX_WORKERS];
+    int numRunning = 0;
+    int crashed = 0;
+    uint64_t seed = (uint64_t) time(NULL) ^ (uint64_t) getpid() << 32;
+    for (int i = 0; i < numWorkers; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            Fuzzer fuzzer = {
+                    .target = target,
+                    .dir = dir,
+                    .shared = shared,
+                    .worker = i,
+                    .random = seed + (uint64_t) (i + 1) * 0x9e3779b97f4a7c15,
+            };
+            runWorker(&fuzzer, seconds);
+        }
+        if (pid < 0) {
+            perror("failed to fork fuzz worker");
+            crashed = -1;
+            break;
+        }
+        pids[numRunning++] = pid;
+    }
+    if (crashed < 0) {
+        for (int i = 0; i < numRunning; ++i) {
+            kill(pids[i], SIGKILL);
+        }
+    }
+
+    // Only the workers are waited for, since the other children of the caller aren't ours to
+    // reap, so they're polled every few milliseconds
+    for (int numExited = 0; numExited < numRunning;) {
+        int status;
+        int worker = 0;
+        pid_t pid = 0;
+        for (; worker < numRunning; ++worker) {
+            if (pids[worker] > 0) {
+                pid = waitpid(pids[worker], &status, WNOHANG);
+                if (pid != 0) {
+                    break;
+                }
+            }
+        }
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("failed to wait for fuzz workers");
+            break;
+        }
+        if (pid == 0) {
+            nanosleep(&(struct timespec) {.tv_nsec = 5 * 1000 * 1000}, NULL);
+            continue;
+        }
+        ++numExited;
+        pids[worker] = -1;
+        if (shared->finished[worker] || crashed != 0) {
+            continue;
+        }
+        // Once one worker has crashed, the run is over
+        crashed = 1;
+        int hung = WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM;
+        char path[PATH_MAX];
+        saveInput(dir, hung ? "hang-" : "crash-", &shared->current[worker], path);
+        if (hung) {
+            printf("fuzz target %s hung on %s\n", name, path);
+        } else if (WIFSIGNALED(status)) {
+            printf("fuzz target %s crashed with signal %d (%s) on %s\n", name, WTERMSIG(status),
+                   strsignal(WTERMSIG(status)), path);
+        } else {
+            printf("fuzz target %s exited with status %d on %s\n", name, WEXITSTATUS(status),
+                   path);
+        }
+        for (int i = 0; i < numRunning; ++i) {
+            if (pids[i] > 0) {
+                kill(pids[i], SIGKILL);
+            }
+        }
+    }
+    printf("fuzzed %s: %llu runs, %llu new inputs\n", name,
+           (unsigned long long) shared->numRuns, (unsigned long long) shared->numNewInputs);
+    munmap(shared, sizeof(FuzzShared));
+    return crashed;
+}
+
+void Fuzz_replay(const char *name, fuzz_target_t target) {
+    char dir[PATH_MAX];
+    getFuzzCorpusPath(name, dir);
+    DIR *directory = opendir(dir);
+    if (directory == NULL) {
+        printf("no fuzz corpus at %s\n", dir);
+        return;
+    }
+    int numInputs = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[PATH_MAX];
+        if (snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name) >= PATH_MAX) {
+            fprintf(stderr, "fuzz input path %s/%s is too long\n", dir, entry->d_name);
+            continue;
+        }
+        FILE *file = fopen(path, "rb");
+        if (file == NULL) {
+            continue;
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        rewind(file);
+        uint8_t *data = malloc(size > 0 ? (size_t) size : 1);
+        if (data == NULL || fread(data, 1, (size_t) size, file) != (size_t) size) {
+            fprintf(stderr, "failed to read fuzz input %s\n", path);
+            free(data);
+            fclose(file);
+            exit(EXIT_FAILURE);
+        }
+        fclose(file);
+        // Printed first so that the log names the input that crashed
+        printf("replaying %s\n", path);
+        fflush(stdout);
+        target(data, (size_t) size);
+        free(data);
+        ++numInputs;
+    }
+    closedir(directory);
+    printf("replayed %d inputs from %s\n", numInputs, dir);
+}
@@ -0,0 +1,91 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "testc/impact.h"
+
+// Both are defined by the linker, around the code of the executable
+extern char __executable_start[];
+extern char etext[];
+
+// One bit per byte of code, set once the function which starts there has been recorded. It's
+// private to the process, so every forked test starts with an empty one.
+static uint8_t *enteredFunctions;
+static size_t enteredFunctionsSize;
+static ImpactRecord *impactRecord;
+
+__attribute__((no_instrument_function))
+int Impact_start(const char *path) {
+    // A test that runs the runner itself starts its tests in processes that it forked while
+    // recording, which record on their own
+    Impact_stop();
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open impact record at %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    ImpactRecord *record = MAP_FAILED;
+    if (ftruncate(fd, sizeof(ImpactRecord)) == 0) {
+        record = mmap(NULL, sizeof(ImpactRecord), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (record == MAP_FAILED) {
+        fprintf(stderr, "failed to map impact record at %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    size_t size = ((size_t) (etext - __executable_start) + 7) / 8;
+    uint8_t *entered = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (entered == MAP_FAILED) {
+        perror("failed to map entered functions");
+        munmap(record, sizeof(ImpactRecord));
+        return -1;
+    }
+    enteredFunctionsSize = size;
+    impactRecord = record;
+    __atomic_store_n(&enteredFunctions, entered, __ATOMIC_RELEASE);
+    return 0;
+}
+
+__attribute__((no_instrument_function))
+void Impact_stop() {
+    uint8_t *entered = __atomic_exchange_n(&enteredFunctions, NULL, __ATOMIC_ACQ_REL);
+    if (entered == NULL) {
+        return;
+    }
+    munmap(entered, enteredFunctionsSize);
+    munmap(impactRecord, sizeof(ImpactRecord));
+    impactRecord = NULL;
+}
+
+// Called by -finstrument-functions on every entry to an instrumented function. After the first
+// entry, it costs a load and a bit test.
+__attribute__((no_instrument_function))
+void __cyg_profile_func_enter(void *function, void *callSite) {
+    (void) callSite;
+    uint8_t *entered = __atomic_load_n(&enteredFunctions, __ATOMIC_ACQUIRE);
+    size_t offset = (size_t) ((char *) function - __executable_start);
+    if (entered == NULL || offset / 8 >= enteredFunctionsSize) {
+        return;
+    }
+    uint8_t bit = (uint8_t) (1 << (offset % 8));
+    if ((__atomic_load_n(&entered[offset / 8], __ATOMIC_RELAXED) & bit)
+        || (__atomic_fetch_or(&entered[offset / 8], bit, __ATOMIC_RELAXED) & bit)) {
+        return;
+    }
+    ImpactRecord *record = impactRecord;
+    uint64_t index = __atomic_fetch_add(&record->numFunctions, 1, __ATOMIC_RELAXED);
+    if (index >= IMPACT_MAX_FUNCTIONS) {
+        __atomic_fetch_add(&record->numDropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    record->functions[index] = (uint64_t) (uintptr_t) function;
+}
+
+__attribute__((no_instrument_function))
+void __cyg_profile_func_exit(void *function, void *callSite) {
+    (void) function;
+    (void) callSite;
+}
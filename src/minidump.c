@@ -0,0 +1,620 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include "testc/minidump.h"
+
+// The size of the stack that the crash handler runs on, which has to fit its own frames even when
+// the test crashed because its stack overflowed
+#define ALTERNATE_STACK_SIZE 65536
+// How far below the stack pointer a function can keep data without moving it, on x86_64
+#define STACK_RED_ZONE 128
+// The granularity that stacks are copied at, so that a copy stops at the end of the stack
+#define STACK_PAGE_SIZE 4096
+// How long the crashed thread waits for the others to capture themselves
+#define CAPTURE_TIMEOUT_MILLIS 100
+// The most words on a thread's stack that Minidump_print looks up
+#define MAX_STACK_ADDRESSES 64
+
+#define NUM_CRASH_SIGNALS 6
+static const int crashSignals[NUM_CRASH_SIGNALS] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT,
+                                                    SIGTRAP};
+// Sent by the crashed thread to each of the others, which capture their own registers and stack
+#define CAPTURE_SIGNAL (SIGRTMAX - 1)
+
+// Everything the crash handler writes, which is allocated when it's installed, since a crashed
+// process can't be trusted to allocate
+typedef struct {
+    MinidumpHeader header;
+    MinidumpThread threads[MINIDUMP_MAX_THREADS];
+    uint8_t stacks[MINIDUMP_MAX_THREADS][MINIDUMP_STACK_SIZE];
+    char maps[MINIDUMP_MAPS_SIZE];
+    char path[PATH_MAX];
+    char taskEntries[4096];
+} MinidumpBuffer;
+
+// An entry of /proc/self/task, as getdents64 has them
+typedef struct {
+    uint64_t inode;
+    int64_t offset;
+    unsigned short length;
+    unsigned char type;
+    char name[];
+} TaskEntry;
+
+static MinidumpBuffer *minidumpBuffer;
+static void *alternateStack;
+// The process that installed the handler, since the processes that a test forks inherit it
+static pid_t installedPid;
+static int crashing;
+static int numCaptured;
+
+#ifdef __linux__
+// Copy the registers of the interrupted thread out of the context of a signal
+void readSignalContext(const ucontext_t *context, MinidumpThread *thread) {
+#if defined(__x86_64__)
+    const greg_t *registers = context->uc_mcontext.gregs;
+    for (int i = 0; i < NGREG && i < MINIDUMP_MAX_REGISTERS; ++i) {
+        thread->registers[i] = (uint64_t) registers[i];
+    }
+    thread->pc = (uint64_t) registers[REG_RIP];
+    thread->sp = (uint64_t) registers[REG_RSP];
+    thread->fp = (uint64_t) registers[REG_RBP];
+#elif defined(__aarch64__)
+    for (int i = 0; i < 31; ++i) {
+        thread->registers[i] = context->uc_mcontext.regs[i];
+    }
+    thread->registers[31] = context->uc_mcontext.sp;
+    thread->registers[32] = context->uc_mcontext.pc;
+    thread->registers[33] = context->uc_mcontext.pstate;
+    thread->pc = context->uc_mcontext.pc;
+    thread->sp = context->uc_mcontext.sp;
+    thread->fp = context->uc_mcontext.regs[29];
+#else
+    (void) context;
+    (void) thread;
+#endif
+}
+
+// Copy the stack above the thread's stack pointer into bytes. process_vm_readv reports a page
+// which isn't mapped instead of faulting on it, and stops there, which is where the stack ends.
+void copyStack(MinidumpThread *thread, uint8_t *bytes) {
+    uint64_t start = thread->sp > STACK_RED_ZONE ? thread->sp - STACK_RED_ZONE : 0;
+    struct iovec local = {.iov_base = bytes, .iov_len = MINIDUMP_STACK_SIZE};
+    struct iovec remote[MINIDUMP_STACK_SIZE / STACK_PAGE_SIZE + 1];
+    int numRemote = 0;
+    uint64_t address = start;
+    while (address < start + MINIDUMP_STACK_SIZE) {
+        uint64_t next = (address / STACK_PAGE_SIZE + 1) * STACK_PAGE_SIZE;
+        if (next > start + MINIDUMP_STACK_SIZE) {
+            next = start + MINIDUMP_STACK_SIZE;
+        }
+        remote[numRemote].iov_base = (void *) (uintptr_t) address;
+        remote[numRemote].iov_len = next - address;
+        ++numRemote;
+        address = next;
+    }
+    ssize_t size = process_vm_readv(getpid(), &local, 1, remote, numRemote, 0);
+    thread->stackStart = start;
+    thread->stackSize = size > 0 ? (uint64_t) size : 0;
+}
+
+int findThread(uint32_t tid) {
+    for (uint32_t i = 0; i < minidumpBuffer->header.numThreads; ++i) {
+        if (minidumpBuffer->threads[i].tid == tid) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+void onCaptureSignal(int signal, siginfo_t *info, void *context) {
+    (void) signal;
+    (void) info;
+    int index = findThread((uint32_t) syscall(SYS_gettid));
+    if (index < 0) {
+        return;
+    }
+    MinidumpThread *thread = &minidumpBuffer->threads[index];
+    readSignalContext(context, thread);
+    copyStack(thread, minidumpBuffer->stacks[index]);
+    __atomic_fetch_add(&numCaptured, 1, __ATOMIC_RELEASE);
+    // The process is about to die of the crash, and the thread shouldn't change anything before
+    for (;;) {
+        pause();
+    }
+}
+
+// Give every other thread a slot after the crashed one's and signal it to fill the slot in.
+// Returns how many were signalled.
+int signalOtherThreads(uint32_t crashedTid) {
+    MinidumpBuffer *buffer = minidumpBuffer;
+    int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return 0;
+    }
+    int numSignalled = 0;
+    long size;
+    while ((size = syscall(SYS_getdents64, fd, buffer->taskEntries, sizeof(buffer->taskEntries)))
+           > 0) {
+        for (long offset = 0; offset < size;) {
+            TaskEntry *entry = (TaskEntry *) (buffer->taskEntries + offset);
+            offset += entry->length;
+            uint32_t tid = 0;
+            for (const char *digit = entry->name; *digit >= '0' && *digit <= '9'; ++digit) {
+                tid = tid * 10 + (uint32_t) (*digit - '0');
+            }
+            if (tid == 0 || tid == crashedTid
+                || buffer->header.numThreads == MINIDUMP_MAX_THREADS) {
+                continue;
+            }
+            MinidumpThread *thread = &buffer->threads[buffer->header.numThreads++];
+            thread->tid = tid;
+            if (syscall(SYS_tgkill, getpid(), tid, CAPTURE_SIGNAL) == 0) {
+                ++numSignalled;
+            }
+        }
+    }
+    close(fd);
+    return numSignalled;
+}
+
+int writeMinidumpData(int fd, const void *data, size_t size) {
+    const char *cursor = data;
+    while (size > 0) {
+        ssize_t written = write(fd, cursor, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        cursor += written;
+        size -= (size_t) written;
+    }
+    return 0;
+}
+
+// Read /proc/self/maps into the buffer, returning its size
+size_t readMaps(char *maps) {
+    int fd = open("/proc/self/maps", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    size_t size = 0;
+    ssize_t length;
+    while (size < MINIDUMP_MAPS_SIZE
+           && (length = read(fd, maps + size, MINIDUMP_MAPS_SIZE - size)) > 0) {
+        size += (size_t) length;
+    }
+    close(fd);
+    return size;
+}
+
+// Write the captured threads to the file in the order that minidump.h has them
+int writeMinidump(MinidumpBuffer *buffer) {
+    MinidumpHeader *header = &buffer->header;
+    uint64_t offset = sizeof(MinidumpHeader) + header->numThreads * sizeof(MinidumpThread);
+    for (uint32_t i = 0; i < header->numThreads; ++i) {
+        buffer->threads[i].stackOffset = offset;
+        offset += buffer->threads[i].stackSize;
+    }
+    header->mapsOffset = offset;
+    int fd = open(buffer->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+    int status = writeMinidumpData(fd, header, sizeof(MinidumpHeader))
+                 || writeMinidumpData(fd, buffer->threads,
+                                      header->numThreads * sizeof(MinidumpThread));
+    for (uint32_t i = 0; i < header->numThreads && status == 0; ++i) {
+        status = writeMinidumpData(fd, buffer->stacks[i], buffer->threads[i].stackSize);
+    }
+    if (status == 0) {
+        status = writeMinidumpData(fd, buffer->maps, header->mapsSize);
+    }
+    close(fd);
+    return status;
+}
+
+// Runs on the alternate stack, so only async-signal-safe calls are made
+void onCrashSignal(int signal, siginfo_t *info, void *context) {
+    struct sigaction reset = {.sa_handler = SIG_DFL};
+    sigaction(signal, &reset, NULL);
+    if (getpid() != installedPid) {
+        raise(signal);
+        return;
+    }
+    if (__atomic_exchange_n(&crashing, 1, __ATOMIC_ACQ_REL)) {
+        // Another thread crashed first, and the process dies once it's written the minidump
+        for (;;) {
+            pause();
+        }
+    }
+    MinidumpBuffer *buffer = minidumpBuffer;
+    MinidumpHeader *header = &buffer->header;
+    header->signal = signal;
+    header->code = info->si_code;
+    header->faultAddress = (uint64_t) (uintptr_t) info->si_addr;
+    header->pid = (uint32_t) getpid();
+    header->numThreads = 1;
+    uint32_t tid = (uint32_t) syscall(SYS_gettid);
+    buffer->threads[0].tid = tid;
+    buffer->threads[0].crashed = 1;
+    readSignalContext(context, &buffer->threads[0]);
+    copyStack(&buffer->threads[0], buffer->stacks[0]);
+    int numSignalled = signalOtherThreads(tid);
+    struct timespec wait = {.tv_sec = 0, .tv_nsec = 1000 * 1000};
+    for (int i = 0; i < CAPTURE_TIMEOUT_MILLIS
+                    && __atomic_load_n(&numCaptured, __ATOMIC_ACQUIRE) < numSignalled; ++i) {
+        nanosleep(&wait, NULL);
+    }
+    header->mapsSize = readMaps(buffer->maps);
+    const char *message = writeMinidump(buffer) == 0 ? "wrote a minidump to "
+                                                      : "failed to write a minidump to ";
+    writeMinidumpData(STDERR_FILENO, message, strlen(message));
+    writeMinidumpData(STDERR_FILENO, buffer->path, strlen(buffer->path));
+    writeMinidumpData(STDERR_FILENO, "\n", 1);
+    // The signal is blocked until the handler returns, and then kills the process as it would
+    // have without the handler, or the faulting instruction runs again and does
+    raise(signal);
+}
+
+int Minidump_install(const char *path) {
+    if (strlen(path) >= PATH_MAX) {
+        fprintf(stderr, "minidump path is too long: %s\n", path);
+        return -1;
+    }
+    if (minidumpBuffer == NULL) {
+        // Pages that aren't touched before a crash cost nothing
+        MinidumpBuffer *buffer = mmap(NULL, sizeof(MinidumpBuffer), PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (buffer == MAP_FAILED) {
+            perror("failed to allocate the minidump buffer");
+            return -1;
+        }
+        void *stack = mmap(NULL, ALTERNATE_STACK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (stack == MAP_FAILED) {
+            perror("failed to allocate the crash handler's stack");
+            munmap(buffer, sizeof(MinidumpBuffer));
+            return -1;
+        }
+        struct utsname name;
+        memcpy(buffer->header.magic, MINIDUMP_MAGIC, sizeof(buffer->header.magic));
+        if (uname(&name) == 0) {
+            snprintf(buffer->header.machine, sizeof(buffer->header.machine), "%.15s",
+                     name.machine);
+        }
+        minidumpBuffer = buffer;
+        alternateStack = stack;
+    }
+    strcpy(minidumpBuffer->path, path);
+    stack_t stack = {.ss_sp = alternateStack, .ss_size = ALTERNATE_STACK_SIZE};
+    struct rlimit noCore = {.rlim_cur = 0, .rlim_max = 0};
+    if (sigaltstack(&stack, NULL) || setrlimit(RLIMIT_CORE, &noCore)) {
+        perror("failed to set up the minidump handler");
+        return -1;
+    }
+    struct sigaction capture = {.sa_sigaction = onCaptureSignal, .sa_flags = SA_SIGINFO};
+    struct sigaction crash = {.sa_sigaction = onCrashSignal, .sa_flags = SA_SIGINFO | SA_ONSTACK};
+    sigemptyset(&capture.sa_mask);
+    sigemptyset(&crash.sa_mask);
+    int status = sigaction(CAPTURE_SIGNAL, &capture, NULL);
+    for (int i = 0; i < NUM_CRASH_SIGNALS && status == 0; ++i) {
+        status = sigaction(crashSignals[i], &crash, NULL);
+    }
+    if (status) {
+        perror("failed to install the minidump handler");
+        return -1;
+    }
+    installedPid = getpid();
+    return 0;
+}
+#else
+int Minidump_install(const char *path) {
+    (void) path;
+    fprintf(stderr, "minidumps are only written on Linux\n");
+    return -1;
+}
+#endif
+
+// A mapping from /proc/self/maps at the time of the crash
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    int executable;
+    char path[PATH_MAX];
+} MinidumpModule;
+
+typedef struct {
+    MinidumpModule *modules;
+    int numModules;
+} MinidumpModules;
+
+int parseModules(const char *maps, size_t size, MinidumpModules *modules) {
+    modules->modules = NULL;
+    modules->numModules = 0;
+    int capacity = 0;
+    const char *line = maps;
+    while (line < maps + size) {
+        const char *end = memchr(line, '\n', (size_t) (maps + size - line));
+        if (end == NULL) {
+            end = maps + size;
+        }
+        char text[PATH_MAX + 128];
+        size_t length = (size_t) (end - line) < sizeof(text) - 1 ? (size_t) (end - line)
+                                                                 : sizeof(text) - 1;
+        memcpy(text, line, length);
+        text[length] = '\0';
+        line = end + 1;
+        MinidumpModule module;
+        char permissions[8];
+        int pathStart = 0;
+        if (sscanf(text, "%lx-%lx %7s %lx %*s %*s %n", &module.start, &module.end, permissions,
+                   &module.offset, &pathStart) < 4 || pathStart == 0 || text[pathStart] == '\0') {
+            continue;
+        }
+        module.executable = permissions[2] == 'x';
+        snprintf(module.path, sizeof(module.path), "%s", text + pathStart);
+        if (modules->numModules == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            MinidumpModule *grown = realloc(modules->modules, capacity * sizeof(MinidumpModule));
+            if (grown == NULL) {
+                perror("failed to allocate minidump modules");
+                return -1;
+            }
+            modules->modules = grown;
+        }
+        modules->modules[modules->numModules++] = module;
+    }
+    return 0;
+}
+
+const MinidumpModule *findModule(const MinidumpModules *modules, uint64_t address) {
+    for (int i = 0; i < modules->numModules; ++i) {
+        if (address >= modules->modules[i].start && address < modules->modules[i].end) {
+            return &modules->modules[i];
+        }
+    }
+    return NULL;
+}
+
+// Find the address that addr2line takes for an address in a module: the address itself in a
+// position-dependent executable, and its offset from where the module was loaded in anything
+// else. Returns 1 if the module isn't a file that addr2line can read, like the vDSO.
+int getModuleAddress(const MinidumpModules *modules, const MinidumpModule *module,
+                     uint64_t address, uint64_t *moduleAddress) {
+    if (module->path[0] != '/') {
+        return 1;
+    }
+    int fd = open(module->path, O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+    // e_type is 16 bits into the ELF header, and ET_EXEC is 2
+    unsigned char header[18];
+    ssize_t length = read(fd, header, sizeof(header));
+    close(fd);
+    if (length != sizeof(header) || memcmp(header, "\177ELF", 4) != 0) {
+        return 1;
+    }
+    if (header[16] == 2 && header[17] == 0) {
+        *moduleAddress = address;
+        return 0;
+    }
+    // The module was loaded where its first mapping starts, less that mapping's file offset
+    for (int i = 0; i < modules->numModules; ++i) {
+        if (strcmp(modules->modules[i].path, module->path) == 0) {
+            *moduleAddress = address - (modules->modules[i].start - modules->modules[i].offset);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Look up the function and line of each address, with one addr2line per module, writing
+// `function at file:line` to lines, or NULL where the address isn't in a module
+int symbolizeAddresses(const MinidumpModules *modules, const uint64_t *addresses,
+                       int numAddresses, char **lines) {
+    char *done = calloc(numAddresses, 1);
+    if (done == NULL) {
+        perror("failed to allocate minidump addresses");
+        return -1;
+    }
+    for (int first = 0; first < numAddresses; ++first) {
+        const MinidumpModule *module = findModule(modules, addresses[first]);
+        uint64_t moduleAddress;
+        if (done[first] || module == NULL
+            || getModuleAddress(modules, module, addresses[first], &moduleAddress)) {
+            continue;
+        }
+        size_t size = strlen(module->path) + 64 + (size_t) numAddresses * 20;
+        char *command = malloc(size);
+        int *batch = malloc(numAddresses * sizeof(int));
+        if (command == NULL || batch == NULL) {
+            free(command);
+            free(batch);
+            free(done);
+            perror("failed to allocate minidump addresses");
+            return -1;
+        }
+        int length = snprintf(command, size, "addr2line -f -p -e '%s' 2>/dev/null",
+                              module->path);
+        int numBatched = 0;
+        for (int i = first; i < numAddresses; ++i) {
+            const MinidumpModule *other = findModule(modules, addresses[i]);
+            if (done[i] || other == NULL || strcmp(other->path, module->path) != 0
+                || getModuleAddress(modules, other, addresses[i], &moduleAddress)) {
+                continue;
+            }
+            length += snprintf(command + length, size - length, " 0x%lx",
+                               (unsigned long) moduleAddress);
+            batch[numBatched++] = i;
+            done[i] = 1;
+        }
+        FILE *output = popen(command, "r");
+        free(command);
+        if (output == NULL) {
+            free(batch);
+            continue;
+        }
+        // -p prints `function at file:line` on one line for each address
+        char line[PATH_MAX + 1024];
+        for (int i = 0; i < numBatched && fgets(line, sizeof(line), output) != NULL; ++i) {
+            line[strcspn(line, "\n")] = '\0';
+            lines[batch[i]] = strdup(line);
+        }
+        pclose(output);
+        free(batch);
+    }
+    free(done);
+    return 0;
+}
+
+static const char *const x86RegisterNames[] = {
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "rdi", "rsi", "rbp", "rbx", "rdx",
+        "rax", "rcx", "rsp", "rip", "eflags"
+};
+
+void printRegisters(const MinidumpHeader *header, const MinidumpThread *thread, int fd) {
+    char name[8];
+    int numRegisters;
+    if (strcmp(header->machine, "x86_64") == 0) {
+        numRegisters = sizeof(x86RegisterNames) / sizeof(*x86RegisterNames);
+    } else if (strcmp(header->machine, "aarch64") == 0) {
+        numRegisters = MINIDUMP_MAX_REGISTERS;
+    } else {
+        return;
+    }
+    for (int i = 0; i < numRegisters; ++i) {
+        if (numRegisters == MINIDUMP_MAX_REGISTERS && i < 31) {
+            snprintf(name, sizeof(name), "x%d", i);
+        } else if (numRegisters == MINIDUMP_MAX_REGISTERS) {
+            snprintf(name, sizeof(name), "%s", i == 31 ? "sp" : i == 32 ? "pc" : "pstate");
+        } else {
+            snprintf(name, sizeof(name), "%s", x86RegisterNames[i]);
+        }
+        dprintf(fd, "%s%6s 0x%016lx%s", i % 4 == 0 ? "  " : " ", name,
+                (unsigned long) thread->registers[i],
+                i % 4 == 3 || i == numRegisters - 1 ? "\n" : "");
+    }
+}
+
+// Print a thread's pc, registers and the words on its stack that point into code
+int printThread(const MinidumpHeader *header, const MinidumpThread *thread,
+                const uint8_t *stack, const MinidumpModules *modules, int fd) {
+    uint64_t addresses[MAX_STACK_ADDRESSES + 1];
+    uint64_t locations[MAX_STACK_ADDRESSES + 1];
+    int numAddresses = 0;
+    addresses[numAddresses++] = thread->pc;
+    for (uint64_t offset = 0; offset + sizeof(uint64_t) <= thread->stackSize
+                              && numAddresses <= MAX_STACK_ADDRESSES; offset += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, stack + offset, sizeof(word));
+        const MinidumpModule *module = findModule(modules, word);
+        if (module != NULL && module->executable) {
+            locations[numAddresses] = thread->stackStart + offset;
+            // Return addresses can be the first instruction of the next line
+            addresses[numAddresses++] = word - 1;
+        }
+    }
+    char *lines[MAX_STACK_ADDRESSES + 1] = {0};
+    if (symbolizeAddresses(modules, addresses, numAddresses, lines)) {
+        return -1;
+    }
+    dprintf(fd, "thread %u%s:\n", thread->tid, thread->crashed ? ", which crashed" : "");
+    dprintf(fd, "  pc 0x%lx %s\n", (unsigned long) thread->pc, lines[0] ? lines[0] : "??");
+    printRegisters(header, thread, fd);
+    if (thread->stackSize == 0) {
+        dprintf(fd, "  no stack was captured\n");
+    } else {
+        dprintf(fd, "  %lu bytes of stack from 0x%lx, with words that point into code:\n",
+                (unsigned long) thread->stackSize, (unsigned long) thread->stackStart);
+    }
+    for (int i = 1; i < numAddresses; ++i) {
+        dprintf(fd, "    0x%lx: 0x%lx %s\n", (unsigned long) locations[i],
+                (unsigned long) addresses[i] + 1, lines[i] ? lines[i] : "??");
+    }
+    for (int i = 0; i < numAddresses; ++i) {
+        free(lines[i]);
+    }
+    return 0;
+}
+
+int Minidump_print(const char *path, int fd) {
+    int status = -1;
+    uint8_t *data = NULL;
+    MinidumpModules modules = {0};
+    int file = open(path, O_RDONLY);
+    struct stat info;
+    if (file < 0 || fstat(file, &info)) {
+        fprintf(stderr, "failed to open minidump %s: %s\n", path, strerror(errno));
+        goto done;
+    }
+    size_t size = (size_t) info.st_size;
+    data = malloc(size > 0 ? size : 1);
+    if (data == NULL) {
+        perror("failed to allocate minidump");
+        goto done;
+    }
+    size_t numRead = 0;
+    ssize_t length;
+    while (numRead < size && (length = read(file, data + numRead, size - numRead)) > 0) {
+        numRead += (size_t) length;
+    }
+    const MinidumpHeader *header = (const MinidumpHeader *) data;
+    if (numRead != size || size < sizeof(MinidumpHeader)
+        || memcmp(header->magic, MINIDUMP_MAGIC, sizeof(header->magic)) != 0
+        || header->numThreads > MINIDUMP_MAX_THREADS
+        || sizeof(MinidumpHeader) + header->numThreads * sizeof(MinidumpThread) > size
+        || header->mapsOffset > size || header->mapsSize > size - header->mapsOffset) {
+        fprintf(stderr, "%s isn't a minidump\n", path);
+        goto done;
+    }
+    const MinidumpThread *threads = (const MinidumpThread *) (header + 1);
+    if (parseModules((const char *) data + header->mapsOffset, header->mapsSize, &modules)) {
+        goto done;
+    }
+    dprintf(fd, "%s (signal %d, code %d) at 0x%lx in pid %u on %s\n", strsignal(header->signal),
+            header->signal, header->code, (unsigned long) header->faultAddress, header->pid,
+            header->machine);
+    for (uint32_t i = 0; i < header->numThreads; ++i) {
+        MinidumpThread thread = threads[i];
+        if (thread.stackOffset > size || thread.stackSize > size - thread.stackOffset) {
+            thread.stackSize = 0;
+        }
+        if (printThread(header, &thread, data + thread.stackOffset, &modules, fd)) {
+            goto done;
+        }
+    }
+    dprintf(fd, "modules:\n");
+    for (int i = 0; i < modules.numModules; ++i) {
+        if (modules.modules[i].executable) {
+            dprintf(fd, "  0x%lx-0x%lx %s\n", (unsigned long) modules.modules[i].start,
+                    (unsigned long) modules.modules[i].end, modules.modules[i].path);
+        }
+    }
+    status = 0;
+done:
+    if (file >= 0) {
+        close(file);
+    }
+    free(data);
+    free(modules.modules);
+    return status;
+}
@@ -0,0 +1,397 @@
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "testc/assert.h"
+#include "testc/property.h"
+
+// The most choices a single case can make. Draws past it are all 0.
+#define MAX_CHOICES 4096
+// The most times a failing case is rerun while shrinking it
+#define MAX_SHRINK_RUNS 4096
+#define MAX_DESCRIPTION 4096
+
+struct Property {
+    // The xoshiro256** state, only used while generating
+    uint64_t random[4];
+    int generating;
+
+    // The choices of the case. When replaying, choices past numChoices are 0.
+    uint64_t choices[MAX_CHOICES];
+    int numChoices;
+    // The index of the next choice to make
+    int next;
+
+    // What the generators produced, for printing the input of a failure
+    char description[MAX_DESCRIPTION];
+    int descriptionLength;
+};
+
+uint64_t rotateLeft(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+// See https://prng.di.unimi.it/xoshiro256starstar.c
+uint64_t nextRandom(uint64_t state[4]) {
+    uint64_t result = rotateLeft(state[1] * 5, 7) * 9;
+    uint64_t t = state[1] << 17;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotateLeft(state[3], 45);
+    return result;
+}
+
+// See https://prng.di.unimi.it/splitmix64.c, which is how xoshiro is meant to be seeded
+uint64_t splitMix(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+uint64_t Property_draw(Property *property, uint64_t max) {
+    if (property->next >= MAX_CHOICES) {
+        return 0;
+    }
+    uint64_t choice = 0;
+    if (property->generating) {
+        uint64_t random = nextRandom(property->random);
+        choice = max == UINT64_MAX ? random : random % (max + 1);
+        property->choices[property->next] = choice;
+        property->numChoices = property->next + 1;
+    } else if (property->next < property->numChoices) {
+        choice = property->choices[property->next];
+        if (choice > max) {
+            choice %= max + 1;
+        }
+    }
+    ++property->next;
+    return choice;
+}
+
+void describe(Property *property, const char *format, ...) {
+    int remaining = MAX_DESCRIPTION - property->descriptionLength;
+    if (remaining <= 1) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(property->description + property->descriptionLength, remaining,
+                           format, args);
+    va_end(args);
+    property->descriptionLength += length < remaining ? length : remaining - 1;
+}
+
+long long Property_int(Property *property) {
+    // Bounding the magnitude by a random number of bits makes small values more likely
+    int bits = (int) Property_draw(property, 63);
+    long long magnitude = (long long) Property_draw(property, (1ULL << bits) - 1);
+    long long value = Property_draw(property, 1) ? -magnitude - 1 : magnitude;
+    describe(property, "  int: %lld\n", value);
+    return value;
+}
+
+long long Property_range(Property *property, long long min, long long max) {
+    long long value = (long long) ((uint64_t) min
+                                   + Property_draw(property, (uint64_t) max - (uint64_t) min));
+    describe(property, "  range [%lld, %lld]: %lld\n", min, max, value);
+    return value;
+}
+
+int Property_length(Property *property, int max) {
+    int length = (int) Property_draw(property, max);
+    describe(property, "  length: %d\n", length);
+    return length;
+}
+
+size_t Property_bytes(Property *property, unsigned char *buffer, size_t maxLength) {
+    size_t length = Property_draw(property, maxLength);
+    describe(property, "  bytes:");
+    for (size_t i = 0; i < length; ++i) {
+        buffer[i] = (unsigned char) Property_draw(property, UCHAR_MAX);
+        describe(property, " %02x", buffer[i]);
+    }
+    describe(property, "\n");
+    return length;
+}
+
+size_t Property_string(Property *property, char *buffer, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    size_t length = Property_draw(property, size - 1);
+    for (size_t i = 0; i < length; ++i) {
+        // The 95 printable characters, rotated so that the simplest one is 'a'
+        buffer[i] = (char) (' ' + (Property_draw(property, 94) + 'a' - ' ') % 95);
+    }
+    buffer[length] = '\0';
+    describe(property, "  string: \"%s\"\n", buffer);
+    return length;
+}
+
+const int crashSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+#define NUM_CRASH_SIGNALS (sizeof(crashSignals) / sizeof(*crashSignals))
+
+void onCrash(int signal) {
+    siglongjmp(*TestC_caseFailure, signal);
+}
+
+// Run the body on the choices of a case and return whether it failed. Failed assertions and
+// crashes jump back here instead of ending the process. A quiet case has its output discarded.
+int runCase(void (*body)(Property *), Property *property, int quiet) {
+    property->next = 0;
+    property->descriptionLength = 0;
+    property->description[0] = '\0';
+    // volatile since the body can jump back past them
+    volatile int savedStdout = -1;
+    volatile int savedStderr = -1;
+    fflush(stdout);
+    fflush(stderr);
+    if (quiet) {
+        savedStdout = dup(STDOUT_FILENO);
+        savedStderr = dup(STDERR_FILENO);
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(devNull);
+    }
+    struct sigaction crash = {.sa_handler = onCrash, .sa_flags = SA_NODEFER};
+    sigemptyset(&crash.sa_mask);
+    struct sigaction previous[NUM_CRASH_SIGNALS];
+    for (size_t i = 0; i < NUM_CRASH_SIGNALS; ++i) {
+        sigaction(crashSignals[i], &crash, &previous[i]);
+    }
+
+    sigjmp_buf failure;
+    volatile int failed = 0;
+    // A property can run inside a test that runs on a thread of the runner, which jumps back too
+    sigjmp_buf *outerFailure = TestC_caseFailure;
+    TestC_caseFailure = &failure;
+    if (sigsetjmp(failure, 1) == 0) {
+        body(property);
+    } else {
+        failed = 1;
+    }
+    TestC_caseFailure = outerFailure;
+
+    for (size_t i = 0; i < NUM_CRASH_SIGNALS; ++i) {
+        sigaction(crashSignals[i], &previous[i], NULL);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    if (quiet) {
+        dup2(savedStdout, STDOUT_FILENO);
+        dup2(savedStderr, STDERR_FILENO);
+        close(savedStdout);
+        close(savedStderr);
+    }
+    // Choices the case didn't get to aren't part of it
+    if (property->next < property->numChoices) {
+        property->numChoices = property->next;
+    }
+    return failed;
+}
+
+void copyChoices(Property *to, const Property *from) {
+    memcpy(to->choices, from->choices, from->numChoices * sizeof(uint64_t));
+    to->numChoices = from->numChoices;
+    to->generating = 0;
+}
+
+// Shrink the choices of a failing case, keeping every change after which it still fails. Deleting
+// runs of choices makes inputs shorter, and then each choice is lowered as far as it can be.
+void shrink(void (*body)(Property *), Property *best, Property *candidate) {
+    int numRuns = 0;
+    int improved = 1;
+    while (improved && numRuns < MAX_SHRINK_RUNS) {
+        improved = 0;
+        for (int size = 8; size >= 1; size /= 2) {
+            int i = 0;
+            while (i + size <= best->numChoices && numRuns < MAX_SHRINK_RUNS) {
+                copyChoices(candidate, best);
+                memmove(candidate->choices + i, candidate->choices + i + size,
+                        (candidate->numChoices - i - size) * sizeof(uint64_t));
+                candidate->numChoices -= size;
+                ++numRuns;
+                if (runCase(body, candidate, 1)) {
+                    copyChoices(best, candidate);
+                    improved = 1;
+                } else {
+                    ++i;
+                }
+            }
+        }
+        for (int i = 0; i < best->numChoices && numRuns < MAX_SHRINK_RUNS; ++i) {
+            // Binary search for the smallest value of this choice which still fails
+            uint64_t low = 0;
+            uint64_t high = best->choices[i];
+            while (low < high && i < best->numChoices && numRuns < MAX_SHRINK_RUNS) {
+                uint64_t mid = low + (high - low) / 2;
+                copyChoices(candidate, best);
+                candidate->choices[i] = mid;
+                ++numRuns;
+                if (runCase(body, candidate, 1)) {
+                    copyChoices(best, candidate);
+                    high = mid;
+                    improved = 1;
+                } else {
+                    low = mid + 1;
+                }
+            }
+        }
+    }
+}
+
+void getCorpusPath(const char *name, char path[PATH_MAX]) {
+    const char *dir = getenv("TESTC_CORPUS");
+    snprintf(path, PATH_MAX, "%s/%s.txt", dir != NULL ? dir : "testc_corpus", name);
+}
+
+// Append the choices of a failing case to the corpus of the property, one case per line, unless
+// it's there already. The shards of a property fail at once, so the corpus is locked while it's
+// checked and appended to.
+void saveToCorpus(const char *name, const Property *property) {
+    char path[PATH_MAX];
+    getCorpusPath(name, path);
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create corpus directory %s: %s\n", path, strerror(errno));
+        return;
+    }
+    *slash = '/';
+    size_t size = (size_t) property->numChoices * 21 + 2;
+    char *entry = malloc(size);
+    if (entry == NULL) {
+        perror("failed to allocate corpus entry");
+        return;
+    }
+    size_t length = 0;
+    for (int i = 0; i < property->numChoices; ++i) {
+        length += snprintf(entry + length, size - length, i == 0 ? "%llu" : " %llu",
+                           (unsigned long long) property->choices[i]);
+    }
+    entry[length++] = '\n';
+    entry[length] = '\0';
+    FILE *file = fopen(path, "a+");
+    if (file == NULL || flock(fileno(file), LOCK_EX)) {
+        fprintf(stderr, "failed to open corpus %s: %s\n", path, strerror(errno));
+        if (file != NULL) {
+            fclose(file);
+        }
+        free(entry);
+        return;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    int found = 0;
+    while (!found && getline(&line, &capacity, file) > 0) {
+        found = strcmp(line, entry) == 0;
+    }
+    if (!found) {
+        fputs(entry, file);
+    }
+    free(line);
+    free(entry);
+    // Closing the file flushes it before it unlocks it
+    fclose(file);
+}
+
+// Shrink a failing case, print it and its seed, add it to the corpus and fail the test. A case
+// that was replayed from the corpus is already in it.
+void failProperty(const char *name, void (*body)(Property *), Property *best,
+                  Property *candidate, const char *origin, int fromCorpus) {
+    best->generating = 0;
+    shrink(body, best, candidate);
+    // Run the smallest failure once more so that its assertion is printed
+    runCase(body, best, 0);
+    printf("Property %s failed on %s\nShrunk input:\n%s", name, origin, best->description);
+    if (!fromCorpus) {
+        saveToCorpus(name, best);
+    }
+    TestC_fail();
+}
+
+// Rerun the failures saved in the corpus of the property
+void replayCorpus(const char *name, void (*body)(Property *), Property *best,
+                  Property *candidate) {
+    char path[PATH_MAX];
+    getCorpusPath(name, path);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    for (int lineNumber = 1; getline(&line, &capacity, file) > 0; ++lineNumber) {
+        best->generating = 0;
+        best->numChoices = 0;
+        char *cursor = line;
+        char *end;
+        unsigned long long choice;
+        while (best->numChoices < MAX_CHOICES
+               && (choice = strtoull(cursor, &end, 10), end != cursor)) {
+            best->choices[best->numChoices++] = choice;
+            cursor = end;
+        }
+        if (runCase(body, best, 1)) {
+            char origin[PATH_MAX + 64];
+            snprintf(origin, sizeof(origin), "line %d of the corpus at %s", lineNumber, path);
+            free(line);
+            fclose(file);
+            failProperty(name, body, best, candidate, origin, 1);
+        }
+    }
+    free(line);
+    fclose(file);
+}
+
+uint64_t getSeed() {
+    const char *seed = getenv("TESTC_SEED");
+    if (seed != NULL) {
+        return strtoull(seed, NULL, 0);
+    }
+    // The shards of a run share their parent, so they usually share a seed
+    return (uint64_t) time(NULL) * 1000003 ^ (uint64_t) getppid();
+}
+
+void Property_check(const char *name, void (*body)(Property *), int numCases, int shard) {
+    Property *properties = calloc(2, sizeof(Property));
+    if (properties == NULL) {
+        perror("failed to allocate property cases");
+        exit(EXIT_FAILURE);
+    }
+    Property *best = &properties[0];
+    Property *candidate = &properties[1];
+    if (shard == 0) {
+        replayCorpus(name, body, best, candidate);
+    }
+    uint64_t seed = getSeed();
+    for (int i = shard; i < numCases; i += PROPERTY_SHARDS) {
+        uint64_t state = seed + (uint64_t) i * 0x2545f4914f6cdd1d;
+        for (int j = 0; j < 4; ++j) {
+            best->random[j] = splitMix(&state);
+        }
+        best->generating = 1;
+        best->numChoices = 0;
+        if (runCase(body, best, 1)) {
+            char origin[128];
+            snprintf(origin, sizeof(origin), "case %d of TESTC_SEED=%llu", i,
+                     (unsigned long long) seed);
+            failProperty(name, body, best, candidate, origin, 0);
+        }
+    }
+    free(properties);
+}
@@ -0,0 +1,442 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "testc/assert.h"
+#include "testc/snapshot.h"
+
+// The most edits that the line diff looks for before giving up on a minimal one
+#define MAX_DIFF_EDITS 256
+// The most lines of a diff, or differing byte ranges, that are printed
+#define MAX_PRINTED 64
+// The unchanged lines shown around each change
+#define DIFF_CONTEXT 2
+// Longer lines are cut short in diffs
+#define MAX_LINE_PRINTED 200
+
+typedef struct {
+    const char *data;
+    size_t size;
+} Bytes;
+
+typedef struct {
+    const char *start;
+    size_t length;
+    uint64_t hash;
+} Line;
+
+// A run of lines [aStart, aEnd) of the snapshot which became lines [bStart, bEnd) of the output
+typedef struct {
+    int aStart;
+    int aEnd;
+    int bStart;
+    int bEnd;
+} Change;
+
+void getSnapshotPath(const char *name, char path[PATH_MAX]) {
+    const char *dir = getenv("TESTC_SNAPSHOT_DIR");
+    snprintf(path, PATH_MAX, "%s/%s", dir != NULL ? dir : "snapshots", name);
+}
+
+int isUpdating() {
+    const char *update = getenv("TESTC_UPDATE_SNAPSHOTS");
+    return update != NULL && strcmp(update, "1") == 0;
+}
+
+// Map a whole file for reading. Empty files have no data.
+int mapBytes(int fd, Bytes *bytes) {
+    struct stat info;
+    if (fstat(fd, &info)) {
+        return -1;
+    }
+    bytes->size = info.st_size;
+    bytes->data = NULL;
+    if (bytes->size == 0) {
+        return 0;
+    }
+    void *mapped = mmap(NULL, bytes->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    // The comparison reads it once from start to end
+    madvise(mapped, bytes->size, MADV_SEQUENTIAL);
+    bytes->data = mapped;
+    return 0;
+}
+
+void unmapBytes(Bytes *bytes) {
+    if (bytes->data != NULL) {
+        munmap((void *) bytes->data, bytes->size);
+        bytes->data = NULL;
+    }
+}
+
+int makeParentDirectories(char *path) {
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int failed = mkdir(path, 0777) && errno != EEXIST;
+        *slash = '/';
+        if (failed) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Replace the snapshot at path through a temporary file that's renamed over it, so that it's never
+// seen half written
+int writeSnapshot(char *path, const char *data, size_t size) {
+    char temporary[PATH_MAX + 32];
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, getpid());
+    if (makeParentDirectories(path)) {
+        return -1;
+    }
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno != EINTR) {
+            close(fd);
+            unlink(temporary);
+            return -1;
+        }
+        if (written > 0) {
+            data += written;
+            size -= written;
+        }
+    }
+    int failed = fsync(fd) != 0;
+    failed |= close(fd) != 0;
+    if (failed || rename(temporary, path)) {
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+int isText(Bytes bytes) {
+    return bytes.size == 0 || memchr(bytes.data, '\0', bytes.size) == NULL;
+}
+
+// Split text into lines without their newlines
+Line *splitLines(Bytes text, int *numLines) {
+    int capacity = 0;
+    for (size_t i = 0; i < text.size; ++i) {
+        capacity += text.data[i] == '\n';
+    }
+    Line *lines = malloc((capacity + 1) * sizeof(Line));
+    if (lines == NULL) {
+        return NULL;
+    }
+    *numLines = 0;
+    for (size_t start = 0; start < text.size;) {
+        const char *end = memchr(text.data + start, '\n', text.size - start);
+        size_t length = end != NULL ? (size_t) (end - (text.data + start)) : text.size - start;
+        // FNV-1a, so that lines are mostly compared by their hash
+        uint64_t hash = 0xcbf29ce484222325;
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ (unsigned char) text.data[start + i]) * 0x100000001b3;
+        }
+        lines[(*numLines)++] = (Line) {.start = text.data + start, .length = length, .hash = hash};
+        start += length + 1;
+    }
+    return lines;
+}
+
+int sameLine(const Line *a, const Line *b) {
+    return a->hash == b->hash && a->length == b->length
+           && memcmp(a->start, b->start, a->length) == 0;
+}
+
+// Find the shortest edit script from the lines a to the lines b with Myers' algorithm. The furthest
+// reaching x of every diagonal after each number of edits is saved in trace, which has room for
+// MAX_DIFF_EDITS + 1 rows. Returns the number of edits, or -1 if it's more than MAX_DIFF_EDITS.
+int findEdits(const Line *a, int n, const Line *b, int m, int *trace) {
+    const int offset = MAX_DIFF_EDITS + 1, width = 2 * MAX_DIFF_EDITS + 3;
+    int *furthest = trace;
+    furthest[offset + 1] = 0;
+    for (int d = 0; d <= MAX_DIFF_EDITS; ++d) {
+        if (d > 0) {
+            memcpy(trace + d * width, trace + (d - 1) * width, width * sizeof(int));
+            furthest = trace + d * width;
+        }
+        for (int k = -d; k <= d; k += 2) {
+            int x = k == -d || (k != d && furthest[offset + k - 1] < furthest[offset + k + 1])
+                    ? furthest[offset + k + 1] : furthest[offset + k - 1] + 1;
+            int y = x - k;
+            while (x < n && y < m && sameLine(&a[x], &b[y])) {
+                ++x;
+                ++y;
+            }
+            furthest[offset + k] = x;
+            if (x >= n && y >= m) {
+                return d;
+            }
+        }
+    }
+    return -1;
+}
+
+// Walk back through the trace of findEdits to the runs of lines which changed, in order
+int findChanges(const int *trace, int numEdits, int n, int m, Change *changes) {
+    const int offset = MAX_DIFF_EDITS + 1, width = 2 * MAX_DIFF_EDITS + 3;
+    int numChanges = 0;
+    int x = n, y = m;
+    for (int d = numEdits; d > 0; --d) {
+        const int *previous = trace + (d - 1) * width;
+        int k = x - y;
+        int inserted = k == -d || (k != d && previous[offset + k - 1] < previous[offset + k + 1]);
+        int previousX = previous[offset + (inserted ? k + 1 : k - 1)];
+        int previousY = previousX - (inserted ? k + 1 : k - 1);
+        // Skip back over the lines that matched after the edit
+        int editX = inserted ? previousX : previousX + 1;
+        int editY = inserted ? previousY + 1 : previousY;
+        int joins = numChanges > 0 && changes[numChanges - 1].aStart == editX
+                    && changes[numChanges - 1].bStart == editY && x == editX && y == editY;
+        if (!joins) {
+            changes[numChanges++] = (Change) {
+                    .aStart = editX, .aEnd = editX, .bStart = editY, .bEnd = editY
+            };
+        }
+        Change *change = &changes[numChanges - 1];
+        change->aStart = previousX;
+        change->bStart = previousY;
+        x = previousX;
+        y = previousY;
+    }
+    // They were found from the end
+    for (int i = 0; i < numChanges / 2; ++i) {
+        Change swap = changes[i];
+        changes[i] = changes[numChanges - 1 - i];
+        changes[numChanges - 1 - i] = swap;
+    }
+    return numChanges;
+}
+
+void printLine(FILE *output, char prefix, const Line *line) {
+    int length = line->length < MAX_LINE_PRINTED ? (int) line->length : MAX_LINE_PRINTED;
+    fprintf(output, "%c%.*s%s\n", prefix, length, line->start,
+            line->length > MAX_LINE_PRINTED ? "..." : "");
+}
+
+// Print the changes like a unified diff, where lines starting with - are only in the snapshot and
+// lines starting with + are only in the output
+void printChanges(FILE *output, const Line *a, int n, const Line *b, const Change *changes,
+                  int numChanges) {
+    int numPrinted = 0;
+    int printedUntil = 0;
+    for (int i = 0; i < numChanges && numPrinted < MAX_PRINTED; ++i) {
+        const Change *change = &changes[i];
+        int contextStart = change->aStart - DIFF_CONTEXT > printedUntil
+                           ? change->aStart - DIFF_CONTEXT : printedUntil;
+        if (i == 0 || contextStart > printedUntil) {
+            fprintf(output, "@@ -%d +%d @@\n", contextStart + 1,
+                    change->bStart - (change->aStart - contextStart) + 1);
+        }
+        for (int line = contextStart; line < change->aStart; ++line, ++numPrinted) {
+            printLine(output, ' ', &a[line]);
+        }
+        for (int line = change->aStart; line < change->aEnd; ++line, ++numPrinted) {
+            printLine(output, '-', &a[line]);
+        }
+        for (int line = change->bStart; line < change->bEnd; ++line, ++numPrinted) {
+            printLine(output, '+', &b[line]);
+        }
+        int contextEnd = change->aEnd + DIFF_CONTEXT;
+        if (i + 1 < numChanges && changes[i + 1].aStart < contextEnd) {
+            contextEnd = changes[i + 1].aStart;
+        }
+        if (contextEnd > n) {
+            contextEnd = n;
+        }
+        for (int line = change->aEnd; line < contextEnd; ++line, ++numPrinted) {
+            printLine(output, ' ', &a[line]);
+        }
+        printedUntil = contextEnd;
+    }
+    if (numPrinted >= MAX_PRINTED) {
+        fprintf(output, "...\n");
+    }
+}
+
+// Print a minimal line diff of the middle of two texts, after the lines they start and end with
+int printLineDiff(FILE *output, Bytes expected, Bytes actual) {
+    int n, m;
+    Line *a = splitLines(expected, &n);
+    Line *b = splitLines(actual, &m);
+    int *trace = malloc((MAX_DIFF_EDITS + 1) * (2 * MAX_DIFF_EDITS + 3) * sizeof(int));
+    Change *changes = malloc((MAX_DIFF_EDITS + 1) * sizeof(Change));
+    if (a == NULL || b == NULL || trace == NULL || changes == NULL) {
+        free(a);
+        free(b);
+        free(trace);
+        free(changes);
+        return -1;
+    }
+    int prefix = 0;
+    while (prefix < n && prefix < m && sameLine(&a[prefix], &b[prefix])) {
+        ++prefix;
+    }
+    int suffix = 0;
+    while (suffix < n - prefix && suffix < m - prefix
+           && sameLine(&a[n - 1 - suffix], &b[m - 1 - suffix])) {
+        ++suffix;
+    }
+    int numEdits = findEdits(a + prefix, n - prefix - suffix, b + prefix, m - prefix - suffix,
+                             trace);
+    int status = 0;
+    if (numEdits < 0) {
+        fprintf(output, "lines %d to %d of the snapshot became lines %d to %d of the output, with "
+                        "too many changes to diff\n", prefix + 1, n - suffix, prefix + 1,
+                m - suffix);
+    } else if (numEdits == 0) {
+        // The lines are the same, so only a newline at the end differs
+        status = -1;
+    } else {
+        int numChanges = findChanges(trace, numEdits, n - prefix - suffix, m - prefix - suffix,
+                                     changes);
+        for (int i = 0; i < numChanges; ++i) {
+            changes[i].aStart += prefix;
+            changes[i].aEnd += prefix;
+            changes[i].bStart += prefix;
+            changes[i].bEnd += prefix;
+        }
+        printChanges(output, a, n, b, changes, numChanges);
+    }
+    free(a);
+    free(b);
+    free(trace);
+    free(changes);
+    return status;
+}
+
+void printHexRow(FILE *output, const char *label, Bytes bytes, size_t row) {
+    fprintf(output, "  %s %08zx:", label, row);
+    for (size_t i = row; i < row + 16 && i < bytes.size; ++i) {
+        fprintf(output, " %02x", (unsigned char) bytes.data[i]);
+    }
+    fprintf(output, "\n");
+}
+
+// Print the ranges of bytes which differ, with the bytes around the first of them
+void printByteDiff(FILE *output, Bytes expected, Bytes actual) {
+    size_t common = expected.size < actual.size ? expected.size : actual.size;
+    size_t first = 0;
+    while (first < common && expected.data[first] == actual.data[first]) {
+        ++first;
+    }
+    if (expected.size != actual.size) {
+        fprintf(output, "the snapshot has %zu bytes and the output has %zu\n", expected.size,
+                actual.size);
+    }
+    int numRanges = 0;
+    for (size_t start = first; start < common && numRanges < MAX_PRINTED; ++numRanges) {
+        size_t end = start;
+        while (end < common && expected.data[end] != actual.data[end]) {
+            ++end;
+        }
+        fprintf(output, "bytes %zu to %zu differ\n", start, end - 1);
+        start = end;
+        while (start < common && expected.data[start] == actual.data[start]) {
+            ++start;
+        }
+    }
+    if (numRanges >= MAX_PRINTED) {
+        fprintf(output, "...\n");
+    }
+    size_t row = first / 16 * 16;
+    printHexRow(output, "snapshot", expected, row);
+    printHexRow(output, "output  ", actual, row);
+}
+
+void compareSnapshot(const char *name, Bytes actual, const char *file, int line) {
+    char path[PATH_MAX];
+    getSnapshotPath(name, path);
+    Bytes expected = {0};
+    int fd = open(path, O_RDONLY);
+    int exists = fd >= 0;
+    int mapFailed = exists && mapBytes(fd, &expected);
+    if (exists) {
+        close(fd);
+    }
+    if (exists && !mapFailed && expected.size == actual.size
+        && (actual.size == 0 || memcmp(expected.data, actual.data, actual.size) == 0)) {
+        unmapBytes(&expected);
+        return;
+    }
+    FILE *output = TESTC_OUTPUT;
+    int error = errno;
+    if (isUpdating() && !mapFailed) {
+        unmapBytes(&expected);
+        if (writeSnapshot(path, actual.data, actual.size) == 0) {
+            fprintf(output, "updated snapshot %s\n", path);
+            fflush(output);
+            return;
+        }
+        error = errno;
+    }
+    fprintf(output, "%s:%d\n", file, line);
+    if (mapFailed || isUpdating()) {
+        fprintf(output, "Assertion Failed: couldn't %s snapshot %s: %s\n",
+                mapFailed ? "read" : "update", path, strerror(error));
+    } else if (!exists) {
+        fprintf(output, "Assertion Failed: snapshot %s doesn't exist yet, run with "
+                        "--update-snapshots to write it\n", path);
+    } else {
+        fprintf(output, "Assertion Failed: output doesn't match snapshot %s:\n", path);
+        if (!isText(expected) || !isText(actual) || printLineDiff(output, expected, actual)) {
+            printByteDiff(output, expected, actual);
+        }
+    }
+    fflush(output);
+    unmapBytes(&expected);
+    printStackTrace(TESTC_TRACE_FD, 16);
+    TestC_fail();
+}
+
+void Snapshot_assert(const char *name, const void *data, size_t size, const char *file, int line) {
+    compareSnapshot(name, (Bytes) {.data = data, .size = size}, file, line);
+}
+
+SnapshotCapture SnapshotCapture_begin() {
+    SnapshotCapture capture = {.stdoutFd = -1, .captureFd = -1, .done = 0};
+    char path[] = "/tmp/testc-snapshot-XXXXXX";
+    fflush(stdout);
+    capture.captureFd = mkstemp(path);
+    if (capture.captureFd < 0) {
+        perror("failed to create a file to capture stdout in");
+        TestC_fail();
+    }
+    unlink(path);
+    capture.stdoutFd = dup(STDOUT_FILENO);
+    if (capture.stdoutFd < 0 || dup2(capture.captureFd, STDOUT_FILENO) < 0) {
+        perror("failed to capture stdout");
+        TestC_fail();
+    }
+    return capture;
+}
+
+void SnapshotCapture_end(SnapshotCapture *capture, const char *name, const char *file, int line) {
+    capture->done = 1;
+    fflush(stdout);
+    dup2(capture->stdoutFd, STDOUT_FILENO);
+    close(capture->stdoutFd);
+    Bytes captured;
+    if (mapBytes(capture->captureFd, &captured)) {
+        perror("failed to read captured stdout");
+        close(capture->captureFd);
+        TestC_fail();
+    }
+    close(capture->captureFd);
+    // A failed comparison doesn't return, but the process is on its way out then anyway
+    compareSnapshot(name, captured, file, line);
+    unmapBytes(&captured);
+}
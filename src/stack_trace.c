@@ -1,10 +1,35 @@
+#define _GNU_SOURCE
 #include <execinfo.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#ifndef __APPLE__
+#include <dlfcn.h>
+#include <link.h>
+#endif
+#include "testc/stack_trace.h"
+#include "testc/assert.h"
+
+// The most frames that symbolizeFunctions passes to one addr2line
+#define SYMBOLIZE_BATCH 256
+
+// The state of testc/assert.h lives here, since everything that asserts links this library
+__thread sigjmp_buf *TestC_caseFailure = NULL;
+__thread FILE *TestC_testOutput = NULL;
 
+void TestC_fail() {
+    if (TestC_caseFailure != NULL) {
+        siglongjmp(*TestC_caseFailure, 1);
+    }
+    exit(EXIT_FAILURE);
+}
+
+#ifdef __APPLE__
 void parseTraceMessage(char *message, char **executable, char **address) {
     char *cursor = message;
     while (*cursor != ' ') {
@@ -24,47 +49,220 @@ void parseTraceMessage(char *message, char **executable, char **address) {
     cursor = strchr(cursor, ' ');
     *cursor = '\0';
 }
+#endif
 
-void printStackTrace(int fd, int maxDepth) {
-    void *trace[maxDepth];
-
-    int depth = backtrace(trace, maxDepth);
-    char **messages = backtrace_symbols(trace, depth);
-    char *executable, *address;
-
-    /* skip first stack frame (points here) */
-    for (int i = 1; i < depth - 1; ++i) {
-        parseTraceMessage(messages[i], &executable, &address);
+#ifndef __APPLE__
+// Find the object that a frame is in, and the address that addr2line takes for the frame in it.
+// Returns 1 if the frame isn't in a loaded object.
+int getFrameObject(void *frame, char object[PATH_MAX], uintptr_t *address) {
+    // Linux messages look like `./test(main+0x1a) [0x401234]`, which don't say where in a shared
+    // library the address is, so the object is looked up instead. addr2line takes addresses in
+    // a position-dependent executable as they are, and offsets into anything else.
+    Dl_info info;
+    if (dladdr(frame, &info) == 0 || info.dli_fname == NULL) {
+        return 1;
+    }
+    const ElfW(Ehdr) *header = info.dli_fbase;
+    int isPositionDependent = header->e_type == ET_EXEC;
+    // /proc/self/exe has to be resolved here, since addr2line would see its own executable
+    if (isPositionDependent || info.dli_fname[0] == '\0') {
+        ssize_t length = readlink("/proc/self/exe", object, PATH_MAX - 1);
+        if (length < 0) {
+            return 1;
+        }
+        object[length] = '\0';
+    } else {
+        snprintf(object, PATH_MAX, "%s", info.dli_fname);
+    }
+    *address = (uintptr_t) frame;
+    if (!isPositionDependent) {
+        *address -= (uintptr_t) info.dli_fbase;
+    }
+    return 0;
+}
+#endif
 
-        char command[256];
+// Write the command which symbolizes a frame to command, returning 1 if the frame can't be
+// symbolized
+int getSymbolizeCommand(void *frame, char **message, char *command, size_t size) {
 #ifdef __APPLE__
-        sprintf(command, "atos --fullPath -o %.256s %s 2>&1", executable, address);
+    char *executable, *address;
+    parseTraceMessage(*message, &executable, &address);
+    snprintf(command, size, "atos --fullPath -o %.256s %s 2>&1", executable, address);
+    return 0;
 #else
-        sprintf(command,"addr2line -f -p -e %.256s %p", executable, addr);
+    (void) message;
+    char object[PATH_MAX];
+    uintptr_t address;
+    if (getFrameObject(frame, object, &address)) {
+        return 1;
+    }
+    snprintf(command, size, "addr2line -f -p -e %.256s 0x%lx 2>&1", object,
+             (unsigned long) address);
+    return 0;
 #endif
+}
+
+void printTrace(int fd, void *const *trace, int depth) {
+    char **messages = backtrace_symbols(trace, depth);
+    if (messages == NULL) {
+        dprintf(fd, "stack trace error: failed to get the symbols of the trace\n");
+        return;
+    }
+    for (int i = 0; i < depth; ++i) {
+        // Frames are return addresses, which can be the first instruction of the next line
+        char command[512];
+        if (getSymbolizeCommand((char *) trace[i] - 1, &messages[i], command, sizeof(command))) {
+            dprintf(fd, "%s\n", messages[i]);
+            continue;
+        }
         FILE *outputFile = popen(command, "r");
         assert(outputFile != NULL);
         char output[1024];
-        assert(fgets(output, sizeof(output), outputFile) != NULL);
+        if (fgets(output, sizeof(output), outputFile) == NULL) {
+            output[0] = '\0';
+        }
         int status = pclose(outputFile);
         assert(WIFEXITED(status));
-        if (WEXITSTATUS(status) == EXIT_SUCCESS) {
-            if (strncmp(output, executable, strlen(executable)) == 0
-                && *(output + strlen(executable)) == ' ') {
-                dprintf(fd, "%s", output);
-                dprintf(fd, "looks like your compiler is missing debug information (add -g)\n");
-            } else if (strncmp(output, "0x", 2) == 0) {
-                dprintf(fd, "%s", output);
-                dprintf(fd, "looks like your compiler has PIE turned on (add -fno-pie)\n");
-            } else {
-                char *function = output;
-                char *sourceCodeLine = strrchr(output, '(') + 1;
-                *strrchr(output, ')') = '\0';
-                *strchr(function, ' ') = '\0';
-                dprintf(fd, "%s (%s)\n", sourceCodeLine, function);
-            }
-        } else {
+        if (WEXITSTATUS(status) != EXIT_SUCCESS) {
             dprintf(fd, "stack trace error: %soriginal command: %s\n", output, command);
+            continue;
+        }
+#ifdef __APPLE__
+        char *executable, *address;
+        parseTraceMessage(messages[i], &executable, &address);
+        if (strncmp(output, executable, strlen(executable)) == 0
+            && *(output + strlen(executable)) == ' ') {
+            dprintf(fd, "%s", output);
+            dprintf(fd, "looks like your compiler is missing debug information (add -g)\n");
+        } else if (strncmp(output, "0x", 2) == 0) {
+            dprintf(fd, "%s", output);
+            dprintf(fd, "looks like your compiler has PIE turned on (add -fno-pie)\n");
+        } else {
+            char *function = output;
+            char *sourceCodeLine = strrchr(output, '(') + 1;
+            *strrchr(output, ')') = '\0';
+            *strchr(function, ' ') = '\0';
+            dprintf(fd, "%s (%s)\n", sourceCodeLine, function);
+        }
+#else
+        // addr2line prints `function at file:line`, with ?? for whatever it doesn't know
+        char *newline = strchr(output, '\n');
+        if (newline != NULL) {
+            *newline = '\0';
+        }
+        char *at = strstr(output, " at ");
+        if (at == NULL || strncmp(at + 4, "??", 2) == 0) {
+            dprintf(fd, "%s (%s)\n", messages[i], output);
+        } else {
+            *at = '\0';
+            dprintf(fd, "%s (%s)\n", at + 4, output);
+        }
+#endif
+    }
+    free(messages);
+}
+
+void printStackTrace(int fd, int maxDepth) {
+    void *trace[maxDepth];
+    int depth = backtrace(trace, maxDepth);
+    /* skip first stack frame (points here) and the last (the entry point) */
+    if (depth > 2) {
+        printTrace(fd, trace + 1, depth - 2);
+    }
+}
+
+#ifndef __APPLE__
+// Symbolize the frames which are in the same object as frames[first] with one addr2line, taking
+// up to SYMBOLIZE_BATCH of them, and mark them as done
+int symbolizeBatch(void *const *frames, int numFrames, int first, char *done, char **functions,
+                   char **files) {
+    Dl_info info;
+    if (dladdr(frames[first], &info) == 0) {
+        done[first] = 1;
+        return 0;
+    }
+    const void *base = info.dli_fbase;
+    char object[PATH_MAX];
+    uintptr_t address;
+    // The vDSO isn't a file that addr2line could read
+    if (getFrameObject(frames[first], object, &address) || access(object, R_OK) != 0) {
+        done[first] = 1;
+        return 0;
+    }
+    int batch[SYMBOLIZE_BATCH];
+    int numBatched = 0;
+    size_t size = strlen(object) + 64 + SYMBOLIZE_BATCH * 20;
+    char *command = malloc(size);
+    if (command == NULL) {
+        return -1;
+    }
+    int length = snprintf(command, size, "addr2line -f -e '%s' 2>/dev/null", object);
+    for (int i = first; i < numFrames && numBatched < SYMBOLIZE_BATCH; ++i) {
+        if (done[i] || dladdr(frames[i], &info) == 0 || info.dli_fbase != base
+            || getFrameObject(frames[i], object, &address)) {
+            continue;
+        }
+        length += snprintf(command + length, size - length, " 0x%lx", (unsigned long) address);
+        batch[numBatched++] = i;
+        done[i] = 1;
+    }
+    FILE *output = popen(command, "r");
+    free(command);
+    if (output == NULL) {
+        return -1;
+    }
+    // addr2line prints the function and then `file:line` for each address, with ?? for whatever
+    // it doesn't know
+    char function[1024], line[PATH_MAX];
+    for (int i = 0; i < numBatched && fgets(function, sizeof(function), output) != NULL
+                    && fgets(line, sizeof(line), output) != NULL; ++i) {
+        function[strcspn(function, "\n")] = '\0';
+        if (functions != NULL && strcmp(function, "??") != 0) {
+            functions[batch[i]] = strdup(function);
+        }
+        // Paths can hold colons themselves, but the line number and the discriminator after it
+        // can't, so the file ends at the last one
+        char *colon = strrchr(line, ':');
+        if (files != NULL && colon != NULL && strncmp(line, "??:", 3) != 0) {
+            *colon = '\0';
+            files[batch[i]] = strdup(line);
+        }
+    }
+    pclose(output);
+    return 0;
+}
+#endif
+
+int symbolizeFunctions(void *const *frames, int numFrames, char **functions, char **files) {
+    for (int i = 0; i < numFrames; ++i) {
+        if (functions != NULL) {
+            functions[i] = NULL;
+        }
+        if (files != NULL) {
+            files[i] = NULL;
         }
     }
-}
\ No newline at end of file
+#ifdef __APPLE__
+    for (int i = 0; i < numFrames; ++i) {
+        Dl_info info;
+        if (functions != NULL && dladdr(frames[i], &info) != 0 && info.dli_sname != NULL) {
+            functions[i] = strdup(info.dli_sname);
+        }
+    }
+    return 0;
+#else
+    char *done = calloc(numFrames > 0 ? numFrames : 1, 1);
+    if (done == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < numFrames; ++i) {
+        if (!done[i] && symbolizeBatch(frames, numFrames, i, done, functions, files)) {
+            free(done);
+            return -1;
+        }
+    }
+    free(done);
+    return 0;
+#endif
+}
@@ -1,13 +1,43 @@
+#define _GNU_SOURCE
 #include "testc/test_suite.h"
 #include "testc/test_runner.h"
+#include "testc/alloc.h"
+#include "testc/assert.h"
+#include "testc/virtual_time.h"
+#include "testc/trace_scope.h"
+#include "testc/stack_trace.h"
+#include "testc/impact.h"
+#include "testc/minidump.h"
+#include <dlfcn.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <memory.h>
 #include <errno.h>
 #include <limits.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
 
 // See https://en.wikipedia.org/wiki/ANSI_escape_code
 #define ESC "\033" // Begin an escape sequence
@@ -16,6 +46,8 @@
 #define FAILED_TEST_COLOR CSI "1;31m"
 #define PASSED_TEST_COLOR CSI "1;32m"
 #define RUNNING_TEST_COLOR CSI "1;34m"
+#define FLAKY_TEST_COLOR CSI "1;33m"
+#define SKIPPED_TEST_COLOR CSI "1;90m"
 #define RESET_COLOR CSI "0m"
 
 // Takes a time in nanoseconds and writes it as a nice human-readable format to fd
@@ -39,32 +71,394 @@ int humanizeDuration(long long nanos, int fd) {
     return dprintf(fd, "%lldns", nanos);
 }
 
-// TestSuites are constant and only capture the test definition, but TestNodes are variable: they
-// have a test state (e.g. running, passed/failed). This function takes a TestSuite and
-// recursively builds a TestNode graph.
-TestNode *buildGraph(TestNode *parent, const TestSuite *suite, int *numTests) {
-    TestNode *node = calloc(1, sizeof(TestNode));
-    node->parent = parent;
-    node->name = suite->name;
-    if (suite->isLeaf) {
-        node->isLeaf = 1;
-        node->test = suite->test;
-        node->state = TestState_IDLE;
-        ++*numTests;
+// A compiled --filter or --exclude pattern. Patterns are period-separated like test paths, and
+// each segment is a glob where * matches any run of characters and ? matches one character. A
+// segment of ** matches any number of path segments, including none.
+typedef struct {
+    int exclude;
+    int numSegments;
+    const char **segments;
+} PathPattern;
+
+// Every pattern is a small NFA whose states are the indices of the segments which can match next,
+// stored as a bitmask. All patterns advance together as the suite is walked, one path segment per
+// level, so each node is matched with a few bit operations and glob comparisons.
+typedef struct {
+    int numPatterns;
+    int numFilters;
+    PathPattern *patterns;
+    // With changedFiles in the options, the sorted paths of the tests which ran code in a changed
+    // file and of all the tests in the impact index, or NULL when every test is selected
+    char **impactedTests;
+    int numImpactedTests;
+    char **indexedTests;
+    int numIndexedTests;
+} PathMatcher;
+
+#define MAX_PATTERN_SEGMENTS 63
+
+int compilePattern(const char *pattern, int exclude, PathPattern *result) {
+    char *copy = strdup(pattern);
+    int numSegments = 1;
+    for (const char *c = copy; *c != '\0'; ++c) {
+        numSegments += *c == '.';
+    }
+    if (numSegments > MAX_PATTERN_SEGMENTS) {
+        fprintf(stderr, "pattern %s has more than %d segments\n", pattern, MAX_PATTERN_SEGMENTS);
+        free(copy);
+        return -1;
+    }
+    result->exclude = exclude;
+    result->numSegments = numSegments;
+    result->segments = malloc(sizeof(char *) * numSegments);
+    char *segment = copy;
+    for (int i = 0; i < numSegments; ++i) {
+        result->segments[i] = segment;
+        char *split = strchr(segment, '.');
+        if (split != NULL) {
+            *split = '\0';
+            segment = split + 1;
+        }
+    }
+    return 0;
+}
+
+void findImpactedTests(const TestRunOptions *options, PathMatcher *matcher);
+
+int compileMatcher(const TestRunOptions *options, PathMatcher *matcher) {
+    findImpactedTests(options, matcher);
+    matcher->numFilters = options->numFilters;
+    matcher->numPatterns = options->numFilters + options->numExcludes;
+    matcher->patterns = calloc(matcher->numPatterns + 1, sizeof(PathPattern));
+    for (int i = 0; i < matcher->numPatterns; ++i) {
+        int exclude = i >= options->numFilters;
+        const char *pattern = exclude ? options->excludes[i - options->numFilters]
+                                      : options->filters[i];
+        if (compilePattern(pattern, exclude, &matcher->patterns[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void freeMatcher(PathMatcher *matcher) {
+    for (int i = 0; i < matcher->numPatterns; ++i) {
+        if (matcher->patterns[i].segments != NULL) {
+            // The segments all point into one copy of the pattern, which starts at the first
+            free((char *) matcher->patterns[i].segments[0]);
+            free(matcher->patterns[i].segments);
+        }
+    }
+    free(matcher->patterns);
+    for (int i = 0; i < matcher->numImpactedTests; ++i) {
+        free(matcher->impactedTests[i]);
+    }
+    free(matcher->impactedTests);
+    for (int i = 0; i < matcher->numIndexedTests; ++i) {
+        free(matcher->indexedTests[i]);
+    }
+    free(matcher->indexedTests);
+}
+
+int compareStrings(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+// A test which the impact index doesn't have yet may be affected by anything, so it's selected
+int isImpacted(const PathMatcher *matcher, const char *path) {
+    return matcher->indexedTests == NULL
+           || bsearch(&path, matcher->indexedTests, matcher->numIndexedTests, sizeof(char *),
+                      compareStrings) == NULL
+           || bsearch(&path, matcher->impactedTests, matcher->numImpactedTests, sizeof(char *),
+                      compareStrings) != NULL;
+}
+
+// Match a single path segment against a glob with * and ?
+int globMatch(const char *glob, const char *name) {
+    const char *starGlob = NULL;
+    const char *starName = NULL;
+    while (*name != '\0') {
+        if (*glob == '*') {
+            starGlob = glob++;
+            starName = name;
+        } else if (*glob == '?' || *glob == *name) {
+            ++glob;
+            ++name;
+        } else if (starGlob != NULL) {
+            // Let the last star swallow one more character and try again
+            glob = starGlob + 1;
+            name = ++starName;
+        } else {
+            return 0;
+        }
+    }
+    while (*glob == '*') {
+        ++glob;
+    }
+    return *glob == '\0';
+}
+
+int isDoubleStar(const char *segment) {
+    return strcmp(segment, "**") == 0;
+}
+
+// Add the states reachable without consuming a path segment i.e. skipping over **
+uint64_t closeStates(const PathPattern *pattern, uint64_t states) {
+    for (int i = 0; i < pattern->numSegments; ++i) {
+        if ((states & (1ull << i)) && isDoubleStar(pattern->segments[i])) {
+            states |= 1ull << (i + 1);
+        }
+    }
+    return states;
+}
+
+// Consume one path segment. The pattern matches a path if bit numSegments is set afterwards.
+uint64_t stepStates(const PathPattern *pattern, uint64_t states, const char *name) {
+    uint64_t next = 0;
+    for (int i = 0; i < pattern->numSegments; ++i) {
+        if (!(states & (1ull << i))) {
+            continue;
+        }
+        if (isDoubleStar(pattern->segments[i])) {
+            next |= 1ull << i;
+        } else if (globMatch(pattern->segments[i], name)) {
+            next |= 1ull << (i + 1);
+        }
+    }
+    return closeStates(pattern, next);
+}
+
+// One entry per selected node, in pre-order
+typedef struct {
+    const TestSuite *suite;
+    int parent;
+    int depth;
+    // The case of a parameterized test, or -1
+    int caseIndex;
+} SelectedNode;
+
+typedef struct {
+    int numNodes;
+    int numLeaves;
+    int capacity;
+    SelectedNode *nodes;
+    // The space needed for the names of the selected cases of parameterized tests
+    size_t caseNameBytes;
+    // The path of the node being visited, which is only kept for impact selection
+    char path[PATH_MAX];
+    size_t pathLength;
+} Selection;
+
+int appendSelected(Selection *selection, SelectedNode node) {
+    if (selection->numNodes == selection->capacity) {
+        selection->capacity = selection->capacity == 0 ? 64 : selection->capacity * 2;
+        selection->nodes = realloc(selection->nodes, sizeof(SelectedNode) * selection->capacity);
+    }
+    selection->nodes[selection->numNodes] = node;
+    return selection->numNodes++;
+}
+
+// Append the selected cases of a parameterized test, which are matched by the name they get from
+// their index. Returns the number of cases selected.
+int selectCases(const PathMatcher *matcher, const TestSuite *suite, const uint64_t *states,
+                int selected, int parent, int depth, Selection *selection) {
+    char name[strlen(suite->name) + 16];
+    int numSelected = 0;
+    for (int c = 0; c < suite->numCases; ++c) {
+        int nameLength = sprintf(name, "%s[%d]", suite->name, c);
+        int caseSelected = selected || matcher->numFilters == 0;
+        int excluded = 0;
+        for (int i = 0; i < matcher->numPatterns; ++i) {
+            const PathPattern *pattern = &matcher->patterns[i];
+            int matched = (stepStates(pattern, states[i], name) >> pattern->numSegments) & 1;
+            excluded |= pattern->exclude && matched;
+            caseSelected |= !pattern->exclude && matched;
+        }
+        if (excluded || !caseSelected) {
+            continue;
+        }
+        if (matcher->indexedTests != NULL) {
+            // A path too long for the index can't be in it, so the case runs like a new test
+            char path[PATH_MAX];
+            int length = snprintf(path, sizeof(path), "%s.%s", selection->path, name);
+            if (length < (int) sizeof(path) && !isImpacted(matcher, path)) {
+                continue;
+            }
+        }
+        appendSelected(selection, (SelectedNode) {
+                .suite = suite, .parent = parent, .depth = depth, .caseIndex = c});
+        selection->caseNameBytes += nameLength + 1;
+        ++selection->numLeaves;
+        ++numSelected;
+    }
+    return numSelected;
+}
+
+// Walk a suite in pre-order, appending the nodes which are selected by the matcher. Subtrees
+// which are excluded, or which no filter can match anymore, are pruned without being visited. A
+// parent without any selected tests is removed again. Returns the number of tests selected.
+int selectTests(const PathMatcher *matcher, const TestSuite *suite, const uint64_t *states,
+                int selected, int parent, int depth, Selection *selection) {
+    uint64_t next[matcher->numPatterns + 1];
+    int canMatch = selected || matcher->numFilters == 0;
+    for (int i = 0; i < matcher->numPatterns; ++i) {
+        const PathPattern *pattern = &matcher->patterns[i];
+        next[i] = stepStates(pattern, states[i], suite->name);
+        int matched = (next[i] >> pattern->numSegments) & 1;
+        if (pattern->exclude && matched) {
+            return 0;
+        }
+        if (!pattern->exclude) {
+            selected |= matched;
+            canMatch |= next[i] != 0;
+        }
+    }
+    if (!canMatch) {
+        return 0;
+    }
+    size_t pathLength = selection->pathLength;
+    if (matcher->indexedTests != NULL) {
+        selection->pathLength += snprintf(selection->path + pathLength, PATH_MAX - pathLength,
+                                          pathLength == 0 ? "%s" : ".%s", suite->name);
+        if (selection->pathLength >= PATH_MAX) {
+            selection->pathLength = PATH_MAX - 1;
+        }
+    }
+
+    int index = appendSelected(selection, (SelectedNode) {
+            .suite = suite, .parent = parent, .depth = depth, .caseIndex = -1});
+
+    // A parameterized test is a parent of its cases in the graph
+    int isCaseParent = suite->isLeaf && suite->caseTest != NULL;
+    int numSelected = 0;
+    if (isCaseParent) {
+        numSelected = selectCases(matcher, suite, next, selected, index, depth + 1, selection);
+    } else if (suite->isLeaf) {
+        numSelected = (selected || matcher->numFilters == 0)
+                      && isImpacted(matcher, selection->path);
     } else {
-        node->isLeaf = 0;
-        int numChildren = suite->numChildren;
-        node->numChildren = numChildren;
-        node->children = malloc(sizeof(TestNode *) * numChildren);
-        node->numTests = 0;
-        node->numPassed = 0;
-        node->numFailed = 0;
-        for (int i = 0; i < numChildren; ++i) {
-            node->children[i] = buildGraph(node, suite->children[i], &node->numTests);
+        for (int i = 0; i < suite->numChildren; ++i) {
+            numSelected += selectTests(matcher, suite->children[i], next, selected, index,
+                                       depth + 1, selection);
+        }
+    }
+    if (numSelected == 0) {
+        selection->numNodes = index;
+    } else if (suite->isLeaf && !isCaseParent) {
+        ++selection->numLeaves;
+    }
+    selection->pathLength = pathLength;
+    selection->path[pathLength] = '\0';
+    return numSelected;
+}
+
+// TestSuites are constant and only capture the test definition, but a TestGraph is variable: its
+// tests have a state (e.g. running, passed/failed). This function takes the nodes selected from a
+// TestSuite and builds their TestGraph in a single allocation, so it is freed with a single call
+// to free. The cases of parameterized tests are expanded here, with their names at the end of
+// the allocation.
+TestGraph *buildGraph(const Selection *selection) {
+    int numNodes = selection->numNodes;
+    int numLeaves = selection->numLeaves;
+    // Ordered by alignment: the leaves hold long longs, the info holds pointers, the nodes only
+    // hold ints and the case names are chars
+    size_t size = sizeof(TestGraph) + sizeof(TestLeaf) * numLeaves
+                  + sizeof(TestNodeInfo) * numNodes + sizeof(TestNode) * numNodes
+                  + selection->caseNameBytes;
+    TestGraph *graph = calloc(1, size);
+    if (graph == NULL) {
+        return NULL;
+    }
+    graph->numNodes = numNodes;
+    graph->numLeaves = numLeaves;
+    graph->leaves = (TestLeaf *) (graph + 1);
+    graph->info = (TestNodeInfo *) (graph->leaves + numLeaves);
+    graph->nodes = (TestNode *) (graph->info + numNodes);
+    char *caseNames = (char *) (graph->nodes + numNodes);
+
+    int leafIndex = 0;
+    for (int i = 0; i < numNodes; ++i) {
+        const SelectedNode *selected = &selection->nodes[i];
+        TestNode *node = &graph->nodes[i];
+        node->parent = selected->parent;
+        node->depth = selected->depth;
+        node->end = i + 1;
+        const TestSuite *suite = selected->suite;
+        TestNodeInfo *info = &graph->info[i];
+        node->isLeaf = suite->isLeaf && (suite->caseTest == NULL || selected->caseIndex >= 0);
+        info->name = suite->name;
+        if (!suite->isLeaf) {
+            info->fixture = suite->fixture;
+            info->threadSafe = suite->threadSafe;
         }
-        *numTests += node->numTests;
+        if (node->isLeaf) {
+            node->leaf = leafIndex++;
+            if (selected->caseIndex >= 0) {
+                info->name = caseNames;
+                caseNames += sprintf(caseNames, "%s[%d]", suite->name, selected->caseIndex) + 1;
+                info->caseTest = suite->caseTest;
+                info->caseIndex = selected->caseIndex;
+            } else {
+                info->test = suite->test;
+                info->fuzz = suite->fuzz;
+                info->virtualTime = suite->virtualTime;
+            }
+            TestLeaf *leaf = &graph->leaves[node->leaf];
+            leaf->node = i;
+            leaf->state = TestState_IDLE;
+            leaf->maxRuns = 1;
+            leaf->server = -1;
+            leaf->cpu = -1;
+            leaf->numaNode = -1;
+            leaf->worker = -1;
+        }
+    }
+    // Children come after their parents, so going backwards finishes each subtree before its
+    // parent reads it
+    for (int i = numNodes - 1; i > 0; --i) {
+        TestNode *node = &graph->nodes[i];
+        TestNode *parent = &graph->nodes[node->parent];
+        if (node->end > parent->end) {
+            parent->end = node->end;
+        }
+        parent->numTests += node->isLeaf ? 1 : node->numTests;
+    }
+    return graph;
+}
+
+// Select the tests of a suite with the filters and excludes of the options and build their graph
+TestGraph *buildSelectedGraph(const TestSuite *suite, const TestRunOptions *options) {
+    PathMatcher matcher;
+    if (compileMatcher(options, &matcher)) {
+        freeMatcher(&matcher);
+        return NULL;
+    }
+    uint64_t states[matcher.numPatterns + 1];
+    for (int i = 0; i < matcher.numPatterns; ++i) {
+        states[i] = closeStates(&matcher.patterns[i], 1);
     }
-    return node;
+    Selection selection = {0};
+    selectTests(&matcher, suite, states, 0, -1, 0, &selection);
+    int impactSelected = matcher.indexedTests != NULL;
+    freeMatcher(&matcher);
+    if (selection.numNodes == 0) {
+        fprintf(stderr, impactSelected ? "no tests match the filters and ran code in the changed "
+                                         "files\n" : "no tests match the filters\n");
+        return NULL;
+    }
+    TestGraph *graph = buildGraph(&selection);
+    free(selection.nodes);
+    if (graph == NULL) {
+        perror("failed to allocate test graph");
+    }
+    return graph;
+}
+
+void TestGraph_free(TestGraph *graph) {
+    for (int i = 0; graph != NULL && i < graph->numNodes; ++i) {
+        free(graph->info[i].traceEvents);
+    }
+    free(graph);
 }
 
 // Render the state of a test progress spinner
@@ -99,492 +493,5180 @@ long long getElapsedNanos(const struct timespec *start, const struct timespec *e
     return nanos;
 }
 
-// Render a test node recursively
-int renderTestNode(TestNode *node, int indent, int fd) {
-    dprintf(fd, "%*c%s: ", indent, ' ', node->name);
-    if (node->isLeaf) {
-        switch (node->state) {
-            case TestState_IDLE:
-                fprintf(stderr, "tests must be running before render is called\n");
-                return -1;
-            case TestState_RUNNING:
-                dprintf(fd, RUNNING_TEST_COLOR "%s" RESET_COLOR "\n",
-                        renderProgress(&node->progressIndicatorState));
-                break;
-            case TestState_DONE: {
-                int exitSignal = node->exitSignal;
-                if (WIFEXITED(exitSignal)) {
-                    if (WEXITSTATUS(exitSignal) == 0) {
-                        dprintf(fd, PASSED_TEST_COLOR "passed" RESET_COLOR);
-                    } else {
-                        dprintf(fd, FAILED_TEST_COLOR "exited: %s" RESET_COLOR,
-                                strsignal(WEXITSTATUS(exitSignal)));
-                    }
-                } else if (WIFSIGNALED(exitSignal)) {
-                    dprintf(fd, FAILED_TEST_COLOR "terminated: %s" RESET_COLOR,
-                            strsignal(WTERMSIG(exitSignal)));
-                } else if (WIFSTOPPED(exitSignal)) {
-                    dprintf(fd, FAILED_TEST_COLOR "stopped: %s" RESET_COLOR,
-                            strsignal(WSTOPSIG(exitSignal)));
-                } else {
-                    fprintf(stderr, "unknown process status for test: %d", exitSignal);
-                    return -1;
-                }
-                dprintf(fd, " (");
-                long long nanos = getElapsedNanos(&node->start, &node->end);
-                humanizeDuration(nanos, fd);
-                dprintf(fd, ")\n");
-                break;
-            }
-
-            default:
-                fprintf(stderr, "found test node in invalid state %s: %d\n", node->name,
-                        node->state);
-                return -1;
+// Render how a test subprocess terminated e.g. "passed" or "terminated: Segmentation fault"
+int renderExitSignal(int exitSignal, int fd) {
+    if (WIFEXITED(exitSignal)) {
+        if (WEXITSTATUS(exitSignal) == 0) {
+            dprintf(fd, PASSED_TEST_COLOR "passed" RESET_COLOR);
+        } else {
+            dprintf(fd, FAILED_TEST_COLOR "exited: %s" RESET_COLOR,
+                    strsignal(WEXITSTATUS(exitSignal)));
         }
+    } else if (WIFSIGNALED(exitSignal)) {
+        dprintf(fd, FAILED_TEST_COLOR "terminated: %s" RESET_COLOR,
+                strsignal(WTERMSIG(exitSignal)));
+    } else if (WIFSTOPPED(exitSignal)) {
+        dprintf(fd, FAILED_TEST_COLOR "stopped: %s" RESET_COLOR,
+                strsignal(WSTOPSIG(exitSignal)));
     } else {
-        dprintf(fd, "(");
-        int numRunning = node->numTests - node->numPassed - node->numFailed;
-        int prev = 0;
-        if (numRunning > 0) {
-            prev = 1;
-            dprintf(fd, RUNNING_TEST_COLOR "%d" RESET_COLOR, numRunning);
-        }
-        if (node->numPassed > 0) {
-            if (prev) {
-                dprintf(fd, ",");
-            }
-            dprintf(fd, PASSED_TEST_COLOR "%d" RESET_COLOR, node->numPassed);
-            prev = 1;
-        }
-        if (node->numFailed > 0) {
-            if (prev) {
-                dprintf(fd, ",");
-            }
-            dprintf(fd, FAILED_TEST_COLOR "%d" RESET_COLOR, node->numFailed);
-        }
-        dprintf(fd, ")\n");
-        for (int i = 0; i < node->numChildren; ++i) {
-            TestNode *child = node->children[i];
-            if (
-                    renderTestNode(child, indent
-                                          + 2, fd)) {
-                fprintf(stderr,
-                        "%s failed to render child\n", node->name);
+        fprintf(stderr, "unknown process status for test: %d", exitSignal);
+        return -1;
+    }
+    return 0;
+}
+
+// The number of tests under a parent node which have finished, whatever their outcome
+int TestNode_numFinished(const TestNode *node) {
+    return node->numPassed + node->numFailed + node->numFlaky + node->numSkipped;
+}
+
+// Render where a pinned or remote test ran, so that slow runs can be traced to a core or a host
+void renderPlacement(const TestLeaf *leaf, int fd) {
+    if (leaf->worker >= 0) {
+        dprintf(fd, ", worker %d", leaf->worker);
+    } else if (leaf->cpu >= 0) {
+        dprintf(fd, ", cpu %d", leaf->cpu);
+    } else if (leaf->numaNode >= 0) {
+        dprintf(fd, ", node %d", leaf->numaNode);
+    }
+}
+
+// Render the state of a single test
+int renderTestLeaf(TestLeaf *leaf, int fd) {
+    switch (leaf->state) {
+        case TestState_IDLE:
+            dprintf(fd, "queued\n");
+            break;
+        case TestState_RUNNING:
+            dprintf(fd, RUNNING_TEST_COLOR "%s" RESET_COLOR,
+                    renderProgress(&leaf->progressIndicatorState));
+            if (leaf->maxRuns > 1 && leaf->maxRuns != INT_MAX) {
+                dprintf(fd, " %d/%d", leaf->numRunsDone, leaf->maxRuns);
+            } else if (leaf->numRunsDone > 0) {
+                dprintf(fd, " %d", leaf->numRunsDone);
+            }
+            dprintf(fd, "\n");
+            break;
+        case TestState_DONE:
+            if (renderExitSignal(leaf->exitSignal, fd)) {
+                return -1;
+            }
+            dprintf(fd, " (");
+            humanizeDuration(getElapsedNanos(&leaf->start, &leaf->end), fd);
+            if (leaf->numRunsDone > 1) {
+                dprintf(fd, ", %d runs, mean ", leaf->numRunsDone);
+                humanizeDuration(leaf->totalRunNanos / leaf->numRunsDone, fd);
+            }
+            if (leaf->totalVirtualNanos > 0) {
+                dprintf(fd, leaf->numRunsDone > 1 ? ", mean virtual " : ", virtual ");
+                humanizeDuration(leaf->totalVirtualNanos / leaf->numRunsDone, fd);
+            }
+            renderPlacement(leaf, fd);
+            dprintf(fd, ")\n");
+            break;
+        case TestState_SKIPPED:
+            dprintf(fd, SKIPPED_TEST_COLOR "skipped" RESET_COLOR "\n");
+            break;
+        case TestState_FLAKY:
+            dprintf(fd, FLAKY_TEST_COLOR "flaky: %d/%d passed (%.1f%%)" RESET_COLOR
+                            ", last failure ", leaf->numRunsPassed, leaf->numRunsDone,
+                    100.0 * leaf->numRunsPassed / leaf->numRunsDone);
+            if (renderExitSignal(leaf->exitSignal, fd)) {
                 return -1;
             }
+            dprintf(fd, " (");
+            humanizeDuration(getElapsedNanos(&leaf->start, &leaf->end), fd);
+            dprintf(fd, ", mean ");
+            humanizeDuration(leaf->totalRunNanos / leaf->numRunsDone, fd);
+            renderPlacement(leaf, fd);
+            dprintf(fd, ")\n");
+            break;
+        default:
+            fprintf(stderr, "found test in invalid state: %d\n", leaf->state);
+            return -1;
+    }
+    return 0;
+}
+
+// Render the counters of a parent node e.g. (1,2,3) for 1 running, 2 passed and 3 failed tests
+void renderTestCounters(const TestNode *node, int fd) {
+    dprintf(fd, "(");
+    int numRunning = node->numTests - TestNode_numFinished(node);
+    int prev = 0;
+    if (numRunning > 0) {
+        prev = 1;
+        dprintf(fd, RUNNING_TEST_COLOR "%d" RESET_COLOR, numRunning);
+    }
+    if (node->numPassed > 0) {
+        if (prev) {
+            dprintf(fd, ",");
+        }
+        dprintf(fd, PASSED_TEST_COLOR "%d" RESET_COLOR, node->numPassed);
+        prev = 1;
+    }
+    if (node->numFailed > 0) {
+        if (prev) {
+            dprintf(fd, ",");
+        }
+        dprintf(fd, FAILED_TEST_COLOR "%d" RESET_COLOR, node->numFailed);
+        prev = 1;
+    }
+    if (node->numFlaky > 0) {
+        if (prev) {
+            dprintf(fd, ",");
+        }
+        dprintf(fd, FLAKY_TEST_COLOR "%d" RESET_COLOR, node->numFlaky);
+        prev = 1;
+    }
+    if (node->numSkipped > 0) {
+        if (prev) {
+            dprintf(fd, ",");
+        }
+        dprintf(fd, SKIPPED_TEST_COLOR "%d" RESET_COLOR, node->numSkipped);
+    }
+    dprintf(fd, ")\n");
+}
+
+// Render every node of the graph. The nodes are in pre-order, so this is a single pass over them.
+int renderTestGraph(TestGraph *graph, int fd) {
+    for (int i = 0; i < graph->numNodes; ++i) {
+        const TestNode *node = &graph->nodes[i];
+        dprintf(fd, "%*c%s: ", node->depth * 2, ' ', graph->info[i].name);
+        if (!node->isLeaf) {
+            renderTestCounters(node, fd);
+        } else if (renderTestLeaf(&graph->leaves[node->leaf], fd)) {
+            fprintf(stderr, "failed to render %s\n", graph->info[i].name);
+            return -1;
         }
     }
     return 0;
 }
 
-// Start the test in a child process, redirecting output to the provided file descriptors
-int startTest(void (*test)(), int stdoutFd, int stderrFd) {
-    pid_t pid = fork();
-    if (pid < 0) {
-        perror("failed to fork for test");
+int exitSignalIsPass(int signal) {
+    return WIFEXITED(signal) && WEXITSTATUS(signal) == EXIT_SUCCESS;
+}
+
+int hasSuiteHooks(const TestFixture *fixture) {
+    return fixture != NULL && (fixture->suiteSetup != NULL || fixture->suiteTeardown != NULL);
+}
+
+// Run a test between the per-test setups and teardowns of the suites it is in
+void runTestWithFixtures(const TestGraph *graph, int index) {
+    int parent = graph->nodes[index].parent;
+    int depth = parent < 0 ? 0 : graph->nodes[parent].depth + 1;
+    // One more than needed, since a root leaf has no suites and arrays can't be empty
+    int chain[depth + 1];
+    for (int i = parent, j = depth - 1; i >= 0; i = graph->nodes[i].parent, --j) {
+        chain[j] = i;
+    }
+    for (int i = 0; i < depth; ++i) {
+        const TestFixture *fixture = graph->info[chain[i]].fixture;
+        if (fixture != NULL && fixture->setup != NULL) {
+            fixture->setup();
+        }
+    }
+    const TestNodeInfo *info = &graph->info[index];
+    if (info->caseTest != NULL) {
+        info->caseTest(info->caseIndex);
+    } else {
+        info->test();
+    }
+    for (int i = depth - 1; i >= 0; --i) {
+        const TestFixture *fixture = graph->info[chain[i]].fixture;
+        if (fixture != NULL && fixture->teardown != NULL) {
+            fixture->teardown();
+        }
+    }
+}
+
+// A slot in the pool of concurrently running test subprocesses
+typedef struct {
+    // 0 while a fixture server has been asked to start the test but hasn't reported its pid yet
+    pid_t pid;
+    // NULL when the slot is free. In a batch, this is the test in progress.
+    TestLeaf *leaf;
+    struct timespec start;
+
+    // A batch runs the leaves from batchNext up to batchEnd and sends a BatchMessage through
+    // batchFd for each one that passes. batchFd is -1 for jobs which run a single test.
+    int batchNext;
+    int batchEnd;
+    int batchFd;
+    // How long the last test of the batch took, which only passes once the batch exits cleanly
+    // after it, since exit handlers and destructors still run in its process
+    long long batchLastNanos;
+} Job;
+
+// Where the tests of a job slot run when slots are pinned (see pin in TestRunOptions)
+typedef struct {
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+    // The single CPU of the slot, or its NUMA node, each -1 if the slot has none
+    int cpu;
+    int numaNode;
+} SlotPlacement;
+
+// NUMA nodes with higher ids aren't used for placement
+#define MAX_NUMA_NODES 64
+
+// Sent by a batch for each of its tests that passed
+typedef struct {
+    int leaf;
+    long long runNanos;
+} BatchMessage;
+
+// Batches aim to take about this long, so that a fork costs little compared to the tests in it
+#define BATCH_NANOS (20 * 1000 * 1000LL)
+
+// A process which ran the suite setups of a suite with a fixture, and which forks that suite's
+// tests so that they inherit whatever the setups built. Servers of nested fixtures are forked from
+// the server of the enclosing fixture, so every suite setup runs once per run. The runner only
+// talks to the outermost servers, which pass the tests of nested fixtures down.
+typedef struct {
+    // The suite node with the fixture
+    int node;
+    // The server of the enclosing fixture, or -1
+    int parent;
+    // 0 until the server is started
+    pid_t pid;
+    // Leaf indices are written to the server through this, and closing it stops the server
+    int commandFd;
+    // ServerMessages come back through this. Nested servers share the pipe of their outermost
+    // server.
+    int resultFd;
+    int exited;
+    int exitSignal;
+} FixtureServer;
+
+typedef enum {
+    ServerMessage_STARTED,
+    ServerMessage_FINISHED,
+} ServerMessageType;
+
+// Sent by fixture servers when they fork a test and when they reap it. Messages are smaller than
+// PIPE_BUF, so writes from nested servers sharing a pipe don't interleave.
+typedef struct {
+    ServerMessageType type;
+    int leaf;
+    pid_t pid;
+    int exitSignal;
+} ServerMessage;
+
+typedef enum {
+    ThreadMessage_STARTED,
+    ThreadMessage_FINISHED,
+    // Sent by a worker thread for a leaf whose runs it leaves to forked processes, since a test
+    // crashed on a thread
+    ThreadMessage_RELEASED,
+    // Sent by a worker thread once there's nothing left for it to run
+    ThreadMessage_EXITED,
+} ThreadMessageType;
+
+// Sent by the worker threads through the result pipe of the pool. Messages are smaller than
+// PIPE_BUF, so writes from different threads don't interleave.
+typedef struct {
+    ThreadMessageType type;
+    int leaf;
+    // The index of the thread that sent the message
+    int thread;
+    int exitSignal;
+    long long runNanos;
+} ThreadMessage;
+
+// The leaves a worker thread starts with. They're all in place before the workers start, so this
+// is a Chase-Lev deque without pushes: the owner pops from the bottom, and workers that ran out of
+// their own leaves steal from the top.
+typedef struct {
+    const int *leaves;
+    long top;
+    long bottom;
+} WorkDeque;
+
+static const int threadCrashSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+#define NUM_THREAD_CRASH_SIGNALS (sizeof(threadCrashSignals) / sizeof(*threadCrashSignals))
+
+// The arguments of a worker thread
+typedef struct {
+    struct TestRun *run;
+    int self;
+} WorkerArgs;
+
+// The threads that run the tests of thread-safe suites inside the runner (see threads in
+// TestRunOptions), while the forked tests run next to them
+typedef struct {
+    int numThreads;
+    pthread_t *threads;
+    WorkerArgs *args;
+    WorkDeque *deques;
+    // The threaded leaves, split into one contiguous chunk per deque
+    int *leaves;
+    // The runs that every threaded leaf starts with, and the failed runs it may retry
+    int maxRuns;
+    int retries;
+    int resultPipe[2];
+    // The threads which haven't sent ThreadMessage_EXITED yet
+    int numRunning;
+    // Set once a test crashed on a thread. The crash may have left a lock taken or the heap
+    // corrupted, so no test starts on a thread after it.
+    int crashed;
+    // Whether the runner said so, which only the runner's thread reads and writes
+    int reportedCrash;
+    struct sigaction previousCrashActions[NUM_THREAD_CRASH_SIGNALS];
+} ThreadPool;
+
+// Bytes on their way through a non-blocking socket
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} WireBuffer;
+
+// A worker process connected to a run, on this or another host (see listen in TestRunOptions)
+typedef struct {
+    // -1 once the worker disconnected
+    int fd;
+    // The number of tests the worker runs at once, 0 until it says hello
+    int numSlots;
+    int numRunning;
+    // The leaves of the runs in flight, with -1 in free slots
+    int *leaves;
+    // The start of messages that didn't arrive completely yet, and what the socket didn't take
+    // yet, so that a slow worker never blocks the run
+    WireBuffer input;
+    WireBuffer output;
+} RemoteWorker;
+
+// Hands tests to remote workers, which pull a test whenever one of their slots is free
+typedef struct {
+    int listenFd;
+    // The path to unlink once the run is over, if the run listens on a Unix socket
+    char socketPath[108];
+    // Workers keep their index after they disconnect, since leaves refer to it
+    RemoteWorker *workers;
+    int numWorkers;
+    // When a worker was last connected or a test last ran here, to give up on workers that don't
+    // come (see workerTimeout in TestRunOptions)
+    struct timespec lastBusy;
+} Coordinator;
+
+typedef enum {
+    // Sent by a worker once it connects: its number of slots
+    WireMessage_HELLO = 1,
+    // Sent by the coordinator to start a run: the leaf, followed by the path of the test
+    WireMessage_RUN,
+    // Sent by a worker when a run ends: the leaf, its exit signal and duration, then its log
+    WireMessage_RESULT,
+} WireMessageType;
+
+// The most log bytes that a worker sends back for one run, past which the log is cut
+#define MAX_REMOTE_LOG (1 << 20)
+// The thread IDs of tracks in the trace start at 1 for job slots, at TRACE_THREAD_TRACKS for the
+// threads of the pool, and at TRACE_WORKER_TRACKS for workers, which get TRACE_THREAD_TRACKS each
+#define TRACE_THREAD_TRACKS 10000
+#define TRACE_WORKER_TRACKS 100000
+// The most often the runner's CPU use is sampled
+#define TRACE_SAMPLE_NANOS (10 * 1000 * 1000)
+// The fields before the log in a result, in network byte order
+#define RESULT_FIELDS 4
+// How often a profiled test is sampled, in nanoseconds of CPU time used by its process
+#define PROFILE_INTERVAL_NANOS (1000 * 1000)
+// The most samples kept per run of a profiled test, and the most frames kept per sample, counting
+// from the sampled instruction
+#define PROFILE_MAX_SAMPLES 32768
+#define PROFILE_MAX_DEPTH 63
+// How many words of the stack a profile sample reads at once while it follows the frame pointers
+#define PROFILE_STACK_CHUNK 512
+
+// How often the runner reads the load on the machine when the number of running tests adapts to it
+#define ADAPT_INTERVAL_NANOS (250 * 1000 * 1000LL)
+// The resources whose pressure is read, by their names in /proc/pressure
+#define NUM_LOAD_RESOURCES 3
+
+// A reading of the load on the machine, for adaptiveJobs in TestRunOptions
+typedef struct {
+    // Since the run started
+    long long time;
+    // The limit on running tests from then on, and how many were running
+    int limit;
+    int running;
+    // The percent of time that some tasks stalled on CPU, memory and IO since the reading before
+    double pressure[NUM_LOAD_RESOURCES];
+} ConcurrencySample;
+
+typedef struct {
+    struct timespec start;
+    // /proc/pressure, or TESTC_PRESSURE_DIR, which stands in for it in tests
+    const char *pressureDir;
+    // The total microseconds that tasks stalled on each resource at the last reading, or -1
+    long long stallMicros[NUM_LOAD_RESOURCES];
+    // The limit before the first reading
+    int initialLimit;
+    ConcurrencySample *samples;
+    int numSamples;
+    int samplesCapacity;
+} Concurrency;
+
+// An event that a test recorded, by its index in the traceEvents of the test's node, and the track
+// of the run that it was taken out of the ring after
+typedef struct {
+    int leaf;
+    int event;
+    int track;
+} TraceMark;
+
+typedef struct {
+    uint64_t depth;
+    void *frames[PROFILE_MAX_DEPTH];
+} ProfileSample;
+
+// The part of a test's .stacks file that one of its runs samples into. Each run reserves its own
+// region by growing the file, so that repeats which overlap don't share one. Samples are written
+// straight to the file, so the ones taken before a crash are kept.
+typedef struct {
+    uint64_t numSamples;
+    uint64_t numDropped;
+    // The bytes that the region takes up in the file, which is a whole number of pages. A run
+    // reserves room for PROFILE_MAX_SAMPLES, and gives back what it didn't sample into when it
+    // stops if no other run reserved a region after it.
+    uint64_t size;
+    uint64_t reserved[5];
+    ProfileSample samples[PROFILE_MAX_SAMPLES];
+} ProfileRegion;
+
+// One run of a test in the trace, in nanoseconds since the trace started
+typedef struct {
+    int leaf;
+    int track;
+    int passed;
+    long long start;
+    long long end;
+} TraceSpan;
+
+// How much of a CPU the runner used since the sample before
+typedef struct {
+    long long time;
+    double cpuPercent;
+} TraceSample;
+
+// Collected as tests finish when the options ask for a trace, and written once the run is over
+typedef struct {
+    struct timespec start;
+    TraceSpan *spans;
+    int numSpans;
+    int spansCapacity;
+    TraceSample *samples;
+    int numSamples;
+    int samplesCapacity;
+    TraceMark *marks;
+    int numMarks;
+    int marksCapacity;
+    long long lastCpuNanos;
+} Trace;
+
+// The state of a forking test run
+typedef struct TestRun {
+    TestGraph *graph;
+    const TestRunOptions *options;
+    const char *dir;
+    // NULL if progress isn't animated
+    pthread_mutex_t *renderMutex;
+
+    Job *jobs;
+    int numJobs;
+    // How many of the job slots may be used at once, which is below numJobs while the load on the
+    // machine is too high with adaptiveJobs
+    int jobLimit;
+    int numRunning;
+    int numDone;
+    int cursor;
+    int cancelled;
+
+    // The number and total duration of the tests which passed in batches so far
+    int numBatchTests;
+    long long batchNanos;
+
+    // Per leaf, the time that children skipped by sleeping on a virtual clock since the runner
+    // last looked. It's shared with the children, or NULL if it couldn't be mapped.
+    long long *skippedNanos;
+    // Per leaf, the ring that its runs record scopes and counters into. It's shared with the
+    // children, or NULL if trace_scope isn't linked or it couldn't be mapped.
+    TraceRing *traceRings;
+
+    FixtureServer *servers;
+    int numServers;
+    struct pollfd *pollFds;
+
+    // Becomes readable whenever a child process exits
+    int childSignalPipe[2];
+
+    // NULL unless some tests run on threads
+    ThreadPool *pool;
+
+    // Per job slot, or NULL if the slots aren't pinned
+    SlotPlacement *placements;
+
+    // NULL unless the run listens for workers
+    Coordinator *coordinator;
+    int numRemoteRunning;
+    // The capacity of pollFds, which grows as workers connect
+    int numPollFds;
+
+    // NULL unless the run is traced
+    Trace *trace;
+
+    // Leaves which start before the others, in the order of the graph (see failedFirst in
+    // TestRunOptions)
+    int *firstLeaves;
+    int numFirstLeaves;
+
+    // NULL unless the number of running tests adapts to the load
+    Concurrency *concurrency;
+} TestRun;
+
+// The write end of the pipe of the TestRun which is waiting for its child processes. SIGCHLD
+// writes to it so that exits can be waited for in the same poll as the fixture servers.
+static int childSignalFd = -1;
+
+void onChildSignal(int signal) {
+    (void) signal;
+    int savedErrno = errno;
+    char byte = 0;
+    write(childSignalFd, &byte, 1);
+    errno = savedErrno;
+}
+
+int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Create the child signal pipe of a process and route SIGCHLD to it
+int watchChildren(int signalPipe[2], struct sigaction *previous) {
+    if (pipe(signalPipe)) {
+        perror("failed to create child signal pipe");
         return -1;
     }
-    if (pid == 0) {
-        assert(dup2(stdoutFd, STDOUT_FILENO) != -1);
-        assert(dup2(stderrFd, STDERR_FILENO) != -1);
-        test();
-        exit(EXIT_SUCCESS);
+    if (setNonBlocking(signalPipe[0]) || setNonBlocking(signalPipe[1])) {
+        perror("failed to make child signal pipe non-blocking");
+        return -1;
     }
-    return pid;
+    childSignalFd = signalPipe[1];
+    struct sigaction action = {.sa_handler = onChildSignal, .sa_flags = SA_RESTART | SA_NOCLDSTOP};
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, previous)) {
+        perror("failed to handle SIGCHLD");
+        return -1;
+    }
+    return 0;
 }
 
-// Start all the tests in a node, recursively. The path argument is the filepath where the test
-// output will go, and it is modified in-place. It should be a buffer of size PATH_MAX, initialized
-// to a c-string of the root directory of where test output will go.
-int startTestNode(TestNode *node, char path[PATH_MAX]) {
-    size_t pathLength = strlen(path);
-    path[pathLength] = '/';
-    size_t nameLength = strlen(node->name);
-    memcpy(path + pathLength + 1, node->name, nameLength);
-    *(path + pathLength + 1 + nameLength) = '\0';
+// Empty a child signal pipe after poll reported it readable
+void drainChildSignals(int fd) {
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {}
+}
 
-    if (node->isLeaf) {
-        node->state = TestState_RUNNING;
-        clock_gettime(CLOCK_MONOTONIC, &node->start);
-        FILE *file;
-        strcat(path, ".txt");
-        file = fopen(path, "w");
-        if (file == NULL) {
-            fprintf(stderr, "failed to create log file at %s: %s\n", path, strerror(errno));
+int writeFully(int fd, const void *data, size_t size) {
+    const char *cursor = data;
+    while (size > 0) {
+        ssize_t written = write(fd, cursor, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
             return -1;
         }
-        node->outputFile = file;
-
-        path[pathLength] = '\0';
+        cursor += written;
+        size -= written;
+    }
+    return 0;
+}
 
-        pid_t testPid = startTest(node->test, fileno(file), fileno(file));
-        if (testPid < 0) {
-            fprintf(stderr, "failed to start test: %s\n", node->name);
+// Returns -1 on errors and when the other end closes before size bytes were read
+int readFully(int fd, void *data, size_t size) {
+    char *cursor = data;
+    while (size > 0) {
+        ssize_t numRead = read(fd, cursor, size);
+        if (numRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (numRead <= 0) {
             return -1;
         }
-        node->pid = testPid;
-    } else {
-        int mkdirStatus = mkdir(path, 0777);
-        if (mkdirStatus) {
-            if (errno != EEXIST) {
-                fprintf(stderr, "mkdir returned %d for %s: %s\n", mkdirStatus, path,
-                        strerror(errno));
+        cursor += numRead;
+        size -= numRead;
+    }
+    return 0;
+}
+
+// Messages between a coordinator and its workers are a header of the payload's length and the
+// message's type, in network byte order, followed by the payload
+int sendWireMessage(int fd, WireMessageType type, const void *payload, uint32_t size) {
+    uint32_t header[2] = {htonl(size), htonl(type)};
+    return writeFully(fd, header, sizeof(header)) || writeFully(fd, payload, size) ? -1 : 0;
+}
+
+// Read the next message, whose payload is allocated and null-terminated. Returns -1 if the
+// connection ended or the message is too big to be one.
+int receiveWireMessage(int fd, WireMessageType *type, char **payload, uint32_t *size) {
+    uint32_t header[2];
+    if (readFully(fd, header, sizeof(header))) {
+        return -1;
+    }
+    *size = ntohl(header[0]);
+    *type = ntohl(header[1]);
+    if (*size > MAX_REMOTE_LOG + RESULT_FIELDS * sizeof(uint32_t)) {
+        fprintf(stderr, "got a message of %u bytes from a %s\n", *size,
+                *type == WireMessage_RUN ? "coordinator" : "worker");
+        return -1;
+    }
+    *payload = malloc(*size + 1);
+    if (*payload == NULL || readFully(fd, *payload, *size)) {
+        free(*payload);
+        return -1;
+    }
+    (*payload)[*size] = '\0';
+    return 0;
+}
+
+// Grow a buffer to hold at least capacity bytes
+int growWireBuffer(WireBuffer *buffer, size_t capacity) {
+    if (capacity <= buffer->capacity) {
+        return 0;
+    }
+    size_t grownCapacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (grownCapacity < capacity) {
+        grownCapacity *= 2;
+    }
+    char *grown = realloc(buffer->data, grownCapacity);
+    if (grown == NULL) {
+        return -1;
+    }
+    buffer->data = grown;
+    buffer->capacity = grownCapacity;
+    return 0;
+}
+
+// Drop the first size bytes of a buffer
+void consumeWireBuffer(WireBuffer *buffer, size_t size) {
+    memmove(buffer->data, buffer->data + size, buffer->size - size);
+    buffer->size -= size;
+}
+
+void freeWireBuffer(WireBuffer *buffer) {
+    free(buffer->data);
+    *buffer = (WireBuffer) {0};
+}
+
+// Queue a message for a non-blocking socket, which flushWireBuffer writes as the socket takes it
+int queueWireMessage(WireBuffer *buffer, WireMessageType type, const void *payload,
+                     uint32_t size) {
+    uint32_t header[2] = {htonl(size), htonl(type)};
+    if (growWireBuffer(buffer, buffer->size + sizeof(header) + size)) {
+        return -1;
+    }
+    memcpy(buffer->data + buffer->size, header, sizeof(header));
+    memcpy(buffer->data + buffer->size + sizeof(header), payload, size);
+    buffer->size += sizeof(header) + size;
+    return 0;
+}
+
+// Write as much of a buffer as a non-blocking socket takes. Returns -1 if the connection broke.
+int flushWireBuffer(int fd, WireBuffer *buffer) {
+    size_t written = 0;
+    while (written < buffer->size) {
+        ssize_t numWritten = write(fd, buffer->data + written, buffer->size - written);
+        if (numWritten < 0 && errno == EINTR) {
+            continue;
+        }
+        if (numWritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (numWritten <= 0) {
+            return -1;
+        }
+        written += numWritten;
+    }
+    consumeWireBuffer(buffer, written);
+    return 0;
+}
+
+// Read what a non-blocking socket has into a buffer. Returns -1 if the connection ended or broke.
+int fillWireBuffer(int fd, WireBuffer *buffer) {
+    if (growWireBuffer(buffer, buffer->size + 65536)) {
+        return -1;
+    }
+    ssize_t numRead;
+    do {
+        numRead = read(fd, buffer->data + buffer->size, buffer->capacity - buffer->size);
+    } while (numRead < 0 && errno == EINTR);
+    if (numRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (numRead <= 0) {
+        return -1;
+    }
+    buffer->size += numRead;
+    return 0;
+}
+
+// Have the kernel notice a peer that went away without closing the connection, like a host that
+// lost power, within about half a minute instead of never. Unix sockets don't take these options.
+void keepAlive(int fd) {
+    int yes = 1;
+    int idleSeconds = 10;
+    int intervalSeconds = 5;
+    int numProbes = 3;
+    // Also covers a peer that stops acknowledging while data is on its way to it
+    unsigned int timeoutMillis = 30 * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idleSeconds, sizeof(idleSeconds));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intervalSeconds, sizeof(intervalSeconds));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &numProbes, sizeof(numProbes));
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeoutMillis, sizeof(timeoutMillis));
+}
+
+// Open a stream socket at an address like `unix:/tmp/testc.sock` or `host:port`, listening on it
+// or connecting to it. The path of a Unix socket is written to unixPath if it isn't NULL. Returns
+// the socket, or -1 with errno set.
+int openSocket(const char *address, int listening, char unixPath[108]) {
+    if (strncmp(address, "unix:", 5) == 0) {
+        struct sockaddr_un socketAddress = {.sun_family = AF_UNIX};
+        if (strlen(address + 5) >= sizeof(socketAddress.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(socketAddress.sun_path, address + 5);
+        if (unixPath != NULL) {
+            strcpy(unixPath, socketAddress.sun_path);
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listening) {
+            // A socket left behind by an earlier run would make bind fail
+            unlink(socketAddress.sun_path);
+        }
+        int failed = listening
+                     ? bind(fd, (struct sockaddr *) &socketAddress, sizeof(socketAddress))
+                       || listen(fd, SOMAXCONN)
+                     : connect(fd, (struct sockaddr *) &socketAddress, sizeof(socketAddress));
+        if (failed) {
+            int savedErrno = errno;
+            close(fd);
+            errno = savedErrno;
+            return -1;
+        }
+        return fd;
+    }
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || colon - address >= 256) {
+        errno = EINVAL;
+        return -1;
+    }
+    char host[256];
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+            .ai_flags = listening ? AI_PASSIVE : 0
+    };
+    struct addrinfo *addresses;
+    int status = getaddrinfo(host[0] != '\0' ? host : NULL, colon + 1, &hints, &addresses);
+    if (status != 0) {
+        fprintf(stderr, "failed to look up %s: %s\n", address, gai_strerror(status));
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *candidate = addresses; candidate != NULL && fd < 0;
+         candidate = candidate->ai_next) {
+        fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        int failed = listening
+                     ? bind(fd, candidate->ai_addr, candidate->ai_addrlen) || listen(fd, SOMAXCONN)
+                     : connect(fd, candidate->ai_addr, candidate->ai_addrlen);
+        if (failed) {
+            int savedErrno = errno;
+            close(fd);
+            errno = savedErrno;
+            fd = -1;
+        } else if (!listening) {
+            keepAlive(fd);
+        }
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+// Close the pipes and sockets of a run
+void closeRunPipes(TestRun *run) {
+    for (int i = 0; i < 2; ++i) {
+        if (run->childSignalPipe[i] >= 0) {
+            close(run->childSignalPipe[i]);
+            run->childSignalPipe[i] = -1;
+        }
+    }
+    for (int i = 0; i < run->numServers; ++i) {
+        FixtureServer *server = &run->servers[i];
+        if (server->commandFd >= 0) {
+            close(server->commandFd);
+        }
+        if (server->resultFd >= 0) {
+            close(server->resultFd);
+        }
+        server->commandFd = -1;
+        server->resultFd = -1;
+        server->pid = 0;
+    }
+    for (int i = 0; i < run->numJobs; ++i) {
+        if (run->jobs[i].batchFd >= 0) {
+            close(run->jobs[i].batchFd);
+            run->jobs[i].batchFd = -1;
+        }
+    }
+    for (int i = 0; run->pool != NULL && i < 2; ++i) {
+        if (run->pool->resultPipe[i] >= 0) {
+            close(run->pool->resultPipe[i]);
+            run->pool->resultPipe[i] = -1;
+        }
+    }
+    Coordinator *coordinator = run->coordinator;
+    if (coordinator != NULL) {
+        if (coordinator->listenFd >= 0) {
+            close(coordinator->listenFd);
+            coordinator->listenFd = -1;
+        }
+        for (int i = 0; i < coordinator->numWorkers; ++i) {
+            if (coordinator->workers[i].fd >= 0) {
+                close(coordinator->workers[i].fd);
+                coordinator->workers[i].fd = -1;
+            }
+        }
+    }
+}
+
+// A crash on a worker thread jumps back to the worker with the negated signal. Anywhere else, the
+// process crashes as it would have without the pool.
+void onThreadCrash(int crashSignal) {
+    if (TestC_caseFailure != NULL) {
+        siglongjmp(*TestC_caseFailure, -crashSignal);
+    }
+    signal(crashSignal, SIG_DFL);
+    raise(crashSignal);
+}
+
+void restoreCrashActions(ThreadPool *pool) {
+    for (size_t i = 0; i < NUM_THREAD_CRASH_SIGNALS; ++i) {
+        sigaction(threadCrashSignals[i], &pool->previousCrashActions[i], NULL);
+    }
+}
+
+// Close the pipes of the run that a forked child inherited, and give it back the default handling
+// of the signals the runner changed, so that tests which run their own test runner work.
+void resetChild(TestRun *run) {
+    closeRunPipes(run);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    if (run->pool != NULL) {
+        restoreCrashActions(run->pool);
+    }
+}
+
+#ifdef __linux__
+// Read a kernel CPU list like `0-3,8` from a sysfs file. Returns the number of CPUs in it, or -1 if
+// the file can't be read.
+int readCpuList(const char *path, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int first;
+    while (fscanf(file, "%d", &first) == 1) {
+        int last = first;
+        int next = fgetc(file);
+        if (next == '-') {
+            if (fscanf(file, "%d", &last) != 1) {
+                break;
+            }
+            next = fgetc(file);
+        }
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+            CPU_SET(cpu, cpus);
+        }
+        if (next != ',') {
+            break;
+        }
+    }
+    fclose(file);
+    return CPU_COUNT(cpus);
+}
+
+// Give each slot one of the CPUs, going round them if there are more slots than CPUs
+void placeOnCores(SlotPlacement *placements, int numSlots, const cpu_set_t *cpus) {
+    int ids[CPU_SETSIZE];
+    int numCpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, cpus)) {
+            ids[numCpus++] = cpu;
+        }
+    }
+    for (int slot = 0; slot < numSlots; ++slot) {
+        int cpu = ids[slot % numCpus];
+        CPU_ZERO(&placements[slot].cpus);
+        CPU_SET(cpu, &placements[slot].cpus);
+        placements[slot].cpu = cpu;
+        placements[slot].numaNode = -1;
+    }
+}
+
+// Deal the slots out to the NUMA nodes which have some of the allowed CPUs. Returns -1 if the
+// nodes can't be found.
+int placeOnNodes(SlotPlacement *placements, int numSlots, const cpu_set_t *allowed) {
+    int nodes[MAX_NUMA_NODES];
+    cpu_set_t nodeCpus[MAX_NUMA_NODES];
+    int numNodes = 0;
+    for (int node = 0; node < MAX_NUMA_NODES; ++node) {
+        char path[64];
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        if (readCpuList(path, &nodeCpus[numNodes]) <= 0) {
+            continue;
+        }
+        CPU_AND(&nodeCpus[numNodes], &nodeCpus[numNodes], allowed);
+        if (CPU_COUNT(&nodeCpus[numNodes]) > 0) {
+            nodes[numNodes++] = node;
+        }
+    }
+    if (numNodes == 0) {
+        return -1;
+    }
+    for (int slot = 0; slot < numSlots; ++slot) {
+        placements[slot].cpus = nodeCpus[slot % numNodes];
+        placements[slot].cpu = -1;
+        placements[slot].numaNode = nodes[slot % numNodes];
+    }
+    return 0;
+}
+#endif
+
+// Decide where each job slot runs according to the pin option of the run
+int planPlacements(TestRun *run) {
+    TestPinMode mode = run->options->pin;
+    if (mode == TestPin_NONE || run->numJobs <= 0) {
+        return 0;
+    }
+#ifndef __linux__
+    fprintf(stderr, "tests aren't pinned because pinning is only supported on Linux\n");
+    return 0;
+#else
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus)) {
+        perror("failed to get the CPUs that tests can run on");
+        return -1;
+    }
+    run->placements = calloc(run->numJobs, sizeof(SlotPlacement));
+    if (run->placements == NULL) {
+        perror("failed to allocate job slot placements");
+        return -1;
+    }
+    if (mode == TestPin_NUMA && placeOnNodes(run->placements, run->numJobs, &cpus) == 0) {
+        return 0;
+    }
+    if (mode == TestPin_NUMA) {
+        fprintf(stderr, "no NUMA nodes were found, so tests are pinned to cores instead\n");
+    }
+    if (mode == TestPin_ISOLATED) {
+        // Isolated CPUs are outside of the default affinity, but they can still be chosen
+        cpu_set_t isolated;
+        if (readCpuList("/sys/devices/system/cpu/isolated", &isolated) > 0) {
+            cpus = isolated;
+        } else {
+            fprintf(stderr, "no CPUs are isolated, so tests are pinned to any of them instead\n");
+        }
+    }
+    placeOnCores(run->placements, run->numJobs, &cpus);
+    return 0;
+#endif
+}
+
+// Move a freshly forked child onto the CPUs, and the memory, of its job slot
+void placeChild(const TestRun *run, int slot) {
+    if (run->placements == NULL || slot < 0) {
+        return;
+    }
+#ifdef __linux__
+    // A failure leaves the test wherever the kernel puts it, which only makes its timing noisier
+    const SlotPlacement *placement = &run->placements[slot];
+    sched_setaffinity(0, sizeof(placement->cpus), &placement->cpus);
+    if (placement->numaNode >= 0) {
+        unsigned long nodes = 1UL << placement->numaNode;
+        syscall(SYS_set_mempolicy, MPOL_BIND, &nodes, sizeof(nodes) * CHAR_BIT);
+    }
+#endif
+}
+
+// Remember where the run of a leaf in a local job slot is placed
+void recordPlacement(const TestRun *run, TestLeaf *leaf, int slot) {
+    leaf->worker = -1;
+    if (run->placements != NULL && slot >= 0) {
+        leaf->cpu = run->placements[slot].cpu;
+        leaf->numaNode = run->placements[slot].numaNode;
+    }
+}
+
+// The size of a region in a .stacks file with room for numSamples, which is a whole number of pages
+// so that regions can be mapped on their own
+size_t getProfileRegionSize(uint64_t numSamples) {
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    size_t size = offsetof(ProfileRegion, samples) + numSamples * sizeof(ProfileSample);
+    return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+void getLogPath(const TestGraph *graph, int index, const char *dir, char path[PATH_MAX]);
+
+// Write the path of a node's profile with the given extension, which is next to its log
+void getProfilePath(const TestGraph *graph, int index, const char *dir, const char *extension,
+                    char path[PATH_MAX]) {
+    getLogPath(graph, index, dir, path);
+    if (graph->nodes[index].isLeaf) {
+        path[strlen(path) - strlen(".txt")] = '\0';
+    }
+    strcat(path, extension);
+}
+
+#ifdef __linux__
+// Where the samples of the profiled test in this process go, the .stacks file that the region is
+// mapped from, and where in it
+ProfileRegion *profileRegion;
+int profileFd = -1;
+off_t profileOffset;
+timer_t profileTimer;
+// The number of profile signal handlers that are running, which stopProfiler waits for
+int numProfileHandlers;
+
+// Write the pc that a signal interrupted and the return addresses above it to frames, following
+// the chain of frame pointers up the stack. backtrace isn't safe in a signal handler, since it can
+// take the loader's lock. The stack is read with process_vm_readv, which fails instead of faulting
+// when code without frame pointers left something else in the register, and the chain has to move
+// up the stack. Frames tend to be close together, so the stack is read a chunk at a time rather
+// than a frame at a time. Returns the number of frames.
+int unwindFramePointers(const ucontext_t *context, void **frames, int maxDepth) {
+#if defined(__x86_64__)
+    uintptr_t pc = (uintptr_t) context->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = (uintptr_t) context->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    uintptr_t pc = (uintptr_t) context->uc_mcontext.pc;
+    uintptr_t fp = (uintptr_t) context->uc_mcontext.regs[29];
+#else
+    (void) context;
+    (void) frames;
+    (void) maxDepth;
+    return 0;
+#endif
+#if defined(__x86_64__) || defined(__aarch64__)
+    frames[0] = (void *) pc;
+    int depth = 1;
+    pid_t pid = getpid();
+    uintptr_t chunk[PROFILE_STACK_CHUNK];
+    uintptr_t chunkStart = 0;
+    size_t chunkSize = 0;
+    while (depth < maxDepth && fp != 0 && fp % sizeof(void *) == 0) {
+        if (fp < chunkStart || fp + 2 * sizeof(uintptr_t) > chunkStart + chunkSize) {
+            // A read that runs past the end of the stack stops short rather than fails
+            struct iovec local = {.iov_base = chunk, .iov_len = sizeof(chunk)};
+            struct iovec remote = {.iov_base = (void *) fp, .iov_len = sizeof(chunk)};
+            ssize_t numRead = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+            if (numRead < (ssize_t) (2 * sizeof(uintptr_t))) {
+                break;
+            }
+            chunkStart = fp;
+            chunkSize = (size_t) numRead;
+        }
+        // The caller's frame pointer, and the return address into the caller
+        const uintptr_t *record = &chunk[(fp - chunkStart) / sizeof(uintptr_t)];
+        if (record[1] == 0) {
+            break;
+        }
+        frames[depth++] = (void *) record[1];
+        if (record[0] <= fp) {
+            break;
+        }
+        fp = record[0];
+    }
+    return depth;
+#endif
+}
+
+void onProfileSignal(int signal, siginfo_t *info, void *context) {
+    (void) signal;
+    (void) info;
+    __atomic_add_fetch(&numProfileHandlers, 1, __ATOMIC_SEQ_CST);
+    ProfileRegion *region = __atomic_load_n(&profileRegion, __ATOMIC_SEQ_CST);
+    if (region != NULL) {
+        uint64_t index = __atomic_fetch_add(&region->numSamples, 1, __ATOMIC_RELAXED);
+        if (index >= PROFILE_MAX_SAMPLES) {
+            __atomic_fetch_add(&region->numDropped, 1, __ATOMIC_RELAXED);
+        } else {
+            int savedErrno = errno;
+            ProfileSample *sample = &region->samples[index];
+            int depth = unwindFramePointers(context, sample->frames, PROFILE_MAX_DEPTH);
+            errno = savedErrno;
+            __atomic_store_n(&sample->depth, (uint64_t) depth, __ATOMIC_RELEASE);
+        }
+    }
+    __atomic_sub_fetch(&numProfileHandlers, 1, __ATOMIC_SEQ_CST);
+}
+#endif
+
+// Start sampling this process into a new region of the .stacks file of the test at index. A test
+// runs without being profiled rather than fail if that can't be done.
+void startProfiler(const TestRun *run, int index) {
+#ifndef __linux__
+    // TestC_run turns profiling off on other platforms
+    (void) run;
+    (void) index;
+#else
+    char path[PATH_MAX];
+    getProfilePath(run->graph, index, run->dir, ".stacks", path);
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open profile at %s: %s\n", path, strerror(errno));
+        return;
+    }
+    size_t regionSize = getProfileRegionSize(PROFILE_MAX_SAMPLES);
+    struct stat status;
+    off_t offset = -1;
+    if (flock(fd, LOCK_EX) == 0) {
+        if (fstat(fd, &status) == 0 && ftruncate(fd, status.st_size + regionSize) == 0) {
+            offset = status.st_size;
+        }
+        flock(fd, LOCK_UN);
+    }
+    ProfileRegion *region = offset < 0 ? MAP_FAILED : mmap(NULL, regionSize, PROT_READ | PROT_WRITE,
+                                                          MAP_SHARED, fd, offset);
+    if (region == MAP_FAILED) {
+        fprintf(stderr, "failed to map profile at %s: %s\n", path, strerror(errno));
+        close(fd);
+        return;
+    }
+    region->size = regionSize;
+    profileFd = fd;
+    profileOffset = offset;
+    struct sigaction action = {.sa_sigaction = onProfileSignal,
+                               .sa_flags = SA_RESTART | SA_SIGINFO};
+    sigemptyset(&action.sa_mask);
+    struct sigevent event = {.sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGPROF};
+    struct itimerspec interval = {
+            .it_interval = {.tv_nsec = PROFILE_INTERVAL_NANOS},
+            .it_value = {.tv_nsec = PROFILE_INTERVAL_NANOS}
+    };
+    profileRegion = region;
+    if (sigaction(SIGPROF, &action, NULL)
+        || timer_create(CLOCK_PROCESS_CPUTIME_ID, &event, &profileTimer)) {
+        perror("failed to start the profiler");
+        profileRegion = NULL;
+        munmap(region, regionSize);
+        close(fd);
+        profileFd = -1;
+        return;
+    }
+    if (timer_settime(profileTimer, 0, &interval, NULL)) {
+        perror("failed to start the profiler");
+        timer_delete(profileTimer);
+        profileRegion = NULL;
+        munmap(region, regionSize);
+        close(fd);
+        profileFd = -1;
+    }
+#endif
+}
+
+// Stop sampling, for batches which run another test in the same process next. The region is cut
+// down to the samples that were taken if it's still the last one in the file, so that repeats
+// don't grow it by the most that a run could sample every time.
+void stopProfiler() {
+#ifdef __linux__
+    if (profileRegion == NULL) {
+        return;
+    }
+    timer_delete(profileTimer);
+    ProfileRegion *region = profileRegion;
+    __atomic_store_n(&profileRegion, NULL, __ATOMIC_SEQ_CST);
+    // A signal that was already pending may still be writing a sample into the region
+    while (__atomic_load_n(&numProfileHandlers, __ATOMIC_SEQ_CST) > 0) {
+        sched_yield();
+    }
+    size_t reservedSize = region->size;
+    uint64_t numSamples = region->numSamples;
+    size_t usedSize = getProfileRegionSize(numSamples < PROFILE_MAX_SAMPLES ? numSamples
+                                                                              : PROFILE_MAX_SAMPLES);
+    struct stat status;
+    if (usedSize < reservedSize && flock(profileFd, LOCK_EX) == 0) {
+        if (fstat(profileFd, &status) == 0
+            && status.st_size == profileOffset + (off_t) reservedSize) {
+            region->size = usedSize;
+            if (ftruncate(profileFd, profileOffset + (off_t) usedSize)) {
+                region->size = reservedSize;
+            }
+        }
+        flock(profileFd, LOCK_UN);
+    }
+    munmap(region, reservedSize);
+    close(profileFd);
+    profileFd = -1;
+#endif
+}
+
+// Have the test that's about to run record into the ring of its leaf, or stop recording if
+// leafIndex is -1. A forked test records from every thread of its process, and a test on one of
+// the runner's threads only from that thread.
+void enterTraceRing(const TestRun *run, int leafIndex, int thread) {
+    void (*enter)(TraceRing *) = thread ? TraceRing_enterThread : TraceRing_enter;
+    if (enter != NULL) {
+        enter(run->traceRings != NULL && leafIndex >= 0 ? &run->traceRings[leafIndex] : NULL);
+    }
+}
+
+// Run a test in a child process. When leaks are checked, a test that returns with allocations it
+// made still live fails, and its leaks are printed to its log.
+void runForkedTest(TestRun *run, int index) {
+    int checkLeaks = run->options->checkLeaks && Alloc_startTracking != NULL;
+    int virtualTime = run->graph->info[index].virtualTime && VirtualTime_start != NULL;
+    if (virtualTime) {
+        int leaf = run->graph->nodes[index].leaf;
+        VirtualTime_start(run->skippedNanos == NULL ? NULL : &run->skippedNanos[leaf]);
+    }
+    if (checkLeaks) {
+        Alloc_startTracking();
+    }
+    enterTraceRing(run, run->graph->nodes[index].leaf, 0);
+    // Workers have no log directory to write profiles to
+    if (run->options->profile && run->dir != NULL) {
+        startProfiler(run, index);
+    }
+    // Workers have no log directory, and their records wouldn't get back to the runner anyway
+    if (Impact_start != NULL && run->dir != NULL) {
+        char path[PATH_MAX];
+        getProfilePath(run->graph, index, run->dir, ".impact", path);
+        Impact_start(path);
+    }
+    if (run->options->minidumps && run->dir != NULL) {
+        char path[PATH_MAX];
+        getProfilePath(run->graph, index, run->dir, ".dmp", path);
+        Minidump_install(path);
+    }
+    runTestWithFixtures(run->graph, index);
+    if (Impact_stop != NULL) {
+        Impact_stop();
+    }
+    stopProfiler();
+    if (checkLeaks && Alloc_stopTracking(STDERR_FILENO) > 0) {
+        exit(EXIT_FAILURE);
+    }
+    if (virtualTime) {
+        VirtualTime_stop();
+    }
+}
+
+// Start the test in a child process, redirecting its output to the provided file descriptor. The
+// child is placed on the CPUs of the job slot, if it has one (slot isn't -1).
+int startTest(TestRun *run, int index, int outputFd, int slot) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork for test");
+        return -1;
+    }
+    if (pid == 0) {
+        resetChild(run);
+        placeChild(run, slot);
+        assert(dup2(outputFd, STDOUT_FILENO) != -1);
+        assert(dup2(outputFd, STDERR_FILENO) != -1);
+        runForkedTest(run, index);
+        exit(EXIT_SUCCESS);
+    }
+    return pid;
+}
+
+// Write the path of a node's log file or directory, which mirrors its position in the graph, to
+// path.
+void getLogPath(const TestGraph *graph, int index, const char *dir, char path[PATH_MAX]) {
+    if (index < 0) {
+        strcpy(path, dir);
+        return;
+    }
+    getLogPath(graph, graph->nodes[index].parent, dir, path);
+    strcat(path, "/");
+    strcat(path, graph->info[index].name);
+    if (graph->nodes[index].isLeaf) {
+        strcat(path, ".txt");
+    }
+}
+
+// Create the log directory of every parent node. Parents come before their children in pre-order,
+// so a single pass creates them in the right order.
+int createLogDirectories(const TestGraph *graph, const char *dir) {
+    char path[PATH_MAX];
+    for (int i = 0; i < graph->numNodes; ++i) {
+        if (graph->nodes[i].isLeaf) {
+            continue;
+        }
+        getLogPath(graph, i, dir, path);
+        int mkdirStatus = mkdir(path, 0777);
+        if (mkdirStatus) {
+            if (errno != EEXIST) {
+                fprintf(stderr, "mkdir returned %d for %s: %s\n", mkdirStatus, path,
+                        strerror(errno));
+                return -1;
+            }
+            printf("%s already exists\n", path);
+        }
+    }
+    return 0;
+}
+
+void serveFixture(TestRun *run, int self, int commandFd, int resultFd, int logFd);
+
+// Fork the server of a fixture, which is a child of the runner for outermost fixtures and a child
+// of the enclosing fixture's server otherwise. Its output goes to fixture.txt in the suite's log
+// directory.
+int startFixtureServer(TestRun *run, int index) {
+    FixtureServer *server = &run->servers[index];
+    int commandPipe[2];
+    int resultPipe[2] = {-1, -1};
+    if (pipe(commandPipe) || (server->parent < 0 && pipe(resultPipe))) {
+        perror("failed to create fixture server pipes");
+        return -1;
+    }
+    int resultFd = server->parent < 0 ? resultPipe[1] : run->servers[server->parent].resultFd;
+    char path[PATH_MAX];
+    getLogPath(run->graph, server->node, run->dir, path);
+    strcat(path, "/fixture.txt");
+    int logFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (logFd < 0) {
+        fprintf(stderr, "failed to create fixture log at %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork fixture server");
+        return -1;
+    }
+    if (pid == 0) {
+        // The result pipe might be one of the run's pipes, which resetChild closes
+        resultFd = dup(resultFd);
+        close(commandPipe[1]);
+        if (server->parent < 0) {
+            close(resultPipe[0]);
+            close(resultPipe[1]);
+        }
+        resetChild(run);
+        serveFixture(run, index, commandPipe[0], resultFd, logFd);
+    }
+    close(commandPipe[0]);
+    close(logFd);
+    if (server->parent < 0) {
+        close(resultPipe[1]);
+        if (setNonBlocking(resultPipe[0])) {
+            perror("failed to make fixture server results non-blocking");
+            return -1;
+        }
+        server->resultFd = resultPipe[0];
+    }
+    server->commandFd = commandPipe[1];
+    server->pid = pid;
+    return 0;
+}
+
+void sendServerMessage(int resultFd, ServerMessage message) {
+    if (write(resultFd, &message, sizeof(message)) != sizeof(message)) {
+        perror("fixture server failed to send a result");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Fork one run of a test from a fixture server. The runner already opened the log file, so the
+// test appends to it.
+pid_t startServedTest(TestRun *run, int leafIndex) {
+    int node = run->graph->leaves[leafIndex].node;
+    char path[PATH_MAX];
+    getLogPath(run->graph, node, run->dir, path);
+    int fd = open(path, O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open log file at %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    pid_t pid = startTest(run, node, fd, -1);
+    close(fd);
+    return pid;
+}
+
+// The loop of a fixture server. It runs the suite setup, then forks a test for every leaf index it
+// reads from commandFd, or passes the index on to the server of a nested fixture, and reports when
+// each of its tests starts and finishes. Once commandFd is closed and all of its children have
+// exited, it runs the suite teardown and exits.
+void serveFixture(TestRun *run, int self, int commandFd, int resultFd, int logFd) {
+    assert(dup2(logFd, STDOUT_FILENO) != -1);
+    assert(dup2(logFd, STDERR_FILENO) != -1);
+    close(logFd);
+    run->servers[self].commandFd = commandFd;
+    run->servers[self].resultFd = resultFd;
+    if (watchChildren(run->childSignalPipe, NULL)) {
+        exit(EXIT_FAILURE);
+    }
+    const TestGraph *graph = run->graph;
+    // Any enclosing suite with suite hooks has a server of its own, which this one was forked from
+    const TestFixture *fixture = graph->info[run->servers[self].node].fixture;
+    if (fixture->suiteSetup != NULL) {
+        fixture->suiteSetup();
+    }
+    fflush(stdout);
+
+    int numChildren = 0;
+    // The running tests that this server forked
+    pid_t *tests = NULL;
+    int numTests = 0, testsCapacity = 0;
+    while (commandFd >= 0 || numChildren > 0) {
+        struct pollfd fds[2] = {
+                {.fd = run->childSignalPipe[0], .events = POLLIN},
+                {.fd = commandFd, .events = POLLIN},
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("fixture server failed to poll");
+            exit(EXIT_FAILURE);
+        }
+        if (fds[1].revents) {
+            int leafIndex;
+            if (read(commandFd, &leafIndex, sizeof(leafIndex)) == sizeof(leafIndex)) {
+                int target = graph->leaves[leafIndex].server;
+                if (target == self) {
+                    pid_t pid = startServedTest(run, leafIndex);
+                    if (pid < 0) {
+                        exit(EXIT_FAILURE);
+                    }
+                    if (numTests == testsCapacity) {
+                        testsCapacity = testsCapacity == 0 ? 16 : testsCapacity * 2;
+                        tests = realloc(tests, testsCapacity * sizeof(pid_t));
+                        if (tests == NULL) {
+                            perror("fixture server failed to allocate its tests");
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    tests[numTests++] = pid;
+                    ++numChildren;
+                    sendServerMessage(resultFd, (ServerMessage) {
+                            .type = ServerMessage_STARTED, .leaf = leafIndex, .pid = pid});
+                } else {
+                    while (run->servers[target].parent != self) {
+                        target = run->servers[target].parent;
+                    }
+                    if (run->servers[target].pid == 0) {
+                        if (startFixtureServer(run, target)) {
+                            exit(EXIT_FAILURE);
+                        }
+                        ++numChildren;
+                    }
+                    int commandStatus = write(run->servers[target].commandFd, &leafIndex,
+                                              sizeof(leafIndex));
+                    if (commandStatus != sizeof(leafIndex)) {
+                        perror("failed to pass a test to a nested fixture server");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+            } else {
+                // The runner has no more tests for this fixture, so neither do nested fixtures
+                close(commandFd);
+                commandFd = -1;
+                for (int i = 0; i < run->numServers; ++i) {
+                    if (run->servers[i].parent == self && run->servers[i].commandFd >= 0) {
+                        close(run->servers[i].commandFd);
+                        run->servers[i].commandFd = -1;
+                    }
+                }
+            }
+        }
+        if (fds[0].revents) {
+            drainChildSignals(run->childSignalPipe[0]);
+            // Only the tests and nested servers are waited for, since the suite setups may have
+            // started children of their own
+            int status;
+            for (int i = 0; i < numTests; ++i) {
+                if (waitpid(tests[i], &status, WNOHANG) <= 0) {
+                    continue;
+                }
+                --numChildren;
+                sendServerMessage(resultFd, (ServerMessage) {
+                        .type = ServerMessage_FINISHED, .pid = tests[i], .exitSignal = status});
+                tests[i--] = tests[--numTests];
+            }
+            for (int i = 0; i < run->numServers; ++i) {
+                FixtureServer *nested = &run->servers[i];
+                if (nested->parent != self || nested->pid <= 0 || nested->exited
+                    || waitpid(nested->pid, &status, WNOHANG) <= 0) {
+                    continue;
+                }
+                --numChildren;
+                nested->exited = 1;
+                if (!exitSignalIsPass(status)) {
+                    // The tests queued in the nested server are lost, so fail them all through
+                    // the outermost server
+                    fprintf(stderr, "nested fixture server failed\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+    free(tests);
+    if (fixture->suiteTeardown != NULL) {
+        fixture->suiteTeardown();
+    }
+    exit(EXIT_SUCCESS);
+}
+
+// Get a leaf ready for its next run. The log file is opened the first time the leaf is started
+// and later runs append to it.
+int prepareTestRun(TestRun *run, TestLeaf *leaf, const struct timespec *start) {
+    TestNodeInfo *info = &run->graph->info[leaf->node];
+    if (leaf->numRuns == 0) {
+        leaf->state = TestState_RUNNING;
+        leaf->start = *start;
+    }
+    if (info->outputFile == NULL) {
+        char path[PATH_MAX];
+        getLogPath(run->graph, leaf->node, run->dir, path);
+        FILE *file = fopen(path, "w");
+        if (file == NULL) {
+            fprintf(stderr, "failed to create log file at %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        info->outputFile = file;
+    } else if (leaf->numRuns > 0) {
+        // Tests started by a fixture server write through their own file description
+        fseek(info->outputFile, 0, SEEK_END);
+        fprintf(info->outputFile, "\n--- run %d ---\n", leaf->numRuns + 1);
+        fflush(info->outputFile);
+    }
+    ++leaf->numRuns;
+    return 0;
+}
+
+// Start one run of a leaf in the given job slot. Tests with a fixture are started by the outermost
+// fixture server, which is started the first time one of its tests runs. Returns 1 if the leaf's
+// fixture server already exited, in which case the run can only fail.
+int startTestRun(TestRun *run, TestLeaf *leaf, Job *job) {
+    TestGraph *graph = run->graph;
+    TestNodeInfo *info = &graph->info[leaf->node];
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    if (prepareTestRun(run, leaf, &job->start)) {
+        return -1;
+    }
+    ++run->numRunning;
+    job->leaf = leaf;
+    job->pid = 0;
+    leaf->slot = (int) (job - run->jobs);
+    if (leaf->server >= 0) {
+        int root = leaf->server;
+        while (run->servers[root].parent >= 0) {
+            root = run->servers[root].parent;
+        }
+        FixtureServer *server = &run->servers[root];
+        if (server->exited) {
+            return 1;
+        }
+        if (server->pid == 0 && startFixtureServer(run, root)) {
+            fprintf(stderr, "failed to start fixture server for %s\n",
+                    graph->info[server->node].name);
+            return -1;
+        }
+        // If the server died, the run fails once the server is reaped
+        int leafIndex = (int) (leaf - graph->leaves);
+        if (write(server->commandFd, &leafIndex, sizeof(leafIndex)) != sizeof(leafIndex)
+            && errno != EPIPE) {
+            perror("failed to send a test to its fixture server");
+            return -1;
+        }
+        return 0;
+    }
+    int slot = (int) (job - run->jobs);
+    pid_t testPid = startTest(run, leaf->node, fileno(info->outputFile), slot);
+    if (testPid < 0) {
+        fprintf(stderr, "failed to start test: %s\n", info->name);
+        return -1;
+    }
+    leaf->pid = testPid;
+    job->pid = testPid;
+    recordPlacement(run, leaf, slot);
+    return 0;
+}
+
+// The C library's clock_gettime, which keeps to the real clock in an executable that links the
+// virtual clock (see virtual_time.h)
+static int (*realClockGettime)(clockid_t, struct timespec *);
+
+// Read a clock without the time that tests on the virtual clock skipped
+int getRealTime(clockid_t clock, struct timespec *time) {
+    if (realClockGettime == NULL) {
+        *(void **) &realClockGettime = dlsym(RTLD_NEXT, "clock_gettime");
+    }
+    return realClockGettime != NULL ? realClockGettime(clock, time) : clock_gettime(clock, time);
+}
+
+// Run the leaves of a batch one after the other, each with its output going to its own log, and
+// send a BatchMessage for each test that passes. A test that fails exits the child, and the runner
+// attributes the exit to the test in progress.
+void runBatch(TestRun *run, int first, int end, int resultFd) {
+    const TestGraph *graph = run->graph;
+    for (int i = first; i < end; ++i) {
+        int node = graph->leaves[i].node;
+        int fd = fileno(graph->info[node].outputFile);
+        assert(dup2(fd, STDOUT_FILENO) != -1);
+        assert(dup2(fd, STDERR_FILENO) != -1);
+        // Timed on the real clock, since a test on the virtual clock moves this process's
+        // clock_gettime forward by the time that it skipped, which recordRun adds separately
+        struct timespec testStart, testEnd;
+        getRealTime(CLOCK_MONOTONIC, &testStart);
+        runForkedTest(run, node);
+        fflush(stdout);
+        fflush(stderr);
+        getRealTime(CLOCK_MONOTONIC, &testEnd);
+        BatchMessage message = {.leaf = i, .runNanos = getElapsedNanos(&testStart, &testEnd)};
+        if (write(resultFd, &message, sizeof(message)) != sizeof(message)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    exit(EXIT_SUCCESS);
+}
+
+// Start the first runs of the sibling leaves from first up to end in a single child
+int startBatch(TestRun *run, int first, int end, Job *job) {
+    TestGraph *graph = run->graph;
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    for (int i = first; i < end; ++i) {
+        if (prepareTestRun(run, &graph->leaves[i], &job->start)) {
+            return -1;
+        }
+    }
+    int batchPipe[2];
+    if (pipe(batchPipe)) {
+        perror("failed to create batch pipe");
+        return -1;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork for batch");
+        return -1;
+    }
+    int slot = (int) (job - run->jobs);
+    if (pid == 0) {
+        close(batchPipe[0]);
+        resetChild(run);
+        placeChild(run, slot);
+        runBatch(run, first, end, batchPipe[1]);
+    }
+    for (int i = first; i < end; ++i) {
+        recordPlacement(run, &graph->leaves[i], slot);
+    }
+    close(batchPipe[1]);
+    if (setNonBlocking(batchPipe[0])) {
+        perror("failed to make batch results non-blocking");
+        return -1;
+    }
+    for (int i = first; i < end; ++i) {
+        graph->leaves[i].pid = pid;
+        graph->leaves[i].slot = slot;
+    }
+    job->pid = pid;
+    job->leaf = &graph->leaves[first];
+    job->batchNext = first;
+    job->batchEnd = end;
+    job->batchFd = batchPipe[0];
+    ++run->numRunning;
+    return 0;
+}
+
+// The number of tests to put in the next batch, aiming for batches which take about BATCH_NANOS
+// given the mean duration of the tests that passed in batches so far. Batches are also kept small
+// enough that the remaining tests are spread over all of the job slots.
+int getBatchSize(const TestRun *run) {
+    long long size = 8;
+    if (run->numBatchTests > 0) {
+        long long meanNanos = run->batchNanos / run->numBatchTests;
+        size = BATCH_NANOS / (meanNanos > 0 ? meanNanos : 1);
+    }
+    int fairShare = (run->graph->numLeaves - run->numDone) / run->numJobs;
+    if (size > fairShare) {
+        size = fairShare;
+    }
+    if (size > run->options->batch) {
+        size = run->options->batch;
+    }
+    return size < 1 ? 1 : (int) size;
+}
+
+// Whether a leaf can join a batch which starts with first: it must be a sibling which hasn't run
+// yet, and batches aren't run by fixture servers or worker threads
+int canBatch(const TestGraph *graph, const TestLeaf *first, const TestLeaf *leaf) {
+    return leaf->state == TestState_IDLE && leaf->numRuns == 0 && leaf->maxRuns > 0
+           && leaf->server < 0 && !leaf->threaded
+           && graph->nodes[leaf->node].parent == graph->nodes[first->node].parent;
+}
+
+// Whether remote workers can run a leaf, which they can unless it needs a fixture server or a
+// thread of this process
+int canRunRemotely(const TestLeaf *leaf) {
+    return leaf->server < 0 && !leaf->threaded;
+}
+
+// Whether another run of a leaf can start now, on a worker if remote is set
+int canStartRun(const TestRun *run, const TestLeaf *leaf, int remote) {
+    int skipRemotable = !remote && run->coordinator != NULL && run->options->remoteOnly;
+    if (leaf->threaded || (remote && !canRunRemotely(leaf))
+        || (skipRemotable && canRunRemotely(leaf))) {
+        return 0;
+    }
+    return (leaf->state == TestState_IDLE || leaf->state == TestState_RUNNING)
+           && leaf->numRuns < leaf->maxRuns;
+}
+
+// Pick the next leaf that still needs a run, cycling through the leaves so that repeated runs of
+// one test are interleaved with the others. Returns NULL if no leaf needs to start a run. Leaves on
+// the thread pool are started by their worker instead. A remote pick only returns leaves that
+// workers can run, and a local one skips them if they're left to workers (see remoteOnly).
+TestLeaf *nextTestToRun(TestRun *run, int remote) {
+    TestGraph *graph = run->graph;
+    for (int i = 0; i < run->numFirstLeaves; ++i) {
+        TestLeaf *leaf = &graph->leaves[run->firstLeaves[i]];
+        if (canStartRun(run, leaf, remote)) {
+            return leaf;
+        }
+    }
+    int numLeaves = graph->numLeaves;
+    for (int i = 0; i < numLeaves; ++i) {
+        int index = (run->cursor + i) % numLeaves;
+        TestLeaf *leaf = &graph->leaves[index];
+        if (canStartRun(run, leaf, remote)) {
+            run->cursor = (index + 1) % numLeaves;
+            return leaf;
+        }
+    }
+    return NULL;
+}
+
+// Remove a trailing slash, if it exists, from a filepath.
+void removeTrailingSlash(char *path) {
+    size_t pathLength = strlen(path);
+    if (pathLength > 0 && path[pathLength - 1] == '/') {
+        path[pathLength - 1] = '\0';
+    }
+}
+
+// Each running job has a process id; this function searches for the job with the provided pid and
+// returns NULL if no such job exists.
+Job *findJobWithPid(Job *jobs, int numJobs, pid_t pid) {
+    for (int i = 0; i < numJobs; ++i) {
+        if (jobs[i].leaf != NULL && jobs[i].pid == pid) {
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+// Render the whole graph, outputting to the provided FILE. It needs to be a FILE and not a file
+// descriptor because we need to flush it in order for the ANSI stuff (terminal colors) to work
+// properly.
+int renderRootTestNode(TestGraph *graph, FILE *file) {
+    printf(CLEAR_SCREEN); // Clear the console
+    fflush(file);
+    dprintf(fileno(file), "TestC\n");
+    if (renderTestGraph(graph, fileno(file))) {
+        fprintf(stderr, "failed to render graph\n");
+        return -1;
+    }
+    fflush(file);
+    return 0;
+}
+
+typedef struct {
+    // There are two threads which can write to the screen, this makes it so only one will render at
+    // a time.
+    pthread_mutex_t *screenRenderMutex;
+
+    TestGraph *graph;
+
+    // The rate at which the spinners will re-render.
+    float fps;
+
+    // The exit status of the render thread, not the tests.
+    int exitStatus;
+} RenderThreadArgs;
+
+// The function that the render thread will run. It re-renders the screen every 1/fps seconds, but
+// it uses a mutex so that it doesn't interfere with screen renders that come from the main thread.
+void *renderLoop(void *input) {
+    RenderThreadArgs *args = input;
+    long us = (long) (1000.f * 1000.f / args->fps);
+    const TestNode *root = &args->graph->nodes[0];
+    while (1) {
+        if (pthread_mutex_lock(args->screenRenderMutex)) {
+            perror("render loop failed to lock mutex");
+            args->exitStatus = 1;
+            return NULL;
+        }
+        if (root->isLeaf ? args->graph->leaves[0].state > TestState_RUNNING
+                         : TestNode_numFinished(root) == root->numTests) {
+            if (pthread_mutex_unlock(args->screenRenderMutex)) {
+                perror("render loop failed to unlock mutex while trying to exit");
+                args->exitStatus = 1;
+                return NULL;
+            }
+            args->exitStatus = 0;
+            return NULL;
+        }
+        if (renderRootTestNode(args->graph, stdout)) {
+            fprintf(stderr, "render loop failed to render graph\n");
+            args->exitStatus = 1;
+            return NULL;
+        }
+        if (pthread_mutex_unlock(args->screenRenderMutex)) {
+            perror("render loop failed to unlock mutex");
+            args->exitStatus = 1;
+            return NULL;
+        }
+        usleep(us);
+    }
+}
+
+// Decide the final state of a test from the runs it has done, and count it in its ancestors
+void settleTest(TestGraph *graph, TestLeaf *leaf) {
+    if (leaf->numRunsPassed == leaf->numRunsDone || leaf->numRunsPassed == 0) {
+        leaf->state = TestState_DONE;
+    } else {
+        leaf->state = TestState_FLAKY;
+    }
+    int passed = exitSignalIsPass(leaf->exitSignal);
+    for (int i = graph->nodes[leaf->node].parent; i >= 0; i = graph->nodes[i].parent) {
+        TestNode *node = &graph->nodes[i];
+        if (leaf->state == TestState_FLAKY) {
+            node->numFlaky += 1;
+        } else if (passed) {
+            node->numPassed += 1;
+        } else {
+            node->numFailed += 1;
+        }
+    }
+}
+
+// Record the result of one run of a test. Failed runs are retried while the test has retries
+// left. Returns 1 once the test has no more runs to do, at which point its final state is decided
+// and the counters of its ancestors are updated by walking up the parent indices.
+int finishTest(TestGraph *graph, TestLeaf *leaf, int testSignal, long long runNanos,
+               int untilFail) {
+    ++leaf->numRunsDone;
+    leaf->totalRunNanos += runNanos;
+    clock_gettime(CLOCK_MONOTONIC, &leaf->end);
+    if (exitSignalIsPass(testSignal)) {
+        ++leaf->numRunsPassed;
+        if (leaf->numRunsPassed == leaf->numRunsDone) {
+            leaf->exitSignal = testSignal;
+        }
+    } else {
+        // Keep the most recent failure around so that it can be rendered
+        leaf->exitSignal = testSignal;
+        if (untilFail) {
+            leaf->maxRuns = leaf->numRuns;
+        } else if (leaf->retriesLeft > 0) {
+            --leaf->retriesLeft;
+            ++leaf->maxRuns;
+        }
+    }
+    if (leaf->numRunsDone < leaf->maxRuns || leaf->numRunsDone < leaf->numRuns) {
+        return 0;
+    }
+    settleTest(graph, leaf);
+    return 1;
+}
+
+// Mark a test which has no runs in progress as skipped
+void skipTest(TestGraph *graph, TestLeaf *leaf) {
+    leaf->state = TestState_SKIPPED;
+    clock_gettime(CLOCK_MONOTONIC, &leaf->end);
+    for (int i = graph->nodes[leaf->node].parent; i >= 0; i = graph->nodes[i].parent) {
+        graph->nodes[i].numSkipped += 1;
+    }
+}
+
+// End a test whose remaining runs were cancelled. It keeps the result of the runs it finished, and
+// is only skipped if it never finished one.
+void endCancelledTest(TestGraph *graph, TestLeaf *leaf) {
+    if (leaf->numRunsDone > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &leaf->end);
+        settleTest(graph, leaf);
+    } else {
+        skipTest(graph, leaf);
+    }
+}
+
+// Stop a test run early: kill the running tests and cancel the runs which haven't started. Tests
+// with killed runs end once they are reaped. Returns the number of tests ended here.
+int cancelTests(TestGraph *graph, Job *jobs, int numJobs) {
+    for (int i = 0; i < numJobs; ++i) {
+        if (jobs[i].leaf != NULL && jobs[i].pid > 0 && kill(jobs[i].pid, SIGKILL)
+            && errno != ESRCH) {
+            fprintf(stderr, "failed to kill test %s: %s\n",
+                    graph->info[jobs[i].leaf->node].name, strerror(errno));
+        }
+    }
+    int numEnded = 0;
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        TestLeaf *leaf = &graph->leaves[i];
+        if (leaf->state != TestState_IDLE && leaf->state != TestState_RUNNING) {
+            continue;
+        }
+        leaf->retriesLeft = 0;
+        leaf->maxRuns = leaf->numRuns;
+        if (leaf->numRuns == leaf->numRunsDone) {
+            endCancelledTest(graph, leaf);
+            ++numEnded;
+        }
+    }
+    return numEnded;
+}
+
+// Cancel the run and stop the fixture servers once their running tests are done. Worker threads
+// finish the test they are running and then stop.
+void cancelRun(TestRun *run) {
+    __atomic_store_n(&run->cancelled, 1, __ATOMIC_RELAXED);
+    run->numDone += cancelTests(run->graph, run->jobs, run->numJobs);
+    for (int i = 0; i < run->numServers; ++i) {
+        if (run->servers[i].commandFd >= 0) {
+            close(run->servers[i].commandFd);
+            run->servers[i].commandFd = -1;
+        }
+    }
+}
+
+// Stop the outermost fixture server of a leaf once all of the tests under it are finished
+void stopFinishedServer(TestRun *run, const TestLeaf *leaf) {
+    if (leaf->server < 0) {
+        return;
+    }
+    int root = leaf->server;
+    while (run->servers[root].parent >= 0) {
+        root = run->servers[root].parent;
+    }
+    FixtureServer *server = &run->servers[root];
+    const TestNode *node = &run->graph->nodes[server->node];
+    if (server->commandFd >= 0 && TestNode_numFinished(node) == node->numTests) {
+        close(server->commandFd);
+        server->commandFd = -1;
+    }
+}
+
+long long timevalNanos(const struct timeval *time) {
+    return time->tv_sec * 1000LL * 1000 * 1000 + time->tv_usec * 1000LL;
+}
+
+// Grow an array by doubling its capacity if it's full
+int reserveTraceEntry(void **array, int *capacity, int count, size_t size) {
+    if (count < *capacity) {
+        return 0;
+    }
+    int grownCapacity = *capacity > 0 ? *capacity * 2 : 256;
+    void *grown = realloc(*array, grownCapacity * size);
+    if (grown == NULL) {
+        return -1;
+    }
+    *array = grown;
+    *capacity = grownCapacity;
+    return 0;
+}
+
+long long getTraceNanos(const Trace *trace) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return getElapsedNanos(&trace->start, &now);
+}
+
+// The track of a run in the trace, as the thread ID of the job slot, the thread of the pool, or the
+// slot of a worker that it ran in
+int getTraceTrack(const TestLeaf *leaf) {
+    if (leaf->worker >= 0) {
+        return TRACE_WORKER_TRACKS + leaf->worker * TRACE_THREAD_TRACKS + leaf->slot;
+    }
+    return leaf->threaded ? TRACE_THREAD_TRACKS + leaf->slot : 1 + leaf->slot;
+}
+
+// Add a run which just ended to the trace. The trace only misses the run if it can't grow.
+void traceRun(Trace *trace, const TestGraph *graph, const TestLeaf *leaf, int testSignal,
+              long long runNanos) {
+    if (reserveTraceEntry((void **) &trace->spans, &trace->spansCapacity, trace->numSpans,
+                          sizeof(TraceSpan))) {
+        return;
+    }
+    long long end = getTraceNanos(trace);
+    trace->spans[trace->numSpans++] = (TraceSpan) {
+            .leaf = (int) (leaf - graph->leaves),
+            .track = getTraceTrack(leaf),
+            .passed = exitSignalIsPass(testSignal),
+            .start = end - runNanos,
+            .end = end
+    };
+}
+
+// The CPU time that every thread of the runner used so far
+long long getRunnerCpuNanos() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        return 0;
+    }
+    return timevalNanos(&usage.ru_utime) + timevalNanos(&usage.ru_stime);
+}
+
+void startTrace(Trace *trace) {
+    clock_gettime(CLOCK_MONOTONIC, &trace->start);
+    trace->lastCpuNanos = getRunnerCpuNanos();
+}
+
+// Sample the runner's CPU use since the sample before, or since the trace started, at most once
+// every TRACE_SAMPLE_NANOS
+void sampleRunnerCpu(Trace *trace) {
+    long long time = getTraceNanos(trace);
+    long long last = trace->numSamples > 0 ? trace->samples[trace->numSamples - 1].time : 0;
+    if (time - last < TRACE_SAMPLE_NANOS
+        || reserveTraceEntry((void **) &trace->samples, &trace->samplesCapacity,
+                             trace->numSamples, sizeof(TraceSample))) {
+        return;
+    }
+    long long cpuNanos = getRunnerCpuNanos();
+    trace->samples[trace->numSamples++] = (TraceSample) {
+            .time = time,
+            .cpuPercent = 100.0 * (double) (cpuNanos - trace->lastCpuNanos)
+                          / (double) (time - last)
+    };
+    trace->lastCpuNanos = cpuNanos;
+}
+
+void freeTrace(Trace *trace) {
+    if (trace != NULL) {
+        free(trace->spans);
+        free(trace->samples);
+        free(trace->marks);
+        free(trace);
+    }
+}
+
+// Take the events that the runs of a leaf recorded since the last harvest out of its ring, keeping
+// them with its node and marking them on the track of the run which just ended. An event which is
+// still being written is left for a later harvest while other runs of the leaf are going, and
+// given up on otherwise, since its run ended before it was done.
+void harvestTraceEvents(TestRun *run, TestLeaf *leaf) {
+    TraceRing *ring = &run->traceRings[leaf - run->graph->leaves];
+    TestNodeInfo *info = &run->graph->info[leaf->node];
+    uint64_t next = __atomic_load_n(&ring->next, __ATOMIC_ACQUIRE);
+    uint64_t first = ring->harvested;
+    if (next - first > TRACE_RING_CAPACITY) {
+        info->numTraceEventsDropped += (long long) (next - first - TRACE_RING_CAPACITY);
+        first = next - TRACE_RING_CAPACITY;
+    }
+    if (next == first) {
+        return;
+    }
+    TraceEvent *grown = realloc(info->traceEvents,
+                                (info->numTraceEvents + (next - first)) * sizeof(TraceEvent));
+    if (grown == NULL) {
+        perror("failed to keep a test's trace events");
+        return;
+    }
+    info->traceEvents = grown;
+    int othersRunning = leaf->numRuns - leaf->numRunsDone > 1;
+    int numKept = info->numTraceEvents;
+    uint64_t position;
+    for (position = first; position < next; ++position) {
+        const TraceEvent *event = &ring->events[position % TRACE_RING_CAPACITY];
+        if (__atomic_load_n(&event->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+            if (othersRunning) {
+                break;
+            }
+            continue;
+        }
+        memcpy(&info->traceEvents[info->numTraceEvents], event, sizeof(TraceEvent));
+        // A writer which wrapped around the ring in the meantime invalidated the copy
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&event->sequence, __ATOMIC_RELAXED) == position + 1) {
+            ++info->numTraceEvents;
+        }
+    }
+    ring->harvested = position;
+    Trace *trace = run->trace;
+    for (int i = numKept; trace != NULL && i < info->numTraceEvents; ++i) {
+        if (reserveTraceEntry((void **) &trace->marks, &trace->marksCapacity, trace->numMarks,
+                              sizeof(TraceMark))) {
+            break;
+        }
+        trace->marks[trace->numMarks++] = (TraceMark) {
+                .leaf = (int) (leaf - run->graph->leaves),
+                .event = i,
+                .track = getTraceTrack(leaf)
+        };
+    }
+}
+
+int compareTraceEventNames(const void *a, const void *b) {
+    const TraceEvent *x = *(const TraceEvent **) a, *y = *(const TraceEvent **) b;
+    int order = strcmp(x->name, y->name);
+    if (order != 0) {
+        return order;
+    }
+    if (x->type != y->type) {
+        return x->type - y->type;
+    }
+    return (x > y) - (x < y);
+}
+
+// Append what the scopes and counters of a finished leaf add up to, by name, to its log
+void writeTraceSummary(const TestNodeInfo *info) {
+    FILE *file = info->outputFile;
+    if (file == NULL || (info->numTraceEvents == 0 && info->numTraceEventsDropped == 0)) {
+        return;
+    }
+    const TraceEvent **sorted = malloc((info->numTraceEvents + 1) * sizeof(TraceEvent *));
+    if (sorted == NULL || fseek(file, 0, SEEK_END) || fflush(file)) {
+        free(sorted);
+        return;
+    }
+    for (int i = 0; i < info->numTraceEvents; ++i) {
+        sorted[i] = &info->traceEvents[i];
+    }
+    qsort(sorted, info->numTraceEvents, sizeof(TraceEvent *), compareTraceEventNames);
+    int fd = fileno(file);
+    dprintf(fd, "\n--- trace ---\n");
+    for (int i = 0, end; i < info->numTraceEvents; i = end) {
+        const TraceEvent *event = sorted[i];
+        long long total = 0, min = event->value, max = event->value;
+        for (end = i; end < info->numTraceEvents && sorted[end]->type == event->type
+                      && strcmp(sorted[end]->name, event->name) == 0; ++end) {
+            long long value = sorted[end]->value;
+            total += value;
+            min = value < min ? value : min;
+            max = value > max ? value : max;
+        }
+        int count = end - i;
+        if (event->type == TraceEvent_SCOPE) {
+            dprintf(fd, "%s: %d scope%s, ", event->name, count, count == 1 ? "" : "s");
+            humanizeDuration(total, fd);
+            dprintf(fd, " total, ");
+            humanizeDuration(total / count, fd);
+            dprintf(fd, " mean, ");
+            humanizeDuration(max, fd);
+            dprintf(fd, " max\n");
+        } else {
+            dprintf(fd, "%s: %d value%s, last %lld, min %lld, max %lld\n", event->name, count,
+                    count == 1 ? "" : "s", (long long) sorted[end - 1]->value, min, max);
+        }
+    }
+    if (info->numTraceEventsDropped > 0) {
+        dprintf(fd, "%lld older events didn't fit in the ring\n", info->numTraceEventsDropped);
+    }
+    free(sorted);
+}
+
+// Record the result of one run of a leaf. Runs which were killed by a cancellation, or which never
+// started because of one, don't count.
+void recordRun(TestRun *run, TestLeaf *leaf, int started, int testSignal, long long runNanos) {
+    TestGraph *graph = run->graph;
+    if (run->trace != NULL && started) {
+        traceRun(run->trace, graph, leaf, testSignal, runNanos);
+    }
+    if (run->traceRings != NULL && started && leaf->worker < 0) {
+        harvestTraceEvents(run, leaf);
+    }
+    int finished;
+    if (run->cancelled && (!started || (WIFSIGNALED(testSignal)
+                                        && WTERMSIG(testSignal) == SIGKILL))) {
+        --leaf->numRuns;
+        finished = leaf->numRuns == leaf->numRunsDone;
+        if (finished) {
+            endCancelledTest(graph, leaf);
+        }
+    } else {
+        if (graph->info[leaf->node].virtualTime && run->skippedNanos != NULL) {
+            long long skipped = __atomic_exchange_n(&run->skippedNanos[leaf - graph->leaves], 0,
+                                                    __ATOMIC_RELAXED);
+            leaf->totalVirtualNanos += runNanos + skipped;
+        }
+        finished = finishTest(graph, leaf, testSignal, runNanos, run->options->untilFail);
+    }
+    if (finished) {
+        ++run->numDone;
+        writeTraceSummary(&graph->info[leaf->node]);
+        stopFinishedServer(run, leaf);
+    }
+    const TestNode *root = &graph->nodes[0];
+    int numFailed = root->isLeaf ? !exitSignalIsPass(leaf->exitSignal) : root->numFailed;
+    if (run->options->failFast > 0 && !run->cancelled && numFailed >= run->options->failFast) {
+        cancelRun(run);
+    }
+}
+
+// Add the resources that a forked run used to its leaf's totals
+void recordUsage(TestLeaf *leaf, const struct rusage *usage) {
+    leaf->totalUserNanos += timevalNanos(&usage->ru_utime);
+    leaf->totalSystemNanos += timevalNanos(&usage->ru_stime);
+    if (usage->ru_maxrss > leaf->maxRssKb) {
+        leaf->maxRssKb = usage->ru_maxrss;
+    }
+}
+
+// Record the end of the run in a job slot and free the slot
+int finishRun(TestRun *run, Job *job, int testSignal) {
+    TestLeaf *leaf = job->leaf;
+    if (leaf->state != TestState_RUNNING) {
+        fprintf(stderr, "got a signal from the subprocess for test %s but that test is already "
+                        "marked done\n", run->graph->info[leaf->node].name);
+        return -1;
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long long runNanos = getElapsedNanos(&job->start, &end);
+    int started = job->pid != 0;
+    job->leaf = NULL;
+    job->pid = 0;
+    --run->numRunning;
+    recordRun(run, leaf, started, testSignal, runNanos);
+    return 0;
+}
+
+// Record the tests of a batch which passed so far, moving the batch on to its next test
+int readBatchResults(TestRun *run, Job *job) {
+    BatchMessage message;
+    ssize_t size;
+    while ((size = read(job->batchFd, &message, sizeof(message))) == sizeof(message)) {
+        if (message.leaf != job->batchNext) {
+            fprintf(stderr, "batch reported test %d while test %d was in progress\n",
+                    message.leaf, job->batchNext);
+            return -1;
+        }
+        run->batchNanos += message.runNanos;
+        ++run->numBatchTests;
+        if (job->batchNext == job->batchEnd - 1) {
+            job->batchLastNanos = message.runNanos;
+        } else {
+            recordRun(run, job->leaf, 1, 0, message.runNanos);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &job->start);
+        if (++job->batchNext < job->batchEnd) {
+            job->leaf = &run->graph->leaves[job->batchNext];
+        }
+    }
+    if (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("failed to read batch results");
+        return -1;
+    }
+    return 0;
+}
+
+// Handle the exit of a batch. If it exited before the end of the batch, the test in progress
+// gets the exit and the tests after it go back in the queue. Otherwise the last test gets it, so
+// that a batch which fails on its way out doesn't count as passed.
+int finishBatch(TestRun *run, Job *job, int testSignal) {
+    if (readBatchResults(run, job)) {
+        return -1;
+    }
+    close(job->batchFd);
+    job->batchFd = -1;
+    int next = job->batchNext;
+    int end = job->batchEnd;
+    if (next == end) {
+        TestLeaf *leaf = job->leaf;
+        job->leaf = NULL;
+        job->pid = 0;
+        --run->numRunning;
+        // A cancellation kills the batch before it exits, but after its last test passed
+        if (run->cancelled && WIFSIGNALED(testSignal) && WTERMSIG(testSignal) == SIGKILL) {
+            testSignal = W_EXITCODE(EXIT_SUCCESS, 0);
+        }
+        if (!exitSignalIsPass(testSignal)) {
+            FILE *log = run->graph->info[leaf->node].outputFile;
+            fseek(log, 0, SEEK_END);
+            if (WIFSIGNALED(testSignal)) {
+                fprintf(log, "the batch was killed by %s after this test\n",
+                        strsignal(WTERMSIG(testSignal)));
+            } else {
+                fprintf(log, "the batch exited with %d after this test\n",
+                        WEXITSTATUS(testSignal));
+            }
+            fflush(log);
+        }
+        recordRun(run, leaf, 1, testSignal, job->batchLastNanos);
+        return 0;
+    }
+    if (finishRun(run, job, testSignal)) {
+        return -1;
+    }
+    for (int i = next + 1; i < end; ++i) {
+        TestLeaf *leaf = &run->graph->leaves[i];
+        --leaf->numRuns;
+        leaf->state = TestState_IDLE;
+        if (run->cancelled) {
+            endCancelledTest(run->graph, leaf);
+            ++run->numDone;
+        }
+    }
+    return 0;
+}
+
+// Handle the messages an outermost fixture server has sent so far. The pipe is closed once the
+// server and all of its nested servers have exited.
+int readServerResults(TestRun *run, FixtureServer *server) {
+    ServerMessage message;
+    ssize_t size;
+    while ((size = read(server->resultFd, &message, sizeof(message))) == sizeof(message)) {
+        if (message.type == ServerMessage_STARTED) {
+            TestLeaf *leaf = &run->graph->leaves[message.leaf];
+            Job *job = NULL;
+            for (int i = 0; i < run->numJobs && job == NULL; ++i) {
+                if (run->jobs[i].leaf == leaf && run->jobs[i].pid == 0) {
+                    job = &run->jobs[i];
+                }
+            }
+            if (job == NULL) {
+                fprintf(stderr, "fixture server started test %s which isn't waiting to start\n",
+                        run->graph->info[leaf->node].name);
+                return -1;
+            }
+            job->pid = message.pid;
+            leaf->pid = message.pid;
+            if (run->cancelled && kill(message.pid, SIGKILL) && errno != ESRCH) {
+                perror("failed to kill cancelled test");
+            }
+            continue;
+        }
+        Job *job = findJobWithPid(run->jobs, run->numJobs, message.pid);
+        if (job == NULL) {
+            fprintf(stderr, "fixture server finished a test that doesn't exist in the test suite "
+                            "(pid=%d, signal=%d), ignoring.\n", message.pid, message.exitSignal);
+            continue;
+        }
+        if (finishRun(run, job, message.exitSignal)) {
+            return -1;
+        }
+    }
+    if (size == 0) {
+        close(server->resultFd);
+        server->resultFd = -1;
+    } else if (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("failed to read fixture server results");
+        return -1;
+    }
+    return 0;
+}
+
+// Handle the exit of an outermost fixture server. Runs which it didn't finish fail with the
+// server's status, as does every later run of its tests.
+int serverExited(TestRun *run, FixtureServer *server, int status) {
+    if (server->resultFd >= 0) {
+        if (setNonBlocking(server->resultFd) || readServerResults(run, server)) {
+            return -1;
+        }
+    }
+    server->exited = 1;
+    server->exitSignal = status;
+    if (server->commandFd >= 0) {
+        close(server->commandFd);
+        server->commandFd = -1;
+    }
+    int failure = exitSignalIsPass(status) ? W_EXITCODE(EXIT_FAILURE, 0) : status;
+    int index = (int) (server - run->servers);
+    for (int i = 0; i < run->numJobs; ++i) {
+        Job *job = &run->jobs[i];
+        if (job->leaf == NULL || job->leaf->server < 0) {
+            continue;
+        }
+        int root = job->leaf->server;
+        while (run->servers[root].parent >= 0) {
+            root = run->servers[root].parent;
+        }
+        if (root != index) {
+            continue;
+        }
+        // The test can outlive a crashed server
+        if (job->pid > 0 && kill(job->pid, SIGKILL) && errno != ESRCH) {
+            perror("failed to kill test of a failed fixture server");
+        }
+        if (finishRun(run, job, failure)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Take the leaf at the bottom of a worker's own deque, or return -1 if it's empty
+int popWork(WorkDeque *deque) {
+    long bottom = __atomic_sub_fetch(&deque->bottom, 1, __ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    if (bottom < top) {
+        __atomic_store_n(&deque->bottom, top, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    int leaf = deque->leaves[bottom];
+    if (bottom > top) {
+        return leaf;
+    }
+    // The last leaf can be stolen at the same time, so the owner races the thieves for it
+    int won = __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST,
+                                          __ATOMIC_SEQ_CST);
+    __atomic_store_n(&deque->bottom, top + 1, __ATOMIC_SEQ_CST);
+    return won ? leaf : -1;
+}
+
+// Take the leaf at the top of another worker's deque. Returns -1 if it's empty, or -2 if another
+// thread took the leaf first.
+int stealWork(WorkDeque *deque) {
+    long top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+    if (top >= bottom) {
+        return -1;
+    }
+    int leaf = deque->leaves[top];
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_SEQ_CST)) {
+        return -2;
+    }
+    return leaf;
+}
+
+// Find the next leaf for a worker, stealing once its own deque is empty. Returns -1 once every
+// deque is empty.
+int findWork(ThreadPool *pool, int self) {
+    int leaf = popWork(&pool->deques[self]);
+    for (int i = 1; leaf < 0 && i < pool->numThreads; ++i) {
+        WorkDeque *victim = &pool->deques[(self + i) % pool->numThreads];
+        while ((leaf = stealWork(victim)) == -2) {}
+    }
+    return leaf;
+}
+
+void sendThreadMessage(ThreadPool *pool, ThreadMessage message) {
+    if (write(pool->resultPipe[1], &message, sizeof(message)) != sizeof(message)) {
+        perror("failed to send test result from worker thread");
+    }
+}
+
+// Run a test on this thread and return the status it would have exited with if it was forked.
+// Failed assertions and crashes jump back here instead of ending the process.
+int runThreadedTest(const TestGraph *graph, int index) {
+    sigjmp_buf failure;
+    TestC_caseFailure = &failure;
+    int jump = sigsetjmp(failure, 1);
+    if (jump == 0) {
+        runTestWithFixtures(graph, index);
+    }
+    TestC_caseFailure = NULL;
+    if (jump == 0) {
+        return W_EXITCODE(EXIT_SUCCESS, 0);
+    }
+    return jump < 0 ? W_EXITCODE(0, -jump) : W_EXITCODE(EXIT_FAILURE, 0);
+}
+
+// Do every run of a threaded leaf, deciding on repeats and retries the same way finishTest does.
+// The worker owns the log of the leaf, which failed assertions on this thread print to.
+void runThreadedLeaf(TestRun *run, int leafIndex, int self) {
+    ThreadPool *pool = run->pool;
+    const TestGraph *graph = run->graph;
+    int index = graph->leaves[leafIndex].node;
+    char path[PATH_MAX];
+    getLogPath(graph, index, run->dir, path);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "failed to create log file at %s: %s\n", path, strerror(errno));
+    }
+    run->graph->info[index].outputFile = file;
+    int maxRuns = pool->maxRuns;
+    int retriesLeft = pool->retries;
+    for (int i = 0; i < maxRuns && !__atomic_load_n(&run->cancelled, __ATOMIC_RELAXED); ++i) {
+        if (__atomic_load_n(&pool->crashed, __ATOMIC_RELAXED)) {
+            sendThreadMessage(pool, (ThreadMessage) {
+                    .type = ThreadMessage_RELEASED,
+                    .leaf = leafIndex,
+                    .thread = self
+            });
+            return;
+        }
+        if (i > 0 && file != NULL) {
+            fprintf(file, "\n--- run %d ---\n", i + 1);
+        }
+        sendThreadMessage(pool, (ThreadMessage) {
+                .type = ThreadMessage_STARTED,
+                .leaf = leafIndex,
+                .thread = self
+        });
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        TestC_testOutput = file;
+        enterTraceRing(run, leafIndex, 1);
+        int testSignal = runThreadedTest(graph, index);
+        enterTraceRing(run, -1, 1);
+        TestC_testOutput = NULL;
+        if (file != NULL) {
+            fflush(file);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (WIFSIGNALED(testSignal)) {
+            __atomic_store_n(&pool->crashed, 1, __ATOMIC_RELAXED);
+        }
+        sendThreadMessage(pool, (ThreadMessage) {
+                .type = ThreadMessage_FINISHED,
+                .leaf = leafIndex,
+                .exitSignal = testSignal,
+                .runNanos = getElapsedNanos(&start, &end)
+        });
+        if (!exitSignalIsPass(testSignal)) {
+            if (run->options->untilFail) {
+                break;
+            } else if (retriesLeft > 0) {
+                --retriesLeft;
+                ++maxRuns;
+            }
+        }
+    }
+}
+
+void *runWorkerThread(void *input) {
+    WorkerArgs *args = input;
+    ThreadPool *pool = args->run->pool;
+    int leaf;
+    while ((leaf = findWork(pool, args->self)) >= 0) {
+        if (!__atomic_load_n(&args->run->cancelled, __ATOMIC_RELAXED)) {
+            runThreadedLeaf(args->run, leaf, args->self);
+        }
+    }
+    sendThreadMessage(pool, (ThreadMessage) {.type = ThreadMessage_EXITED, .leaf = -1});
+    return NULL;
+}
+
+// Whether a leaf is in a thread-safe suite and doesn't need a process of its own
+int canRunOnThread(const TestRun *run, const TestLeaf *leaf) {
+    const TestGraph *graph = run->graph;
+    const TestNodeInfo *info = &graph->info[leaf->node];
+    if (leaf->server >= 0 || info->virtualTime || info->fuzz != NULL || run->options->checkLeaks) {
+        return 0;
+    }
+    for (int i = graph->nodes[leaf->node].parent; i >= 0; i = graph->nodes[i].parent) {
+        if (graph->info[i].threadSafe) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void freeThreadPool(TestRun *run) {
+    ThreadPool *pool = run->pool;
+    for (int i = 0; i < 2; ++i) {
+        if (pool->resultPipe[i] >= 0) {
+            close(pool->resultPipe[i]);
+        }
+    }
+    free(pool->threads);
+    free(pool->args);
+    free(pool->deques);
+    free(pool->leaves);
+    free(pool);
+    run->pool = NULL;
+}
+
+// Mark the leaves that run on threads and start the worker threads, which take them from then on.
+// The pool stays NULL if no leaf runs on a thread.
+int startThreadPool(TestRun *run, int maxRuns) {
+    TestGraph *graph = run->graph;
+    int numThreaded = 0;
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        graph->leaves[i].threaded = canRunOnThread(run, &graph->leaves[i]);
+        numThreaded += graph->leaves[i].threaded;
+    }
+    if (numThreaded == 0) {
+        return 0;
+    }
+    int numThreads = run->options->threads < numThreaded ? run->options->threads : numThreaded;
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) {
+        perror("failed to allocate thread pool");
+        return -1;
+    }
+    run->pool = pool;
+    pool->numThreads = numThreads;
+    pool->maxRuns = maxRuns;
+    pool->retries = run->options->retries;
+    pool->resultPipe[0] = pool->resultPipe[1] = -1;
+    pool->threads = calloc(numThreads, sizeof(pthread_t));
+    pool->args = calloc(numThreads, sizeof(WorkerArgs));
+    pool->deques = calloc(numThreads, sizeof(WorkDeque));
+    pool->leaves = calloc(numThreaded, sizeof(int));
+    if (pool->threads == NULL || pool->args == NULL || pool->deques == NULL
+        || pool->leaves == NULL) {
+        perror("failed to allocate thread pool");
+        freeThreadPool(run);
+        return -1;
+    }
+    if (pipe(pool->resultPipe) || setNonBlocking(pool->resultPipe[0])) {
+        perror("failed to create thread result pipe");
+        freeThreadPool(run);
+        return -1;
+    }
+    // Each deque gets a contiguous chunk of siblings, reversed so that its owner pops them in
+    // order while thieves take them from the far end
+    int *chunk = pool->leaves;
+    for (int i = 0, leaf = 0; i < numThreads; ++i) {
+        int size = numThreaded / numThreads + (i < numThreaded % numThreads);
+        for (int j = size - 1; j >= 0; --j, ++leaf) {
+            while (!graph->leaves[leaf].threaded) {
+                ++leaf;
+            }
+            chunk[j] = leaf;
+        }
+        pool->deques[i] = (WorkDeque) {.leaves = chunk, .top = 0, .bottom = size};
+        chunk += size;
+    }
+
+    struct sigaction crash = {.sa_handler = onThreadCrash};
+    sigemptyset(&crash.sa_mask);
+    for (size_t i = 0; i < NUM_THREAD_CRASH_SIGNALS; ++i) {
+        sigaction(threadCrashSignals[i], &crash, &pool->previousCrashActions[i]);
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        pool->args[i] = (WorkerArgs) {.run = run, .self = i};
+        if (pthread_create(&pool->threads[i], NULL, runWorkerThread, &pool->args[i])) {
+            perror("failed to create worker thread");
+            // The threads already started still take every leaf
+            break;
+        }
+        ++pool->numRunning;
+    }
+    if (pool->numRunning == 0) {
+        restoreCrashActions(pool);
+        freeThreadPool(run);
+        return -1;
+    }
+    pool->numThreads = pool->numRunning;
+    return 0;
+}
+
+// Wait for the worker threads, which stop after their current test once the run is cancelled
+void stopThreadPool(TestRun *run) {
+    ThreadPool *pool = run->pool;
+    if (pool == NULL) {
+        return;
+    }
+    __atomic_store_n(&run->cancelled, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < pool->numThreads; ++i) {
+        if (pthread_join(pool->threads[i], NULL)) {
+            perror("failed to join worker thread");
+        }
+    }
+    restoreCrashActions(pool);
+}
+
+// Record the runs that the worker threads started and finished
+int readThreadResults(TestRun *run) {
+    ThreadMessage message;
+    ssize_t size;
+    while ((size = read(run->pool->resultPipe[0], &message, sizeof(message)))
+           == sizeof(message)) {
+        if (message.type == ThreadMessage_EXITED) {
+            --run->pool->numRunning;
+            continue;
+        }
+        TestLeaf *leaf = &run->graph->leaves[message.leaf];
+        // A cancellation may have ended the leaf just as its worker took it
+        if (leaf->state != TestState_IDLE && leaf->state != TestState_RUNNING) {
+            continue;
+        }
+        if (message.type == ThreadMessage_RELEASED) {
+            // The job slots take the runs that are left, like those of any forked leaf
+            leaf->threaded = 0;
+        } else if (message.type == ThreadMessage_STARTED) {
+            if (leaf->numRuns == 0) {
+                leaf->state = TestState_RUNNING;
+                clock_gettime(CLOCK_MONOTONIC, &leaf->start);
+            }
+            ++leaf->numRuns;
+            leaf->slot = message.thread;
+        } else {
+            if (WIFSIGNALED(message.exitSignal) && !run->pool->reportedCrash) {
+                run->pool->reportedCrash = 1;
+                fprintf(stderr, "%s crashed on a thread, so the tests after it are forked\n",
+                        run->graph->info[leaf->node].name);
+            }
+            recordRun(run, leaf, 1, message.exitSignal, message.runNanos);
+        }
+    }
+    if (size > 0 || (size < 0 && errno != EAGAIN)) {
+        fprintf(stderr, "failed to read results from the worker threads\n");
+        return -1;
+    }
+    return 0;
+}
+
+void getTestPath(const TestGraph *graph, int index, char path[PATH_MAX]);
+
+// Start listening for workers at the address in the options
+int startCoordinator(TestRun *run) {
+    Coordinator *coordinator = calloc(1, sizeof(Coordinator));
+    if (coordinator == NULL) {
+        perror("failed to allocate coordinator");
+        return -1;
+    }
+    coordinator->listenFd = openSocket(run->options->listen, 1, coordinator->socketPath);
+    if (coordinator->listenFd < 0) {
+        fprintf(stderr, "failed to listen for workers at %s: %s\n", run->options->listen,
+                strerror(errno));
+        free(coordinator);
+        return -1;
+    }
+    if (setNonBlocking(coordinator->listenFd)) {
+        perror("failed to make the worker socket non-blocking");
+        close(coordinator->listenFd);
+        free(coordinator);
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &coordinator->lastBusy);
+    run->coordinator = coordinator;
+    return 0;
+}
+
+// Unlink the socket of the coordinator, after closeRunPipes closed it
+void freeCoordinator(TestRun *run) {
+    Coordinator *coordinator = run->coordinator;
+    if (coordinator->socketPath[0] != '\0') {
+        unlink(coordinator->socketPath);
+    }
+    for (int i = 0; i < coordinator->numWorkers; ++i) {
+        free(coordinator->workers[i].leaves);
+        freeWireBuffer(&coordinator->workers[i].input);
+        freeWireBuffer(&coordinator->workers[i].output);
+    }
+    free(coordinator->workers);
+    free(coordinator);
+    run->coordinator = NULL;
+}
+
+// Accept the workers that are waiting to connect
+int acceptWorkers(TestRun *run) {
+    Coordinator *coordinator = run->coordinator;
+    int fd;
+    while ((fd = accept(coordinator->listenFd, NULL, NULL)) >= 0) {
+        if (setNonBlocking(fd)) {
+            perror("failed to make a worker's socket non-blocking");
+            close(fd);
+            continue;
+        }
+        keepAlive(fd);
+        RemoteWorker *workers = realloc(coordinator->workers,
+                                        (coordinator->numWorkers + 1) * sizeof(RemoteWorker));
+        if (workers == NULL) {
+            perror("failed to allocate worker");
+            close(fd);
+            return -1;
+        }
+        coordinator->workers = workers;
+        workers[coordinator->numWorkers++] = (RemoteWorker) {.fd = fd};
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+        perror("failed to accept worker");
+        return -1;
+    }
+    return 0;
+}
+
+// Close the connection to a worker which disconnected or broke the protocol, and requeue the runs
+// it was in the middle of
+void dropWorker(TestRun *run, RemoteWorker *worker) {
+    close(worker->fd);
+    worker->fd = -1;
+    freeWireBuffer(&worker->input);
+    freeWireBuffer(&worker->output);
+    for (int i = 0; i < worker->numSlots; ++i) {
+        if (worker->leaves[i] < 0) {
+            continue;
+        }
+        TestLeaf *leaf = &run->graph->leaves[worker->leaves[i]];
+        worker->leaves[i] = -1;
+        --run->numRemoteRunning;
+        if (run->cancelled) {
+            recordRun(run, leaf, 0, 0, 0);
+        } else {
+            --leaf->numRuns;
+        }
+    }
+    worker->numRunning = 0;
+}
+
+// Send the runs that still need to happen to the free slots of the workers
+int startRemoteTests(TestRun *run) {
+    Coordinator *coordinator = run->coordinator;
+    for (int i = 0; i < coordinator->numWorkers; ++i) {
+        RemoteWorker *worker = &coordinator->workers[i];
+        TestLeaf *leaf;
+        while (worker->fd >= 0 && worker->numRunning < worker->numSlots
+               && (leaf = nextTestToRun(run, 1)) != NULL) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            if (prepareTestRun(run, leaf, &start)) {
+                return -1;
+            }
+            int leafIndex = (int) (leaf - run->graph->leaves);
+            int slot = 0;
+            while (worker->leaves[slot] >= 0) {
+                ++slot;
+            }
+            worker->leaves[slot] = leafIndex;
+            ++worker->numRunning;
+            ++run->numRemoteRunning;
+            leaf->worker = i;
+            leaf->slot = slot;
+
+            char payload[sizeof(uint32_t) + PATH_MAX];
+            uint32_t wireLeaf = htonl(leafIndex);
+            memcpy(payload, &wireLeaf, sizeof(wireLeaf));
+            getTestPath(run->graph, leaf->node, payload + sizeof(wireLeaf));
+            uint32_t size = sizeof(wireLeaf) + strlen(payload + sizeof(wireLeaf));
+            if (queueWireMessage(&worker->output, WireMessage_RUN, payload, size)) {
+                perror("failed to queue a test for a worker");
+                return -1;
+            }
+        }
+        if (worker->fd >= 0 && flushWireBuffer(worker->fd, &worker->output)) {
+            dropWorker(run, worker);
+        }
+    }
+    return 0;
+}
+
+// Handle a message from a worker: its hello, or the result of a run, whose log is appended to the
+// leaf's log
+int handleWorkerMessage(TestRun *run, RemoteWorker *worker, WireMessageType type,
+                        const char *payload, uint32_t size) {
+    uint32_t fields[RESULT_FIELDS] = {0};
+    memcpy(fields, payload, size < sizeof(fields) ? size : sizeof(fields));
+    for (int i = 0; i < RESULT_FIELDS; ++i) {
+        fields[i] = ntohl(fields[i]);
+    }
+    if (type == WireMessage_HELLO && worker->numSlots == 0 && fields[0] > 0
+        && fields[0] <= 4096) {
+        worker->leaves = malloc(fields[0] * sizeof(int));
+        if (worker->leaves == NULL) {
+            perror("failed to allocate worker slots");
+            return -1;
+        }
+        for (uint32_t i = 0; i < fields[0]; ++i) {
+            worker->leaves[i] = -1;
+        }
+        worker->numSlots = (int) fields[0];
+        return 0;
+    }
+    int slot = -1;
+    for (int i = 0; type == WireMessage_RESULT && size >= sizeof(fields) && i < worker->numSlots;
+         ++i) {
+        if (worker->leaves[i] == (int) fields[0]) {
+            slot = i;
+        }
+    }
+    if (slot < 0) {
+        fprintf(stderr, "got an unexpected message from a worker, disconnecting it\n");
+        dropWorker(run, worker);
+        return 0;
+    }
+    TestLeaf *leaf = &run->graph->leaves[fields[0]];
+    FILE *log = run->graph->info[leaf->node].outputFile;
+    fwrite(payload + sizeof(fields), 1, size - sizeof(fields), log);
+    fflush(log);
+    worker->leaves[slot] = -1;
+    --worker->numRunning;
+    --run->numRemoteRunning;
+    long long runNanos = (long long) ((uint64_t) fields[2] << 32 | fields[3]);
+    recordRun(run, leaf, 1, (int) fields[1], runNanos);
+    return 0;
+}
+
+// Read what a worker sent and handle the messages which arrived completely. A worker which
+// disconnected or broke the protocol is dropped.
+int readWorkerMessages(TestRun *run, RemoteWorker *worker) {
+    WireBuffer *input = &worker->input;
+    if (fillWireBuffer(worker->fd, input)) {
+        dropWorker(run, worker);
+        return 0;
+    }
+    size_t offset = 0;
+    uint32_t header[2];
+    while (worker->fd >= 0 && input->size - offset >= sizeof(header)) {
+        memcpy(header, input->data + offset, sizeof(header));
+        uint32_t size = ntohl(header[0]);
+        if (size > MAX_REMOTE_LOG + RESULT_FIELDS * sizeof(uint32_t)) {
+            fprintf(stderr, "got a message of %u bytes from a worker\n", size);
+            dropWorker(run, worker);
+            return 0;
+        }
+        if (input->size - offset - sizeof(header) < size) {
+            break;
+        }
+        const char *payload = input->data + offset + sizeof(header);
+        offset += sizeof(header) + size;
+        if (handleWorkerMessage(run, worker, ntohl(header[1]), payload, size)) {
+            return -1;
+        }
+    }
+    if (worker->fd >= 0) {
+        consumeWireBuffer(input, offset);
+    }
+    return 0;
+}
+
+int lockRender(TestRun *run) {
+    if (run->renderMutex != NULL && pthread_mutex_lock(run->renderMutex)) {
+        perror("wait loop failed to lock mutex");
+        return -1;
+    }
+    return 0;
+}
+
+int unlockRender(TestRun *run) {
+    if (run->renderMutex != NULL && pthread_mutex_unlock(run->renderMutex)) {
+        perror("wait loop failed to unlock mutex");
+        return -1;
+    }
+    return 0;
+}
+
+static const char *const loadResources[NUM_LOAD_RESOURCES] = {"cpu", "memory", "io"};
+// Above any of these percents of stalled time, a test slot is taken away, and below all of them,
+// one is added back. Some CPU pressure is normal with every core busy, but stalls on memory mean
+// reclaim or swapping, which only get worse with more tests.
+static const double lowerLoadAbove[NUM_LOAD_RESOURCES] = {40, 5, 20};
+static const double raiseLoadBelow[NUM_LOAD_RESOURCES] = {10, 1, 5};
+
+// Read the `some` line of a pressure file: the percent of the last 10 seconds that some tasks
+// stalled, and the total microseconds that they ever did. Returns -1 if it isn't there.
+int readPressure(const char *dir, const char *resource, double *recent, long long *totalMicros) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, resource);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    int numRead = fscanf(file, "some avg10=%lf avg60=%*f avg300=%*f total=%lld", recent,
+                         totalMicros);
+    fclose(file);
+    return numRead == 2 ? 0 : -1;
+}
+
+// Without pressure stall information, CPU pressure is the share of runnable tasks, which
+// /proc/loadavg counts, that there are no CPUs for
+double getRunnableExcess() {
+    FILE *file = fopen("/proc/loadavg", "r");
+    int runnable = 0;
+    if (file != NULL) {
+        if (fscanf(file, "%*f %*f %*f %d", &runnable) != 1) {
+            runnable = 0;
+        }
+        fclose(file);
+    }
+    int numCpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    return runnable > numCpus ? 100.0 * (runnable - numCpus) / runnable : 0;
+}
+
+// Without pressure stall information, memory pressure rises from 0 to 100 as the memory available
+// goes from a tenth of the total to nothing
+double getMemoryShortage() {
+    FILE *file = fopen("/proc/meminfo", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char line[256];
+    long long total = 0, available = -1;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        sscanf(line, "MemTotal: %lld", &total);
+        sscanf(line, "MemAvailable: %lld", &available);
+    }
+    fclose(file);
+    if (total <= 0 || available < 0 || available * 10 >= total) {
+        return 0;
+    }
+    return 100.0 * (1 - available * 10.0 / total);
+}
+
+// Read how much each resource was under pressure since the reading before, elapsedNanos ago, or in
+// the last 10 seconds at the first reading, and in the last 10 seconds to recent
+void readLoad(Concurrency *concurrency, long long elapsedNanos,
+              double pressure[NUM_LOAD_RESOURCES], double recent[NUM_LOAD_RESOURCES]) {
+    for (int i = 0; i < NUM_LOAD_RESOURCES; ++i) {
+        long long totalMicros;
+        if (readPressure(concurrency->pressureDir, loadResources[i], &recent[i], &totalMicros)) {
+            recent[i] = i == 0 ? getRunnableExcess() : i == 1 ? getMemoryShortage() : 0;
+            pressure[i] = recent[i];
+            continue;
+        }
+        long long previous = concurrency->stallMicros[i];
+        pressure[i] = previous < 0 || elapsedNanos <= 0 ? recent[i]
+                      : 100.0 * (double) (totalMicros - previous) * 1000 / (double) elapsedNanos;
+        concurrency->stallMicros[i] = totalMicros;
+    }
+}
+
+// Take test slots away while the machine is under pressure, and add them back one at a time while
+// it isn't and every slot is busy, at most once every ADAPT_INTERVAL_NANOS. A slot is only added
+// back once the last 10 seconds were quiet too, so that the limit doesn't swing back and forth.
+void adaptConcurrency(TestRun *run) {
+    Concurrency *concurrency = run->concurrency;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long time = getElapsedNanos(&concurrency->start, &now);
+    long long last = concurrency->numSamples > 0
+                     ? concurrency->samples[concurrency->numSamples - 1].time : 0;
+    if ((concurrency->numSamples > 0 && time - last < ADAPT_INTERVAL_NANOS)
+        || reserveTraceEntry((void **) &concurrency->samples, &concurrency->samplesCapacity,
+                             concurrency->numSamples, sizeof(ConcurrencySample))) {
+        return;
+    }
+    ConcurrencySample *sample = &concurrency->samples[concurrency->numSamples++];
+    double recent[NUM_LOAD_RESOURCES];
+    readLoad(concurrency, time - last, sample->pressure, recent);
+    int overloaded = 0, quiet = 1;
+    for (int i = 0; i < NUM_LOAD_RESOURCES; ++i) {
+        overloaded |= sample->pressure[i] > lowerLoadAbove[i];
+        quiet &= sample->pressure[i] < raiseLoadBelow[i] && recent[i] < raiseLoadBelow[i];
+    }
+    int minJobs = run->options->minJobs < 1 ? 1 : run->options->minJobs;
+    if (minJobs > run->numJobs) {
+        minJobs = run->numJobs;
+    }
+    if (overloaded) {
+        int step = run->jobLimit / 4 > 1 ? run->jobLimit / 4 : 1;
+        run->jobLimit = run->jobLimit - step > minJobs ? run->jobLimit - step : minJobs;
+    } else if (quiet && run->numRunning >= run->jobLimit && run->jobLimit < run->numJobs) {
+        ++run->jobLimit;
+    }
+    sample->time = time;
+    sample->limit = run->jobLimit;
+    sample->running = run->numRunning;
+}
+
+// How long the event loop may wait before the load should be read again, or -1 if it isn't read
+int getAdaptTimeoutMillis(const TestRun *run) {
+    const Concurrency *concurrency = run->concurrency;
+    if (concurrency == NULL || concurrency->numSamples == 0) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long next = concurrency->samples[concurrency->numSamples - 1].time + ADAPT_INTERVAL_NANOS;
+    long long remaining = next - getElapsedNanos(&concurrency->start, &now);
+    return remaining > 0 ? (int) (remaining / (1000 * 1000)) + 1 : 0;
+}
+
+// How long a coordinator which has nothing left to do but wait for workers may keep waiting for
+// one to connect, 0 once it shouldn't, or -1 if it isn't waiting
+int getWorkerTimeoutMillis(TestRun *run) {
+    Coordinator *coordinator = run->coordinator;
+    if (coordinator == NULL) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int busy = run->numRunning > 0 || (run->pool != NULL && run->pool->numRunning > 0)
+               || run->numDone == run->graph->numLeaves;
+    for (int i = 0; !busy && i < coordinator->numWorkers; ++i) {
+        busy = coordinator->workers[i].fd >= 0;
+    }
+    if (busy) {
+        coordinator->lastBusy = now;
+        return -1;
+    }
+    int timeoutSeconds = run->options->workerTimeout > 0 ? run->options->workerTimeout : 60;
+    long long remaining = timeoutSeconds * 1000LL * 1000 * 1000
+                          - getElapsedNanos(&coordinator->lastBusy, &now);
+    return remaining > 0 ? (int) (remaining / (1000 * 1000)) + 1 : 0;
+}
+
+// How long the event loop may wait for events before it has something else to do
+int getWaitTimeoutMillis(TestRun *run) {
+    int adaptTimeout = getAdaptTimeoutMillis(run);
+    int workerTimeout = getWorkerTimeoutMillis(run);
+    if (adaptTimeout < 0 || workerTimeout < 0) {
+        return adaptTimeout > workerTimeout ? adaptTimeout : workerTimeout;
+    }
+    return adaptTimeout < workerTimeout ? adaptTimeout : workerTimeout;
+}
+
+// Write every reading of the load to concurrency.txt in the run's log directory, as tab-separated
+// columns, and print how the limit on running tests changed over the run
+int writeConcurrency(const Concurrency *concurrency, const char *dir) {
+    if (concurrency->numSamples == 0) {
+        return 0;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/concurrency.txt", dir);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(file, "seconds\tlimit\trunning\tcpu\tmemory\tio\n");
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long end = getElapsedNanos(&concurrency->start, &now);
+    int lowest = INT_MAX, highest = 0, numChanges = 0;
+    double limitNanos = 0;
+    for (int i = 0; i < concurrency->numSamples; ++i) {
+        const ConcurrencySample *sample = &concurrency->samples[i];
+        fprintf(file, "%.3f\t%d\t%d\t%.1f\t%.1f\t%.1f\n", sample->time / 1e9, sample->limit,
+                sample->running, sample->pressure[0], sample->pressure[1], sample->pressure[2]);
+        long long until = i + 1 < concurrency->numSamples ? concurrency->samples[i + 1].time : end;
+        limitNanos += (double) sample->limit * (double) (until - sample->time);
+        lowest = sample->limit < lowest ? sample->limit : lowest;
+        highest = sample->limit > highest ? sample->limit : highest;
+        int previous = i > 0 ? concurrency->samples[i - 1].limit : concurrency->initialLimit;
+        numChanges += sample->limit != previous;
+    }
+    if (fclose(file)) {
+        fprintf(stderr, "failed to write %s\n", path);
+        return -1;
+    }
+    printf("Ran %d to %d tests at once, %.1f on average, after %d change%s for the load on the "
+           "machine\n", lowest, highest, end > 0 ? limitNanos / (double) end : highest,
+           numChanges, numChanges == 1 ? "" : "s");
+    return 0;
+}
+
+void freeConcurrency(Concurrency *concurrency) {
+    if (concurrency != NULL) {
+        free(concurrency->samples);
+        free(concurrency);
+    }
+}
+
+// Fill the free job slots with the runs that still need to happen
+int startQueuedTests(TestRun *run) {
+    TestLeaf *next;
+    while (run->numRunning < run->jobLimit && (next = nextTestToRun(run, 0))) {
+        Job *job = run->jobs;
+        while (job->leaf != NULL) {
+            ++job;
+        }
+        int first = (int) (next - run->graph->leaves);
+        int end = first + 1;
+        if (run->options->batch > 0 && canBatch(run->graph, next, next)) {
+            int maxEnd = first + getBatchSize(run);
+            if (maxEnd > run->graph->numLeaves) {
+                maxEnd = run->graph->numLeaves;
+            }
+            while (end < maxEnd && canBatch(run->graph, next, &run->graph->leaves[end])) {
+                ++end;
+            }
+        }
+        if (end - first > 1) {
+            run->cursor = end % run->graph->numLeaves;
+            if (startBatch(run, first, end, job)) {
+                fprintf(stderr, "failed to start tests\n");
+                return -1;
+            }
+            continue;
+        }
+        int status = startTestRun(run, next, job);
+        if (status < 0) {
+            fprintf(stderr, "failed to start tests\n");
+            return -1;
+        }
+        if (status > 0) {
+            int root = next->server;
+            while (run->servers[root].parent >= 0) {
+                root = run->servers[root].parent;
+            }
+            int serverSignal = run->servers[root].exitSignal;
+            int failure = exitSignalIsPass(serverSignal) ? W_EXITCODE(EXIT_FAILURE, 0)
+                                                         : serverSignal;
+            if (finishRun(run, job, failure)) {
+                return -1;
+            }
+        }
+    }
+    return run->coordinator != NULL ? startRemoteTests(run) : 0;
+}
+
+// Reap the children of the run which have exited: forked tests, batches and outermost fixture
+// servers. Only their pids are waited for, so the other children of the process, such as the ones
+// that a caller of TestC_run or a popen started, are left to whoever started them.
+int reapChildren(TestRun *run) {
+    int testSignal;
+    struct rusage usage;
+    for (int i = 0; i < run->numJobs; ++i) {
+        Job *job = &run->jobs[i];
+        // Tests of fixture servers are the servers' children
+        if (job->leaf == NULL || job->pid <= 0
+            || (job->batchFd < 0 && job->leaf->server >= 0)
+            || wait4(job->pid, &testSignal, WNOHANG, &usage) <= 0) {
+            continue;
+        }
+        if (job->batchFd >= 0) {
+            if (finishBatch(run, job, testSignal)) {
+                return -1;
+            }
+            continue;
+        }
+        recordUsage(job->leaf, &usage);
+        if (finishRun(run, job, testSignal)) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < run->numServers; ++i) {
+        FixtureServer *server = &run->servers[i];
+        if (server->parent < 0 && server->pid > 0 && !server->exited
+            && waitpid(server->pid, &testSignal, WNOHANG) > 0
+            && serverExited(run, server, testSignal)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Block until a child process exits or a fixture server sends results, then update the graph
+int waitForEvents(TestRun *run) {
+    Coordinator *coordinator = run->coordinator;
+    int numFds = run->numServers + run->numJobs + 2;
+    if (coordinator != NULL && numFds + 1 + coordinator->numWorkers > run->numPollFds) {
+        int capacity = (numFds + 1 + coordinator->numWorkers) * 2;
+        struct pollfd *grown = realloc(run->pollFds, capacity * sizeof(struct pollfd));
+        if (grown == NULL) {
+            perror("failed to grow the polled file descriptors");
+            return -1;
+        }
+        run->pollFds = grown;
+        run->numPollFds = capacity;
+    }
+    struct pollfd *fds = run->pollFds;
+    fds[0] = (struct pollfd) {.fd = run->childSignalPipe[0], .events = POLLIN};
+    for (int i = 0; i < run->numServers; ++i) {
+        fds[i + 1] = (struct pollfd) {.fd = run->servers[i].resultFd, .events = POLLIN};
+    }
+    struct pollfd *batchFds = fds + run->numServers + 1;
+    for (int i = 0; i < run->numJobs; ++i) {
+        batchFds[i] = (struct pollfd) {.fd = run->jobs[i].batchFd, .events = POLLIN};
+    }
+    struct pollfd *threadFd = batchFds + run->numJobs;
+    *threadFd = (struct pollfd) {
+            .fd = run->pool != NULL ? run->pool->resultPipe[0] : -1,
+            .events = POLLIN
+    };
+    // The coordinator's socket is followed by one for each worker that ever connected
+    struct pollfd *coordinatorFd = threadFd + 1;
+    struct pollfd *workerFds = coordinatorFd + 1;
+    if (coordinator != NULL) {
+        *coordinatorFd = (struct pollfd) {.fd = coordinator->listenFd, .events = POLLIN};
+        for (int i = 0; i < coordinator->numWorkers; ++i) {
+            RemoteWorker *worker = &coordinator->workers[i];
+            workerFds[i] = (struct pollfd) {
+                    .fd = worker->fd,
+                    .events = POLLIN | (worker->output.size > 0 ? POLLOUT : 0)
+            };
+        }
+        numFds += 1 + coordinator->numWorkers;
+    }
+    if (poll(fds, numFds, getWaitTimeoutMillis(run)) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        fprintf(stderr, "failed to wait with %d/%d done: %s\n", run->numDone,
+                run->graph->numLeaves, strerror(errno));
+        return -1;
+    }
+    if (lockRender(run)) {
+        return -1;
+    }
+    for (int i = 0; i < run->numServers; ++i) {
+        if (fds[i + 1].revents && readServerResults(run, &run->servers[i])) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < run->numJobs; ++i) {
+        if (batchFds[i].revents && run->jobs[i].batchFd >= 0
+            && readBatchResults(run, &run->jobs[i])) {
+            return -1;
+        }
+    }
+    if (threadFd->revents && readThreadResults(run)) {
+        return -1;
+    }
+    if (coordinator != NULL) {
+        // Workers which connected during the poll aren't in workerFds yet
+        int numWorkers = coordinator->numWorkers;
+        for (int i = 0; i < numWorkers; ++i) {
+            RemoteWorker *worker = &coordinator->workers[i];
+            if ((workerFds[i].revents & POLLOUT) && worker->fd >= 0
+                && flushWireBuffer(worker->fd, &worker->output)) {
+                dropWorker(run, worker);
+            }
+            if ((workerFds[i].revents & ~POLLOUT) && worker->fd >= 0
+                && readWorkerMessages(run, worker)) {
+                return -1;
+            }
+        }
+        if (coordinatorFd->revents && acceptWorkers(run)) {
+            return -1;
+        }
+    }
+    if (fds[0].revents) {
+        drainChildSignals(run->childSignalPipe[0]);
+        if (reapChildren(run)) {
+            return -1;
+        }
+    }
+    if (renderRootTestNode(run->graph, stdout)) {
+        fprintf(stderr, "failed to render graph in wait loop\n");
+        return -1;
+    }
+    return unlockRender(run);
+}
+
+// Whether an outermost fixture server was started and hasn't been reaped yet
+int serversRunning(const TestRun *run) {
+    for (int i = 0; i < run->numServers; ++i) {
+        if (run->servers[i].pid != 0 && !run->servers[i].exited && run->servers[i].parent < 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Give every suite with suite setup or teardown hooks a fixture server, and point every leaf at
+// the server of the innermost such suite it is in. Returns the number of servers, or -1.
+int assignFixtureServers(TestGraph *graph, FixtureServer **result) {
+    int *serverOfNode = malloc(graph->numNodes * sizeof(int));
+    FixtureServer *servers = malloc(graph->numNodes * sizeof(FixtureServer));
+    if (serverOfNode == NULL || servers == NULL) {
+        fprintf(stderr, "failed to allocate fixture servers\n");
+        free(serverOfNode);
+        free(servers);
+        return -1;
+    }
+    int numServers = 0;
+    for (int i = 0; i < graph->numNodes; ++i) {
+        TestNode *node = &graph->nodes[i];
+        int parentServer = node->parent < 0 ? -1 : serverOfNode[node->parent];
+        serverOfNode[i] = parentServer;
+        if (node->isLeaf) {
+            graph->leaves[node->leaf].server = parentServer;
+        } else if (hasSuiteHooks(graph->info[i].fixture)) {
+            servers[numServers] = (FixtureServer) {
+                    .node = i,
+                    .parent = parentServer,
+                    .commandFd = -1,
+                    .resultFd = -1,
+            };
+            serverOfNode[i] = numServers++;
+        }
+    }
+    free(serverOfNode);
+    *result = servers;
+    return numServers;
+}
+
+// This method is useful when you want to debug a specific test since follow-fork-mode is
+// GDB-specific, IDE specific, and it is not suited to parallel execution. Suite setups run when
+// the walk enters a suite and suite teardowns when it leaves it.
+void TestC_runNoFork(TestGraph *graph) {
+    int *suites = malloc(graph->numNodes * sizeof(int));
+    int numSuites = 0;
+    for (int i = 0; i < graph->numNodes; ++i) {
+        while (numSuites > 0 && graph->nodes[suites[numSuites - 1]].end <= i) {
+            const TestFixture *fixture = graph->info[suites[--numSuites]].fixture;
+            if (fixture->suiteTeardown != NULL) {
+                fixture->suiteTeardown();
+            }
+        }
+        TestNode *node = &graph->nodes[i];
+        if (!node->isLeaf) {
+            const TestFixture *fixture = graph->info[i].fixture;
+            if (hasSuiteHooks(fixture)) {
+                if (fixture->suiteSetup != NULL) {
+                    fixture->suiteSetup();
+                }
+                suites[numSuites++] = i;
+            }
+            continue;
+        }
+        TestLeaf *leaf = &graph->leaves[node->leaf];
+        printf(RUNNING_TEST_COLOR "Testing %s\n" RESET_COLOR, graph->info[i].name);
+        int virtualTime = graph->info[i].virtualTime && VirtualTime_start != NULL;
+        long long skippedNanos = 0;
+        if (virtualTime) {
+            VirtualTime_start(&skippedNanos);
+        }
+        runTestWithFixtures(graph, i);
+        if (virtualTime) {
+            VirtualTime_stop();
+            leaf->totalVirtualNanos += skippedNanos;
+        }
+        finishTest(graph, leaf, 0, 0, 0);
+    }
+    while (numSuites > 0) {
+        const TestFixture *fixture = graph->info[suites[--numSuites]].fixture;
+        if (fixture->suiteTeardown != NULL) {
+            fixture->suiteTeardown();
+        }
+    }
+    free(suites);
+}
+
+// Utility method which is so far only used in the test for this file. Each path segment is
+// matched against the children of the previous match by hopping from sibling to sibling.
+TestNode *findNode(TestGraph *graph, const char *path) {
+    int index = 0;
+    int end = graph->numNodes;
+    while (index < end) {
+        const char *name = graph->info[index].name;
+        size_t nameLength = strlen(name);
+        if (strncmp(name, path, nameLength) != 0
+            || (path[nameLength] != '\0' && path[nameLength] != '.')) {
+            index = graph->nodes[index].end;
+            continue;
+        }
+        if (path[nameLength] == '\0') {
+            return &graph->nodes[index];
+        }
+        path += nameLength + 1;
+        end = graph->nodes[index].end;
+        ++index;
+    }
+    return NULL;
+}
+
+TestLeaf *findLeaf(TestGraph *graph, const char *path) {
+    TestNode *node = findNode(graph, path);
+    if (node == NULL || !node->isLeaf) {
+        return NULL;
+    }
+    return &graph->leaves[node->leaf];
+}
+
+// When the test runner finishes, there probably be a lot of empty files which were created during
+// the test, but never written to. This method cleans up all those empty files, and then the
+// directories which are left empty. Descendants come after their ancestors in pre-order, so going
+// through the nodes backwards empties a directory before it is removed.
+int deleteEmptyLogs(TestGraph *graph, const char *dir) {
+    char path[PATH_MAX];
+    for (int i = graph->numNodes - 1; i >= 0; --i) {
+        getLogPath(graph, i, dir, path);
+        if (!graph->nodes[i].isLeaf) {
+            if (hasSuiteHooks(graph->info[i].fixture)) {
+                char fixturePath[PATH_MAX];
+                strcpy(fixturePath, path);
+                strcat(fixturePath, "/fixture.txt");
+                struct stat fixtureStat;
+                if (stat(fixturePath, &fixtureStat) == 0 && fixtureStat.st_size == 0
+                    && remove(fixturePath) != 0) {
+                    perror("failed to delete fixture output file");
+                    return 1;
+                }
+            }
+            // The root's directory is kept even if it's empty
+            if (i > 0 && rmdir(path) != 0 && errno != ENOTEMPTY && errno != EEXIST) {
+                perror("failed to delete test log subdirectory");
+                return 1;
+            }
+            continue;
+        }
+        FILE *outputFile = graph->info[i].outputFile;
+        if (outputFile == NULL) {
+            // The test never ran, so it has no log file
+            continue;
+        }
+        if (fseek(outputFile, 0, SEEK_END) != 0) {
+            fprintf(stderr, "failed to seek end of output %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        long size = ftell(outputFile);
+        if (fclose(outputFile) != 0) {
+            fprintf(stderr, "failed to close %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        graph->info[i].outputFile = NULL;
+        if (size == 0 && remove(path) != 0) {
+            perror("failed to delete node's output file");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Write the path of the directory that runs put their logs in to dir. It's options->dir, or
+// test_logs in the working directory by default.
+void getLogRoot(const TestRunOptions *options, char dir[PATH_MAX]) {
+    if (options->dir == NULL) {
+        getcwd(dir, PATH_MAX - 1);
+        removeTrailingSlash(dir);
+        strcat(dir, "/test_logs");
+    } else {
+        strcpy(dir, options->dir);
+    }
+}
+
+// Create the timestamped directory that this run's logs go in, and point the "latest" symlink at
+// it. The path of the directory is written to dir.
+int createRunDirectory(const TestRunOptions *options, char dir[PATH_MAX]) {
+    getLogRoot(options, dir);
+    if (options->dir == NULL && mkdir(dir, 0777) < 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create root test logs directory at %s: %s\n", dir,
+                strerror(errno));
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long micros = start.tv_sec * 1000 * 1000 + start.tv_nsec / 1000;
+    size_t rootDirPathLength = strlen(dir);
+    sprintf(dir + rootDirPathLength, "/%016ld", micros);
+    if (mkdir(dir, 0777) < 0) {
+        fprintf(stderr, "failed to create test run directory for this run at %s: %s", dir,
+                strerror
+                        (errno));
+        return 1;
+    }
+    char rootDirAbsolutePath[PATH_MAX];
+    dir[rootDirPathLength] = '\0';
+    if (realpath(dir, rootDirAbsolutePath) == NULL) {
+        fprintf(stderr, "failed to convert directory to absolute path %s: %s\n", dir,
+                strerror(errno));
+        return -1;
+    }
+    dir[rootDirPathLength] = '/';
+
+    char symlinkTargetPath[PATH_MAX];
+    strcpy(symlinkTargetPath, rootDirAbsolutePath);
+    strcat(symlinkTargetPath, dir + rootDirPathLength);
+    char symlinkLabelPath[PATH_MAX];
+    strcpy(symlinkLabelPath, rootDirAbsolutePath);
+    strcat(symlinkLabelPath, "/latest");
+    remove(symlinkLabelPath);
+    if (symlink(symlinkTargetPath, symlinkLabelPath)) {
+        fprintf(stderr, "failed to symlink target=%s, link_name=%s: %s\n", symlinkTargetPath,
+                symlinkLabelPath, strerror(errno));
+        return -1;
+    }
+    printf("running suite and outputting logs to %s\n", dir);
+    return 0;
+}
+
+// Write the period-separated path of a node e.g. `all.http.parser.badRequest` to path
+void getTestPath(const TestGraph *graph, int index, char path[PATH_MAX]) {
+    int parent = graph->nodes[index].parent;
+    if (parent < 0) {
+        strcpy(path, graph->info[index].name);
+        return;
+    }
+    getTestPath(graph, parent, path);
+    strcat(path, ".");
+    strcat(path, graph->info[index].name);
+}
+
+// Print the path of every selected test, one per line, without running anything
+void listTests(const TestGraph *graph) {
+    char path[PATH_MAX];
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        getTestPath(graph, graph->leaves[i].node, path);
+        printf("%s\n", path);
+    }
+}
+
+void unmapSharedCounters(TestRun *run, size_t skippedNanosSize) {
+    if (run->skippedNanos != NULL) {
+        munmap(run->skippedNanos, skippedNanosSize);
+    }
+    if (run->traceRings != NULL) {
+        munmap(run->traceRings, run->graph->numLeaves * sizeof(TraceRing));
+    }
+}
+
+// The history of every run lives in two append-only files in the root test logs directory.
+// history.paths has one test path per line, and a test's ID is the line its path is on.
+// history.results starts with HISTORY_MAGIC and is followed by fixed-size records, so that it can
+// be mapped and scanned as an array.
+#define HISTORY_MAGIC "TESTCH01"
+// How much the median duration has to change across a shift for the history to point it out
+#define HISTORY_SHIFT 1.25
+
+// One test's result in one run
+typedef struct {
+    uint32_t path;
+    // A TestState
+    int32_t state;
+    int32_t exitSignal;
+    uint32_t numRuns;
+    uint32_t numRunsPassed;
+    uint32_t reserved;
+    // When the run started, in microseconds since the epoch
+    int64_t time;
+    // The first 16 hex digits of the commit the tests were built from, or 0
+    uint64_t commit;
+    // The means over the test's runs
+    int64_t nanos;
+    int64_t userNanos;
+    int64_t systemNanos;
+    int64_t maxRssKb;
+} HistoryRecord;
+
+typedef struct {
+    const char *path;
+    size_t length;
+    uint32_t id;
+} HistoryPath;
+
+// git's HEAD in the working directory, which is only asked for once per process
+static char gitHead[64];
+static int foundGitHead;
+
+// The commit the tests were built from, from TESTC_COMMIT or git's HEAD in the working directory
+uint64_t getCommitFingerprint() {
+    const char *commit = getenv("TESTC_COMMIT");
+    if (commit == NULL) {
+        if (!foundGitHead) {
+            foundGitHead = 1;
+            FILE *git = popen("git rev-parse HEAD 2>/dev/null", "r");
+            if (git != NULL) {
+                if (fgets(gitHead, sizeof(gitHead), git) == NULL) {
+                    gitHead[0] = '\0';
+                }
+                pclose(git);
+            }
+        }
+        commit = gitHead;
+    }
+    char digits[17];
+    snprintf(digits, sizeof(digits), "%.16s", commit);
+    return strtoull(digits, NULL, 16);
+}
+
+size_t hashPath(const char *path, size_t length) {
+    // FNV-1a
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char) path[i]) * 0x100000001b3;
+    }
+    return (size_t) hash;
+}
+
+// Find the ID of every leaf's path in the paths of the history, which are mapped at paths. The
+// leaves which aren't there yet get UINT32_MAX, or the next free IDs if they're appended to
+// pathsFd. Returns the number of IDs in use, or -1 on errors.
+int64_t findPathIds(const TestGraph *graph, const char *paths, size_t size, int pathsFd,
+                    uint32_t *ids) {
+    uint32_t numPaths = 0;
+    for (size_t i = 0; i < size; ++i) {
+        numPaths += paths[i] == '\n';
+    }
+    size_t capacity = 16;
+    while (capacity < 2 * (size_t) numPaths) {
+        capacity *= 2;
+    }
+    HistoryPath *table = calloc(capacity, sizeof(HistoryPath));
+    if (table == NULL) {
+        perror("failed to allocate history paths");
+        return -1;
+    }
+    for (size_t start = 0, id = 0; start < size; ++id) {
+        const char *end = memchr(paths + start, '\n', size - start);
+        if (end == NULL) {
+            break;
+        }
+        size_t length = end - (paths + start);
+        size_t slot = hashPath(paths + start, length) & (capacity - 1);
+        while (table[slot].path != NULL) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        table[slot] = (HistoryPath) {.path = paths + start, .length = length, .id = id};
+        start += length + 1;
+    }
+    char path[PATH_MAX];
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        getTestPath(graph, graph->leaves[i].node, path);
+        size_t length = strlen(path);
+        ids[i] = UINT32_MAX;
+        for (size_t slot = hashPath(path, length) & (capacity - 1); table[slot].path != NULL;
+             slot = (slot + 1) & (capacity - 1)) {
+            if (table[slot].length == length && memcmp(table[slot].path, path, length) == 0) {
+                ids[i] = table[slot].id;
+                break;
+            }
+        }
+        // Paths are unique within a graph, so a new one can't come up again
+        if (ids[i] == UINT32_MAX && pathsFd >= 0) {
+            path[length] = '\n';
+            if (writeFully(pathsFd, path, length + 1)) {
+                perror("failed to append to the history paths");
+                free(table);
                 return -1;
             }
-            printf("%s already exists\n", path);
-        }
-        for (int i = 0; i < node->numChildren; ++i) {
-            TestNode *child = node->children[i];
-            if (startTestNode(child, path)) {
-                fprintf(stderr, "%s failed to start graph for %s\n", node->name,
-                        child->name);
-                return -1;
+            ids[i] = numPaths++;
+        }
+    }
+    free(table);
+    return numPaths;
+}
+
+// Map the whole of a file for reading, or set *data to NULL if it's empty
+int mapFile(int fd, const char **data, size_t *size) {
+    struct stat info;
+    if (fstat(fd, &info)) {
+        return -1;
+    }
+    *size = info.st_size;
+    *data = NULL;
+    if (*size == 0) {
+        return 0;
+    }
+    void *mapped = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        return -1;
+    }
+    *data = mapped;
+    return 0;
+}
+
+int openHistory(const char *root, const char *name, int flags, int *fd) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    *fd = open(path, flags, 0666);
+    return *fd < 0 ? -1 : 0;
+}
+
+// Append a record for every test of a finished run to the history under root. Runs which share a
+// root take turns, so that two of them can't give the same new path different IDs.
+int appendHistory(const TestGraph *graph, const char *root, long long startMicros) {
+    int pathsFd = -1, resultsFd = -1;
+    const char *paths = NULL;
+    size_t pathsSize = 0;
+    uint32_t *ids = malloc((graph->numLeaves + 1) * sizeof(uint32_t));
+    HistoryRecord *records = calloc(graph->numLeaves + 1, sizeof(HistoryRecord));
+    int status = -1;
+    if (ids == NULL || records == NULL
+        || openHistory(root, "history.paths", O_RDWR | O_CREAT | O_APPEND, &pathsFd)
+        || openHistory(root, "history.results", O_RDWR | O_CREAT | O_APPEND, &resultsFd)
+        || flock(pathsFd, LOCK_EX) || mapFile(pathsFd, &paths, &pathsSize)
+        || findPathIds(graph, paths, pathsSize, pathsFd, ids) < 0) {
+        fprintf(stderr, "failed to add this run to the history at %s: %s\n", root,
+                strerror(errno));
+        goto done;
+    }
+    struct stat info;
+    if (fstat(resultsFd, &info) == 0 && info.st_size == 0
+        && writeFully(resultsFd, HISTORY_MAGIC, strlen(HISTORY_MAGIC))) {
+        perror("failed to start the history");
+        goto done;
+    }
+    uint64_t commit = getCommitFingerprint();
+    int numRecords = 0;
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        const TestLeaf *leaf = &graph->leaves[i];
+        if (leaf->state == TestState_IDLE || leaf->state == TestState_RUNNING) {
+            continue;
+        }
+        int numRuns = leaf->numRunsDone > 0 ? leaf->numRunsDone : 1;
+        records[numRecords++] = (HistoryRecord) {
+                .path = ids[i],
+                .state = leaf->state,
+                .exitSignal = leaf->exitSignal,
+                .numRuns = leaf->numRunsDone,
+                .numRunsPassed = leaf->numRunsPassed,
+                .time = startMicros,
+                .commit = commit,
+                .nanos = leaf->totalRunNanos / numRuns,
+                .userNanos = leaf->totalUserNanos / numRuns,
+                .systemNanos = leaf->totalSystemNanos / numRuns,
+                .maxRssKb = leaf->maxRssKb,
+        };
+    }
+    if (writeFully(resultsFd, records, numRecords * sizeof(HistoryRecord))) {
+        perror("failed to append to the history");
+        goto done;
+    }
+    status = 0;
+    done:
+    if (paths != NULL) {
+        munmap((void *) paths, pathsSize);
+    }
+    if (pathsFd >= 0) {
+        close(pathsFd);
+    }
+    if (resultsFd >= 0) {
+        close(resultsFd);
+    }
+    free(ids);
+    free(records);
+    return status;
+}
+
+// Find the leaves whose last result in the history under root is a failure, writing their indexes
+// to failed in the order of the graph. Returns how many there are, which is 0 without a history.
+int findLastFailures(const TestGraph *graph, const char *root, int *failed) {
+    int pathsFd = -1, resultsFd = -1;
+    const char *paths = NULL, *results = NULL;
+    size_t pathsSize = 0, resultsSize = 0;
+    uint32_t *ids = malloc((graph->numLeaves + 1) * sizeof(uint32_t));
+    char *lastFailed = calloc(graph->numLeaves + 1, 1);
+    char *seen = calloc(graph->numLeaves + 1, 1);
+    int *leafOfId = NULL;
+    int numFailed = 0;
+    int64_t numPaths;
+    size_t headerSize = strlen(HISTORY_MAGIC);
+    if (ids == NULL || lastFailed == NULL || seen == NULL
+        || openHistory(root, "history.paths", O_RDONLY, &pathsFd)
+        || openHistory(root, "history.results", O_RDONLY, &resultsFd)
+        || mapFile(pathsFd, &paths, &pathsSize) || mapFile(resultsFd, &results, &resultsSize)
+        || (numPaths = findPathIds(graph, paths, pathsSize, -1, ids)) < 0
+        || resultsSize < headerSize || memcmp(results, HISTORY_MAGIC, headerSize) != 0
+        || (leafOfId = malloc((numPaths + 1) * sizeof(int))) == NULL) {
+        goto done;
+    }
+    int numKnown = 0;
+    for (int64_t i = 0; i < numPaths; ++i) {
+        leafOfId[i] = -1;
+    }
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        if (ids[i] != UINT32_MAX) {
+            leafOfId[ids[i]] = i;
+            ++numKnown;
+        }
+    }
+    // The newest records are at the end, so the scan stops once every known leaf turned up
+    const HistoryRecord *records = (const HistoryRecord *) (results + headerSize);
+    size_t numRecords = (resultsSize - headerSize) / sizeof(HistoryRecord);
+    for (size_t i = numRecords; i-- > 0 && numKnown > 0;) {
+        const HistoryRecord *record = &records[i];
+        int leaf = record->path < numPaths ? leafOfId[record->path] : -1;
+        if (leaf < 0 || seen[leaf]) {
+            continue;
+        }
+        seen[leaf] = 1;
+        --numKnown;
+        lastFailed[leaf] = record->state == TestState_FLAKY
+                           || (record->state == TestState_DONE
+                               && !exitSignalIsPass(record->exitSignal));
+    }
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        if (lastFailed[i]) {
+            failed[numFailed++] = i;
+        }
+    }
+    done:
+    if (paths != NULL) {
+        munmap((void *) paths, pathsSize);
+    }
+    if (results != NULL) {
+        munmap((void *) results, resultsSize);
+    }
+    if (pathsFd >= 0) {
+        close(pathsFd);
+    }
+    if (resultsFd >= 0) {
+        close(resultsFd);
+    }
+    free(ids);
+    free(lastFailed);
+    free(seen);
+    free(leafOfId);
+    return numFailed;
+}
+
+int compareNanos(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+// The value at a percentile of sorted values
+long long getPercentile(const long long *sorted, int count, int percent) {
+    return sorted[(long long) (count - 1) * percent / 100];
+}
+
+long long getMedian(const long long *nanos, int count, long long *scratch) {
+    memcpy(scratch, nanos, count * sizeof(long long));
+    qsort(scratch, count, sizeof(long long), compareNanos);
+    return getPercentile(scratch, count, 50);
+}
+
+// Find the run where a test's durations shifted the most, as the split of the runs whose means
+// on either side are furthest apart relative to how many runs they have. Returns the index of the
+// first run after the shift, or -1 if there aren't enough runs.
+int findShift(const long long *nanos, int count) {
+    if (count < 6) {
+        return -1;
+    }
+    double total = 0;
+    for (int i = 0; i < count; ++i) {
+        total += (double) nanos[i];
+    }
+    int best = -1;
+    double bestScore = 0, before = 0;
+    for (int split = 1; split < count; ++split) {
+        before += (double) nanos[split - 1];
+        if (split < 3 || count - split < 3) {
+            continue;
+        }
+        double difference = (total - before) / (count - split) - before / split;
+        double score = difference * difference * split * (count - split);
+        if (best < 0 || score > bestScore) {
+            best = split;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+// Print one test's history from its records, which are in the order they were appended. The
+// records of runs with a duration are moved to the front.
+void printTestHistory(const char *path, const HistoryRecord **records, int count, long long *nanos,
+                      long long *scratch, int fd) {
+    int numFailed = 0, numFlaky = 0, numTimed = 0;
+    long long userNanos = 0, systemNanos = 0, maxRssKb = 0;
+    for (int i = 0; i < count; ++i) {
+        const HistoryRecord *record = records[i];
+        if (record->state == TestState_SKIPPED || record->numRuns == 0) {
+            continue;
+        }
+        numFlaky += record->state == TestState_FLAKY;
+        numFailed += record->state == TestState_DONE && !exitSignalIsPass(record->exitSignal);
+        userNanos += record->userNanos;
+        systemNanos += record->systemNanos;
+        if (record->maxRssKb > maxRssKb) {
+            maxRssKb = record->maxRssKb;
+        }
+        nanos[numTimed] = record->nanos;
+        records[numTimed++] = record;
+    }
+    dprintf(fd, "%s: %d runs", path, numTimed);
+    if (numTimed == 0) {
+        dprintf(fd, "\n");
+        return;
+    }
+    dprintf(fd, ", %d failed (%.1f%%), %d flaky, p50 ", numFailed, 100.0 * numFailed / numTimed,
+            numFlaky);
+    memcpy(scratch, nanos, numTimed * sizeof(long long));
+    qsort(scratch, numTimed, sizeof(long long), compareNanos);
+    humanizeDuration(getPercentile(scratch, numTimed, 50), fd);
+    dprintf(fd, ", p95 ");
+    humanizeDuration(getPercentile(scratch, numTimed, 95), fd);
+    dprintf(fd, ", last ");
+    humanizeDuration(nanos[numTimed - 1], fd);
+    dprintf(fd, "\n  cpu ");
+    humanizeDuration(userNanos / numTimed, fd);
+    dprintf(fd, " user, ");
+    humanizeDuration(systemNanos / numTimed, fd);
+    dprintf(fd, " system, %lldKB peak memory\n", maxRssKb);
+
+    int shift = findShift(nanos, numTimed);
+    if (shift < 0) {
+        return;
+    }
+    long long before = getMedian(nanos, shift, scratch);
+    long long after = getMedian(nanos + shift, numTimed - shift, scratch);
+    if (after < before * HISTORY_SHIFT && before < after * HISTORY_SHIFT) {
+        return;
+    }
+    const HistoryRecord *first = records[shift];
+    time_t seconds = (time_t) (first->time / (1000 * 1000));
+    struct tm date;
+    char dateText[32];
+    strftime(dateText, sizeof(dateText), "%Y-%m-%d %H:%M", localtime_r(&seconds, &date));
+    dprintf(fd, "  %s since the run on %s (commit %016llx): p50 ", after > before ? "slower"
+                                                                                : "faster",
+            dateText, (unsigned long long) first->commit);
+    humanizeDuration(before, fd);
+    dprintf(fd, " before, ");
+    humanizeDuration(after, fd);
+    dprintf(fd, " since\n");
+}
+
+int TestC_history(const TestSuite *suite, TestRunOptions options, int fd) {
+    TestGraph *graph = buildSelectedGraph(suite, &options);
+    if (graph == NULL) {
+        return -1;
+    }
+    char root[PATH_MAX];
+    getLogRoot(&options, root);
+    int pathsFd = -1, resultsFd = -1;
+    const char *paths = NULL, *results = NULL;
+    size_t pathsSize = 0, resultsSize = 0;
+    uint32_t *ids = malloc((graph->numLeaves + 1) * sizeof(uint32_t));
+    int *counts = NULL;
+    const HistoryRecord **byLeaf = NULL;
+    long long *nanos = NULL, *scratch = NULL;
+    int *leafOfId = NULL;
+    int status = -1;
+    if (openHistory(root, "history.paths", O_RDONLY, &pathsFd)
+        || openHistory(root, "history.results", O_RDONLY, &resultsFd)) {
+        dprintf(fd, "no history at %s yet\n", root);
+        status = 0;
+        goto done;
+    }
+    int64_t numPaths;
+    if (ids == NULL || mapFile(pathsFd, &paths, &pathsSize)
+        || mapFile(resultsFd, &results, &resultsSize)
+        || (numPaths = findPathIds(graph, paths, pathsSize, -1, ids)) < 0) {
+        fprintf(stderr, "failed to read the history at %s: %s\n", root, strerror(errno));
+        goto done;
+    }
+    size_t headerSize = strlen(HISTORY_MAGIC);
+    if (resultsSize < headerSize || memcmp(results, HISTORY_MAGIC, headerSize) != 0) {
+        fprintf(stderr, "%s/history.results isn't a history\n", root);
+        goto done;
+    }
+    const HistoryRecord *records = (const HistoryRecord *) (results + headerSize);
+    size_t numRecords = (resultsSize - headerSize) / sizeof(HistoryRecord);
+
+    // Bucket the records by leaf in two passes over the map, keeping the order they ran in
+    leafOfId = malloc((numPaths + 1) * sizeof(int));
+    counts = calloc(graph->numLeaves + 1, sizeof(int));
+    byLeaf = malloc((numRecords + 1) * sizeof(HistoryRecord *));
+    nanos = malloc((numRecords + 1) * sizeof(long long));
+    scratch = malloc((numRecords + 1) * sizeof(long long));
+    if (leafOfId == NULL || counts == NULL || byLeaf == NULL || nanos == NULL
+        || scratch == NULL) {
+        perror("failed to allocate history");
+        goto done;
+    }
+    for (int64_t i = 0; i < numPaths; ++i) {
+        leafOfId[i] = -1;
+    }
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        if (ids[i] != UINT32_MAX) {
+            leafOfId[ids[i]] = i;
+        }
+    }
+    for (size_t i = 0; i < numRecords; ++i) {
+        if (records[i].path < numPaths && leafOfId[records[i].path] >= 0) {
+            ++counts[leafOfId[records[i].path] + 1];
+        }
+    }
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        counts[i + 1] += counts[i];
+    }
+    // counts[i] is now where the records of leaf i start, and moves along as they're placed
+    for (size_t i = 0; i < numRecords; ++i) {
+        if (records[i].path < numPaths && leafOfId[records[i].path] >= 0) {
+            byLeaf[counts[leafOfId[records[i].path]]++] = &records[i];
+        }
+    }
+    dprintf(fd, "history of %zu results at %s\n", numRecords, root);
+    char path[PATH_MAX];
+    for (int i = 0, start = 0; i < graph->numLeaves; start = counts[i++]) {
+        if (counts[i] > start) {
+            getTestPath(graph, graph->leaves[i].node, path);
+            printTestHistory(path, byLeaf + start, counts[i] - start, nanos, scratch, fd);
+        }
+    }
+    status = 0;
+    done:
+    if (paths != NULL) {
+        munmap((void *) paths, pathsSize);
+    }
+    if (results != NULL) {
+        munmap((void *) results, resultsSize);
+    }
+    if (pathsFd >= 0) {
+        close(pathsFd);
+    }
+    if (resultsFd >= 0) {
+        close(resultsFd);
+    }
+    free(ids);
+    free(leafOfId);
+    free(counts);
+    free(byLeaf);
+    free(nanos);
+    free(scratch);
+    TestGraph_free(graph);
+    return status;
+}
+
+void writeJsonString(FILE *file, const char *text) {
+    fputc('"', file);
+    for (; *text != '\0'; ++text) {
+        unsigned char c = (unsigned char) *text;
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Start the next event of the trace's array, with a comma after the one before
+void beginTraceEvent(FILE *file, int *numEvents) {
+    fprintf(file, *numEvents > 0 ? ",\n{" : "\n{");
+    ++*numEvents;
+}
+
+void writeTrackName(FILE *file, int *numEvents, int pid, int tid, const char *name, int order) {
+    beginTraceEvent(file, numEvents);
+    fprintf(file, "\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                  "\"args\": {\"name\": ", pid, tid);
+    writeJsonString(file, name);
+    fprintf(file, "}}");
+    beginTraceEvent(file, numEvents);
+    fprintf(file, "\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, "
+                  "\"args\": {\"sort_index\": %d}}", pid, tid, order);
+}
+
+int compareInts(const void *a, const void *b) {
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+// A change in the number of running tests, where the ends of runs sort before the starts of runs
+// at the same time
+typedef struct {
+    long long time;
+    int change;
+} TraceEdge;
+
+int compareTraceEdges(const void *a, const void *b) {
+    const TraceEdge *x = a, *y = b;
+    if (x->time != y->time) {
+        return (x->time > y->time) - (x->time < y->time);
+    }
+    return x->change - y->change;
+}
+
+// Write the tracks of tests, their counters and the tracks of suites
+int writeTraceEvents(const TestGraph *graph, const Trace *trace, FILE *file) {
+    int *tracks = malloc((trace->numSpans + 1) * sizeof(int));
+    TraceEdge *edges = malloc((2 * trace->numSpans + 1) * sizeof(TraceEdge));
+    long long *firstStart = malloc((graph->numLeaves + 1) * sizeof(long long));
+    long long *lastEnd = malloc((graph->numLeaves + 1) * sizeof(long long));
+    if (tracks == NULL || edges == NULL || firstStart == NULL || lastEnd == NULL) {
+        free(tracks);
+        free(edges);
+        free(firstStart);
+        free(lastEnd);
+        return -1;
+    }
+    int numEvents = 0;
+    char name[PATH_MAX];
+    beginTraceEvent(file, &numEvents);
+    fprintf(file, "\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+                  "\"args\": {\"name\": \"tests\"}}");
+    beginTraceEvent(file, &numEvents);
+    fprintf(file, "\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, "
+                  "\"args\": {\"name\": \"suites\"}}");
+
+    for (int i = 0; i < trace->numSpans; ++i) {
+        tracks[i] = trace->spans[i].track;
+    }
+    qsort(tracks, trace->numSpans, sizeof(int), compareInts);
+    for (int i = 0; i < trace->numSpans; ++i) {
+        int track = tracks[i];
+        if (i > 0 && tracks[i - 1] == track) {
+            continue;
+        }
+        if (track >= TRACE_WORKER_TRACKS) {
+            sprintf(name, "worker %d slot %d", (track - TRACE_WORKER_TRACKS) / TRACE_THREAD_TRACKS,
+                    (track - TRACE_WORKER_TRACKS) % TRACE_THREAD_TRACKS);
+        } else if (track >= TRACE_THREAD_TRACKS) {
+            sprintf(name, "thread %d", track - TRACE_THREAD_TRACKS);
+        } else {
+            sprintf(name, "slot %d", track - 1);
+        }
+        writeTrackName(file, &numEvents, 1, track, name, track);
+    }
+
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        firstStart[i] = -1;
+        lastEnd[i] = -1;
+    }
+    for (int i = 0; i < trace->numSpans; ++i) {
+        const TraceSpan *span = &trace->spans[i];
+        getTestPath(graph, graph->leaves[span->leaf].node, name);
+        beginTraceEvent(file, &numEvents);
+        fprintf(file, "\"name\": ");
+        writeJsonString(file, graph->info[graph->leaves[span->leaf].node].name);
+        fprintf(file, ", \"cat\": \"test\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, "
+                      "\"dur\": %.3f, \"args\": {\"path\": ", span->track, span->start / 1e3,
+                (span->end - span->start) / 1e3);
+        writeJsonString(file, name);
+        fprintf(file, ", \"result\": \"%s\"}}", span->passed ? "passed" : "failed");
+        edges[2 * i] = (TraceEdge) {.time = span->start, .change = 1};
+        edges[2 * i + 1] = (TraceEdge) {.time = span->end, .change = -1};
+        if (firstStart[span->leaf] < 0 || span->start < firstStart[span->leaf]) {
+            firstStart[span->leaf] = span->start;
+        }
+        if (span->end > lastEnd[span->leaf]) {
+            lastEnd[span->leaf] = span->end;
+        }
+    }
+
+    // Scopes nest under the run of their test, and counters get a track per name with a series
+    // per test
+    long long traceStart = trace->start.tv_sec * 1000LL * 1000 * 1000 + trace->start.tv_nsec;
+    for (int i = 0; i < trace->numMarks; ++i) {
+        const TraceMark *mark = &trace->marks[i];
+        const TestNodeInfo *info = &graph->info[graph->leaves[mark->leaf].node];
+        const TraceEvent *event = &info->traceEvents[mark->event];
+        beginTraceEvent(file, &numEvents);
+        fprintf(file, "\"name\": ");
+        writeJsonString(file, event->name);
+        if (event->type == TraceEvent_SCOPE) {
+            fprintf(file, ", \"cat\": \"scope\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                          "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"test\": ", mark->track,
+                    (event->time - traceStart) / 1e3, event->value / 1e3);
+            writeJsonString(file, info->name);
+            fprintf(file, "}}");
+        } else {
+            fprintf(file, ", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, \"args\": {",
+                    (event->time - traceStart) / 1e3);
+            writeJsonString(file, info->name);
+            fprintf(file, ": %lld}}", (long long) event->value);
+        }
+    }
+
+    qsort(edges, 2 * trace->numSpans, sizeof(TraceEdge), compareTraceEdges);
+    for (int i = 0, running = 0; i < 2 * trace->numSpans; ++i) {
+        running += edges[i].change;
+        // Only the last of the changes at the same time is the count from then on
+        if (i + 1 < 2 * trace->numSpans && edges[i + 1].time == edges[i].time) {
+            continue;
+        }
+        beginTraceEvent(file, &numEvents);
+        fprintf(file, "\"name\": \"running tests\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, "
+                      "\"args\": {\"tests\": %d}}", edges[i].time / 1e3, running);
+    }
+    for (int i = 0; i < trace->numSamples; ++i) {
+        beginTraceEvent(file, &numEvents);
+        fprintf(file, "\"name\": \"runner cpu\", \"ph\": \"C\", \"pid\": 1, \"ts\": %.3f, "
+                      "\"args\": {\"percent\": %.1f}}", trace->samples[i].time / 1e3,
+                trace->samples[i].cpuPercent);
+    }
+
+    // Suites get a track each, in the order of the tree
+    for (int i = 0; i < graph->numNodes; ++i) {
+        const TestNode *node = &graph->nodes[i];
+        if (node->isLeaf) {
+            continue;
+        }
+        long long start = -1, end = -1;
+        for (int j = i + 1; j < node->end; ++j) {
+            if (!graph->nodes[j].isLeaf) {
+                continue;
+            }
+            int leaf = graph->nodes[j].leaf;
+            if (firstStart[leaf] >= 0 && (start < 0 || firstStart[leaf] < start)) {
+                start = firstStart[leaf];
+            }
+            if (lastEnd[leaf] > end) {
+                end = lastEnd[leaf];
+            }
+        }
+        if (start < 0) {
+            continue;
+        }
+        getTestPath(graph, i, name);
+        writeTrackName(file, &numEvents, 2, i + 1, name, i);
+        beginTraceEvent(file, &numEvents);
+        fprintf(file, "\"name\": ");
+        writeJsonString(file, graph->info[i].name);
+        fprintf(file, ", \"cat\": \"suite\", \"ph\": \"X\", \"pid\": 2, \"tid\": %d, \"ts\": %.3f, "
+                      "\"dur\": %.3f, \"args\": {\"tests\": %d, \"passed\": %d, \"failed\": %d, "
+                      "\"flaky\": %d}}", i + 1, start / 1e3, (end - start) / 1e3, node->numTests,
+                node->numPassed, node->numFailed, node->numFlaky);
+    }
+    free(tracks);
+    free(edges);
+    free(firstStart);
+    free(lastEnd);
+    return 0;
+}
+
+// Write the trace of a finished run to trace.json in its log directory
+int writeTrace(const TestGraph *graph, const Trace *trace, const char *dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/trace.json", dir);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "failed to create trace at %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    int status = writeTraceEvents(graph, trace, file);
+    fprintf(file, "\n]}\n");
+    if (fclose(file) || status) {
+        fprintf(stderr, "failed to write trace at %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Whether the region at offset in a .stacks file of size bytes is whole
+int isProfileRegion(const char *data, size_t size, size_t offset) {
+    if (offset + offsetof(ProfileRegion, samples) > size) {
+        return 0;
+    }
+    const ProfileRegion *region = (const ProfileRegion *) (data + offset);
+    return region->size >= getProfileRegionSize(0) && region->size <= size - offset;
+}
+
+// Map the .stacks file of a leaf and return its first region, or NULL if none of its runs were
+// sampled. Its size is written to size, to unmap it with.
+const ProfileRegion *mapProfile(const TestGraph *graph, int index, const char *dir,
+                                size_t *size) {
+    char path[PATH_MAX];
+    getProfilePath(graph, index, dir, ".stacks", path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    const char *data;
+    int status = mapFile(fd, &data, size);
+    close(fd);
+    if (status || !isProfileRegion(data, *size, 0)) {
+        if (status == 0 && *size > 0) {
+            munmap((void *) data, *size);
+        }
+        return NULL;
+    }
+    return (const ProfileRegion *) data;
+}
+
+// The region after region in a .stacks file of size bytes that starts with regions, or NULL
+const ProfileRegion *getNextProfileRegion(const ProfileRegion *regions, size_t size,
+                                          const ProfileRegion *region) {
+    size_t offset = (const char *) region - (const char *) regions + region->size;
+    return isProfileRegion((const char *) regions, size, offset)
+           ? (const ProfileRegion *) ((const char *) regions + offset) : NULL;
+}
+
+// The number of samples in a region which were taken, where ones with a depth of 0 were cut off
+// before they were written
+uint64_t getNumSamples(const ProfileRegion *region) {
+    uint64_t capacity = (region->size - offsetof(ProfileRegion, samples)) / sizeof(ProfileSample);
+    return region->numSamples < capacity ? region->numSamples : capacity;
+}
+
+// A frame as addr2line should see it: the sampled instruction itself, and otherwise the
+// instruction before the return address, which is the call
+void *getSampleFrame(const ProfileSample *sample, uint64_t depth) {
+    return depth == 0 ? sample->frames[0] : (char *) sample->frames[depth] - 1;
+}
+
+int compareFrames(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) *(void *const *) a, y = (uintptr_t) *(void *const *) b;
+    return (x > y) - (x < y);
+}
+
+int compareStacks(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// Write each distinct stack of a leaf's samples from the test down to the sampled function, with
+// the number of samples it got. frames is sorted, functions is the name of each of them, and
+// isEntry marks the frames in runForkedTest, which everything above is cut from the stacks.
+int foldProfile(const ProfileRegion *regions, size_t size, void *const *frames,
+                size_t numFrames, char *const *functions, const char *isEntry, FILE *file) {
+    size_t numSamples = 0;
+    for (const ProfileRegion *region = regions; region != NULL;
+         region = getNextProfileRegion(regions, size, region)) {
+        numSamples += getNumSamples(region);
+    }
+    char **stacks = malloc((numSamples + 1) * sizeof(char *));
+    if (stacks == NULL) {
+        return -1;
+    }
+    size_t numStacks = 0;
+    char stack[PROFILE_MAX_DEPTH * 128];
+    for (const ProfileRegion *region = regions; region != NULL;
+         region = getNextProfileRegion(regions, size, region)) {
+        for (uint64_t j = 0; j < getNumSamples(region); ++j) {
+            const ProfileSample *sample = &region->samples[j];
+            if (sample->depth == 0 || sample->depth > PROFILE_MAX_DEPTH) {
+                continue;
+            }
+            uint64_t top = sample->depth;
+            for (uint64_t k = 0; k < sample->depth; ++k) {
+                void *frame = getSampleFrame(sample, k);
+                void *const *found = bsearch(&frame, frames, numFrames, sizeof(void *),
+                                             compareFrames);
+                if (found != NULL && isEntry[found - frames]) {
+                    top = k;
+                    break;
+                }
+            }
+            size_t length = 0;
+            for (uint64_t k = top; k-- > 0 && length < sizeof(stack) - 1;) {
+                void *frame = getSampleFrame(sample, k);
+                void *const *found = bsearch(&frame, frames, numFrames, sizeof(void *),
+                                             compareFrames);
+                const char *function = found != NULL && functions != NULL
+                                       ? functions[found - frames] : NULL;
+                length += function != NULL
+                          ? snprintf(stack + length, sizeof(stack) - length, "%s;", function)
+                          : snprintf(stack + length, sizeof(stack) - length, "%p;", frame);
+            }
+            if (length >= sizeof(stack)) {
+                length = sizeof(stack) - 1;
             }
+            stack[length > 0 ? length - 1 : 0] = '\0';
+            if ((stacks[numStacks] = strdup(stack)) != NULL) {
+                ++numStacks;
+            }
+        }
+    }
+    qsort(stacks, numStacks, sizeof(char *), compareStacks);
+    for (size_t i = 0, end; i < numStacks; i = end) {
+        for (end = i + 1; end < numStacks && strcmp(stacks[end], stacks[i]) == 0; ++end) {
         }
+        fprintf(file, "%s %zu\n", stacks[i], end - i);
+    }
+    for (size_t i = 0; i < numStacks; ++i) {
+        free(stacks[i]);
     }
-    path[pathLength] = '\0';
+    free(stacks);
     return 0;
 }
 
-// Remove a trailing slash, if it exists, from a filepath.
-void removeTrailingSlash(char *path) {
-    size_t pathLength = strlen(path);
-    if (pathLength > 0 && path[pathLength - 1] == '/') {
-        path[pathLength - 1] = '\0';
+// Append the folded stacks of a leaf to the profile of a suite that it's in, starting each stack
+// with the path of the leaf within the suite
+void addToSuiteProfile(const TestGraph *graph, int suite, int index, const char *dir,
+                       FILE *suiteFile) {
+    char path[PATH_MAX], prefix[PATH_MAX] = "";
+    for (int node = index; node != suite; node = graph->nodes[node].parent) {
+        size_t length = strlen(graph->info[node].name);
+        if (strlen(prefix) + length + 2 > sizeof(prefix)) {
+            break;
+        }
+        memmove(prefix + length + 1, prefix, strlen(prefix) + 1);
+        memcpy(prefix, graph->info[node].name, length);
+        prefix[length] = ';';
+    }
+    getProfilePath(graph, index, dir, ".folded", path);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
     }
+    char *line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, file) > 0) {
+        fprintf(suiteFile, "%s%s", prefix, line);
+    }
+    free(line);
+    fclose(file);
 }
 
-// Each test node has a process id; this function searches for a node with the provided pid,
-// recursively and returns NULL if no such node exists.
-TestNode *findNodeWithPid(TestNode *node, pid_t pid) {
-    if (node->isLeaf) {
-        if (node->pid == pid) {
-            return node;
-        }
-    } else {
-        for (int i = 0; i < node->numChildren; ++i) {
-            TestNode *result = findNodeWithPid(node->children[i], pid);
-            if (result != NULL) {
-                return result;
+// Turn the .stacks files that profiled tests sampled into folded stacks, for each test and each
+// suite. Every distinct frame in the run is symbolized once.
+int writeProfiles(const TestGraph *graph, const char *dir) {
+    void **frames = NULL;
+    size_t numFrames = 0, framesCapacity = 0;
+    for (int i = 0; i < graph->numNodes; ++i) {
+        size_t size;
+        const ProfileRegion *regions = graph->nodes[i].isLeaf
+                                       ? mapProfile(graph, i, dir, &size) : NULL;
+        for (const ProfileRegion *region = regions; region != NULL;
+             region = getNextProfileRegion(regions, size, region)) {
+            for (uint64_t k = 0; k < getNumSamples(region); ++k) {
+                const ProfileSample *sample = &region->samples[k];
+                if (sample->depth > PROFILE_MAX_DEPTH) {
+                    continue;
+                }
+                if (numFrames + sample->depth > framesCapacity) {
+                    size_t capacity = framesCapacity > 0 ? framesCapacity * 2 : 4096;
+                    void **grown = realloc(frames, (capacity + PROFILE_MAX_DEPTH) * sizeof(void *));
+                    if (grown == NULL) {
+                        perror("failed to collect profiled frames");
+                        free(frames);
+                        munmap((void *) regions, size);
+                        return -1;
+                    }
+                    frames = grown;
+                    framesCapacity = capacity;
+                }
+                for (uint64_t l = 0; l < sample->depth; ++l) {
+                    frames[numFrames++] = getSampleFrame(sample, l);
+                }
             }
         }
+        if (regions != NULL) {
+            munmap((void *) regions, size);
+        }
     }
-    return NULL;
-}
-
-// Render the root test node, outputting to the provided FILE. It needs to be a FILE and not a file
-// descriptor because we need to flush it in order for the ANSI stuff (terminal colors) to work
-// properly.
-int renderRootTestNode(TestNode *root, FILE *file) {
-    printf(CLEAR_SCREEN); // Clear the console
-    fflush(file);
-    dprintf(fileno(file), "TestC\n");
-    if (renderTestNode(root, 0, fileno(file))) {
-        fprintf(stderr, "failed to render graph\n");
+    qsort(frames, numFrames, sizeof(void *), compareFrames);
+    size_t numDistinct = 0;
+    for (size_t i = 0; i < numFrames; ++i) {
+        if (numDistinct == 0 || frames[numDistinct - 1] != frames[i]) {
+            frames[numDistinct++] = frames[i];
+        }
+    }
+    char **functions = calloc(numDistinct + 1, sizeof(char *));
+    if (functions == NULL || symbolizeFunctions(frames, (int) numDistinct, functions, NULL)) {
+        fprintf(stderr, "failed to symbolize profiled frames, so they're left as addresses\n");
+    }
+    char *isEntry = calloc(numDistinct + 1, 1);
+    if (isEntry == NULL) {
+        perror("failed to allocate profiled frames");
+        free(functions);
+        free(frames);
         return -1;
     }
-    fflush(file);
-    return 0;
-}
-
-typedef struct {
-    // There are two threads which can write to the screen, this makes it so only one will render at
-    // a time.
-    pthread_mutex_t *screenRenderMutex;
-
-    TestNode *root;
-
-    // The rate at which the spinners will re-render.
-    float fps;
-
-    // The exit status of the render thread, not the tests.
-    int exitStatus;
-} RenderThreadArgs;
+    // Executables which don't export their symbols only have them in their symbol table, which
+    // addr2line reads but dladdr doesn't
+    for (size_t i = 0; i < numDistinct; ++i) {
+        Dl_info info;
+        isEntry[i] = (dladdr(frames[i], &info) != 0 && info.dli_saddr == (void *) runForkedTest)
+                     || (functions != NULL && functions[i] != NULL
+                         && strcmp(functions[i], "runForkedTest") == 0);
+    }
 
-// The function that the render thread will run. It re-renders the screen every 1/fps seconds, but
-// it uses a mutex so that it doesn't interfere with screen renders that come from the main thread.
-void *renderLoop(void *input) {
-    RenderThreadArgs *args = input;
-    long us = (long) (1000.f * 1000.f / args->fps);
-    while (1) {
-        if (pthread_mutex_lock(args->screenRenderMutex)) {
-            perror("render loop failed to lock mutex");
-            args->exitStatus = 1;
-            return NULL;
+    char path[PATH_MAX];
+    int status = 0;
+    for (int i = 0; i < graph->numNodes; ++i) {
+        size_t size;
+        const ProfileRegion *regions = graph->nodes[i].isLeaf
+                                       ? mapProfile(graph, i, dir, &size) : NULL;
+        if (regions == NULL) {
+            continue;
         }
-        if (args->root->numPassed + args->root->numFailed == args->root->numTests) {
-            if (pthread_mutex_unlock(args->screenRenderMutex)) {
-                perror("render loop failed to unlock mutex while trying to exit");
-                args->exitStatus = 1;
-                return NULL;
-            }
-            args->exitStatus = 0;
-            return NULL;
+        uint64_t numDropped = 0;
+        for (const ProfileRegion *region = regions; region != NULL;
+             region = getNextProfileRegion(regions, size, region)) {
+            numDropped += region->numDropped;
         }
-        if (renderRootTestNode(args->root, stdout)) {
-            fprintf(stderr, "render loop failed to render graph\n");
-            args->exitStatus = 1;
-            return NULL;
+        getProfilePath(graph, i, dir, ".folded", path);
+        FILE *file = fopen(path, "w");
+        if (file == NULL
+            || foldProfile(regions, size, frames, numDistinct, functions, isEntry, file)
+            || fclose(file)) {
+            fprintf(stderr, "failed to write profile at %s\n", path);
+            status = -1;
+        } else {
+            getProfilePath(graph, i, dir, ".stacks", path);
+            unlink(path);
         }
-        if (pthread_mutex_unlock(args->screenRenderMutex)) {
-            perror("render loop failed to unlock mutex");
-            args->exitStatus = 1;
-            return NULL;
+        munmap((void *) regions, size);
+        if (numDropped > 0 && graph->info[i].outputFile != NULL) {
+            FILE *log = graph->info[i].outputFile;
+            fseek(log, 0, SEEK_END);
+            fprintf(log, "\n%llu profile samples didn't fit and were dropped\n",
+                    (unsigned long long) numDropped);
+            fflush(log);
         }
-        usleep(us);
     }
-}
 
-// Recursively free a test node
-void freeNode(TestNode *node) {
-    if (!node->isLeaf) {
-        for (int i = 0; i < node->numChildren; ++i) {
-            freeNode(node->children[i]);
+    // Suites come before their tests in pre-order, so each suite's profile is opened at its
+    // first profiled test
+    for (int i = 0; i < graph->numNodes; ++i) {
+        const TestNode *node = &graph->nodes[i];
+        FILE *suiteFile = NULL;
+        for (int j = i + 1; !node->isLeaf && j < node->end; ++j) {
+            getProfilePath(graph, j, dir, ".folded", path);
+            if (!graph->nodes[j].isLeaf || access(path, F_OK) != 0) {
+                continue;
+            }
+            if (suiteFile == NULL) {
+                getProfilePath(graph, i, dir, ".folded", path);
+                if ((suiteFile = fopen(path, "w")) == NULL) {
+                    fprintf(stderr, "failed to create profile at %s: %s\n", path,
+                            strerror(errno));
+                    status = -1;
+                    break;
+                }
+            }
+            addToSuiteProfile(graph, i, j, dir, suiteFile);
         }
-        free(node->children);
+        if (suiteFile != NULL && fclose(suiteFile)) {
+            status = -1;
+        }
+    }
+    for (size_t i = 0; functions != NULL && i < numDistinct; ++i) {
+        free(functions[i]);
     }
-    free(node);
+    free(functions);
+    free(isEntry);
+    free(frames);
+    return status;
 }
 
-int exitSignalIsPass(int signal) {
-    return WIFEXITED(signal) && WEXITSTATUS(signal) == EXIT_SUCCESS;
-}
+// One line of the impact index: a source file, and a test which ran code in it
+typedef struct {
+    char *file;
+    char *test;
+} ImpactEntry;
 
-void finishTest(TestNode *node, int testSignal) {
-    node->state = TestState_DONE;
-    clock_gettime(CLOCK_MONOTONIC, &node->end);
-    node->exitSignal = testSignal;
-    int passed = exitSignalIsPass(node->exitSignal);
-    while ((node = node->parent) != NULL) {
-        if (passed) {
-            node->numPassed += 1;
-        } else {
-            node->numFailed += 1;
+typedef struct {
+    ImpactEntry *entries;
+    size_t numEntries;
+    size_t capacity;
+} ImpactIndex;
+
+int appendImpactEntry(ImpactIndex *index, const char *file, size_t fileLength, const char *test,
+                      size_t testLength) {
+    if (index->numEntries == index->capacity) {
+        size_t capacity = index->capacity == 0 ? 256 : index->capacity * 2;
+        ImpactEntry *entries = realloc(index->entries, capacity * sizeof(ImpactEntry));
+        if (entries == NULL) {
+            return -1;
         }
+        index->entries = entries;
+        index->capacity = capacity;
     }
+    ImpactEntry *entry = &index->entries[index->numEntries++];
+    entry->file = strndup(file, fileLength);
+    entry->test = strndup(test, testLength);
+    return 0;
 }
 
-// This method is useful when you want to debug a specific test since follow-fork-mode is
-// GDB-specific, IDE specific, and it is not suited to parallel execution.
-void TestC_runNoFork(TestNode *node) {
-    if (node->isLeaf) {
-        printf(RUNNING_TEST_COLOR "Testing %s\n" RESET_COLOR, node->name);
-        node->test();
-        finishTest(node, 0);
-    } else {
-        for (int i = 0; i < node->numChildren; ++i) {
-            struct TestNode *child = node->children[i];
-            TestC_runNoFork(child);
+void freeImpactIndex(ImpactIndex *index) {
+    for (size_t i = 0; i < index->numEntries; ++i) {
+        free(index->entries[i].file);
+        free(index->entries[i].test);
+    }
+    free(index->entries);
+}
+
+// The index is text: every source file is on a line of its own, followed by the paths of the tests
+// which ran code in it, each on a line that starts with a tab
+int parseImpactIndex(const char *data, size_t size, ImpactIndex *index) {
+    const char *file = NULL;
+    size_t fileLength = 0;
+    for (const char *line = data, *end; line < data + size; line = end + 1) {
+        end = memchr(line, '\n', data + size - line);
+        if (end == NULL) {
+            end = data + size;
+        }
+        if (*line != '\t') {
+            file = line;
+            fileLength = end - line;
+        } else if (file != NULL
+                   && appendImpactEntry(index, file, fileLength, line + 1, end - line - 1)) {
+            return -1;
         }
     }
+    return 0;
+}
+
+int compareImpactEntries(const void *a, const void *b) {
+    const ImpactEntry *left = a, *right = b;
+    int files = strcmp(left->file, right->file);
+    return files != 0 ? files : strcmp(left->test, right->test);
 }
 
-// Find the test suite with the given path e.g. `all.http.parser.badRequest`
-const TestSuite *findSuite(const TestSuite *suite, const char *filter) {
-    if (strcmp(suite->name, filter) == 0) {
-        return suite;
+// Whether a changed file is a file of the index: either the same path, or a path relative to
+// some directory that the indexed file is in, like `src/parser.c` for `/home/me/http/src/parser.c`
+int isChangedFile(const char *indexed, const char *changed) {
+    while (strncmp(changed, "./", 2) == 0) {
+        changed += 2;
+    }
+    size_t indexedLength = strlen(indexed);
+    size_t changedLength = strlen(changed);
+    if (changedLength == 0 || changedLength > indexedLength) {
+        return 0;
     }
+    const char *suffix = indexed + indexedLength - changedLength;
+    return strcmp(suffix, changed) == 0
+           && (suffix == indexed || suffix[-1] == '/' || *changed == '/');
+}
 
-    if (!suite->isLeaf) {
-        char *split = strchr(filter, '.');
-        assert(split != NULL);
-        filter = split + 1;
-        for (int i = 0; i < suite->numChildren; ++i) {
-            const TestSuite *child = suite->children[i];
-            const TestSuite *result = findSuite(child, filter);
-            if (result != NULL) {
-                return result;
+// Add the tests of the index which ran code in any of the comma-separated files in changed to the
+// impacted tests of the matcher. Returns -1 if one of the files isn't in the index.
+int addImpactedTests(const ImpactIndex *index, const char *changed, PathMatcher *matcher) {
+    char *files = strdup(changed);
+    int status = 0;
+    char *save;
+    for (char *file = strtok_r(files, ",", &save); file != NULL && status == 0;
+         file = strtok_r(NULL, ",", &save)) {
+        int found = 0;
+        for (size_t i = 0; i < index->numEntries; ++i) {
+            if (!isChangedFile(index->entries[i].file, file)) {
+                continue;
+            }
+            found = 1;
+            char **tests = realloc(matcher->impactedTests,
+                                   (matcher->numImpactedTests + 1) * sizeof(char *));
+            if (tests == NULL) {
+                status = -1;
+                break;
             }
+            matcher->impactedTests = tests;
+            tests[matcher->numImpactedTests++] = strdup(index->entries[i].test);
+        }
+        if (!found) {
+            fprintf(stderr, "%s isn't in the impact index, so every test is selected\n", file);
+            status = -1;
         }
     }
-    return NULL;
+    free(files);
+    return status;
 }
 
-// Utility method which is so far only used in the test for this file.
-TestNode *findNode(TestNode *node, const char *filter) {
-    if (strcmp(node->name, filter) == 0) {
-        return node;
+// Fill in the impacted and indexed tests of the matcher for the changedFiles of the options, from
+// the impact index that past runs left under the log root. Nothing is known about the tests that a
+// change affects without an index, or if a changed file isn't in it, so then they're left NULL and
+// every test is selected.
+void findImpactedTests(const TestRunOptions *options, PathMatcher *matcher) {
+    matcher->impactedTests = NULL;
+    matcher->numImpactedTests = 0;
+    matcher->indexedTests = NULL;
+    matcher->numIndexedTests = 0;
+    if (options->numChangedFiles == 0) {
+        return;
     }
-
-    if (!node->isLeaf) {
-        char *split = strchr(filter, '.');
-        if (split == NULL) {
-            return NULL;
-        }
-        filter = split + 1;
-        for (int i = 0; i < node->numChildren; ++i) {
-            TestNode *child = node->children[i];
-            TestNode *result = findNode(child, filter);
-            if (result != NULL) {
-                return result;
-            }
+    char root[PATH_MAX];
+    getLogRoot(options, root);
+    int fd;
+    const char *data = NULL;
+    size_t size = 0;
+    if (openHistory(root, "impact.index", O_RDONLY, &fd)) {
+        fprintf(stderr, "there's no impact index under %s, so every test is selected\n", root);
+        return;
+    }
+    ImpactIndex index = {0};
+    int status = mapFile(fd, &data, &size);
+    close(fd);
+    if (status == 0) {
+        status = parseImpactIndex(data, size, &index);
+    }
+    if (data != NULL) {
+        munmap((void *) data, size);
+    }
+    for (int i = 0; i < options->numChangedFiles && status == 0; ++i) {
+        status = addImpactedTests(&index, options->changedFiles[i], matcher);
+    }
+    // Entries are sorted by file, so the same test can be in the index many times
+    matcher->indexedTests = status == 0 ? malloc((index.numEntries + 1) * sizeof(char *)) : NULL;
+    for (size_t i = 0; matcher->indexedTests != NULL && i < index.numEntries; ++i) {
+        matcher->indexedTests[matcher->numIndexedTests++] = index.entries[i].test;
+        index.entries[i].test = NULL;
+    }
+    freeImpactIndex(&index);
+    if (matcher->indexedTests == NULL) {
+        for (int i = 0; i < matcher->numImpactedTests; ++i) {
+            free(matcher->impactedTests[i]);
         }
+        free(matcher->impactedTests);
+        matcher->impactedTests = NULL;
+        matcher->numImpactedTests = 0;
+        return;
     }
-    return NULL;
+    qsort(matcher->impactedTests, matcher->numImpactedTests, sizeof(char *), compareStrings);
+    qsort(matcher->indexedTests, matcher->numIndexedTests, sizeof(char *), compareStrings);
 }
 
-// When the test runner finishes, there probably be a lot of empty files which were created during
-// the test, but never written to. This method cleans up all those empty files.
-int deleteEmptyLogs(const TestNode *node, char *path, int *deleted) {
-    int len = (int) strlen(path);
-    strcat(path, "/");
-    strcat(path, node->name);
-    if (node->isLeaf) {
-        strcat(path, ".txt");
-        if (fseek(node->outputFile, 0, SEEK_END) != 0) {
-            fprintf(stderr, "failed to seek end of output %s: %s\n", path, strerror(errno));
-            return 1;
+// A function that a test entered, from its impact record
+typedef struct {
+    uint64_t function;
+    int leaf;
+} ImpactHit;
+
+int compareImpactHits(const void *a, const void *b) {
+    const ImpactHit *left = a, *right = b;
+    return left->function < right->function ? -1 : left->function > right->function;
+}
+
+// Read the impact records that the forked tests of a finished run left next to their logs, and
+// delete them. Leaves which recorded functions are marked in recorded.
+ImpactHit *readImpactRecords(const TestGraph *graph, const char *dir, char *recorded,
+                             size_t *numHits) {
+    ImpactHit *hits = NULL;
+    size_t capacity = 0;
+    *numHits = 0;
+    char path[PATH_MAX];
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        getProfilePath(graph, graph->leaves[i].node, dir, ".impact", path);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            continue;
         }
-        long size = ftell(node->outputFile);
-        if (fclose(node->outputFile) != 0) {
-            fprintf(stderr, "failed to close %s: %s\n", path, strerror(errno));
-            return 1;
+        const ImpactRecord *record = mmap(NULL, sizeof(ImpactRecord), PROT_READ, MAP_SHARED, fd,
+                                          0);
+        close(fd);
+        unlink(path);
+        if (record == MAP_FAILED) {
+            continue;
         }
-        if (size == 0) {
-            if (remove(path) != 0) {
-                perror("failed to delete node's output file");
-                return 1;
-            }
-            *deleted = 1;
-        } else {
-            *deleted = 0;
+        uint64_t numFunctions = record->numFunctions;
+        if (numFunctions > IMPACT_MAX_FUNCTIONS) {
+            numFunctions = IMPACT_MAX_FUNCTIONS;
         }
-    } else {
-        int numChildren = node->numChildren;
-        int numDeleted = 0;
-        int childDeleted = 0;
-        for (int i = 0; i < node->numChildren; ++i) {
-            TestNode *child = node->children[i];
-            if (deleteEmptyLogs(child, path, &childDeleted)) {
-                return 1;
-            }
-            if (childDeleted) {
-                ++numDeleted;
+        if (*numHits + numFunctions > capacity) {
+            capacity = (*numHits + numFunctions) * 2;
+            ImpactHit *grown = realloc(hits, capacity * sizeof(ImpactHit));
+            if (grown == NULL) {
+                munmap((void *) record, sizeof(ImpactRecord));
+                break;
             }
+            hits = grown;
         }
-        if (numDeleted == numChildren && node->parent != NULL) {
-            if (remove(path) != 0) {
-                perror("failed to delete test log subdirectory");
-                return 1;
+        for (uint64_t j = 0; j < numFunctions; ++j) {
+            // A function is written after its slot is taken, so a crash can leave a slot empty
+            if (record->functions[j] != 0) {
+                hits[(*numHits)++] = (ImpactHit) {.function = record->functions[j], .leaf = i};
+                recorded[i] = 1;
             }
-            *deleted = 1;
-        } else {
-            *deleted = 0;
         }
+        if (record->numDropped > 0 && graph->info[graph->leaves[i].node].outputFile != NULL) {
+            FILE *log = graph->info[graph->leaves[i].node].outputFile;
+            fseek(log, 0, SEEK_END);
+            fprintf(log, "\n%llu functions didn't fit in the impact record, so changes to them "
+                         "don't select this test\n", (unsigned long long) record->numDropped);
+            fflush(log);
+        }
+        munmap((void *) record, sizeof(ImpactRecord));
     }
-    *(path + len) = '\0';
-    return 0;
+    return hits;
 }
 
-// Run a test suite by converting it into a test node and then running that test node. If the result
-// argument is non-NULL, the results of the test can be inspected, but it's up to the caller to
-// run freeNode(*result).
-int TestC_run(const TestSuite *suite, TestRunOptions options, TestNode **result) {
-    char dir[PATH_MAX];
-
-    if (options.noFork == 0) {
-        if (options.dir == NULL) {
-            getcwd(dir, PATH_MAX - 1);
-            removeTrailingSlash(dir);
-            strcat(dir, "/test_logs");
-
-            if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
-                fprintf(stderr, "failed to create root test logs directory at %s: %s\n", dir,
-                        strerror(errno));
-                return 1;
-            }
+// Merge the source files of the functions that the forked tests of a finished run entered into the
+// impact index under root. They replace what the index had for those tests, and the other tests
+// keep theirs. Runs which share a root take turns on impact.lock, and the new index is written
+// next to the old one and renamed over it, so that a run which selects tests with it never sees
+// half of it.
+int updateImpactIndex(const TestGraph *graph, const char *dir, const char *root) {
+    char *recorded = calloc(graph->numLeaves + 1, 1);
+    size_t numHits;
+    ImpactHit *hits = recorded == NULL ? NULL : readImpactRecords(graph, dir, recorded, &numHits);
+    // Without any instrumented code, there's nothing to index
+    if (hits == NULL || numHits == 0) {
+        free(hits);
+        free(recorded);
+        return 0;
+    }
+    qsort(hits, numHits, sizeof(ImpactHit), compareImpactHits);
+    void **functions = malloc(numHits * sizeof(void *));
+    char **files = calloc(numHits, sizeof(char *));
+    size_t numDistinct = 0;
+    for (size_t i = 0; functions != NULL && i < numHits; ++i) {
+        void *hit = (void *) (uintptr_t) hits[i].function;
+        if (numDistinct == 0 || functions[numDistinct - 1] != hit) {
+            functions[numDistinct++] = hit;
+        }
+    }
+    int status = -1;
+    ImpactIndex index = {0};
+    char **tests = calloc(graph->numLeaves + 1, sizeof(char *));
+    int lockFd = -1, fd = -1;
+    const char *data = NULL;
+    size_t size = 0;
+    FILE *file = NULL;
+    char path[PATH_MAX], temporary[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%s/impact.index", root);
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, getpid());
+    if (functions == NULL || files == NULL || tests == NULL
+        || symbolizeFunctions(functions, (int) numDistinct, NULL, files)
+        || openHistory(root, "impact.lock", O_RDWR | O_CREAT, &lockFd)
+        || flock(lockFd, LOCK_EX)
+        || openHistory(root, "impact.index", O_RDONLY | O_CREAT, &fd)
+        || mapFile(fd, &data, &size) || parseImpactIndex(data, size, &index)) {
+        goto done;
+    }
+    for (int i = 0; i < graph->numLeaves; ++i) {
+        char testPath[PATH_MAX];
+        if (recorded[i]) {
+            getTestPath(graph, graph->leaves[i].node, testPath);
+            tests[i] = strdup(testPath);
+        }
+    }
+    // Drop what the index had for the tests that this run recorded
+    size_t numKept = 0;
+    char **recordedTests = malloc((graph->numLeaves + 1) * sizeof(char *));
+    int numRecorded = 0;
+    for (int i = 0; recordedTests != NULL && i < graph->numLeaves; ++i) {
+        if (tests[i] != NULL) {
+            recordedTests[numRecorded++] = tests[i];
+        }
+    }
+    if (recordedTests == NULL) {
+        goto done;
+    }
+    qsort(recordedTests, numRecorded, sizeof(char *), compareStrings);
+    for (size_t i = 0; i < index.numEntries; ++i) {
+        ImpactEntry *entry = &index.entries[i];
+        if (bsearch(&entry->test, recordedTests, numRecorded, sizeof(char *),
+                    compareStrings) == NULL) {
+            index.entries[numKept++] = *entry;
         } else {
-            strcpy(dir, options.dir);
+            free(entry->file);
+            free(entry->test);
         }
-
-        struct timespec start;
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        long micros = start.tv_sec * 1000 * 1000 + start.tv_nsec / 1000;
-        size_t rootDirPathLength = strlen(dir);
-        sprintf(dir + rootDirPathLength, "/%016ld", micros);
-        if (mkdir(dir, 0777) < 0) {
-            fprintf(stderr, "failed to create test run directory for this run at %s: %s", dir,
-                    strerror
-                            (errno));
-            return 1;
+    }
+    free(recordedTests);
+    index.numEntries = numKept;
+    size_t function = 0;
+    for (size_t i = 0; i < numHits; ++i) {
+        while (functions[function] != (void *) (uintptr_t) hits[i].function) {
+            ++function;
         }
-        char rootDirAbsolutePath[PATH_MAX];
-        dir[rootDirPathLength] = '\0';
-        if (realpath(dir, rootDirAbsolutePath) == NULL) {
-            fprintf(stderr, "failed to convert directory to absolute path %s: %s\n", dir,
-                    strerror(errno));
-            return -1;
+        const char *source = files[function];
+        const char *test = tests[hits[i].leaf];
+        if (source != NULL
+            && appendImpactEntry(&index, source, strlen(source), test, strlen(test))) {
+            goto done;
         }
-        dir[rootDirPathLength] = '/';
-
-        char symlinkTargetPath[PATH_MAX];
-        strcpy(symlinkTargetPath, rootDirAbsolutePath);
-        strcat(symlinkTargetPath, dir + rootDirPathLength);
-        char symlinkLabelPath[PATH_MAX];
-        strcpy(symlinkLabelPath, rootDirAbsolutePath);
-        strcat(symlinkLabelPath, "/latest");
-        remove(symlinkLabelPath);
-        if (symlink(symlinkTargetPath, symlinkLabelPath)) {
-            fprintf(stderr, "failed to symlink target=%s, link_name=%s: %s\n", symlinkTargetPath,
-                    symlinkLabelPath, strerror(errno));
-            return -1;
+    }
+    qsort(index.entries, index.numEntries, sizeof(ImpactEntry), compareImpactEntries);
+    if ((file = fopen(temporary, "w")) == NULL) {
+        goto done;
+    }
+    for (size_t i = 0; i < index.numEntries; ++i) {
+        const ImpactEntry *entry = &index.entries[i];
+        int sameFile = i > 0 && strcmp(entry->file, index.entries[i - 1].file) == 0;
+        if (sameFile && strcmp(entry->test, index.entries[i - 1].test) == 0) {
+            continue;
+        }
+        if (!sameFile) {
+            fprintf(file, "%s\n", entry->file);
         }
-        printf("running suite and outputting logs to %s\n", dir);
+        fprintf(file, "\t%s\n", entry->test);
+    }
+    int failed = fflush(file) != 0 || fsync(fileno(file)) != 0;
+    failed |= fclose(file) != 0;
+    file = NULL;
+    if (!failed && rename(temporary, path) == 0) {
+        status = 0;
     }
 
-    if (options.filter != NULL) {
-        suite = findSuite(suite, options.filter);
-        if (suite == NULL) {
-            fprintf(stderr, "failed to find test suite at path %s\n", options.filter);
-            return -1;
+done:
+    if (file != NULL) {
+        fclose(file);
+    }
+    if (status != 0) {
+        unlink(temporary);
+        fprintf(stderr, "failed to update the impact index under %s\n", root);
+    }
+    if (data != NULL) {
+        munmap((void *) data, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    // Closing the lock lets the next run in
+    if (lockFd >= 0) {
+        close(lockFd);
+    }
+    freeImpactIndex(&index);
+    for (int i = 0; tests != NULL && i < graph->numLeaves; ++i) {
+        free(tests[i]);
+    }
+    free(tests);
+    for (size_t i = 0; files != NULL && i < numDistinct; ++i) {
+        free(files[i]);
+    }
+    free(files);
+    free(functions);
+    free(hits);
+    free(recorded);
+    return status;
+}
+
+// Snapshot assertions find their options in the environment, even in forked tests
+void exportSnapshotOptions(const TestRunOptions *options) {
+    setenv("TESTC_SNAPSHOT_DIR", options->snapshotDir != NULL ? options->snapshotDir : "snapshots",
+           1);
+    setenv("TESTC_UPDATE_SNAPSHOTS", options->updateSnapshots ? "1" : "0", 1);
+}
+
+// Run a test suite by converting it into a test graph and then running that graph. If the result
+// argument is non-NULL, the results of the test can be inspected, but it's up to the caller to
+// run TestGraph_free(*result).
+int TestC_run(const TestSuite *suite, TestRunOptions options, TestGraph **result) {
+    TestGraph *graph = buildSelectedGraph(suite, &options);
+    if (graph == NULL) {
+        return -1;
+    }
+    if (options.list) {
+        listTests(graph);
+        if (result == NULL) {
+            TestGraph_free(graph);
+        } else {
+            *result = graph;
         }
+        return 0;
+    }
+
+    // Fuzz targets find their corpus under the root, even in forked tests
+    char dir[PATH_MAX];
+    getLogRoot(&options, dir);
+    setenv("TESTC_LOG_ROOT", dir, 1);
+    exportSnapshotOptions(&options);
+#ifndef __linux__
+    if (options.profile) {
+        fprintf(stderr, "tests aren't profiled because profiling is only supported on Linux\n");
+        options.profile = 0;
+    }
+#endif
+    if (options.noFork == 0 && createRunDirectory(&options, dir)) {
+        TestGraph_free(graph);
+        return -1;
     }
+    struct timespec startTime;
+    clock_gettime(CLOCK_REALTIME, &startTime);
 
     if (options.noFork) {
-        int numTests;
-        TestNode *node = buildGraph(NULL, suite, &numTests);
-        TestC_runNoFork(node);
+        TestC_runNoFork(graph);
         if (result == NULL) {
-            freeNode(node);
+            TestGraph_free(graph);
         } else {
-            *result = node;
+            *result = graph;
         }
         return 0;
     }
 
     const float fps = options.fps;
     const int renderProgress = options.animate;
+    if (options.checkLeaks && Alloc_startTracking == NULL) {
+        fprintf(stderr, "leaks aren't checked because the alloc library isn't linked\n");
+    }
 
     if (renderProgress && fps <= 0) {
         fprintf(stderr, "fps (%f) must be greater than zero if progress rendering is on\n", fps);
+        TestGraph_free(graph);
         return -1;
     }
-    int numTests = 0;
-    TestNode *root = buildGraph(NULL, suite, &numTests);
     if (result != NULL) {
-        *result = root;
+        *result = graph;
+    }
+    int numTests = graph->numLeaves;
+    if (createLogDirectories(graph, dir)) {
+        fprintf(stderr, "failed to create test log directories\n");
+        TestGraph_free(graph);
+        return -1;
+    }
+
+    int maxRuns = options.repeat > 1 ? options.repeat : 1;
+    if (options.untilFail && options.repeat <= 1) {
+        maxRuns = INT_MAX;
+    }
+    for (int i = 0; i < numTests; ++i) {
+        graph->leaves[i].maxRuns = maxRuns;
+        graph->leaves[i].retriesLeft = options.retries;
+    }
+    TestRun run = {
+            .graph = graph,
+            .options = &options,
+            .dir = dir,
+            .numJobs = options.jobs > 0 ? options.jobs : numTests,
+            .childSignalPipe = {-1, -1},
+    };
+    run.jobLimit = run.numJobs;
+    run.numServers = assignFixtureServers(graph, &run.servers);
+    if (run.numServers < 0) {
+        TestGraph_free(graph);
+        return -1;
+    }
+    run.jobs = calloc(run.numJobs > 0 ? run.numJobs : 1, sizeof(Job));
+    for (int i = 0; i < run.numJobs; ++i) {
+        run.jobs[i].batchFd = -1;
     }
-    int numDone = 0;
-    if (startTestNode(root, dir)) {
-        fprintf(stderr, "failed to start tests\n");
-        freeNode(root);
+    if (planPlacements(&run)) {
+        free(run.jobs);
+        free(run.servers);
+        TestGraph_free(graph);
         return -1;
     }
+    size_t skippedNanosSize = (numTests > 0 ? numTests : 1) * sizeof(long long);
+    run.skippedNanos = mmap(NULL, skippedNanosSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (run.skippedNanos == MAP_FAILED) {
+        perror("failed to map virtual time counters");
+        run.skippedNanos = NULL;
+    }
+    // Only the pages of rings which tests record into are ever touched
+    if (TraceRing_enter != NULL && numTests > 0) {
+        run.traceRings = mmap(NULL, numTests * sizeof(TraceRing), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (run.traceRings == MAP_FAILED) {
+            perror("failed to map trace rings");
+            run.traceRings = NULL;
+        }
+    }
+    if (options.failedFirst) {
+        char root[PATH_MAX];
+        getLogRoot(&options, root);
+        run.firstLeaves = malloc((numTests + 1) * sizeof(int));
+        if (run.firstLeaves != NULL) {
+            run.numFirstLeaves = findLastFailures(graph, root, run.firstLeaves);
+        }
+    }
+    // The child signal pipe, the servers, the batches and the thread pool. Workers are added later.
+    run.numPollFds = run.numServers + run.numJobs + 2;
+    run.pollFds = malloc(run.numPollFds * sizeof(struct pollfd));
 
     //region: Double-buffer stdout output to reduce jitters
     // So far doesn't seem to help in embedded CLion terminal
-    size_t bufferCapacity = 4096;
-    char buffer[bufferCapacity];
+    // The buffer is static because stdout keeps using it after this function returns
+    static char buffer[4096];
+    size_t bufferCapacity = sizeof(buffer);
     if (setvbuf(stdout, buffer, _IOFBF, bufferCapacity)) {
         perror("failed to set stdout buffer");
     }
     //endregion
 
+    // Children are waited for through a pipe, and a fixture server which dies must not take the
+    // runner down with it when a test is sent to it
+    int previousChildSignalFd = childSignalFd;
+    struct sigaction previousChildAction, previousPipeAction;
+    struct sigaction ignore = {.sa_handler = SIG_IGN};
+    sigemptyset(&ignore.sa_mask);
+    if (watchChildren(run.childSignalPipe, &previousChildAction)
+        || sigaction(SIGPIPE, &ignore, &previousPipeAction)) {
+        free(run.jobs);
+        free(run.servers);
+        free(run.pollFds);
+        free(run.placements);
+        free(run.firstLeaves);
+        unmapSharedCounters(&run, skippedNanosSize);
+        TestGraph_free(graph);
+        return -1;
+    }
+
+    if (options.adaptiveJobs && run.numJobs > 0) {
+        run.concurrency = calloc(1, sizeof(Concurrency));
+        if (run.concurrency == NULL) {
+            perror("failed to allocate the concurrency readings");
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &run.concurrency->start);
+            run.concurrency->initialLimit = run.jobLimit;
+            const char *pressureDir = getenv("TESTC_PRESSURE_DIR");
+            run.concurrency->pressureDir = pressureDir != NULL ? pressureDir : "/proc/pressure";
+            for (int i = 0; i < NUM_LOAD_RESOURCES; ++i) {
+                run.concurrency->stallMicros[i] = -1;
+            }
+        }
+    }
+    if (options.trace) {
+        run.trace = calloc(1, sizeof(Trace));
+        if (run.trace == NULL) {
+            perror("failed to allocate the trace");
+        } else {
+            startTrace(run.trace);
+        }
+    }
+
     pthread_mutex_t renderMutex;
     pthread_mutex_init(&renderMutex, NULL);
+    if (renderProgress) {
+        run.renderMutex = &renderMutex;
+    }
     RenderThreadArgs renderThreadArgs = {
-            .root = root,
+            .graph = graph,
             .screenRenderMutex = &renderMutex,
             .fps = fps
     };
@@ -592,73 +5674,128 @@ int TestC_run(const TestSuite *suite, TestRunOptions options, TestNode **result)
     if ((renderProgress) && pthread_create(&renderThread, NULL, renderLoop,
                                            &renderThreadArgs)) {
         perror("failed to create render thread");
-        freeNode(root);
-        return -1;
+        goto err;
+    }
+    if (options.threads > 0 && startThreadPool(&run, maxRuns)) {
+        goto err;
+    }
+    if (options.listen != NULL && startCoordinator(&run)) {
+        goto err;
     }
 
-    while (numDone < numTests) {
-        int testSignal, waitStatus;
-        wait:
-        waitStatus = wait(&testSignal);
-        if (waitStatus < 0) {
-            if (errno == EINTR) {
-                goto wait;
-            }
-            fprintf(stderr, "failed to wait with %d/%d done: %s\n", numDone, numTests, strerror
-                    (errno));
-            err:
-            if (renderProgress && pthread_cancel(renderThread)) {
-                perror("failed to cancel render thread while cleaning up wait loop");
-            }
-            freeNode(root);
-            return -1;
-        }
-        pid_t pid = waitStatus;
-        TestNode *node = findNodeWithPid(root, pid);
-        if (node == NULL) {
-            fprintf(stderr, "got a signal for a subprocess that doesn't exist in the test "
-                            "suite (pid=%d, signal=%d), ignoring.\n", pid, testSignal);
-            continue;
+    while (run.numDone < numTests || serversRunning(&run)) {
+        if (run.trace != NULL) {
+            sampleRunnerCpu(run.trace);
         }
-        if (WIFCONTINUED(testSignal)) {
-            printf("received continue signal for test: %s\n", node->name);
-            continue;
+        if (run.concurrency != NULL) {
+            adaptConcurrency(&run);
         }
-        if (renderProgress && pthread_mutex_lock(&renderMutex)) {
-            perror("wait loop failed to lock mutex");
+        if (lockRender(&run) || startQueuedTests(&run) || unlockRender(&run)) {
             goto err;
         }
-        if (node->state == TestState_DONE) {
-            fprintf(stderr, "got a signal from the subprocess for test %s but that test is "
-                            "already marked done\n", node->name);
+        int numThreadsRunning = run.pool != NULL ? run.pool->numRunning : 0;
+        // A coordinator waits for workers, until none has been connected for the worker timeout
+        if (run.numRunning == 0 && numThreadsRunning == 0 && run.coordinator == NULL
+            && run.numDone < numTests) {
+            fprintf(stderr, "no tests are running or queued with %d/%d done\n", run.numDone,
+                    numTests);
             goto err;
         }
-        finishTest(node, testSignal);
-        if (renderRootTestNode(root, stdout)) {
-            fprintf(stderr, "failed to render graph in wait loop\n");
-            goto err;
+        if (getWorkerTimeoutMillis(&run) == 0) {
+            fprintf(stderr, "no worker connected, skipping the tests that only workers run with "
+                            "%d/%d done\n", run.numDone, numTests);
+            if (lockRender(&run)) {
+                goto err;
+            }
+            cancelRun(&run);
+            if (unlockRender(&run)) {
+                goto err;
+            }
+            continue;
         }
-        if (renderProgress && pthread_mutex_unlock(&renderMutex)) {
-            perror("wait loop failed to unlock mutex");
-            goto err;
+        if (waitForEvents(&run)) {
+            err:
+            if (renderProgress && pthread_cancel(renderThread)) {
+                perror("failed to cancel render thread while cleaning up wait loop");
+            }
+            stopThreadPool(&run);
+            for (int i = 0; i < run.numServers; ++i) {
+                if (run.servers[i].pid > 0 && !run.servers[i].exited) {
+                    kill(run.servers[i].pid, SIGKILL);
+                }
+            }
+            closeRunPipes(&run);
+            sigaction(SIGCHLD, &previousChildAction, NULL);
+            sigaction(SIGPIPE, &previousPipeAction, NULL);
+            childSignalFd = previousChildSignalFd;
+            if (run.pool != NULL) {
+                freeThreadPool(&run);
+            }
+            if (run.coordinator != NULL) {
+                freeCoordinator(&run);
+            }
+            free(run.jobs);
+            free(run.servers);
+            free(run.pollFds);
+            free(run.placements);
+            free(run.firstLeaves);
+            freeTrace(run.trace);
+            freeConcurrency(run.concurrency);
+            unmapSharedCounters(&run, skippedNanosSize);
+            TestGraph_free(graph);
+            return -1;
         }
-        ++numDone;
     }
-    int status = renderRootTestNode(root, stdout);
+    // The render thread uses the mutex and arguments on this stack, so it has to be done first
+    if (renderProgress && pthread_join(renderThread, NULL)) {
+        perror("failed to join render thread");
+    }
+    // Every threaded leaf is done, so the workers are only waiting to exit
+    stopThreadPool(&run);
+    closeRunPipes(&run);
+    sigaction(SIGCHLD, &previousChildAction, NULL);
+    sigaction(SIGPIPE, &previousPipeAction, NULL);
+    childSignalFd = previousChildSignalFd;
+    if (run.pool != NULL) {
+        freeThreadPool(&run);
+    }
+    if (run.coordinator != NULL) {
+        freeCoordinator(&run);
+    }
+    free(run.jobs);
+    free(run.servers);
+    free(run.pollFds);
+    free(run.placements);
+    free(run.firstLeaves);
+    unmapSharedCounters(&run, skippedNanosSize);
+    int status = renderRootTestNode(graph, stdout);
+    if (run.trace != NULL) {
+        sampleRunnerCpu(run.trace);
+        writeTrace(graph, run.trace, dir);
+        freeTrace(run.trace);
+    }
+    if (run.concurrency != NULL) {
+        writeConcurrency(run.concurrency, dir);
+        freeConcurrency(run.concurrency);
+    }
+    if (options.profile) {
+        writeProfiles(graph, dir);
+    }
+    char root[PATH_MAX];
+    getLogRoot(&options, root);
+    if (Impact_start != NULL) {
+        updateImpactIndex(graph, dir, root);
+    }
 
-    int rootDeleted = 0;
-    if (deleteEmptyLogs(root, dir, &rootDeleted) != 0) {
+    if (deleteEmptyLogs(graph, dir) != 0) {
         fprintf(stderr, "failed to delete logs at %s\n", dir);
         return -1;
     }
-    if (rootDeleted) {
-        fprintf(stderr, "test log root was accidentally deleted--this will break the \"latest\" "
-                        "symlink");
-        return -1;
-    }
+    // The history is only for looking back, so a run which couldn't be added to it still counts
+    appendHistory(graph, root, startTime.tv_sec * 1000LL * 1000 + startTime.tv_nsec / 1000);
 
     if (result == NULL) {
-        freeNode(root);
+        TestGraph_free(graph);
     }
 
     printf("Test results written to:\n%s\n", dir);
@@ -673,6 +5810,8 @@ typedef enum {
     CommandLineParameterType_int,
     CommandLineParameterType_float,
     CommandLineParameterType_str,
+    // A string parameter which may be given more than once
+    CommandLineParameterType_strList,
 } CommandLineParameterType;
 
 typedef struct {
@@ -681,11 +5820,17 @@ typedef struct {
     CommandLineParameterType type;
     int required;
 
+    // If non-NULL, the argument may be left out and this is parsed in its place
+    const char *implicitArgument;
+
     union {
         int *int_;
         float *float_;
         const char **str_;
+        const char ***strList_;
     } parsedArgument;
+    // The number of arguments parsed so far, for list parameters
+    int *numParsedArguments;
     int numOptions;
     union {
         int *int_;
@@ -713,6 +5858,12 @@ void printUsage(CommandLineParameter *parameters, int numParameters) {
             case CommandLineParameterType_str:
                 printf(" [string]");
                 break;
+            case CommandLineParameterType_strList:
+                printf(" [string, repeatable]");
+                break;
+        }
+        if (parameter.implicitArgument != NULL) {
+            printf(" (optional, implicitly %s)", parameter.implicitArgument);
         }
         printf("\n");
         if (parameter.required) {
@@ -730,6 +5881,9 @@ void printUsage(CommandLineParameter *parameters, int numParameters) {
                 case CommandLineParameterType_str:
                     printf("%s", *parameter.parsedArgument.str_);
                     break;
+                case CommandLineParameterType_strList:
+                    printf("(none)");
+                    break;
             }
         }
         printf("\n");
@@ -781,7 +5935,10 @@ parseArguments(CommandLineParameter *parameters, int numParameters, int argc, ch
                 matched = 1;
 
                 char *value;
-                if (parameter.type != CommandLineParameterType_void) {
+                if (parameter.implicitArgument != NULL
+                    && (argv == end || strncmp(*argv, "--", 2) == 0)) {
+                    value = (char *) parameter.implicitArgument;
+                } else if (parameter.type != CommandLineParameterType_void) {
                     if (argv == end) {
                         printf("expected an argument to %s\n", parameter.name);
                         goto badArgs;
@@ -797,11 +5954,11 @@ parseArguments(CommandLineParameter *parameters, int numParameters, int argc, ch
                     case CommandLineParameterType_int: {
                         char *endptr;
                         int intVal = (int) strtol(value, &endptr, 10);
-                        if (endptr == NULL) {
+                        if (endptr == value || *endptr != '\0') {
                             printf("%s expected an int but got %s\n", parameterName, value);
                             goto badArgs;
                         }
-                        int gotOption = 0;
+                        int gotOption = parameter.numOptions == 0;
                         if (parameter.numOptions > 0) {
                             for (int j = 0; j < parameter.numOptions; ++j) {
                                 if (intVal == parameter.options.int_[j]) {
@@ -831,6 +5988,13 @@ parseArguments(CommandLineParameter *parameters, int numParameters, int argc, ch
                         *parameter.parsedArgument.str_ = value;
                     }
                         break;
+                    case CommandLineParameterType_strList: {
+                        const char ***values = parameter.parsedArgument.strList_;
+                        int count = (*parameter.numParsedArguments)++;
+                        *values = realloc(*values, sizeof(char *) * (count + 1));
+                        (*values)[count] = value;
+                    }
+                        break;
                 }
 
                 break;
@@ -848,13 +6012,479 @@ parseArguments(CommandLineParameter *parameters, int numParameters, int argc, ch
     return ParseArgumentsResult_BAD_ARGS;
 }
 
-int TestNode_passed(TestNode *node) {
+// Flaky tests eventually passed, so they count as passes unless strict is set
+int TestNode_passed(const TestGraph *graph, const TestNode *node, int strict) {
     if (node->isLeaf) {
-        assert(node->state == TestState_DONE);
-        return exitSignalIsPass(node->exitSignal);
+        const TestLeaf *leaf = &graph->leaves[node->leaf];
+        if (leaf->state == TestState_FLAKY) {
+            return !strict;
+        }
+        if (leaf->state != TestState_DONE) {
+            return 0;
+        }
+        return exitSignalIsPass(leaf->exitSignal);
     } else {
-        return node->numPassed == node->numTests;
+        int numFlakyPassed = strict ? 0 : node->numFlaky;
+        return node->numPassed + numFlakyPassed == node->numTests;
+    }
+}
+
+// A run in progress in a worker process
+typedef struct {
+    // 0 for free slots
+    pid_t pid;
+    // The index of the leaf in the coordinator's graph
+    uint32_t leaf;
+    FILE *log;
+    struct timespec start;
+} WorkerRun;
+
+// Send the result of a run to the coordinator, with as much of its log as fits, and close the log
+int sendRunResult(int socketFd, WorkerRun *workerRun, int exitSignal) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t runNanos = (uint64_t) getElapsedNanos(&workerRun->start, &end);
+    uint32_t fields[RESULT_FIELDS] = {
+            htonl(workerRun->leaf),
+            htonl((uint32_t) exitSignal),
+            htonl((uint32_t) (runNanos >> 32)),
+            htonl((uint32_t) runNanos)
+    };
+    char *payload = malloc(sizeof(fields) + MAX_REMOTE_LOG);
+    if (payload == NULL) {
+        perror("failed to allocate run result");
+        return -1;
+    }
+    memcpy(payload, fields, sizeof(fields));
+    size_t logSize = 0;
+    if (workerRun->log != NULL) {
+        int logFd = fileno(workerRun->log);
+        lseek(logFd, 0, SEEK_SET);
+        ssize_t numRead;
+        while (logSize < MAX_REMOTE_LOG
+               && (numRead = read(logFd, payload + sizeof(fields) + logSize,
+                                  MAX_REMOTE_LOG - logSize)) > 0) {
+            logSize += numRead;
+        }
+        fclose(workerRun->log);
+        workerRun->log = NULL;
+    }
+    int status = sendWireMessage(socketFd, WireMessage_RESULT, payload,
+                                 sizeof(fields) + logSize);
+    free(payload);
+    return status;
+}
+
+// Start a run that the coordinator sent, in a child whose output goes to a temporary log. A test
+// that isn't in this worker's graph fails at once. Returns 1 if the child started, 0 if the result
+// was sent already, and -1 on errors.
+int startWorkerRun(TestRun *run, int socketFd, WorkerRun *workerRun, const char *payload) {
+    uint32_t leaf;
+    memcpy(&leaf, payload, sizeof(leaf));
+    workerRun->leaf = ntohl(leaf);
+    const char *path = payload + sizeof(leaf);
+    clock_gettime(CLOCK_MONOTONIC, &workerRun->start);
+    workerRun->log = tmpfile();
+    TestNode *node = findNode(run->graph, path);
+    if (workerRun->log == NULL || node == NULL || !node->isLeaf) {
+        if (workerRun->log != NULL) {
+            fprintf(workerRun->log, "this worker has no test at %s\n", path);
+            fflush(workerRun->log);
+        }
+        return sendRunResult(socketFd, workerRun, W_EXITCODE(EXIT_FAILURE, 0));
+    }
+    int index = (int) (node - run->graph->nodes);
+    int outputFd = fileno(workerRun->log);
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("failed to fork for test");
+        return -1;
+    }
+    if (pid == 0) {
+        // The coordinator has to see the connection close as soon as the worker is gone
+        close(socketFd);
+        resetChild(run);
+        assert(dup2(outputFd, STDOUT_FILENO) != -1);
+        assert(dup2(outputFd, STDERR_FILENO) != -1);
+        runForkedTest(run, index);
+        exit(EXIT_SUCCESS);
+    }
+    workerRun->pid = pid;
+    return 1;
+}
+
+// Connect to a coordinator, waiting a while for it to start listening
+int connectToCoordinator(const char *address) {
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < 100; ++attempt) {
+        fd = openSocket(address, 0, NULL);
+        if (fd < 0 && errno != ENOENT && errno != ECONNREFUSED) {
+            break;
+        }
+        if (fd < 0) {
+            usleep(100 * 1000);
+        }
+    }
+    if (fd < 0) {
+        fprintf(stderr, "failed to connect to the coordinator at %s: %s\n", address,
+                strerror(errno));
+    }
+    return fd;
+}
+
+// Run the tests that a coordinator sends until it closes the connection, and then kill whatever
+// it no longer waits for
+int TestC_work(const TestSuite *suite, TestRunOptions options, const char *address) {
+    TestGraph *graph = buildSelectedGraph(suite, &options);
+    if (graph == NULL) {
+        return -1;
+    }
+    exportSnapshotOptions(&options);
+    int numSlots = options.jobs > 0 ? options.jobs : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    WorkerRun *runs = calloc(numSlots, sizeof(WorkerRun));
+    int socketFd = connectToCoordinator(address);
+    if (runs == NULL || socketFd < 0) {
+        free(runs);
+        TestGraph_free(graph);
+        return -1;
+    }
+    TestRun run = {
+            .graph = graph,
+            .options = &options,
+            .childSignalPipe = {-1, -1},
+    };
+    int previousChildSignalFd = childSignalFd;
+    struct sigaction previousChildAction, previousPipeAction;
+    struct sigaction ignore = {.sa_handler = SIG_IGN};
+    sigemptyset(&ignore.sa_mask);
+    uint32_t hello = htonl(numSlots);
+    int status = watchChildren(run.childSignalPipe, &previousChildAction)
+                 || sigaction(SIGPIPE, &ignore, &previousPipeAction)
+                 || sendWireMessage(socketFd, WireMessage_HELLO, &hello, sizeof(hello)) ? -1 : 0;
+
+    int numRunning = 0;
+    while (status == 0) {
+        struct pollfd fds[2] = {
+                {.fd = run.childSignalPipe[0], .events = POLLIN},
+                {.fd = socketFd, .events = POLLIN}
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("failed to wait for the coordinator");
+            status = -1;
+            break;
+        }
+        if (fds[0].revents) {
+            drainChildSignals(run.childSignalPipe[0]);
+            // Only the tests are reaped, since the caller may have children of its own
+            for (int i = 0; i < numSlots; ++i) {
+                int testSignal;
+                if (runs[i].pid != 0 && waitpid(runs[i].pid, &testSignal, WNOHANG) > 0) {
+                    runs[i].pid = 0;
+                    --numRunning;
+                    // A coordinator that's gone shows up as the end of the connection
+                    sendRunResult(socketFd, &runs[i], testSignal);
+                }
+            }
+        }
+        if (fds[1].revents) {
+            WireMessageType type;
+            char *payload;
+            uint32_t size;
+            // The coordinator closes the connection once the run is over
+            if (receiveWireMessage(socketFd, &type, &payload, &size)) {
+                break;
+            }
+            if (type != WireMessage_RUN || size <= sizeof(uint32_t) || numRunning == numSlots) {
+                fprintf(stderr, "got an unexpected message from the coordinator\n");
+                free(payload);
+                status = -1;
+                break;
+            }
+            int slot = 0;
+            while (runs[slot].pid != 0) {
+                ++slot;
+            }
+            int started = startWorkerRun(&run, socketFd, &runs[slot], payload);
+            free(payload);
+            if (started < 0) {
+                status = -1;
+                break;
+            }
+            numRunning += started;
+        }
+    }
+
+    for (int i = 0; i < numSlots; ++i) {
+        if (runs[i].pid != 0) {
+            kill(runs[i].pid, SIGKILL);
+            waitpid(runs[i].pid, NULL, 0);
+        }
+        if (runs[i].log != NULL) {
+            fclose(runs[i].log);
+        }
+    }
+    close(socketFd);
+    closeRunPipes(&run);
+    sigaction(SIGCHLD, &previousChildAction, NULL);
+    sigaction(SIGPIPE, &previousPipeAction, NULL);
+    childSignalFd = previousChildSignalFd;
+    free(runs);
+    TestGraph_free(graph);
+    return status;
+}
+
+// Fuzz the selected fuzz targets one after the other. The targets fork their own workers, so
+// this runs in the caller's process.
+int TestC_fuzz(const TestSuite *suite, TestRunOptions options) {
+    TestGraph *graph = buildSelectedGraph(suite, &options);
+    if (graph == NULL) {
+        return -1;
+    }
+    char root[PATH_MAX];
+    getLogRoot(&options, root);
+    setenv("TESTC_LOG_ROOT", root, 1);
+    int numWorkers = options.jobs > 0 ? options.jobs : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int numTargets = 0;
+    int numCrashed = 0;
+    for (int i = 0; i < graph->numLeaves && numCrashed >= 0; ++i) {
+        const TestNodeInfo *info = &graph->info[graph->leaves[i].node];
+        if (info->fuzz == NULL) {
+            continue;
+        }
+        ++numTargets;
+        int crashed = info->fuzz(numWorkers, options.fuzz);
+        numCrashed = crashed < 0 ? -1 : numCrashed + crashed;
+    }
+    if (numTargets == 0) {
+        fprintf(stderr, "no fuzz targets were selected\n");
+    }
+    TestGraph_free(graph);
+    return numCrashed;
+}
+
+// How long a watched change has to be followed by quiet before the tests run again, so that a
+// linker which writes the executable in pieces is done with it
+#define WATCH_SETTLE_MILLIS 100
+
+// Write the path of this process's executable to path. When the file was replaced since it
+// started, the kernel's name for it ends with " (deleted)", and the path of the new one is wanted.
+int getExecutablePath(char path[PATH_MAX]) {
+#ifndef __linux__
+    // Watching is refused before this on other platforms (see runParsedArguments)
+    (void) path;
+    return -1;
+#else
+    ssize_t length = readlink("/proc/self/exe", path, PATH_MAX - 1);
+    if (length < 0) {
+        perror("failed to find the test executable");
+        return -1;
+    }
+    path[length] = '\0';
+    const char *deleted = " (deleted)";
+    if ((size_t) length > strlen(deleted)
+        && strcmp(path + length - strlen(deleted), deleted) == 0) {
+        path[length - strlen(deleted)] = '\0';
+    }
+    return 0;
+#endif
+}
+
+// The watches of a watched run on its executable and the watched paths. They're set up before its
+// tests run, so that a change while they do starts the next run once they're done.
+typedef struct {
+    int fd;
+    int executableWatch;
+    // The executable's name in its directory
+    const char *name;
+    int changed;
+} Watch;
+
+// Start watching the executable, and anything at the watched paths, for changes. The executable's
+// directory is watched rather than the file itself, since builds tend to replace it instead of
+// writing over it. A build which replaced it since this process started counts as a change.
+int startWatching(const char *executable, const TestRunOptions *options, Watch *watch) {
+#ifndef __linux__
+    (void) executable;
+    (void) options;
+    (void) watch;
+    return -1;
+#else
+    watch->fd = inotify_init1(IN_CLOEXEC);
+    if (watch->fd < 0) {
+        perror("failed to watch for changes");
+        return -1;
+    }
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", executable);
+    char *slash = strrchr(directory, '/');
+    watch->name = executable + (slash - directory) + 1;
+    *slash = '\0';
+    watch->executableWatch = inotify_add_watch(watch->fd, directory[0] != '\0' ? directory : "/",
+                                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE
+                                               | IN_ATTRIB);
+    if (watch->executableWatch < 0) {
+        fprintf(stderr, "failed to watch %s: %s\n", directory, strerror(errno));
+        close(watch->fd);
+        return -1;
+    }
+    for (int i = 0; i < options->numWatchPaths; ++i) {
+        if (inotify_add_watch(watch->fd, options->watchPaths[i], IN_CLOSE_WRITE | IN_MOVED_TO
+                                                                 | IN_CREATE | IN_DELETE
+                                                                 | IN_MODIFY) < 0) {
+            fprintf(stderr, "failed to watch %s: %s\n", options->watchPaths[i], strerror(errno));
+        }
+    }
+    struct stat running, current;
+    watch->changed = stat("/proc/self/exe", &running) == 0
+                     && (stat(executable, &current) != 0 || current.st_ino != running.st_ino
+                         || current.st_dev != running.st_dev);
+    return 0;
+#endif
+}
+
+// Wait until the executable, or anything at the watched paths, changes and then settles, with the
+// executable there to run. The watches are closed.
+int waitForChange(const char *executable, Watch *watch) {
+#ifndef __linux__
+    (void) executable;
+    (void) watch;
+    return -1;
+#else
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        struct pollfd pollFd = {.fd = watch->fd, .events = POLLIN};
+        int ready = poll(&pollFd, 1, watch->changed ? WATCH_SETTLE_MILLIS : -1);
+        if (ready < 0 && errno != EINTR) {
+            perror("failed to wait for changes");
+            close(watch->fd);
+            return -1;
+        }
+        if (ready == 0 && access(executable, X_OK) == 0) {
+            break;
+        }
+        ssize_t length = ready > 0 ? read(watch->fd, events, sizeof(events)) : 0;
+        for (ssize_t offset = 0; offset < length;) {
+            const struct inotify_event *event = (const struct inotify_event *) (events + offset);
+            if (event->wd != watch->executableWatch
+                || (event->len > 0 && strcmp(event->name, watch->name) == 0)) {
+                watch->changed = 1;
+            }
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    close(watch->fd);
+    return 0;
+#endif
+}
+
+// Run TestC_main in the mode that its parsed arguments ask for
+TestCResult runParsedArguments(const TestSuite *suite, TestRunOptions options, const char *pin,
+                               const char *worker, int history, const char *minidump,
+                               char **argv) {
+    if (pin != NULL) {
+        if (strcmp(pin, "cores") == 0) {
+            options.pin = TestPin_CORES;
+        } else if (strcmp(pin, "isolated") == 0) {
+            options.pin = TestPin_ISOLATED;
+        } else if (strcmp(pin, "numa") == 0) {
+            options.pin = TestPin_NUMA;
+        } else {
+            fprintf(stderr, "unknown pin mode %s, expected cores, isolated or numa\n", pin);
+            return TestCResult_BAD_ARGS;
+        }
+    }
+
+#ifndef __linux__
+    if (options.watch) {
+        fprintf(stderr, "--watch is only supported on Linux, since it watches with inotify\n");
+        return TestCResult_BAD_ARGS;
+    }
+#endif
+
+    if (minidump != NULL) {
+        fflush(stdout);
+        return Minidump_print(minidump, STDOUT_FILENO) == 0 ? TestCResult_ALL_PASSED
+                                                             : TestCResult_INTERNAL_ERROR;
+    }
+    // Filters that select nothing, or that don't parse, are a mistake in the arguments rather
+    // than a failure of the runner. A watched run keeps watching, since a rebuild can add tests.
+    if (!options.watch) {
+        TestGraph *selected = buildSelectedGraph(suite, &options);
+        if (selected == NULL) {
+            return TestCResult_BAD_ARGS;
+        }
+        TestGraph_free(selected);
+    }
+    if (history) {
+        fflush(stdout);
+        return TestC_history(suite, options, STDOUT_FILENO) == 0 ? TestCResult_ALL_PASSED
+                                                                  : TestCResult_INTERNAL_ERROR;
+    }
+    if (worker != NULL) {
+        return TestC_work(suite, options, worker) == 0 ? TestCResult_ALL_PASSED
+                                                       : TestCResult_INTERNAL_ERROR;
+    }
+
+    if (options.fuzz > 0) {
+        int numCrashed = TestC_fuzz(suite, options);
+        if (numCrashed < 0) {
+            return TestCResult_INTERNAL_ERROR;
+        }
+        return numCrashed > 0 ? TestCResult_SOME_TESTS_FAILED : TestCResult_ALL_PASSED;
+    }
+
+    // A watched run starts over in a new process, which the failures of the one before go first in
+    const char *watchRun = getenv("TESTC_WATCH_RUN");
+    char executable[PATH_MAX];
+    Watch watch;
+    if (options.watch) {
+        options.failedFirst = 1;
+        if (getExecutablePath(executable) || startWatching(executable, &options, &watch)) {
+            return TestCResult_INTERNAL_ERROR;
+        }
     }
+    TestGraph *result = NULL;
+    int status = TestC_run(suite, options, &result);
+    if (status != 0) {
+        fprintf(stderr, "test runner failed to run");
+        if (!options.watch) {
+            return TestCResult_INTERNAL_ERROR;
+        }
+    }
+    if (options.list) {
+        TestGraph_free(result);
+        if (options.watch) {
+            close(watch.fd);
+        }
+        return TestCResult_ALL_PASSED;
+    }
+    // When tests are repeated to shake out flakiness, a flaky test is a failure
+    int allPassed = status == 0 && TestNode_passed(result, &result->nodes[0],
+                                                   options.repeat > 1 || options.untilFail);
+    TestGraph_free(result);
+    if (options.watch) {
+        char nextRun[16];
+        int thisRun = watchRun != NULL ? atoi(watchRun) : 1;
+        snprintf(nextRun, sizeof(nextRun), "%d", thisRun + 1);
+        printf("run %d %s, watching %s for changes\n", thisRun,
+               allPassed ? "passed" : "failed", executable);
+        fflush(stdout);
+        if (waitForChange(executable, &watch)) {
+            return TestCResult_INTERNAL_ERROR;
+        }
+        setenv("TESTC_WATCH_RUN", nextRun, 1);
+        execv(executable, argv);
+        fprintf(stderr, "failed to run %s again: %s\n", executable, strerror(errno));
+        return TestCResult_INTERNAL_ERROR;
+    }
+    if (!allPassed) {
+        return TestCResult_SOME_TESTS_FAILED;
+    }
+    return TestCResult_ALL_PASSED;
 }
 
 TestCResult TestC_main(const TestSuite *suite, int argc, char **argv) {
@@ -864,7 +6494,41 @@ TestCResult TestC_main(const TestSuite *suite, int argc, char **argv) {
     options.fps = 30.f;
     options.noFork = 0;
     options.dir = NULL;
-    options.filter = NULL;
+    options.filters = NULL;
+    options.numFilters = 0;
+    options.excludes = NULL;
+    options.numExcludes = 0;
+    options.list = 0;
+    options.jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    options.retries = 0;
+    options.repeat = 1;
+    options.untilFail = 0;
+    options.failFast = 0;
+    options.batch = 0;
+    options.fuzz = 0;
+    options.checkLeaks = 0;
+    options.threads = 0;
+    options.pin = TestPin_NONE;
+    options.listen = NULL;
+    options.remoteOnly = 0;
+    options.workerTimeout = 0;
+    options.snapshotDir = NULL;
+    options.updateSnapshots = 0;
+    options.trace = 0;
+    options.profile = 0;
+    options.adaptiveJobs = 0;
+    options.minJobs = 1;
+    options.minidumps = 0;
+    options.failedFirst = 0;
+    options.changedFiles = NULL;
+    options.numChangedFiles = 0;
+    options.watch = 0;
+    options.watchPaths = NULL;
+    options.numWatchPaths = 0;
+    const char *pin = NULL;
+    const char *worker = NULL;
+    int history = 0;
+    const char *minidump = NULL;
 
     CommandLineParameter parameters[] = {
             {
@@ -898,9 +6562,214 @@ TestCResult TestC_main(const TestSuite *suite, int argc, char **argv) {
             },
             {
                     .name = "filter",
+                    .type = CommandLineParameterType_strList,
+                    .parsedArgument.strList_ = &options.filters,
+                    .numParsedArguments = &options.numFilters,
+                    .doc = "a period-separated path to a test suite to run, where * and ? match "
+                           "within a segment and ** matches any number of segments e.g. "
+                           "all.**.parse*"
+            },
+            {
+                    .name = "exclude",
+                    .type = CommandLineParameterType_strList,
+                    .parsedArgument.strList_ = &options.excludes,
+                    .numParsedArguments = &options.numExcludes,
+                    .doc = "a pattern like --filter of tests or suites not to run"
+            },
+            {
+                    .name = "list",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.list,
+                    .doc = "print the path of every selected test without running them"
+            },
+            {
+                    .name = "jobs",
+                    .type = CommandLineParameterType_int,
+                    .parsedArgument.int_ = &options.jobs,
+                    .doc = "the maximum number of tests to run at once (the default is the number "
+                           "of online CPUs, and 0 runs every test at once)"
+            },
+            {
+                    .name = "retries",
+                    .type = CommandLineParameterType_int,
+                    .parsedArgument.int_ = &options.retries,
+                    .doc = "rerun a failed test up to this many times--a test which passes on a "
+                           "retry is reported as flaky instead of failed"
+            },
+            {
+                    .name = "repeat",
+                    .type = CommandLineParameterType_int,
+                    .parsedArgument.int_ = &options.repeat,
+                    .doc = "run every test this many times across the job slots and report the "
+                           "pass rate of each test"
+            },
+            {
+                    .name = "until-fail",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.untilFail,
+                    .doc = "stop repeating a test once it fails (without --repeat, tests repeat "
+                           "until they fail)"
+            },
+            {
+                    .name = "fail-fast",
+                    .type = CommandLineParameterType_int,
+                    .implicitArgument = "1",
+                    .parsedArgument.int_ = &options.failFast,
+                    .doc = "once this many tests fail, kill the running tests and skip the rest "
+                           "(0 never stops early)"
+            },
+            {
+                    .name = "batch",
+                    .type = CommandLineParameterType_int,
+                    .implicitArgument = "64",
+                    .parsedArgument.int_ = &options.batch,
+                    .doc = "run up to this many sibling tests one after the other in the same "
+                           "child, sized to how long tests take (0 forks every test)"
+            },
+            {
+                    .name = "fuzz",
+                    .type = CommandLineParameterType_int,
+                    .implicitArgument = "60",
+                    .parsedArgument.int_ = &options.fuzz,
+                    .doc = "fuzz the selected fuzz targets for this many seconds each, with one "
+                           "worker per job, instead of running the tests"
+            },
+            {
+                    .name = "check-leaks",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.checkLeaks,
+                    .doc = "fail tests which leak memory (needs the alloc library to be linked)"
+            },
+            {
+                    .name = "threads",
+                    .type = CommandLineParameterType_int,
+                    .parsedArgument.int_ = &options.threads,
+                    .doc = "run the tests of thread-safe suites on this many threads in the runner "
+                           "instead of forking them"
+            },
+            {
+                    .name = "pin",
+                    .type = CommandLineParameterType_str,
+                    .implicitArgument = "cores",
+                    .parsedArgument.str_ = &pin,
+                    .doc = "pin each job slot to a CPU (cores), to an isolated CPU (isolated) or to "
+                           "the CPUs and memory of a NUMA node (numa)"
+            },
+            {
+                    .name = "listen",
+                    .type = CommandLineParameterType_str,
+                    .parsedArgument.str_ = &options.listen,
+                    .doc = "also send tests to the workers that connect to this address, either "
+                           "host:port or unix:path"
+            },
+            {
+                    .name = "workers-only",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.remoteOnly,
+                    .doc = "with --listen, run every test that can run remotely on the workers"
+            },
+            {
+                    .name = "worker-timeout",
+                    .type = CommandLineParameterType_int,
+                    .parsedArgument.int_ = &options.workerTimeout,
+                    .doc = "with --workers-only, skip the tests that are left once no worker has "
+                           "been connected for this many seconds, 60 by default"
+            },
+            {
+                    .name = "worker",
+                    .type = CommandLineParameterType_str,
+                    .parsedArgument.str_ = &worker,
+                    .doc = "run the tests sent by the coordinator at this address, with --jobs "
+                           "tests at once, until it's done"
+            },
+            {
+                    .name = "snapshots",
+                    .type = CommandLineParameterType_str,
+                    .parsedArgument.str_ = &options.snapshotDir,
+                    .doc = "the directory that snapshot assertions compare against (the null "
+                           "default means snapshots in the working directory)"
+            },
+            {
+                    .name = "update-snapshots",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.updateSnapshots,
+                    .doc = "write the snapshots which are missing or don't match instead of failing"
+            },
+            {
+                    .name = "trace",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.trace,
+                    .doc = "write a timeline of the run to trace.json in its log directory, for "
+                           "chrome://tracing or Perfetto"
+            },
+            {
+                    .name = "profile",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.profile,
+                    .doc = "sample the stacks of forked tests and write them as folded stacks "
+                           "next to their logs, for flame graphs"
+            },
+            {
+                    .name = "adaptive-jobs",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.adaptiveJobs,
+                    .doc = "run fewer tests at once while the machine is under CPU, memory or IO "
+                           "pressure, and up to --jobs while it isn't"
+            },
+            {
+                    .name = "min-jobs",
+                    .type = CommandLineParameterType_int,
+                    .parsedArgument.int_ = &options.minJobs,
+                    .doc = "the fewest tests that run at once with --adaptive-jobs"
+            },
+            {
+                    .name = "minidumps",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.minidumps,
+                    .doc = "write a minidump next to the log of each forked test that crashes, "
+                           "instead of a core dump"
+            },
+            {
+                    .name = "read-minidump",
                     .type = CommandLineParameterType_str,
-                    .parsedArgument.str_ = &options.filter,
-                    .doc = "a period-separated path to a test suite to run"
+                    .parsedArgument.str_ = &minidump,
+                    .doc = "print the threads of a minidump with their functions and lines "
+                           "instead of running tests"
+            },
+            {
+                    .name = "failed-first",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.failedFirst,
+                    .doc = "start the tests which failed last time before the others"
+            },
+            {
+                    .name = "changed-files",
+                    .type = CommandLineParameterType_strList,
+                    .parsedArgument.strList_ = &options.changedFiles,
+                    .numParsedArguments = &options.numChangedFiles,
+                    .doc = "only select the tests which ran code in these comma-separated source "
+                           "files before, going by the impact index"
+            },
+            {
+                    .name = "watch",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &options.watch,
+                    .doc = "run the tests again, failed ones first, whenever this executable or a "
+                           "watched path changes"
+            },
+            {
+                    .name = "watch-path",
+                    .type = CommandLineParameterType_strList,
+                    .parsedArgument.strList_ = &options.watchPaths,
+                    .numParsedArguments = &options.numWatchPaths,
+                    .doc = "a file or directory which reruns the tests when it changes, with --watch"
+            },
+            {
+                    .name = "history",
+                    .type = CommandLineParameterType_void,
+                    .parsedArgument.int_ = &history,
+                    .doc = "print the failure rates, durations and slowdowns of the selected tests "
+                           "over past runs instead of running them"
             }
     };
     int numParameters = sizeof(parameters) / sizeof(*parameters);
@@ -908,24 +6777,19 @@ TestCResult TestC_main(const TestSuite *suite, int argc, char **argv) {
 
     ParseArgumentsResult parseArgumentsResult = parseArguments(parameters, numParameters, argc,
                                                                argv);
+    TestCResult result;
     if (parseArgumentsResult == ParseArgumentsResult_BAD_ARGS) {
-        return TestCResult_BAD_ARGS;
-    }
-    if (parseArgumentsResult == ParseArgumentsResult_HELP) {
+        result = TestCResult_BAD_ARGS;
+    } else if (parseArgumentsResult == ParseArgumentsResult_HELP) {
         printUsage(parameters, numParameters);
-        return TestCResult_ALL_PASSED;
-    }
-
-    TestNode *result = NULL;
-    int status = TestC_run(suite, options, &result);
-    if (status != 0) {
-        fprintf(stderr, "test runner failed to run");
-        return TestCResult_INTERNAL_ERROR;
-    }
-    int allPassed = TestNode_passed(result);
-    freeNode(result);
-    if (!allPassed) {
-        return TestCResult_SOME_TESTS_FAILED;
+        result = TestCResult_ALL_PASSED;
+    } else {
+        result = runParsedArguments(suite, options, pin, worker, history, minidump, argv);
     }
-    return TestCResult_ALL_PASSED;
+    // The lists point into argv, so only the arrays are allocated
+    free(options.filters);
+    free(options.excludes);
+    free(options.changedFiles);
+    free(options.watchPaths);
+    return result;
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include "testc/test_suite.h"
 
 int TestSuite_numTests(const TestSuite *suite) {
@@ -8,5 +9,125 @@ int TestSuite_numTests(const TestSuite *suite) {
         }
         return count;
     }
-    return 1;
+    return suite->caseTest != NULL ? suite->numCases : 1;
+}
+
+#ifdef __APPLE__
+extern const TestRegistration *const registrationsStart[]
+        __asm("section$start$__DATA$testc_tests");
+extern const TestRegistration *const registrationsStop[]
+        __asm("section$end$__DATA$testc_tests");
+#else
+// These are weak so that binaries without any registered tests still link
+extern const TestRegistration *const __start_testc_tests[] __attribute__((weak));
+extern const TestRegistration *const __stop_testc_tests[] __attribute__((weak));
+#define registrationsStart __start_testc_tests
+#define registrationsStop __stop_testc_tests
+#endif
+
+// A suite under construction, which keeps track of how much room its children array has
+typedef struct {
+    TestSuite suite;
+    int capacity;
+} SuiteBuilder;
+
+SuiteBuilder *newSuiteBuilder(const char *name, size_t nameLength) {
+    SuiteBuilder *builder = calloc(1, sizeof(SuiteBuilder));
+    char *copy = malloc(nameLength + 1);
+    memcpy(copy, name, nameLength);
+    copy[nameLength] = '\0';
+    builder->suite.name = copy;
+    builder->suite.isLeaf = 0;
+    builder->suite.fixture = NULL;
+    return builder;
+}
+
+void addChild(SuiteBuilder *builder, const TestSuite *child) {
+    if (builder->suite.numChildren == builder->capacity) {
+        builder->capacity = builder->capacity == 0 ? 4 : builder->capacity * 2;
+        builder->suite.children = realloc(builder->suite.children,
+                                          sizeof(TestSuite *) * builder->capacity);
+    }
+    builder->suite.children[builder->suite.numChildren++] = child;
+}
+
+// Find the child suite with the given name, creating it if it doesn't exist. Tests from the same
+// file are next to each other in the section, so the last child is checked first.
+SuiteBuilder *findOrAddChild(SuiteBuilder *builder, const char *name, size_t nameLength) {
+    for (int i = builder->suite.numChildren - 1; i >= 0; --i) {
+        const TestSuite *child = builder->suite.children[i];
+        if (!child->isLeaf && strncmp(child->name, name, nameLength) == 0
+            && child->name[nameLength] == '\0') {
+            return (SuiteBuilder *) child;
+        }
+    }
+    SuiteBuilder *child = newSuiteBuilder(name, nameLength);
+    addChild(builder, &child->suite);
+    return child;
+}
+
+// Turn a registration's suite into the path that it's registered under. Registrations without a
+// TESTC_SUITE have a source file path, which becomes the file's name without its extension.
+void getRegisteredPath(const char *suite, const char **path, size_t *pathLength) {
+    size_t length = strlen(suite);
+    if (length > 2 && strcmp(suite + length - 2, ".c") == 0) {
+        const char *slash = strrchr(suite, '/');
+        *path = slash == NULL ? suite : slash + 1;
+        *pathLength = suite + length - 2 - *path;
+    } else {
+        *path = suite;
+        *pathLength = length;
+    }
+}
+
+// Build one tree out of every registered test, whose children are shared by every root
+SuiteBuilder *buildRegisteredTree() {
+    SuiteBuilder *tree = newSuiteBuilder("", 0);
+    if (registrationsStart == NULL) {
+        return tree;
+    }
+    for (const TestRegistration *const *registration = registrationsStart;
+         registration < registrationsStop; ++registration) {
+        const char *path;
+        size_t pathLength;
+        getRegisteredPath((*registration)->suite, &path, &pathLength);
+        SuiteBuilder *suite = tree;
+        const char *end = path + pathLength;
+        while (path < end) {
+            const char *split = memchr(path, '.', end - path);
+            if (split == NULL) {
+                split = end;
+            }
+            suite = findOrAddChild(suite, path, split - path);
+            path = split + 1;
+        }
+        addChild(suite, (*registration)->test);
+    }
+    return tree;
+}
+
+// A root that TestSuite_registered returned, kept so that the same name gets the same suite
+typedef struct RegisteredRoot {
+    SuiteBuilder *builder;
+    struct RegisteredRoot *next;
+} RegisteredRoot;
+
+const TestSuite *TestSuite_registered(const char *rootName) {
+    static SuiteBuilder *tree = NULL;
+    static RegisteredRoot *roots = NULL;
+    for (RegisteredRoot *root = roots; root != NULL; root = root->next) {
+        if (strcmp(root->builder->suite.name, rootName) == 0) {
+            return &root->builder->suite;
+        }
+    }
+    if (tree == NULL) {
+        tree = buildRegisteredTree();
+    }
+    RegisteredRoot *root = malloc(sizeof(RegisteredRoot));
+    root->builder = newSuiteBuilder(rootName, strlen(rootName));
+    root->builder->suite.children = tree->suite.children;
+    root->builder->suite.numChildren = tree->suite.numChildren;
+    root->next = roots;
+    roots = root;
+    return &root->builder->suite;
 }
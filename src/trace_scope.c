@@ -0,0 +1,65 @@
+#include <string.h>
+#include <time.h>
+#include "testc/trace_scope.h"
+
+// NULL outside of tests that the runner started, where events aren't recorded. A forked test has
+// the ring of its process, which every thread that it starts records into, and a test that runs on
+// one of the runner's threads has the ring of that thread.
+static TraceRing *processTraceRing;
+static __thread TraceRing *threadTraceRing;
+
+void TraceRing_enter(TraceRing *ring) {
+    __atomic_store_n(&processTraceRing, ring, __ATOMIC_RELEASE);
+}
+
+void TraceRing_enterThread(TraceRing *ring) {
+    threadTraceRing = ring;
+}
+
+TraceRing *getTraceRing() {
+    TraceRing *ring = threadTraceRing;
+    return ring != NULL ? ring : __atomic_load_n(&processTraceRing, __ATOMIC_ACQUIRE);
+}
+
+int64_t readTraceClock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL * 1000 * 1000 + now.tv_nsec;
+}
+
+void recordTraceEvent(TraceRing *ring, TraceEventType type, const char *name, int64_t time,
+                      int64_t value) {
+    uint64_t position = __atomic_fetch_add(&ring->next, 1, __ATOMIC_RELAXED);
+    TraceEvent *event = &ring->events[position % TRACE_RING_CAPACITY];
+    // The runner skips the event until it's whole again
+    __atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->time = time;
+    event->value = value;
+    event->type = type;
+    strncpy(event->name, name, TRACE_NAME_SIZE - 1);
+    event->name[TRACE_NAME_SIZE - 1] = '\0';
+    __atomic_store_n(&event->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+TraceScope TraceScope_begin(const char *name) {
+    return (TraceScope) {
+            .name = name,
+            .start = getTraceRing() != NULL ? readTraceClock() : 0
+    };
+}
+
+void TraceScope_end(TraceScope *scope) {
+    TraceRing *ring = getTraceRing();
+    if (ring != NULL) {
+        recordTraceEvent(ring, TraceEvent_SCOPE, scope->name, scope->start,
+                         readTraceClock() - scope->start);
+    }
+}
+
+void Trace_counter(const char *name, int64_t value) {
+    TraceRing *ring = getTraceRing();
+    if (ring != NULL) {
+        recordTraceEvent(ring, TraceEvent_COUNTER, name, readTraceClock(), value);
+    }
+}
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include "testc/virtual_time.h"
+
+#define NANOS_PER_SECOND (1000LL * 1000 * 1000)
+
+static int enabled;
+// How far the virtual clock is ahead of the real one
+static long long offsetNanos;
+static long long *skipped;
+
+// The replaced functions, looked up in the libraries after this executable the first time they're
+// needed
+static int (*realClockGettime)(clockid_t, struct timespec *);
+static int (*realClockNanosleep)(clockid_t, int, const struct timespec *, struct timespec *);
+static int (*realNanosleep)(const struct timespec *, struct timespec *);
+static int (*realUsleep)(useconds_t);
+static unsigned int (*realSleep)(unsigned int);
+static time_t (*realTime)(time_t *);
+
+#define FIND_REAL(pointer, name) \
+    if (pointer == NULL) { \
+        *(void **) &pointer = dlsym(RTLD_NEXT, name); \
+    }
+
+int isVirtual() {
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+// CPU time keeps passing for real while sleeping on the virtual clock
+int isWallClock(clockid_t clock) {
+    return clock == CLOCK_REALTIME || clock == CLOCK_MONOTONIC || clock == CLOCK_MONOTONIC_RAW
+           || clock == CLOCK_REALTIME_COARSE || clock == CLOCK_MONOTONIC_COARSE
+           || clock == CLOCK_BOOTTIME;
+}
+
+long long toNanos(const struct timespec *time) {
+    return time->tv_sec * NANOS_PER_SECOND + time->tv_nsec;
+}
+
+// Move the virtual clock forward instead of sleeping
+void skip(long long nanos) {
+    if (nanos <= 0) {
+        return;
+    }
+    __atomic_fetch_add(&offsetNanos, nanos, __ATOMIC_RELAXED);
+    if (skipped != NULL) {
+        __atomic_fetch_add(skipped, nanos, __ATOMIC_RELAXED);
+    }
+}
+
+int clock_gettime(clockid_t clock, struct timespec *time) {
+    FIND_REAL(realClockGettime, "clock_gettime")
+    int result = realClockGettime(clock, time);
+    long long offset = __atomic_load_n(&offsetNanos, __ATOMIC_RELAXED);
+    if (result == 0 && offset > 0 && isWallClock(clock)) {
+        long long nanos = time->tv_nsec + offset;
+        time->tv_sec += nanos / NANOS_PER_SECOND;
+        time->tv_nsec = nanos % NANOS_PER_SECOND;
+    }
+    return result;
+}
+
+time_t time(time_t *result) {
+    FIND_REAL(realTime, "time")
+    if (__atomic_load_n(&offsetNanos, __ATOMIC_RELAXED) == 0) {
+        return realTime(result);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (result != NULL) {
+        *result = now.tv_sec;
+    }
+    return now.tv_sec;
+}
+
+int clock_nanosleep(clockid_t clock, int flags, const struct timespec *request,
+                    struct timespec *remaining) {
+    FIND_REAL(realClockNanosleep, "clock_nanosleep")
+    if (!isVirtual() || !isWallClock(clock)) {
+        return realClockNanosleep(clock, flags, request, remaining);
+    }
+    if (flags & TIMER_ABSTIME) {
+        struct timespec now;
+        clock_gettime(clock, &now);
+        skip(toNanos(request) - toNanos(&now));
+    } else {
+        skip(toNanos(request));
+    }
+    return 0;
+}
+
+int nanosleep(const struct timespec *request, struct timespec *remaining) {
+    FIND_REAL(realNanosleep, "nanosleep")
+    if (!isVirtual()) {
+        return realNanosleep(request, remaining);
+    }
+    skip(toNanos(request));
+    if (remaining != NULL) {
+        remaining->tv_sec = 0;
+        remaining->tv_nsec = 0;
+    }
+    return 0;
+}
+
+int usleep(useconds_t micros) {
+    FIND_REAL(realUsleep, "usleep")
+    if (!isVirtual()) {
+        return realUsleep(micros);
+    }
+    skip(micros * 1000LL);
+    return 0;
+}
+
+unsigned int sleep(unsigned int seconds) {
+    FIND_REAL(realSleep, "sleep")
+    if (!isVirtual()) {
+        return realSleep(seconds);
+    }
+    skip(seconds * NANOS_PER_SECOND);
+    return 0;
+}
+
+void VirtualTime_start(long long *skippedNanos) {
+    skipped = skippedNanos;
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELAXED);
+}
+
+void VirtualTime_stop() {
+    __atomic_store_n(&enabled, 0, __ATOMIC_RELAXED);
+    skipped = NULL;
+}
@@ -0,0 +1,9 @@
+// Tests in this file register themselves, so they are compiled separately instead of being
+// included by test.c
+#define TESTC_AUTO_REGISTER
+#define TESTC_SUITE "registered.parser"
+#include <testc/test_suite.h>
+
+TEST(registeredPass) {}
+
+TEST(registeredAlsoPass) {}
@@ -5,7 +5,7 @@
 #pragma clang diagnostic pop
 #include <testc/test_runner.h>
 
-SUITE(all, &testTestRunner);
+SUITE(all, &testRunnerTests);
 
 int main(int argc, char **argv) {
     return TestC_main(&all, argc, argv);
@@ -1,9 +1,27 @@
+#define _GNU_SOURCE
 #include <zconf.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <testc/test_runner.h>
 #include <testc/test_suite.h>
 #include <testc/assert.h>
+#include <testc/property.h>
+#include <testc/fuzz.h>
+#include <testc/concurrent.h>
+#include <testc/alloc.h>
+#include <testc/snapshot.h>
+#include <testc/trace_scope.h>
+#include <testc/impact.h>
+#include <testc/minidump.h>
+#include <testc/virtual_time.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 TEST(fast) {
 
@@ -85,13 +103,14 @@ TEST(modifyConstString) {
 SUITE(errors, &sleepThenFail, &sleepThenDereferenceNullPointer, &modifyConstString)
 
 
-void assertResults(TestNode *root, char *path, int expectedNumPassed, int expectedNumFailed) {
-    TestNode *node = findNode(root, path);
+void assertResults(TestGraph *graph, char *path, int expectedNumPassed, int expectedNumFailed) {
+    TestNode *node = findNode(graph, path);
     ASSERT_NEQ(node, NULL, TestNode*, %p);
     if (node->isLeaf) {
-        ASSERT_EQ(node->state, TestState_DONE, int, %d);
-        int passed = WIFEXITED(node->exitSignal)
-                && (WEXITSTATUS(node->exitSignal) == EXIT_SUCCESS);
+        TestLeaf *leaf = &graph->leaves[node->leaf];
+        ASSERT_EQ(leaf->state, TestState_DONE, int, %d);
+        int passed = WIFEXITED(leaf->exitSignal)
+                && (WEXITSTATUS(leaf->exitSignal) == EXIT_SUCCESS);
         if (expectedNumPassed == 1) {
             ASSERT_EQ(expectedNumFailed, 0, int, %d);
             ASSERT_EQ(passed, 1, int, %d);
@@ -122,10 +141,9 @@ TEST(testTestRunner) {
     TestRunOptions options = {
             .animate = 1,
             .fps = 30.f,
-            .filter = NULL,
             .noFork = 0,
     };
-    TestNode *result;
+    TestGraph *result;
     ASSERT_EQ(TestC_run(&exampleTestSuite, options, &result),0, int, %d);
 
     assertResults(result, "exampleTestSuite.fast", 1, 0);
@@ -138,7 +156,1518 @@ TEST(testTestRunner) {
     assertResults(result, "exampleTestSuite.errors", 0, 3);
     assertResults(result, "exampleTestSuite.stackTrace", 0, 1);
 
+    // The graph is laid out in pre-order, so a subtree is a contiguous span of nodes
+    TestNode *nested = findNode(result, "exampleTestSuite.nestedTestSuite");
+    ASSERT_EQ(nested->end - (int) (nested - result->nodes), 15, int, %d);
+    ASSERT_EQ(findNode(result, "exampleTestSuite.nestedTestSuite.efgh.h")->depth, 3, int, %d);
+    ASSERT_EQ(findNode(result, "otherSuite.fast"), NULL, TestNode *, %p);
+
     // TODO: add tests to verify file I/O to test logs directory
 
     printf("Test runner test passed!\n");
-}
\ No newline at end of file
+}
+
+// The marker is keyed by the pid of the test runner so that test runners running at the same time
+// don't share it
+void getFlakyMarkerPath(char path[64], pid_t runnerPid) {
+    sprintf(path, "failFirstRun.%d.marker", runnerPid);
+}
+
+void removeFlakyMarker() {
+    char path[64];
+    getFlakyMarkerPath(path, getpid());
+    remove(path);
+}
+
+// Fails the first time it runs and passes after that, using a file to remember across processes
+TEST(failFirstRun) {
+    char path[64];
+    getFlakyMarkerPath(path, getppid());
+    int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0666);
+    if (fd >= 0) {
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+}
+
+SUITE(flakySuite, &failFirstRun, &fast, &sleepThenFail)
+
+TEST(testRetries) {
+    removeFlakyMarker();
+    TestRunOptions options = {
+            .animate = 0,
+            .jobs = 2,
+            .retries = 1,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&flakySuite, options, &result), 0, int, %d);
+    removeFlakyMarker();
+
+    TestLeaf *flaky = findLeaf(result, "flakySuite.failFirstRun");
+    ASSERT_EQ(flaky->state, TestState_FLAKY, int, %d);
+    ASSERT_EQ(flaky->numRunsDone, 2, int, %d);
+    ASSERT_EQ(flaky->numRunsPassed, 1, int, %d);
+    TestLeaf *failed = findLeaf(result, "flakySuite.sleepThenFail");
+    ASSERT_EQ(failed->state, TestState_DONE, int, %d);
+    ASSERT_EQ(failed->numRunsDone, 2, int, %d);
+    ASSERT_EQ(result->nodes->numPassed, 1, int, %d);
+    ASSERT_EQ(result->nodes->numFailed, 1, int, %d);
+    ASSERT_EQ(result->nodes->numFlaky, 1, int, %d);
+}
+
+SUITE(repeatSuite, &fast, &failFirstRun)
+
+TEST(testRepeat) {
+    removeFlakyMarker();
+    TestRunOptions options = {
+            .animate = 0,
+            .jobs = 3,
+            .repeat = 5,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&repeatSuite, options, &result), 0, int, %d);
+    removeFlakyMarker();
+
+    TestLeaf *passed = findLeaf(result, "repeatSuite.fast");
+    ASSERT_EQ(passed->state, TestState_DONE, int, %d);
+    ASSERT_EQ(passed->numRunsDone, 5, int, %d);
+    ASSERT_EQ(passed->numRunsPassed, 5, int, %d);
+    TestLeaf *flaky = findLeaf(result, "repeatSuite.failFirstRun");
+    ASSERT_EQ(flaky->state, TestState_FLAKY, int, %d);
+    ASSERT_EQ(flaky->numRunsPassed, 4, int, %d);
+    ASSERT_EQ(result->nodes->numPassed, 1, int, %d);
+    ASSERT_EQ(result->nodes->numFlaky, 1, int, %d);
+}
+
+TEST(testUntilFail) {
+    removeFlakyMarker();
+    TestRunOptions options = {
+            .animate = 0,
+            .jobs = 1,
+            .repeat = 5,
+            .untilFail = 1,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&repeatSuite, options, &result), 0, int, %d);
+    removeFlakyMarker();
+
+    ASSERT_EQ(findLeaf(result, "repeatSuite.fast")->numRunsDone, 5, int, %d);
+    TestLeaf *failed = findLeaf(result, "repeatSuite.failFirstRun");
+    ASSERT_EQ(failed->state, TestState_DONE, int, %d);
+    ASSERT_EQ(failed->numRunsDone, 1, int, %d);
+    ASSERT_EQ(result->nodes->numFailed, 1, int, %d);
+}
+
+SUITE(failFastSuite, &modifyConstString, &sleep1, &slow, &fast)
+SUITE(repeatFailFastSuite, &fast, &modifyConstString)
+
+TEST(testFailFast) {
+    TestRunOptions options = {
+            .animate = 0,
+            .jobs = 2,
+            .failFast = 1,
+    };
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&failFastSuite, options, &result), 0, int, %d);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // sleep1 was killed instead of waited for
+    long long elapsedNanos = (end.tv_sec - start.tv_sec) * 1000000000LL
+                             + (end.tv_nsec - start.tv_nsec);
+    ASSERT_BIN(<, elapsedNanos, 900 * 1000 * 1000LL, long long, %lld);
+    ASSERT_EQ(result->nodes->numFailed, 1, int, %d);
+    ASSERT_EQ(result->nodes->numSkipped, 3, int, %d);
+    ASSERT_EQ(findLeaf(result, "failFastSuite.sleep1")->state, TestState_SKIPPED, int, %d);
+    ASSERT_EQ(findLeaf(result, "failFastSuite.fast")->state, TestState_SKIPPED, int, %d);
+    TestGraph_free(result);
+
+    // The runs go round the leaves, so one run of fast finishes before modifyConstString fails.
+    // fast keeps that run instead of being skipped.
+    options.jobs = 1;
+    options.repeat = 3;
+    options.untilFail = 1;
+    ASSERT_EQ(TestC_run(&repeatFailFastSuite, options, &result), 0, int, %d);
+    TestLeaf *fast = findLeaf(result, "repeatFailFastSuite.fast");
+    ASSERT_EQ(fast->state, TestState_DONE, int, %d);
+    ASSERT_EQ(fast->numRunsDone, 1, int, %d);
+    ASSERT_EQ(fast->numRunsPassed, 1, int, %d);
+    ASSERT_EQ(result->nodes->numPassed, 1, int, %d);
+    ASSERT_EQ(result->nodes->numSkipped, 0, int, %d);
+    TestGraph_free(result);
+}
+
+// Fixture hooks record themselves in this file, which is keyed by the pid of the test that runs
+// them so that concurrent runs don't share it
+char fixtureLogPath[64];
+
+void logFixture(const char *message) {
+    int fd = open(fixtureLogPath, O_CREAT | O_APPEND | O_WRONLY, 0666);
+    dprintf(fd, "%s\n", message);
+    close(fd);
+}
+
+int *sharedData = NULL;
+pid_t fixtureServerPid = 0;
+int numSetups = 0;
+
+SUITE_SETUP(setupOuterFixture) {
+    logFixture("outer setup");
+}
+
+SUITE_TEARDOWN(teardownOuterFixture) {
+    logFixture("outer teardown");
+}
+
+SUITE_SETUP(buildSharedData) {
+    logFixture("inner setup");
+    sharedData = calloc(1024, sizeof(int));
+    sharedData[1023] = 42;
+    fixtureServerPid = getpid();
+}
+
+SETUP(countSetup) {
+    ++numSetups;
+}
+
+SUITE_SETUP(failSuiteSetup) {
+    exit(EXIT_FAILURE);
+}
+
+TEST(readsSharedData) {
+    ASSERT_EQ(sharedData[1023], 42, int, %d);
+    ASSERT_EQ(getppid(), fixtureServerPid, int, %d);
+    ASSERT_EQ(numSetups, 2, int, %d);
+}
+
+TEST(alsoReadsSharedData) {
+    ASSERT_EQ(sharedData[1023], 42, int, %d);
+    ASSERT_EQ(numSetups, 2, int, %d);
+}
+
+FIXTURE(outerFixture, .suiteSetup = setupOuterFixture, .suiteTeardown = teardownOuterFixture,
+        .setup = countSetup)
+FIXTURE(innerFixture, .suiteSetup = buildSharedData, .setup = countSetup)
+FIXTURE(brokenFixture, .suiteSetup = failSuiteSetup)
+SUITE_F(innerFixtureSuite, innerFixture, &readsSharedData, &alsoReadsSharedData)
+SUITE_F(outerFixtureSuite, outerFixture, &innerFixtureSuite, &fast)
+SUITE_F(brokenFixtureSuite, brokenFixture, &fast)
+SUITE(fixtureSuite, &outerFixtureSuite, &brokenFixtureSuite)
+
+TEST(testFixtures) {
+    sprintf(fixtureLogPath, "fixtures.%d.txt", getpid());
+    remove(fixtureLogPath);
+    TestRunOptions options = {
+            .animate = 0,
+            .jobs = 4,
+    };
+    // A child of the caller which exits during the run is left for the caller to reap
+    pid_t callerChild = fork();
+    ASSERT_NEQ(callerChild, -1, pid_t, %d);
+    if (callerChild == 0) {
+        _exit(7);
+    }
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&fixtureSuite, options, &result), 0, int, %d);
+    assertResults(result, "fixtureSuite.outerFixtureSuite", 3, 0);
+    assertResults(result, "fixtureSuite.brokenFixtureSuite", 0, 1);
+    TestGraph_free(result);
+    int callerChildStatus;
+    ASSERT_EQ(waitpid(callerChild, &callerChildStatus, 0), callerChild, pid_t, %d);
+    ASSERT_EQ(WIFEXITED(callerChildStatus) && WEXITSTATUS(callerChildStatus) == 7, 1, int, %d);
+
+    // Each suite setup ran once, and the servers were done by the time the run returned
+    char log[128] = {0};
+    FILE *file = fopen(fixtureLogPath, "r");
+    ASSERT_NEQ(file, NULL, FILE *, %p);
+    fread(log, 1, sizeof(log) - 1, file);
+    fclose(file);
+    remove(fixtureLogPath);
+    ASSERT_EQ(strcmp(log, "outer setup\ninner setup\nouter teardown\n"), 0, int, %d);
+}
+
+int half(int index) {
+    return index / 2;
+}
+
+TEST_P(halfIsSmall, int, 6, half) {
+    ASSERT_EQ(param < 2, 1, int, %d);
+}
+
+const char *words[] = {"a", "bb", "ccc"};
+
+TEST_TABLE(wordIsShort, const char *, words) {
+    ASSERT_EQ(strlen(param) < 3, 1, int, %d);
+}
+
+SUITE(parameterizedSuite, &halfIsSmall, &wordIsShort)
+
+TEST(testParameterized) {
+    ASSERT_EQ(TestSuite_numTests(&parameterizedSuite), 9, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&parameterizedSuite, options, &result), 0, int, %d);
+    assertResults(result, "parameterizedSuite.halfIsSmall", 4, 2);
+    assertResults(result, "parameterizedSuite.halfIsSmall.halfIsSmall[3]", 1, 0);
+    assertResults(result, "parameterizedSuite.halfIsSmall.halfIsSmall[4]", 0, 1);
+    assertResults(result, "parameterizedSuite.wordIsShort.wordIsShort[2]", 0, 1);
+    TestGraph_free(result);
+
+    // Cases are selected by their own names
+    options.filters = (const char *[]) {"**.wordIsShort[*]"};
+    options.numFilters = 1;
+    options.excludes = (const char *[]) {"**.*[2]"};
+    options.numExcludes = 1;
+    ASSERT_EQ(TestC_run(&parameterizedSuite, options, &result), 0, int, %d);
+    ASSERT_EQ(result->numLeaves, 2, int, %d);
+    assertResults(result, "parameterizedSuite", 2, 0);
+    TestGraph_free(result);
+}
+
+TEST(tinyA) {
+    printf("a\n");
+}
+
+TEST(tinyB) {
+}
+
+TEST(crashInBatch) {
+    abort();
+}
+
+TEST(tinyC) {
+}
+
+TEST(tinyD) {
+}
+
+SUITE(batchSuite, &tinyA, &tinyB, &crashInBatch, &tinyC, &tinyD)
+
+void exitWithFailure() {
+    _exit(3);
+}
+
+TEST(failsAtExit) {
+    atexit(exitWithFailure);
+}
+
+SUITE(exitingBatchSuite, &tinyA, &failsAtExit)
+
+TEST(testBatch) {
+    TestRunOptions options = {
+            .animate = 0,
+            .jobs = 1,
+            .batch = 64,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&batchSuite, options, &result), 0, int, %d);
+    assertResults(result, "batchSuite", 4, 1);
+    assertResults(result, "batchSuite.crashInBatch", 0, 1);
+
+    // The tests after the crash ran in a fresh child
+    pid_t pid = findLeaf(result, "batchSuite.tinyA")->pid;
+    ASSERT_EQ(findLeaf(result, "batchSuite.tinyB")->pid, pid, int, %d);
+    ASSERT_EQ(findLeaf(result, "batchSuite.crashInBatch")->pid, pid, int, %d);
+    ASSERT_NEQ(findLeaf(result, "batchSuite.tinyC")->pid, pid, int, %d);
+    ASSERT_EQ(findLeaf(result, "batchSuite.tinyD")->pid, findLeaf(result, "batchSuite.tinyC")->pid,
+              int, %d);
+    TestGraph_free(result);
+
+    // A batch that fails after its last test passed fails that test
+    ASSERT_EQ(TestC_run(&exitingBatchSuite, options, &result), 0, int, %d);
+    assertResults(result, "exitingBatchSuite.tinyA", 1, 0);
+    TestLeaf *exited = findLeaf(result, "exitingBatchSuite.failsAtExit");
+    ASSERT_EQ(exited->pid, findLeaf(result, "exitingBatchSuite.tinyA")->pid, int, %d);
+    ASSERT_EQ(WIFEXITED(exited->exitSignal) && WEXITSTATUS(exited->exitSignal) == 3, 1, int, %d);
+    TestGraph_free(result);
+}
+
+PROPERTY(additionCommutes, 200) {
+    long long a = Property_range(property, -1000000, 1000000);
+    long long b = Property_int(property) / 4;
+    ASSERT_EQ(a + b, b + a, long long, %lld);
+}
+
+PROPERTY(stringsAreShort, 200) {
+    char string[32];
+    Property_string(property, string, sizeof(string));
+    ASSERT_EQ(strlen(string) < 5, 1, int, %d);
+}
+
+SUITE(propertySuite, &additionCommutes, &stringsAreShort)
+
+// Read a whole file into a null-terminated buffer, returning NULL if it doesn't exist
+char *readFile(const char *path, char *buffer, size_t size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    buffer[fread(buffer, 1, size - 1, file)] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+// Create a directory for the files of a test, named after it and this process so that runs at
+// the same time don't share it. Returns 0 if it was created.
+int makeTestDir(char dir[64], const char *name) {
+    snprintf(dir, 64, "%s.%d", name, getpid());
+    return mkdir(dir, 0777);
+}
+
+int removeTestFile(const char *path, const struct stat *info, int type, struct FTW *position) {
+    (void) info;
+    (void) type;
+    (void) position;
+    return remove(path);
+}
+
+// Remove a directory made by makeTestDir with everything in it. Returns 0 if it's gone.
+int removeTestDir(const char *dir) {
+    return nftw(dir, removeTestFile, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+TEST(testProperty) {
+    char dir[64], corpus[128], path[256], log[4096];
+    ASSERT_EQ(makeTestDir(dir, "property"), 0, int, %d);
+    sprintf(corpus, "%s/corpus", dir);
+    setenv("TESTC_CORPUS", corpus, 1);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&propertySuite, options, &result), 0, int, %d);
+    assertResults(result, "propertySuite.additionCommutes", PROPERTY_SHARDS, 0);
+    assertResults(result, "propertySuite.stringsAreShort", 0, PROPERTY_SHARDS);
+    TestGraph_free(result);
+
+    // Every shard found a failure and shrank it to the shortest string that fails
+    sprintf(path, "%s/latest/propertySuite/stringsAreShort/stringsAreShort[1].txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "string: \"aaaaa\"\n"), NULL, char *, %p);
+    sprintf(path, "%s/stringsAreShort.txt", corpus);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+
+    // The next run replays the corpus first
+    ASSERT_EQ(TestC_run(&propertySuite, options, &result), 0, int, %d);
+    TestGraph_free(result);
+    sprintf(path, "%s/latest/propertySuite/stringsAreShort/stringsAreShort[0].txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "of the corpus"), NULL, char *, %p);
+
+    // All the shards of both runs shrank to the same string, which the corpus holds once
+    sprintf(path, "%s/stringsAreShort.txt", corpus);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    char *second = strchr(log, '\n');
+    ASSERT_NEQ(second, NULL, char *, %p);
+    ASSERT_EQ(second[1], '\0', char, %c);
+
+    unsetenv("TESTC_CORPUS");
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+TEST_FUZZ(rejectsFlags, data, size) {
+    if (size > 0 && data[0] == 'F') {
+        abort();
+    }
+}
+
+TEST_FUZZ(acceptsAnything, data, size) {
+    (void) data;
+    ASSERT_EQ(size <= FUZZ_MAX_INPUT, 1, int, %d);
+}
+
+SUITE(fuzzSuite, &rejectsFlags, &acceptsAnything)
+
+TEST(testFuzz) {
+    char dir[64], corpus[128];
+    ASSERT_EQ(makeTestDir(dir, "fuzz"), 0, int, %d);
+    // Fuzzing stops at the first crash, so the run is only as long as finding it takes
+    const char *filters[] = {"fuzzSuite.rejectsFlags"};
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .filters = filters,
+            .numFilters = 1,
+            .jobs = 2,
+            .fuzz = 60,
+    };
+    // Fuzzing waits for its workers only, not for the caller's children
+    pid_t callerChild = fork();
+    ASSERT_NEQ(callerChild, -1, pid_t, %d);
+    if (callerChild == 0) {
+        _exit(7);
+    }
+    ASSERT_EQ(TestC_fuzz(&fuzzSuite, options), 1, int, %d);
+    int callerChildStatus;
+    ASSERT_EQ(waitpid(callerChild, &callerChildStatus, 0), callerChild, pid_t, %d);
+    ASSERT_EQ(WIFEXITED(callerChildStatus) && WEXITSTATUS(callerChildStatus) == 7, 1, int, %d);
+
+    // The input that crashed is saved to the corpus...
+    sprintf(corpus, "%s/fuzz_corpus/rejectsFlags", dir);
+    DIR *directory = opendir(corpus);
+    ASSERT_NEQ(directory, NULL, DIR *, %p);
+    int numCrashes = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        numCrashes += strncmp(entry->d_name, "crash-", 6) == 0;
+    }
+    closedir(directory);
+    ASSERT_EQ(numCrashes, 1, int, %d);
+
+    // ...so a normal run replays it
+    options.numFilters = 0;
+    options.fuzz = 0;
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&fuzzSuite, options, &result), 0, int, %d);
+    assertResults(result, "fuzzSuite.rejectsFlags", 0, 1);
+    assertResults(result, "fuzzSuite.acceptsAnything", 1, 0);
+    TestGraph_free(result);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+// Volatile so that the compiler can't leave out allocations
+void *volatile allocSink;
+
+TEST(leaksBuffer) {
+    allocSink = malloc(32);
+}
+
+TEST(freesBuffer) {
+    allocSink = malloc(32);
+    free(allocSink);
+}
+
+TEST(allocatesInHotPath) {
+    ASSERT_ALLOCS_BETWEEN(0, 0) {
+        allocSink = malloc(8);
+    }
+    free(allocSink);
+}
+
+SUITE(allocSuite, &leaksBuffer, &freesBuffer, &allocatesInHotPath)
+
+TEST(testAllocs) {
+    ASSERT_ALLOCS_BETWEEN(0, 0) {
+        allocSink = NULL;
+    }
+    ASSERT_ALLOCS_BETWEEN(2, 2) {
+        allocSink = malloc(8);
+        allocSink = realloc(allocSink, 64);
+        free(allocSink);
+    }
+
+    char dir[64], path[256], log[8192];
+    ASSERT_EQ(makeTestDir(dir, "allocs"), 0, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .checkLeaks = 1,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&allocSuite, options, &result), 0, int, %d);
+    assertResults(result, "allocSuite.leaksBuffer", 0, 1);
+    assertResults(result, "allocSuite.freesBuffer", 1, 0);
+    assertResults(result, "allocSuite.allocatesInHotPath", 0, 1);
+    TestGraph_free(result);
+
+    // The leak is reported with the stack trace of its allocation
+    sprintf(path, "%s/latest/allocSuite/leaksBuffer.txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "leaked 32 bytes"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "leaksBufferMethod"), NULL, char *, %p);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+TEST_VIRTUAL_TIME(sleepsForAnHour) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    time_t startSeconds = time(NULL);
+    sleep(3599);
+    usleep(500 * 1000);
+    struct timespec halfSecond = {.tv_nsec = 500 * 1000 * 1000};
+    nanosleep(&halfSecond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT_EQ(end.tv_sec - start.tv_sec >= 3600, 1, int, %d);
+    ASSERT_EQ(time(NULL) - startSeconds >= 3600, 1, int, %d);
+
+    // Absolute sleeps wake up at their deadline on the virtual clock
+    struct timespec deadline = end;
+    deadline.tv_sec += 60;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT_EQ(end.tv_sec >= deadline.tv_sec, 1, int, %d);
+}
+
+SUITE(virtualTimeSuite, &sleepsForAnHour, &sleep1)
+
+TEST(testVirtualTime) {
+    TestRunOptions options = {
+            .animate = 0,
+    };
+    TestGraph *result;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT_EQ(TestC_run(&virtualTimeSuite, options, &result), 0, int, %d);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assertResults(result, "virtualTimeSuite", 2, 0);
+    // Only the test on the virtual clock skips its sleeps
+    ASSERT_EQ(end.tv_sec - start.tv_sec < 30, 1, int, %d);
+    TestLeaf *leaf = findLeaf(result, "virtualTimeSuite.sleepsForAnHour");
+    ASSERT_EQ(leaf->totalVirtualNanos >= 3660LL * 1000 * 1000 * 1000, 1, int, %d);
+    ASSERT_EQ(leaf->totalRunNanos < 30LL * 1000 * 1000 * 1000, 1, int, %d);
+    ASSERT_EQ(findLeaf(result, "virtualTimeSuite.sleep1")->totalVirtualNanos, 0, long long, %lld);
+    TestGraph_free(result);
+
+    // Batched tests count the skipped time once too
+    options.batch = 8;
+    options.jobs = 1;
+    ASSERT_EQ(TestC_run(&virtualTimeSuite, options, &result), 0, int, %d);
+    leaf = findLeaf(result, "virtualTimeSuite.sleepsForAnHour");
+    ASSERT_EQ(leaf->totalVirtualNanos >= 3660LL * 1000 * 1000 * 1000, 1, int, %d);
+    ASSERT_EQ(leaf->totalVirtualNanos < 3700LL * 1000 * 1000 * 1000, 1, int, %d);
+    ASSERT_EQ(leaf->totalRunNanos < 30LL * 1000 * 1000 * 1000, 1, int, %d);
+    TestGraph_free(result);
+}
+
+int numBodiesStarted;
+
+TEST_CONCURRENT(startsRoundsTogether, 4, 200) {
+    static __thread int round;
+    int numStarted = __atomic_fetch_add(&numBodiesStarted, 1, __ATOMIC_RELAXED);
+    // Every thread finished the previous round before any of them started this one
+    ASSERT_EQ(numStarted >= 4 * round && numStarted < 4 * (round + 1), 1, int, %d);
+    CONCURRENT_YIELD();
+    ++round;
+}
+
+TEST_CONCURRENT(failsOnThirdThread, 3, 100) {
+    static __thread int round;
+    if (thread == 2 && round == 5) {
+        ASSERT_EQ(thread, 0, int, %d);
+    }
+    ++round;
+}
+
+SUITE(concurrentSuite, &startsRoundsTogether, &failsOnThirdThread)
+
+TEST(testConcurrent) {
+    char dir[64], path[256], log[4096];
+    ASSERT_EQ(makeTestDir(dir, "concurrent"), 0, int, %d);
+    setenv("TESTC_YIELD", "50", 1);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&concurrentSuite, options, &result), 0, int, %d);
+    unsetenv("TESTC_YIELD");
+    assertResults(result, "concurrentSuite.startsRoundsTogether", 1, 0);
+    assertResults(result, "concurrentSuite.failsOnThirdThread", 0, 1);
+    TestGraph_free(result);
+
+    sprintf(path, "%s/latest/concurrentSuite/startsRoundsTogether.txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "4 threads, 200 rounds"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "thread 3"), NULL, char *, %p);
+    // The other threads stopped after the round that failed
+    sprintf(path, "%s/latest/concurrentSuite/failsOnThirdThread.txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "Assertion Failed: thread == 0"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "thread 2 failed in round 5"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "thread 0: 6 rounds"), NULL, char *, %p);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+// The process that the threaded tests ran in, which is the process of the runner
+pid_t threadedTestPid;
+
+TEST(recordsItsProcess) {
+    __atomic_store_n(&threadedTestPid, getpid(), __ATOMIC_RELAXED);
+}
+
+TEST(failsOnThread) {
+    ASSERT_EQ(1 + 1, 3, int, %d);
+}
+
+TEST(crashesOnThread) {
+    raise(SIGSEGV);
+}
+
+SUITE_THREADSAFE(threadSafeSuite, &recordsItsProcess, &failsOnThread, &a, &b)
+SUITE(threadsSuite, &threadSafeSuite, &fast)
+SUITE_THREADSAFE(crashingSuite, &crashesOnThread, &recordsItsProcess, &a)
+
+TEST(testThreads) {
+    char dir[64], path[256], log[4096];
+    ASSERT_EQ(makeTestDir(dir, "threads"), 0, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 2,
+            .threads = 2,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&threadsSuite, options, &result), 0, int, %d);
+    assertResults(result, "threadsSuite", 4, 1);
+    ASSERT_EQ(threadedTestPid, getpid(), pid_t, %d);
+    TestLeaf *failed = findLeaf(result, "threadsSuite.threadSafeSuite.failsOnThread");
+    ASSERT_EQ(failed->threaded, 1, int, %d);
+    ASSERT_EQ(WIFEXITED(failed->exitSignal) && WEXITSTATUS(failed->exitSignal) == EXIT_FAILURE,
+              1, int, %d);
+    // Tests outside of thread-safe suites are still forked
+    ASSERT_EQ(findLeaf(result, "threadsSuite.fast")->threaded, 0, int, %d);
+    TestGraph_free(result);
+
+    // The assertion went to the log of the test instead of the runner's stderr
+    sprintf(path, "%s/latest/threadsSuite/threadSafeSuite/failsOnThread.txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "Assertion Failed: 1 + 1 == 3"), NULL, char *, %p);
+
+    // Workers repeat and retry the tests they run like the forked runner does
+    options.repeat = 3;
+    options.retries = 1;
+    ASSERT_EQ(TestC_run(&threadsSuite, options, &result), 0, int, %d);
+    ASSERT_EQ(findLeaf(result, "threadsSuite.threadSafeSuite.a")->numRunsDone, 3, int, %d);
+    failed = findLeaf(result, "threadsSuite.threadSafeSuite.failsOnThread");
+    ASSERT_EQ(failed->numRunsDone, 4, int, %d);
+    TestGraph_free(result);
+
+    // A crash fails its test, and the runs after it are forked, retries included
+    options.jobs = 1;
+    options.threads = 1;
+    options.repeat = 1;
+    threadedTestPid = 0;
+    ASSERT_EQ(TestC_run(&crashingSuite, options, &result), 0, int, %d);
+    assertResults(result, "crashingSuite", 2, 1);
+    TestLeaf *crashed = findLeaf(result, "crashingSuite.crashesOnThread");
+    ASSERT_EQ(crashed->numRunsDone, 2, int, %d);
+    ASSERT_EQ(WIFSIGNALED(crashed->exitSignal) && WTERMSIG(crashed->exitSignal) == SIGSEGV, 1,
+              int, %d);
+    ASSERT_EQ(findLeaf(result, "crashingSuite.recordsItsProcess")->threaded, 0, int, %d);
+    ASSERT_EQ(threadedTestPid, 0, pid_t, %d);
+    TestGraph_free(result);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+TEST(testTrace) {
+    char dir[64], path[256], trace[16384];
+    ASSERT_EQ(makeTestDir(dir, "trace"), 0, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 2,
+            .threads = 1,
+            .trace = 1,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&threadsSuite, options, &result), 0, int, %d);
+    TestGraph_free(result);
+    sprintf(path, "%s/latest/trace.json", dir);
+    ASSERT_NEQ(readFile(path, trace, sizeof(trace)), NULL, char *, %p);
+    ASSERT_EQ(strncmp(trace, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", 42), 0, int, %d);
+    // Forked and threaded runs are on the tracks of where they ran
+    ASSERT_NEQ(strstr(trace, "\"args\": {\"name\": \"slot 0\"}"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"args\": {\"name\": \"thread 0\"}"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"args\": {\"path\": \"threadsSuite.fast\", \"result\": \"passed\"}"),
+               NULL, char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"args\": {\"path\": \"threadsSuite.threadSafeSuite.failsOnThread\", "
+                             "\"result\": \"failed\"}"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"name\": \"running tests\""), NULL, char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"args\": {\"tests\": 0}"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"args\": {\"name\": \"threadsSuite.threadSafeSuite\"}"), NULL,
+               char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"args\": {\"tests\": 5, \"passed\": 4, \"failed\": 1, "
+                             "\"flaky\": 0}"), NULL, char *, %p);
+    ASSERT_EQ(strcmp(trace + strlen(trace) - 4, "\n]}\n"), 0, int, %d);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+TEST(recordsScopes) {
+    for (int i = 0; i < 3; ++i) {
+        TRACE_SCOPE("parse");
+        TRACE_COUNTER("nodes", 10 * (i + 1));
+    }
+    TRACE_SCOPE("a name which is much longer than the ring keeps");
+}
+
+void *countOnThread(void *input) {
+    (void) input;
+    TRACE_COUNTER("threadNodes", 5);
+    return NULL;
+}
+
+TEST(recordsScopesOnThreads) {
+    pthread_t thread;
+    ASSERT_EQ(pthread_create(&thread, NULL, countOnThread, NULL), 0, int, %d);
+    ASSERT_EQ(pthread_join(thread, NULL), 0, int, %d);
+}
+
+SUITE(scopedSuite, &recordsScopes, &recordsScopesOnThreads)
+
+TEST(testTraceScopes) {
+    char dir[64], path[256], log[1024], trace[16384];
+    ASSERT_EQ(makeTestDir(dir, "scopes"), 0, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 1,
+            .repeat = 2,
+            .trace = 1,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&scopedSuite, options, &result), 0, int, %d);
+    const TestNodeInfo *info = &result->info[findNode(result, "scopedSuite.recordsScopes")
+                                             - result->nodes];
+    ASSERT_EQ(info->numTraceEvents, 14, int, %d);
+    ASSERT_EQ(info->traceEvents[0].type, TraceEvent_COUNTER, int, %d);
+    ASSERT_EQ(info->traceEvents[1].type, TraceEvent_SCOPE, int, %d);
+    ASSERT_EQ(strcmp(info->traceEvents[1].name, "parse"), 0, int, %d);
+    // Threads that a forked test starts record into its ring too
+    info = &result->info[findNode(result, "scopedSuite.recordsScopesOnThreads") - result->nodes];
+    ASSERT_EQ(info->numTraceEvents, 2, int, %d);
+    ASSERT_EQ(strcmp(info->traceEvents[0].name, "threadNodes"), 0, int, %d);
+    TestGraph_free(result);
+
+    sprintf(path, "%s/latest/scopedSuite/recordsScopes.txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "--- trace ---\na name which is much longer than th: 2 scopes, "), NULL,
+               char *, %p);
+    ASSERT_NEQ(strstr(log, "\nnodes: 6 values, last 30, min 10, max 30\nparse: 6 scopes, "), NULL,
+               char *, %p);
+    sprintf(path, "%s/latest/trace.json", dir);
+    ASSERT_NEQ(readFile(path, trace, sizeof(trace)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"name\": \"parse\", \"cat\": \"scope\", \"ph\": \"X\", \"pid\": 1, "
+                             "\"tid\": 1, "), NULL, char *, %p);
+    ASSERT_NEQ(strstr(trace, "\"args\": {\"recordsScopes\": 30}"), NULL, char *, %p);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+volatile long profileSink;
+
+void spinForProfile() {
+    struct timespec start, now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+    do {
+        for (int i = 0; i < 1000; ++i) {
+            profileSink += i;
+        }
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000LL + now.tv_nsec - start.tv_nsec < 50000000);
+}
+
+TEST(spins) {
+    spinForProfile();
+}
+
+SUITE(profiledSuite, &spins, &a)
+
+TEST(testProfile) {
+    char dir[64], path[256], folded[65536];
+    ASSERT_EQ(makeTestDir(dir, "profile"), 0, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 1,
+            .profile = 1,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&profiledSuite, options, &result), 0, int, %d);
+    TestGraph_free(result);
+    // Stacks run from the root down to the sampled function, with the number of samples. A sample
+    // taken before a function set up its frame misses its caller, so it can't be the first stack.
+    sprintf(path, "%s/latest/profiledSuite/spins.folded", dir);
+    ASSERT_NEQ(readFile(path, folded, sizeof(folded)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(folded, "runTestWithFixtures;spinsMethod;spinForProfile"), NULL, char *,
+               %p);
+    ASSERT_EQ(folded[strlen(folded) - 1], '\n', char, %c);
+    sprintf(path, "%s/latest/profiledSuite/spins.stacks", dir);
+    ASSERT_EQ(access(path, F_OK), -1, int, %d);
+    // Suites prefix the stacks of their tests with their paths
+    sprintf(path, "%s/latest/profiledSuite.folded", dir);
+    ASSERT_NEQ(readFile(path, folded, sizeof(folded)), NULL, char *, %p);
+    ASSERT_EQ(strncmp(folded, "spins;runTestWithFixtures;", 26), 0, int, %d);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+int lateFailureFails;
+
+TEST(lateFailure) {
+    ASSERT_EQ(lateFailureFails, 0, int, %d);
+}
+
+SUITE(failedFirstSuite, &a, &b, &lateFailure)
+
+long long getStartNanos(TestGraph *graph, const char *path) {
+    const TestLeaf *leaf = findLeaf(graph, path);
+    return leaf->start.tv_sec * 1000000000LL + leaf->start.tv_nsec;
+}
+
+TEST(testFailedFirst) {
+    char dir[64];
+    ASSERT_EQ(makeTestDir(dir, "failedFirst"), 0, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 1,
+            .failedFirst = 1,
+    };
+    TestGraph *result;
+    // Without a history, tests go in the order of the tree
+    lateFailureFails = 1;
+    ASSERT_EQ(TestC_run(&failedFirstSuite, options, &result), 0, int, %d);
+    ASSERT_BIN(<, getStartNanos(result, "failedFirstSuite.a"),
+              getStartNanos(result, "failedFirstSuite.lateFailure"), long long, %lld);
+    TestGraph_free(result);
+    lateFailureFails = 0;
+    ASSERT_EQ(TestC_run(&failedFirstSuite, options, &result), 0, int, %d);
+    ASSERT_BIN(<, getStartNanos(result, "failedFirstSuite.lateFailure"),
+              getStartNanos(result, "failedFirstSuite.a"), long long, %lld);
+    TestGraph_free(result);
+    // Once it passed, it's back in its place
+    ASSERT_EQ(TestC_run(&failedFirstSuite, options, &result), 0, int, %d);
+    ASSERT_BIN(<, getStartNanos(result, "failedFirstSuite.a"),
+              getStartNanos(result, "failedFirstSuite.lateFailure"), long long, %lld);
+    TestGraph_free(result);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+TEST(testWatch) {
+    char dir[64], watched[64], path[256], output[4096];
+    ASSERT_EQ(makeTestDir(dir, "watch"), 0, int, %d);
+    ASSERT_EQ(makeTestDir(watched, "watched"), 0, int, %d);
+    sprintf(path, "%s/output.txt", dir);
+    int outputFd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    ASSERT_NEQ(outputFd, -1, int, %d);
+    char *argv[] = {"test", "--watch", "--watch-path", watched, "--animate", "0", "--dir", dir,
+                    "--filter", "**.a", NULL};
+    pid_t pid = fork();
+    ASSERT_NEQ(pid, -1, int, %d);
+    if (pid == 0) {
+        dup2(outputFd, STDOUT_FILENO);
+        exit(TestC_main(&failedFirstSuite, 10, argv));
+    }
+    close(outputFd);
+    // After each run, a change to a watched path runs the executable again with the same arguments,
+    // which select no tests in its own suite. The watches are set up before the line that says so.
+    int numRuns = 0;
+    for (int i = 0; i < 500 && numRuns < 2; ++i) {
+        usleep(10 * 1000);
+        if (readFile(path, output, sizeof(output)) == NULL) {
+            continue;
+        }
+        if (numRuns == 0 && strstr(output, "run 1 passed, watching ") != NULL) {
+            numRuns = 1;
+            char changed[256];
+            sprintf(changed, "%s/changed", watched);
+            FILE *file = fopen(changed, "w");
+            ASSERT_NEQ(file, NULL, FILE *, %p);
+            fclose(file);
+        } else if (strstr(output, "\nrun 2 ") != NULL) {
+            numRuns = 2;
+        }
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    ASSERT_EQ(numRuns, 2, int, %d);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+    ASSERT_EQ(removeTestDir(watched), 0, int, %d);
+}
+
+TEST(coversParser) {
+}
+
+SUITE(impactSuite, &a, &b, &coversParser)
+
+// Write index as the impact index under dir if it isn't NULL, run impactSuite with the given
+// changed files, check that the selected test runs if it isn't NULL, and return how many tests run
+int runChangedFiles(const char *dir, const char *index, const char *changedFiles,
+                    const char *selected) {
+    if (index != NULL) {
+        char path[256];
+        sprintf(path, "%s/impact.index", dir);
+        FILE *file = fopen(path, "w");
+        ASSERT_NEQ(file, NULL, FILE *, %p);
+        fputs(index, file);
+        fclose(file);
+    }
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 2,
+            .changedFiles = &changedFiles,
+            .numChangedFiles = 1,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&impactSuite, options, &result), 0, int, %d);
+    int numLeaves = result->numLeaves;
+    if (selected != NULL) {
+        ASSERT_NEQ(findLeaf(result, selected), NULL, TestLeaf *, %p);
+    }
+    TestGraph_free(result);
+    return numLeaves;
+}
+
+TEST(testChangedFiles) {
+    char dir[64], path[256], index[4096];
+    ASSERT_EQ(makeTestDir(dir, "changedFiles"), 0, int, %d);
+    // Without an index, nothing is known about what a change affects
+    ASSERT_EQ(runChangedFiles(dir, NULL, "src/http/parser.c", NULL), 3, int, %d);
+
+    // Runs with the coverage build update the index, so each starts from this one again
+    const char *handWritten = "/home/me/http/src/http/parser.c\n\timpactSuite.coversParser\n"
+                              "/home/me/http/src/http/printer.c\n\timpactSuite.b\n";
+    // a isn't in the index yet, so it always runs
+    ASSERT_EQ(runChangedFiles(dir, handWritten, "src/http/parser.c", "impactSuite.coversParser"),
+              2, int, %d);
+    ASSERT_EQ(runChangedFiles(dir, handWritten, "./http/printer.c", "impactSuite.b"), 2, int, %d);
+    ASSERT_EQ(runChangedFiles(dir, handWritten, "http/parser.c,http/printer.c", NULL), 3, int,
+              %d);
+    // Files only match at path boundaries
+    ASSERT_EQ(runChangedFiles(dir, handWritten, "arser.c", NULL), 3, int, %d);
+    ASSERT_EQ(runChangedFiles(dir, handWritten, "src/http/lexer.c", NULL), 3, int, %d);
+
+    // With the coverage build, every run puts the files of what its forked tests entered into the
+    // index, in place of what it had for them
+    if (Impact_start != NULL) {
+        ASSERT_EQ(runChangedFiles(dir, handWritten, "lexer.c", NULL), 3, int, %d);
+        sprintf(path, "%s/impact.index", dir);
+        ASSERT_NEQ(readFile(path, index, sizeof(index)), NULL, char *, %p);
+        ASSERT_NEQ(strstr(index, "\timpactSuite.coversParser\n"), NULL, char *, %p);
+        ASSERT_EQ(strstr(index, "printer.c"), NULL, char *, %p);
+    }
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+TEST_P(sleepsUnderLoad, int, 8, half) {
+    (void) param;
+    usleep(20 * 1000);
+}
+
+SUITE(adaptiveSuite, &sleepsUnderLoad)
+
+TEST_P(sleepsWhileLoadChanges, int, 240, half) {
+    (void) param;
+    usleep(50 * 1000);
+}
+
+SUITE(changingLoadSuite, &sleepsWhileLoadChanges)
+
+// Replace the memory pressure file in dir, so that the runner never reads half of it
+void writeMemoryPressure(const char *dir, const char *recent, long long totalMicros) {
+    char path[256], temporary[256];
+    sprintf(path, "%s/memory", dir);
+    sprintf(temporary, "%s/memory.tmp", dir);
+    FILE *file = fopen(temporary, "w");
+    if (file != NULL) {
+        fprintf(file, "some avg10=%s avg60=0.00 avg300=0.00 total=%lld\n", recent, totalMicros);
+        fclose(file);
+        rename(temporary, path);
+    }
+}
+
+// Have tasks stall on memory for most of the next second and a half, and then not at all
+void *changeMemoryPressure(void *dir) {
+    long long totalMicros = 1000;
+    for (int i = 0; i < 30; ++i) {
+        totalMicros += 40 * 1000;
+        writeMemoryPressure(dir, "50.00", totalMicros);
+        usleep(50 * 1000);
+    }
+    writeMemoryPressure(dir, "0.00", totalMicros);
+    return NULL;
+}
+
+TEST(testAdaptiveJobs) {
+    char dir[64], path[256], readings[4096];
+    ASSERT_EQ(makeTestDir(dir, "adaptive"), 0, int, %d);
+    // Tasks stalled on memory for half of the last 10 seconds, and haven't since
+    sprintf(path, "%s/pressure", dir);
+    ASSERT_EQ(mkdir(path, 0777), 0, int, %d);
+    setenv("TESTC_PRESSURE_DIR", path, 1);
+    const char *resources[] = {"cpu", "memory", "io"};
+    for (int i = 0; i < 3; ++i) {
+        sprintf(path, "%s/pressure/%s", dir, resources[i]);
+        FILE *file = fopen(path, "w");
+        ASSERT_NEQ(file, NULL, FILE *, %p);
+        fprintf(file, "some avg10=%s avg60=0.00 avg300=0.00 total=1000\n",
+                i == 1 ? "50.00" : "0.00");
+        fclose(file);
+    }
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 4,
+            .adaptiveJobs = 1,
+            .minJobs = 2,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&adaptiveSuite, options, &result), 0, int, %d);
+    assertResults(result, "adaptiveSuite", 8, 0);
+    TestGraph_free(result);
+
+    // The first reading takes a slot away, and the quiet since isn't enough to add it back
+    sprintf(path, "%s/latest/concurrency.txt", dir);
+    ASSERT_NEQ(readFile(path, readings, sizeof(readings)), NULL, char *, %p);
+    const char *header = "seconds\tlimit\trunning\tcpu\tmemory\tio\n";
+    ASSERT_EQ(strncmp(readings, header, strlen(header)), 0, int, %d);
+    int numReadings = 0;
+    for (char *line = strchr(readings, '\n') + 1; *line != '\0'; line = strchr(line, '\n') + 1) {
+        int limit;
+        int numParsed = sscanf(line, "%*f %d", &limit);
+        ASSERT_EQ(numParsed, 1, int, %d);
+        ASSERT_EQ(limit, 3, int, %d);
+        ++numReadings;
+    }
+    ASSERT_BIN(>, numReadings, 0, int, %d);
+
+    // While the pressure lasts, the limit goes down to the floor, and once it's gone, it goes back
+    // up. Tests only start while fewer than the limit run, so at most the limit before a reading
+    // were running at it.
+    sprintf(path, "%s/pressure", dir);
+    pthread_t changer;
+    ASSERT_EQ(pthread_create(&changer, NULL, changeMemoryPressure, path), 0, int, %d);
+    options.jobs = 8;
+    ASSERT_EQ(TestC_run(&changingLoadSuite, options, &result), 0, int, %d);
+    ASSERT_EQ(pthread_join(changer, NULL), 0, int, %d);
+    assertResults(result, "changingLoadSuite", 240, 0);
+    TestGraph_free(result);
+    sprintf(path, "%s/latest/concurrency.txt", dir);
+    ASSERT_NEQ(readFile(path, readings, sizeof(readings)), NULL, char *, %p);
+    int previousLimit = options.jobs, lowest = options.jobs, raisedAfterLowest = 0;
+    for (char *line = strchr(readings, '\n') + 1; *line != '\0'; line = strchr(line, '\n') + 1) {
+        int limit, running;
+        int numParsed = sscanf(line, "%*f %d %d", &limit, &running);
+        ASSERT_EQ(numParsed, 2, int, %d);
+        ASSERT_BIN(<=, running, previousLimit, int, %d);
+        ASSERT_BIN(>=, limit, options.minJobs, int, %d);
+        raisedAfterLowest |= lowest == options.minJobs && limit > lowest;
+        lowest = limit < lowest ? limit : lowest;
+        previousLimit = limit;
+    }
+    ASSERT_EQ(lowest, options.minJobs, int, %d);
+    ASSERT_EQ(raisedAfterLowest, 1, int, %d);
+    unsetenv("TESTC_PRESSURE_DIR");
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+void *waitForCrash(void *argument) {
+    __atomic_store_n((int *) argument, 1, __ATOMIC_RELEASE);
+    for (;;) {
+        pause();
+    }
+}
+
+__attribute__((noinline))
+void crashForMinidump(volatile int *address) {
+    *address = 1;
+}
+
+TEST(crashesWithThread) {
+    pthread_t thread;
+    static int started;
+    ASSERT_EQ(pthread_create(&thread, NULL, waitForCrash, &started), 0, int, %d);
+    while (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    crashForMinidump(NULL);
+}
+
+SUITE(minidumpSuite, &crashesWithThread, &a)
+
+TEST(testMinidumps) {
+    char dir[64], path[256], printed[65536];
+    ASSERT_EQ(makeTestDir(dir, "minidumps"), 0, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 1,
+            .minidumps = 1,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&minidumpSuite, options, &result), 0, int, %d);
+    // The handler lets the crash kill the test as it would have
+    int crashSignal = findLeaf(result, "minidumpSuite.crashesWithThread")->exitSignal;
+    ASSERT_EQ(WIFSIGNALED(crashSignal) && WTERMSIG(crashSignal) == SIGSEGV, 1, int, %d);
+    TestGraph_free(result);
+    sprintf(path, "%s/latest/minidumpSuite/a.dmp", dir);
+    ASSERT_EQ(access(path, F_OK), -1, int, %d);
+
+    sprintf(path, "%s/latest/minidumpSuite/crashesWithThread.dmp", dir);
+    FILE *file = fopen(path, "r");
+    ASSERT_NEQ(file, NULL, FILE *, %p);
+    MinidumpHeader header;
+    MinidumpThread crashed;
+    ASSERT_EQ(fread(&header, sizeof(header), 1, file), 1, size_t, %zu);
+    ASSERT_EQ(fread(&crashed, sizeof(crashed), 1, file), 1, size_t, %zu);
+    fclose(file);
+    ASSERT_EQ(memcmp(header.magic, MINIDUMP_MAGIC, 8), 0, int, %d);
+    ASSERT_EQ(header.signal, SIGSEGV, int, %d);
+    ASSERT_EQ(header.faultAddress, 0, uint64_t, %lu);
+    ASSERT_EQ(header.numThreads, 2, uint32_t, %u);
+    ASSERT_EQ(crashed.crashed, 1, uint32_t, %u);
+    ASSERT_BIN(>, crashed.stackSize, 0, uint64_t, %lu);
+
+    // The reader finds the crashing function from the pc, and its caller on the stack
+    char printedPath[256];
+    sprintf(printedPath, "%s/printed.txt", dir);
+    int fd = open(printedPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    ASSERT_BIN(>=, fd, 0, int, %d);
+    ASSERT_EQ(Minidump_print(path, fd), 0, int, %d);
+    close(fd);
+    ASSERT_NEQ(readFile(printedPath, printed, sizeof(printed)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(printed, ", which crashed:\n  pc 0x"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(printed, "crashForMinidump at "), NULL, char *, %p);
+    ASSERT_NEQ(strstr(printed, "crashesWithThreadMethod at "), NULL, char *, %p);
+    ASSERT_NEQ(strstr(printed, "waitForCrash"), NULL, char *, %p);
+    ASSERT_EQ(Minidump_print(printedPath, fd), -1, int, %d);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+TEST(runsOnOneCpu) {
+    cpu_set_t cpus;
+    ASSERT_EQ(sched_getaffinity(0, sizeof(cpus), &cpus), 0, int, %d);
+    ASSERT_EQ(CPU_COUNT(&cpus), 1, int, %d);
+    // CPU_ISSET is kept out of the assertion, whose message would have the % of its expansion
+    int isAllowed = CPU_ISSET(sched_getcpu(), &cpus);
+    ASSERT_EQ(isAllowed, 1, int, %d);
+}
+
+SUITE(pinnedSuite, &runsOnOneCpu, &a, &b)
+
+TEST(testPin) {
+    TestRunOptions options = {
+            .animate = 0,
+            .jobs = 2,
+            .pin = TestPin_CORES,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&pinnedSuite, options, &result), 0, int, %d);
+    assertResults(result, "pinnedSuite", 3, 0);
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int i = 0; i < result->numLeaves; ++i) {
+        int isAllowed = CPU_ISSET(result->leaves[i].cpu, &allowed);
+        ASSERT_EQ(isAllowed, 1, int, %d);
+        ASSERT_EQ(result->leaves[i].numaNode, -1, int, %d);
+    }
+    TestGraph_free(result);
+
+    // Every machine has at least one node, unless sysfs isn't there
+    options.pin = TestPin_NUMA;
+    ASSERT_EQ(TestC_run(&pinnedSuite, options, &result), 0, int, %d);
+    TestLeaf *leaf = findLeaf(result, "pinnedSuite.a");
+    ASSERT_EQ(leaf->numaNode >= 0 || leaf->cpu >= 0, 1, int, %d);
+    TestGraph_free(result);
+}
+
+// A file that the first run of killsItsWorker creates before it kills its worker
+char distributedMarker[128];
+
+TEST(printsOnWorker) {
+    printf("hello from pid %d\n", getpid());
+}
+
+TEST(killsItsWorker) {
+    int fd = open(distributedMarker, O_CREAT | O_EXCL | O_WRONLY, 0666);
+    if (fd >= 0) {
+        close(fd);
+        kill(getppid(), SIGKILL);
+    }
+}
+
+SUITE(distributedSuite, &printsOnWorker, &killsItsWorker, &a, &b, &c)
+SUITE(workedSuite, &printsOnWorker, &a, &b)
+
+// Work for a coordinator while a child of the worker's own exits, which the worker has to leave
+// for it to reap
+int workWithChild(const char *address, TestRunOptions options) {
+    pid_t child = fork();
+    if (child == 0) {
+        _exit(7);
+    }
+    int status;
+    return TestC_work(&workedSuite, options, address) == 0
+           && waitpid(child, &status, 0) == child && WEXITSTATUS(status) == 7 ? 0 : 1;
+}
+
+TEST(testDistributed) {
+    char dir[64], address[128], path[256], log[4096];
+    ASSERT_EQ(makeTestDir(dir, "distributed"), 0, int, %d);
+    sprintf(address, "unix:%s/coordinator.sock", dir);
+    sprintf(distributedMarker, "%s/killed", dir);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 1,
+            .listen = address,
+            .remoteOnly = 1,
+    };
+    pid_t workers[2];
+    for (int i = 0; i < 2; ++i) {
+        workers[i] = fork();
+        ASSERT_NEQ(workers[i], -1, pid_t, %d);
+        if (workers[i] == 0) {
+            _exit(TestC_work(&distributedSuite, options, address) == 0 ? 0 : 1);
+        }
+    }
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&distributedSuite, options, &result), 0, int, %d);
+    // The test whose worker died was run again by the other one
+    assertResults(result, "distributedSuite", 5, 0);
+    for (int i = 0; i < result->numLeaves; ++i) {
+        ASSERT_NEQ(result->leaves[i].worker, -1, int, %d);
+    }
+    ASSERT_EQ(access(distributedMarker, F_OK), 0, int, %d);
+    TestGraph_free(result);
+    // The runner only reaps its own children, so both workers are still there to be waited for
+    for (int i = 0; i < 2; ++i) {
+        ASSERT_EQ(waitpid(workers[i], NULL, 0), workers[i], pid_t, %d);
+    }
+
+    // The log of a test run by a worker came back to the runner
+    sprintf(path, "%s/latest/distributedSuite/printsOnWorker.txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "hello from pid"), NULL, char *, %p);
+
+    // A worker reaps its tests and nothing else
+    pid_t worker = fork();
+    ASSERT_NEQ(worker, -1, pid_t, %d);
+    if (worker == 0) {
+        _exit(workWithChild(address, options));
+    }
+    ASSERT_EQ(TestC_run(&workedSuite, options, &result), 0, int, %d);
+    assertResults(result, "workedSuite", 3, 0);
+    TestGraph_free(result);
+    int workerStatus;
+    ASSERT_EQ(waitpid(worker, &workerStatus, 0), worker, pid_t, %d);
+    ASSERT_EQ(workerStatus, 0, int, %d);
+
+    // Without workers, the run skips the tests only they could run once the timeout is over
+    options.workerTimeout = 1;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ASSERT_EQ(TestC_run(&workedSuite, options, &result), 0, int, %d);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ASSERT_EQ(result->nodes->numSkipped, 3, int, %d);
+    long long elapsedNanos = (end.tv_sec - start.tv_sec) * 1000000000LL
+                             + (end.tv_nsec - start.tv_nsec);
+    ASSERT_BIN(>=, elapsedNanos, 1000 * 1000 * 1000LL, long long, %lld);
+    ASSERT_BIN(<, elapsedNanos, 10 * 1000 * 1000 * 1000LL, long long, %lld);
+    TestGraph_free(result);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+int historyFailing;
+int historySleepMicros;
+
+TEST(startsFailing) {
+    ASSERT_EQ(historyFailing, 0, int, %d);
+}
+
+TEST(getsSlower) {
+    usleep(historySleepMicros);
+}
+
+SUITE(historySuite, &startsFailing, &getsSlower)
+
+TEST(testHistory) {
+    char dir[64], path[256], log[4096];
+    ASSERT_EQ(makeTestDir(dir, "history"), 0, int, %d);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .jobs = 2,
+    };
+    TestGraph *result;
+    for (int i = 0; i < 6; ++i) {
+        setenv("TESTC_COMMIT", i < 3 ? "aaaaaaaaaaaaaaaa1234" : "bbbbbbbbbbbbbbbb5678", 1);
+        historySleepMicros = i < 3 ? 0 : 20 * 1000;
+        historyFailing = i == 5;
+        ASSERT_EQ(TestC_run(&historySuite, options, &result), 0, int, %d);
+        ASSERT_NEQ(findLeaf(result, "historySuite.getsSlower")->maxRssKb, 0, long, %ld);
+        TestGraph_free(result);
+    }
+    unsetenv("TESTC_COMMIT");
+    historyFailing = 0;
+
+    // Each path is interned once
+    sprintf(path, "%s/history.paths", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_EQ(strcmp(log, "historySuite.startsFailing\nhistorySuite.getsSlower\n"), 0, int, %d);
+
+    FILE *output = tmpfile();
+    ASSERT_EQ(TestC_history(&historySuite, options, fileno(output)), 0, int, %d);
+    rewind(output);
+    size_t size = fread(log, 1, sizeof(log) - 1, output);
+    log[size] = '\0';
+    fclose(output);
+    ASSERT_NEQ(strstr(log, "history of 12 results"), NULL, char *, %p);
+    // The line is kept out of the assertion, whose message would have its %
+    const char *failureRate = "historySuite.startsFailing: 6 runs, 1 failed (16.7%)";
+    ASSERT_NEQ(strstr(log, failureRate), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "slower since the run on"), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "(commit bbbbbbbbbbbbbbbb)"), NULL, char *, %p);
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+int snapshotChanged;
+
+TEST(matchesTextSnapshot) {
+    ASSERT_STDOUT_SNAPSHOT("report.txt") {
+        for (int i = 0; i < 20; ++i) {
+            if (snapshotChanged && i == 10) {
+                printf("line ten\n");
+            } else {
+                printf("line %d\n", i);
+            }
+        }
+        if (snapshotChanged) {
+            printf("line 20\n");
+        }
+    }
+}
+
+TEST(matchesBinarySnapshot) {
+    unsigned char data[4096];
+    for (int i = 0; i < (int) sizeof(data); ++i) {
+        data[i] = (unsigned char) (i * 7);
+    }
+    if (snapshotChanged) {
+        data[1000] ^= 0xff;
+    }
+    ASSERT_SNAPSHOT("nested/data.bin", data, sizeof(data));
+}
+
+SUITE(snapshotSuite, &matchesTextSnapshot, &matchesBinarySnapshot)
+
+TEST(testSnapshot) {
+    char dir[64], snapshots[128], path[256], log[4096];
+    ASSERT_EQ(makeTestDir(dir, "snapshot"), 0, int, %d);
+    sprintf(snapshots, "%s/snapshots", dir);
+    TestRunOptions options = {
+            .animate = 0,
+            .dir = dir,
+            .snapshotDir = snapshots,
+    };
+    TestGraph *result;
+    // Snapshots which don't exist fail until they're written
+    ASSERT_EQ(TestC_run(&snapshotSuite, options, &result), 0, int, %d);
+    assertResults(result, "snapshotSuite", 0, 2);
+    TestGraph_free(result);
+    options.updateSnapshots = 1;
+    ASSERT_EQ(TestC_run(&snapshotSuite, options, &result), 0, int, %d);
+    assertResults(result, "snapshotSuite", 2, 0);
+    TestGraph_free(result);
+    sprintf(path, "%s/report.txt", snapshots);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_EQ(strncmp(log, "line 0\nline 1\n", 14), 0, int, %d);
+    options.updateSnapshots = 0;
+    ASSERT_EQ(TestC_run(&snapshotSuite, options, &result), 0, int, %d);
+    assertResults(result, "snapshotSuite", 2, 0);
+    TestGraph_free(result);
+
+    snapshotChanged = 1;
+    ASSERT_EQ(TestC_run(&snapshotSuite, options, &result), 0, int, %d);
+    assertResults(result, "snapshotSuite", 0, 2);
+    TestGraph_free(result);
+    sprintf(path, "%s/latest/snapshotSuite/matchesTextSnapshot.txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "@@ -9 +9 @@\n line 8\n line 9\n-line 10\n+line ten\n line 11\n"),
+               NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, " line 19\n+line 20\n"), NULL, char *, %p);
+    sprintf(path, "%s/latest/snapshotSuite/matchesBinarySnapshot.txt", dir);
+    ASSERT_NEQ(readFile(path, log, sizeof(log)), NULL, char *, %p);
+    ASSERT_NEQ(strstr(log, "bytes 1000 to 1000 differ"), NULL, char *, %p);
+
+    // Updating replaces the snapshots which changed
+    options.updateSnapshots = 1;
+    ASSERT_EQ(TestC_run(&snapshotSuite, options, &result), 0, int, %d);
+    TestGraph_free(result);
+    options.updateSnapshots = 0;
+    ASSERT_EQ(TestC_run(&snapshotSuite, options, &result), 0, int, %d);
+    assertResults(result, "snapshotSuite", 2, 0);
+    TestGraph_free(result);
+    snapshotChanged = 0;
+
+    ASSERT_EQ(removeTestDir(dir), 0, int, %d);
+}
+
+TEST(testRegisteredSuite) {
+    const TestSuite *registered = TestSuite_registered("registeredRoot");
+    ASSERT_EQ(registered, TestSuite_registered("registeredRoot"), const TestSuite *, %p);
+    ASSERT_EQ(TestSuite_numTests(registered), 2, int, %d);
+    // Another name gets its own root over the same tests
+    const TestSuite *renamed = TestSuite_registered("renamedRoot");
+    ASSERT_NEQ(renamed, registered, const TestSuite *, %p);
+    ASSERT_EQ(strcmp(renamed->name, "renamedRoot"), 0, int, %d);
+    ASSERT_EQ(strcmp(registered->name, "registeredRoot"), 0, int, %d);
+    ASSERT_EQ(TestSuite_numTests(renamed), 2, int, %d);
+
+    TestRunOptions options = {
+            .animate = 0,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(registered, options, &result), 0, int, %d);
+    assertResults(result, "registeredRoot.registered.parser", 2, 0);
+    assertResults(result, "registeredRoot.registered.parser.registeredAlsoPass", 1, 0);
+}
+
+TEST(testSelection) {
+    TestRunOptions options = {
+            .animate = 0,
+            .filters = (const char *[]) {"exampleTestSuite.nested*.abcd",
+                                         "exampleTestSuite.fileIO.printToStd*"},
+            .numFilters = 2,
+            .excludes = (const char *[]) {"**.b", "**.*NoNewline"},
+            .numExcludes = 2,
+    };
+    TestGraph *result;
+    ASSERT_EQ(TestC_run(&exampleTestSuite, options, &result), 0, int, %d);
+    assertResults(result, "exampleTestSuite", 5, 0);
+    assertResults(result, "exampleTestSuite.nestedTestSuite.abcd", 3, 0);
+    assertResults(result, "exampleTestSuite.fileIO", 2, 0);
+    ASSERT_EQ(findNode(result, "exampleTestSuite.nestedTestSuite.efgh"), NULL, TestNode *, %p);
+    ASSERT_EQ(findNode(result, "exampleTestSuite.slow"), NULL, TestNode *, %p);
+    TestGraph_free(result);
+
+    // ** matches any number of suites, and listing doesn't run anything
+    TestRunOptions listOptions = {
+            .filters = (const char *[]) {"**.sleep*"},
+            .numFilters = 1,
+            .list = 1,
+    };
+    ASSERT_EQ(TestC_run(&exampleTestSuite, listOptions, &result), 0, int, %d);
+    ASSERT_EQ(result->numLeaves, 3, int, %d);
+    ASSERT_EQ(findLeaf(result, "exampleTestSuite.slow.sleep1")->state, TestState_IDLE, int, %d);
+    ASSERT_NEQ(findLeaf(result, "exampleTestSuite.errors.sleepThenFail"), NULL, TestLeaf *, %p);
+    TestGraph_free(result);
+
+    // A filter that matches nothing is a mistake in the arguments
+    char *argv[] = {"test", "--filter", "**.noSuchTest", "--filter", "**.norThisOne", NULL};
+    ASSERT_EQ(TestC_main(&exampleTestSuite, 5, argv), TestCResult_BAD_ARGS, TestCResult, %d);
+}
+
+SUITE(testRunnerTests, &testTestRunner, &testRetries, &testRepeat, &testUntilFail, &testFailFast,
+      &testFixtures, &testParameterized, &testBatch, &testProperty, &testFuzz, &testAllocs,
+      &testVirtualTime, &testThreads, &testConcurrent, &testPin, &testDistributed, &testHistory,
+      &testSnapshot, &testTrace, &testTraceScopes, &testProfile, &testFailedFirst,
+      &testWatch, &testChangedFiles, &testAdaptiveJobs, &testMinidumps, &testRegisteredSuite,
+      &testSelection)